@@ -0,0 +1,98 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+#include "shared.h"
+#include "map.h"
+#include "config.h"
+#include "metrics.h"
+
+/*
+ * Admission control, which keeps single clients and the server as a whole from taking on more
+ * than they can handle:
+ *      - Every client has a token bucket per command class, refilled at the class' rate (-R)
+ *        and holding at most a second's worth of tokens. Commands that find their bucket empty
+ *        are dropped, the client is told once when to retry.
+ *      - New logins are deferred while a reactor lags behind (-O) or while too much is queued
+ *        for the clients (-Q), they're told to retry later and keep their connection.
+ * Heartbeat answers are never limited, dropping them would only get clients disconnected, and
+ * neither are the commands that release state: logging out, leaving a conversation or a room, and
+ * answering or cancelling a conversation request.
+ */
+#define RATE_TOKEN       1000000000ll // A bucket's content is kept in billionths of a token, a rate of one token per second adds one a nanosecond
+#define LOGIN_RETRY_MS   1000         // Least time a deferred login is told to wait
+
+const char *rateClassesString[RATE_CLASSES] = { "messages", "queries", "requests" };
+
+// Class a command of the client is limited by, -1 for commands that never are
+int CommandRateClass(clientData *client, clientCommands cmd)
+{
+    switch(cmd)
+    {
+        case DATA:
+        case SAY:
+        case MSG:
+            return RATE_CLASS_MESSAGES;
+        case USERS:
+        case ROOMS:
+        case STATS:
+            return RATE_CLASS_QUERIES;
+        case PING:
+        case LOGOUT:
+        case DISCONNECT:
+        case LEAVE:
+            return -1;
+        case TALKTO:
+        {
+            // While a request is open the command answers or cancels it, the state is only a hint read without the lock
+            clientStates state = __atomic_load_n(&client->state, __ATOMIC_RELAXED);
+            return state == PENDING_REQUEST || state == CONNECTING ? -1 : RATE_CLASS_REQUESTS;
+        }
+        default:
+            return RATE_CLASS_REQUESTS;
+    }
+}
+
+// Takes a token from a client's bucket, returns 0 if it had one or the milliseconds until it will
+long RateTake(clientData *client, int rateClass, uint64_t now)
+{
+    long long rate = __atomic_load_n(&config.rateLimits[rateClass], __ATOMIC_RELAXED);
+    if(!rate) return 0;
+    long long burst = rate * RATE_TOKEN;
+    long long tokens = burst;
+    if(client->rateRefilled[rateClass])
+    {
+        // A second refills any bucket, which also keeps the product below from overflowing
+        uint64_t elapsed = now > client->rateRefilled[rateClass] ? now - client->rateRefilled[rateClass] : 0;
+        if(elapsed > (uint64_t)RATE_TOKEN) elapsed = RATE_TOKEN;
+        tokens = client->rateTokens[rateClass] + (long long)elapsed * rate;
+        if(tokens > burst) tokens = burst;
+    }
+    client->rateRefilled[rateClass] = now;
+    if(tokens < RATE_TOKEN)
+    {
+        client->rateTokens[rateClass] = tokens;
+        return (long)((RATE_TOKEN - tokens) / rate / 1000000) + 1;
+    }
+    client->rateTokens[rateClass] = tokens - RATE_TOKEN;
+    return 0;
+}
+
+// Whether new logins should be deferred, see the comment above
+int ServerOverloaded()
+{
+    int lagLimit = __atomic_load_n(&config.overloadLag, __ATOMIC_RELAXED);
+    if(lagLimit && MetricsLoopLag(MetricsNanos()) > (uint64_t)lagLimit * 1000000) return 1;
+    size_t queueLimit = __atomic_load_n(&config.overloadQueue, __ATOMIC_RELAXED);
+    if(!queueLimit) return 0;
+    uint64_t queued = 0;
+    int i;
+    for(i = 0; i < metricsThreads; i++) queued += __atomic_load_n(&metricsTable[i].queuedBytes, __ATOMIC_RELAXED);
+    return queued > queueLimit;
+}
+
+// Milliseconds a deferred login is told to wait, spread by client so their retries don't come at once
+long LoginRetryDelay(clientData *client)
+{
+    return LOGIN_RETRY_MS + (long)(client->id % LOGIN_RETRY_MS);
+}
+
+#endif // ADMISSION_H
@@ -0,0 +1,289 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include "shared.h"
+#include "protocol.h"
+#include "compress.h"
+#include "histogram.h"
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <getopt.h>
+#include <signal.h>
+#include <openssl/ssl.h>
+
+/*
+ * Load generator for the server. Connections are spread over worker threads, each one
+ * driving its share through its own epoll instance with non-blocking sockets.
+ *
+ * Every connection logs in over the binary protocol and then either pairs up with its
+ * neighbour through TalkTo/Accept or joins a room. Once every connection is ready, chat
+ * messages are sent at a fixed rate per connection, or one at a time with the next one
+ * sent as soon as the previous one came back (closed loop, rate 0).
+ *
+ * Every chat message starts with the time it was meant to be sent at and the index of
+ * its sender. Receivers record the difference to the time of arrival in a latency
+ * histogram. Using the intended rather than the actual send time keeps latency from
+ * being under-reported while the generator itself falls behind.
+ *
+ * With -e every connection speaks TLS, without checking the server's certificate. The handshake
+ * is driven by the reads and writes of the login, like any other non-blocking OpenSSL session.
+ *
+ * The rest of a message is filled up with chat-like text. With -z connections negotiate compression
+ * and pair mode messages of at least COMPRESS_THRESHOLD bytes are sent compressed, every worker
+ * compressing and inflating with its own compressor.
+ */
+#define BENCH_TICK_MS      1     // Interval at which rate-limited messages are sent
+#define BENCH_CATCH_UP     64    // Messages a connection sends at most per tick when it fell behind
+#define BENCH_CONNECT_BATCH 256  // Connections a worker opens per tick while ramping up
+#define BENCH_PORTS_MAX    16    // Server ports the connections can be spread over
+#define BENCH_HEADER_SIZE  (sizeof(uint64_t) + sizeof(uint32_t))
+
+typedef enum { BENCH_PAIRS, BENCH_ROOMS } benchModes;
+typedef enum { BENCH_IDLE, BENCH_CONNECTING, BENCH_LOGGING_IN, BENCH_JOINING, BENCH_READY, BENCH_CLOSED } benchStates;
+typedef enum { PHASE_SETUP, PHASE_WARMUP, PHASE_MEASURE, PHASE_DRAIN, PHASE_DONE } benchPhases;
+
+typedef struct benchConfig {
+    char *ip;
+    int connections;
+    int threads;
+    benchModes mode;
+    int rooms;          // Rooms the connections are spread over in room mode
+    double rate;        // Messages per second per connection, 0 for closed loop
+    int size;           // Chat message size in bytes
+    int duration;       // Seconds measured
+    int warmup;         // Seconds sent before measuring
+    char *prefix;       // Prefix of the generated usernames
+    int tls;
+    int compress;
+    int ports[BENCH_PORTS_MAX]; // Connections are spread over the ports round robin, e.g the nodes of a cluster
+    int portCount;
+} benchConfig;
+
+benchConfig bench = {
+    .ip = "127.0.0.1",
+    .connections = 1000,
+    .threads = 1,
+    .mode = BENCH_PAIRS,
+    .rooms = 1,
+    .rate = 10,
+    .size = 64,
+    .duration = 10,
+    .warmup = 2,
+    .prefix = "bench",
+    .tls = 0,
+    .compress = 0,
+    .ports = { DEFAULT_PORT },
+    .portCount = 1,
+};
+
+typedef struct benchConnection {
+    int socket;
+    SSL *tls;                       // NULL without -e
+    unsigned int index;             // Position among all connections, sent along with every message
+    benchStates state;
+    struct benchConnection *partner; // Neighbour the connection chats with in pair mode
+    char username[USERNAME_MAX];
+    uint64_t nextSend;              // Intended send time of the next message in nanoseconds
+    int inFlight;                   // Closed loop only, whether the last message hasn't come back yet
+    char *in;
+    size_t inLength;
+    char *out;
+    size_t outLength;
+} benchConnection;
+
+typedef struct benchWorker {
+    pthread_t thread;
+    int id;
+    int epollFd;
+    benchConnection *connections;
+    int count;
+    int opened;
+    histogram latency;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t bytesReceived;
+    uint64_t backpressured;         // Messages skipped as the socket's send buffer was full
+    uint64_t errors;
+} benchWorker;
+
+int benchPhase = PHASE_SETUP;
+int readyConnections = 0;
+uint64_t measureStart = 0;          // Messages meant to be sent before this are left out of the results
+size_t inCapacity;
+size_t outCapacity;
+SSL_CTX *benchTls = NULL;
+char benchFiller[FRAME_MAX_PAYLOAD / 2];
+__thread compressor benchCompressor;
+__thread char benchText[FRAME_MAX_PAYLOAD];  // Inflated text of a compressed message
+
+uint64_t NowNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+int Phase()
+{
+    return __atomic_load_n(&benchPhase, __ATOMIC_ACQUIRE);
+}
+
+void PrintUsage(char *name)
+{
+    printf("Usage: %s [options] [server ip]\n"
+           "\t-n <count>   - Connections to open (default %d)\n"
+           "\t-T <count>   - Worker threads (default %d)\n"
+           "\t-m <mode>    - pairs: chat in pairs through TalkTo, rooms: chat in rooms (default pairs)\n"
+           "\t-R <count>   - Rooms to spread the connections over in room mode (default %d)\n"
+           "\t-r <rate>    - Messages per second per connection, 0 sends the next one once the last came back (default %.0f)\n"
+           "\t-s <bytes>   - Message size (default %d)\n"
+           "\t-d <seconds> - Measured duration (default %d)\n"
+           "\t-w <seconds> - Warm-up before measuring (default %d)\n"
+           "\t-u <prefix>  - Username prefix, has to differ between concurrent runs (default %s)\n"
+           "\t-e           - Connect through TLS\n"
+           "\t-z           - Compress long messages\n"
+           "\t-p <ports>   - Comma separated server ports, connections alternate between them so pairs span cluster nodes (default %d)\n"
+           "\t-h           - Show this message\n",
+           name, bench.connections, bench.threads, bench.rooms, bench.rate, bench.size, bench.duration, bench.warmup, bench.prefix, DEFAULT_PORT);
+}
+void ParseArguments(int argc, char *argv[])
+{
+    int opt;
+    while((opt = getopt(argc, argv, "n:T:m:R:r:s:d:w:u:ezp:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': bench.connections = atoi(optarg); break;
+            case 'T': bench.threads = atoi(optarg); break;
+            case 'R': bench.rooms = atoi(optarg); break;
+            case 'r': bench.rate = atof(optarg); break;
+            case 's': bench.size = atoi(optarg); break;
+            case 'd': bench.duration = atoi(optarg); break;
+            case 'w': bench.warmup = atoi(optarg); break;
+            case 'u': bench.prefix = optarg; break;
+            case 'e': bench.tls = 1; break;
+            case 'z': bench.compress = 1; break;
+            case 'p':
+            {
+                char *port, *save = NULL;
+                bench.portCount = 0;
+                for(port = strtok_r(optarg, ",", &save); port && bench.portCount < BENCH_PORTS_MAX; port = strtok_r(NULL, ",", &save))
+                    bench.ports[bench.portCount++] = atoi(port);
+                if(!bench.portCount)
+                {
+                    PrintUsage(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
+            case 'm':
+                if(strcmp(optarg, "pairs") == 0) bench.mode = BENCH_PAIRS;
+                else if(strcmp(optarg, "rooms") == 0) bench.mode = BENCH_ROOMS;
+                else
+                {
+                    PrintUsage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'h':
+                PrintUsage(argv[0]);
+                exit(0);
+            default:
+                PrintUsage(argv[0]);
+                exit(1);
+        }
+    }
+    if(optind < argc) bench.ip = argv[optind];
+    if(bench.threads < 1) bench.threads = 1;
+    if(bench.rooms < 1) bench.rooms = 1;
+    if(bench.size < (int)BENCH_HEADER_SIZE) bench.size = BENCH_HEADER_SIZE;
+    if(bench.size > FRAME_MAX_PAYLOAD / 2) bench.size = FRAME_MAX_PAYLOAD / 2;
+    if(bench.mode == BENCH_PAIRS && bench.connections % 2) bench.connections++;
+    if(strlen(bench.prefix) > 8) bench.prefix[8] = 0; // Leaves room for the connection index
+}
+
+// Queues a frame on the connection, returns 0 if it doesn't fit into the send buffer
+int BenchQueue(benchConnection *c, uint8_t opcode, char *payload, size_t length)
+{
+    if(c->outLength + FRAME_HEADER_SIZE + length > outCapacity) return 0;
+    c->outLength += BuildFrame(c->out + c->outLength, opcode, payload, length);
+    return 1;
+}
+// Sends and receives the way send and recv do, through TLS with -e. Waiting for the handshake reads as EAGAIN
+ssize_t BenchSend(benchConnection *c, char *data, size_t length)
+{
+    if(!c->tls) return send(c->socket, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    int written = SSL_write(c->tls, data, (int)length);
+    if(written > 0) return written;
+    int error = SSL_get_error(c->tls, written);
+    errno = error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE ? EAGAIN : EPROTO;
+    return -1;
+}
+ssize_t BenchRecv(benchConnection *c, char *buffer, size_t length)
+{
+    if(!c->tls) return recv(c->socket, buffer, length, MSG_DONTWAIT);
+    int readSize = SSL_read(c->tls, buffer, (int)length);
+    if(readSize > 0) return readSize;
+    int error = SSL_get_error(c->tls, readSize);
+    if(error == SSL_ERROR_ZERO_RETURN) return 0;
+    errno = error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE ? EAGAIN : EPROTO;
+    return -1;
+}
+// Writes as much of the send buffer as the socket takes, returns -1 if the connection has failed
+int BenchFlush(benchConnection *c)
+{
+    while(c->outLength)
+    {
+        ssize_t written = BenchSend(c, c->out, c->outLength);
+        if(written < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        memmove(c->out, c->out + written, c->outLength - written);
+        c->outLength -= written;
+    }
+    return 0;
+}
+// Fills the filler with words picked from the compression dictionary, which compresses about like chat text
+void BenchFillText()
+{
+    const char *words[] = { "the ", "meeting ", "tomorrow ", "I think ", "release ", "because ", "thanks ", "error: ",
+                            "project ", "lol ", "see you ", "function ", "actually ", "problem ", "version ", "nice " };
+    uint32_t seed = 2463534242u;
+    size_t used = 0;
+    while(used < sizeof(benchFiller))
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        const char *word = words[seed % (sizeof(words) / sizeof(words[0]))];
+        size_t length = strlen(word);
+        if(length > sizeof(benchFiller) - used) length = sizeof(benchFiller) - used;
+        memcpy(benchFiller + used, word, length);
+        used += length;
+    }
+}
+// Queues a chat message stamped with its intended send time
+int BenchSendChat(benchConnection *c, uint64_t stamp)
+{
+    char payload[FRAME_MAX_PAYLOAD / 2 + ROOMNAME_MAX + 1];
+    size_t offset = 0;
+    if(bench.mode == BENCH_ROOMS) offset = sprintf(payload, "room%u ", c->index % bench.rooms);
+    memcpy(payload + offset, &stamp, sizeof(stamp));
+    memcpy(payload + offset + sizeof(stamp), &c->index, sizeof(c->index));
+    memcpy(payload + offset + BENCH_HEADER_SIZE, benchFiller, bench.size - BENCH_HEADER_SIZE);
+    if(bench.compress && bench.mode == BENCH_PAIRS && c->outLength + FRAME_HEADER_SIZE + bench.size <= outCapacity)
+    {
+        long compressed = CompressText(&benchCompressor, payload, bench.size, c->out + c->outLength + FRAME_HEADER_SIZE, bench.size);
+        if(compressed >= 0)
+        {
+            WriteFrameHeader(c->out + c->outLength, (uint32_t)compressed, DATA, FRAME_FLAG_COMPRESSED);
+            c->outLength += FRAME_HEADER_SIZE + compressed;
+            return 1;
+        }
+    }
+    return BenchQueue(c, bench.mode == BENCH_ROOMS ? SAY : DATA, payload, offset + bench.size);
+}
+
+#endif // BENCH_H
@@ -0,0 +1,229 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include "shared.h"
+#include "config.h"
+#include "log.h"
+#include "protocol.h"
+#include "trace.h"
+#include <fcntl.h>
+
+/*
+ * Capture mode, which records every command clients send, along with connections opening and
+ * closing, into a trace file the replay tool plays back against a server (see trace.h).
+ *
+ * It works like the logger: every thread that captures gets its own ring, with the thread itself
+ * as the only producer and the capture thread as the only consumer. A record is copied into the
+ * ring as a fixed header followed by its payload, and published with a single release store. The
+ * capture thread encodes the records of every ring and writes them out in large batches. When a
+ * ring is full the record is dropped and counted instead of blocking the reactor.
+ *
+ * Capturing starts with -X or through the admin socket, which also stops it.
+ */
+#define CAPTURE_RING_SIZE      (1024 * 1024) // Bytes per thread, must be a power of two
+#define CAPTURE_BATCH_SIZE     (256 * 1024)
+#define CAPTURE_DRAIN_INTERVAL 10            // Milliseconds the capture thread sleeps once every ring is empty
+
+typedef struct captureEntry {
+    uint64_t time;       // Microseconds since the capture started
+    uint64_t connection;
+    uint32_t length;     // Payload bytes following the entry in the ring
+    uint8_t type;
+    uint8_t opcode;
+    uint8_t flags;
+    uint8_t state;
+} captureEntry;
+
+typedef struct captureRing {
+    struct captureRing *next;
+    unsigned long head __attribute__((aligned(64))); // Written by the owning thread only
+    unsigned long dropped;
+    unsigned long tail __attribute__((aligned(64))); // Written by the capture thread only
+    unsigned long droppedReported;
+    char data[CAPTURE_RING_SIZE];
+} captureRing;
+
+captureRing *captureRings = NULL; // Every ring ever registered, rings live until the server exits
+pthread_mutex_t captureRingsLock = PTHREAD_MUTEX_INITIALIZER;
+__thread captureRing *localCapture = NULL;
+pthread_mutex_t captureLock = PTHREAD_MUTEX_INITIALIZER; // Serializes starting and stopping
+int captureActive = 0;
+int captureRunning = 0;
+int captureFd = -1;
+uint64_t captureStart;
+pthread_t captureThread;
+
+uint64_t CaptureNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+captureRing* CaptureRegister()
+{
+    captureRing *ring;
+    if(posix_memalign((void**)&ring, 64, sizeof(captureRing)) != 0) return NULL;
+    memset(ring, 0, offsetof(captureRing, data));
+    pthread_mutex_lock(&captureRingsLock);
+    ring->next = captureRings;
+    __atomic_store_n(&captureRings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&captureRingsLock);
+    localCapture = ring;
+    return ring;
+}
+
+// Copies into and out of a ring, wrapping around its end
+void CaptureCopyIn(captureRing *ring, unsigned long position, void *data, size_t length)
+{
+    size_t offset = position & (CAPTURE_RING_SIZE - 1);
+    size_t first = length < CAPTURE_RING_SIZE - offset ? length : CAPTURE_RING_SIZE - offset;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (char*)data + first, length - first);
+}
+void CaptureCopyOut(captureRing *ring, unsigned long position, void *data, size_t length)
+{
+    size_t offset = position & (CAPTURE_RING_SIZE - 1);
+    size_t first = length < CAPTURE_RING_SIZE - offset ? length : CAPTURE_RING_SIZE - offset;
+    memcpy(data, ring->data + offset, first);
+    memcpy((char*)data + first, ring->data, length - first);
+}
+
+void CaptureRecord(uint8_t type, uint64_t connection, uint8_t state, uint8_t opcode, uint8_t flags, char *payload, size_t length)
+{
+    if(!__atomic_load_n(&captureActive, __ATOMIC_ACQUIRE)) return;
+    captureRing *ring = localCapture ? localCapture : CaptureRegister();
+    if(!ring) return;
+
+    if(length > FRAME_MAX_PAYLOAD) length = FRAME_MAX_PAYLOAD;
+    unsigned long head = ring->head;
+    if(sizeof(captureEntry) + length > CAPTURE_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)))
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    captureEntry entry = { .time = CaptureNow() - captureStart, .connection = connection, .length = (uint32_t)length,
+                           .type = type, .opcode = opcode, .flags = flags, .state = state };
+    CaptureCopyIn(ring, head, &entry, sizeof(entry));
+    if(length) CaptureCopyIn(ring, head + sizeof(entry), payload, length);
+    __atomic_store_n(&ring->head, head + sizeof(entry) + length, __ATOMIC_RELEASE);
+}
+/*
+ * The state is read without the conversation lock, a command racing a change of it was sent before the
+ * client could know anyway. A text command is cut at its terminator, which its binary frame doesn't have.
+ */
+#define CaptureCommand(client, cmd, flags, args, length) CaptureRecord(TRACE_FRAME, (client)->id, (uint8_t)__atomic_load_n(&(client)->state, __ATOMIC_RELAXED), (uint8_t)(cmd), (flags), (args), \
+                                                                       (client)->protocol == PROTOCOL_TEXT ? strnlen((args), (length)) : (length))
+#define CaptureConnection(client, type) CaptureRecord((type), (client)->id, 0, 0, 0, NULL, 0)
+
+// Appends every published record of the ring to the batch, writing the batch out whenever it fills up
+size_t CaptureDrainRing(captureRing *ring, char *batch, size_t used, int64_t *lastTime)
+{
+    unsigned long tail = ring->tail;
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if(dropped != ring->droppedReported)
+    {
+        LogWarn("%lu capture records dropped, the capture ring was full", dropped - ring->droppedReported);
+        ring->droppedReported = dropped;
+    }
+    while(tail != head)
+    {
+        captureEntry entry;
+        CaptureCopyOut(ring, tail, &entry, sizeof(entry));
+        if(used + TRACE_RECORD_MAX + entry.length > CAPTURE_BATCH_SIZE)
+        {
+            if(write(captureFd, batch, used) < 0) LogError("Failed to write the capture: %m");
+            used = 0;
+        }
+        traceRecord record = { .type = entry.type, .time = (int64_t)entry.time, .connection = entry.connection,
+                               .opcode = entry.opcode, .flags = entry.flags, .state = entry.state, .length = entry.length };
+        used += TraceWriteRecord(batch + used, &record, lastTime);
+        CaptureCopyOut(ring, tail + sizeof(entry), batch + used, entry.length);
+        used += entry.length;
+        tail += sizeof(entry) + entry.length;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return used;
+}
+// Drains every ring until the capture is stopped, then once more so nothing captured before is lost
+void* CaptureThread(void *arg)
+{
+    char *batch = (char*)malloc(CAPTURE_BATCH_SIZE);
+    int64_t lastTime = 0;
+    if(!batch) return NULL;
+    while(1)
+    {
+        int running = __atomic_load_n(&captureRunning, __ATOMIC_ACQUIRE);
+        size_t used = 0;
+        captureRing *ring;
+        for(ring = __atomic_load_n(&captureRings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+            used = CaptureDrainRing(ring, batch, used, &lastTime);
+        if(used && write(captureFd, batch, used) < 0) LogError("Failed to write the capture: %m");
+        if(!running) break;
+        if(!used)
+        {
+            struct timespec interval = { .tv_sec = 0, .tv_nsec = CAPTURE_DRAIN_INTERVAL * 1000000L };
+            nanosleep(&interval, NULL);
+        }
+    }
+    free(batch);
+    return NULL;
+}
+
+// Starts writing a new trace to the file, returns 0 if that failed or a capture is already running
+int CaptureStart(char *path)
+{
+    pthread_mutex_lock(&captureLock);
+    if(captureFd >= 0)
+    {
+        pthread_mutex_unlock(&captureLock);
+        return 0;
+    }
+    char header[TRACE_HEADER_SIZE];
+    captureFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(captureFd < 0 || write(captureFd, header, TraceWriteHeader(header)) != TRACE_HEADER_SIZE)
+    {
+        LogError("Failed to open the capture file %s: %m", path);
+        if(captureFd >= 0) close(captureFd);
+        captureFd = -1;
+        pthread_mutex_unlock(&captureLock);
+        return 0;
+    }
+    // Records that came in as the last capture stopped belong to neither
+    captureRing *ring;
+    for(ring = __atomic_load_n(&captureRings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+        __atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    captureStart = CaptureNow();
+    captureRunning = 1;
+    if(pthread_create(&captureThread, NULL, CaptureThread, NULL) != 0)
+    {
+        LogError("Failed to start the capture thread");
+        close(captureFd);
+        captureFd = -1;
+        pthread_mutex_unlock(&captureLock);
+        return 0;
+    }
+    __atomic_store_n(&captureActive, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&captureLock);
+    LogInfo("Capturing client traffic to %s", path);
+    return 1;
+}
+// Stops the capture once everything recorded so far is written
+void CaptureStop()
+{
+    pthread_mutex_lock(&captureLock);
+    if(captureFd < 0)
+    {
+        pthread_mutex_unlock(&captureLock);
+        return;
+    }
+    __atomic_store_n(&captureActive, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&captureRunning, 0, __ATOMIC_RELEASE);
+    pthread_join(captureThread, NULL);
+    close(captureFd);
+    captureFd = -1;
+    pthread_mutex_unlock(&captureLock);
+    LogInfo("Capture stopped");
+}
+
+#endif // CAPTURE_H
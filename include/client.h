@@ -1,103 +1,910 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 #include "shared.h"
+#include "protocol.h"
+#include "compress.h"
+#include "ormclient.h"
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 
-void SendMessage(int socket, char* message)
+/*
+ * Implementation of libormclient, see ormclient.h for the interface.
+ *
+ * Every session has its own receive and send buffers, which start out small and only grow
+ * while a large frame is received or the socket doesn't take what's sent. Replies are decoded
+ * into the context's single serverMessage, one at a time, right before their event is reported,
+ * so a session costs little more than its socket no matter how many of them a context drives.
+ *
+ * Sessions opened with ORM_TLS handshake right after connecting. The context keeps the last
+ * session ticket the server issued, so the next session to the same server resumes the TLS
+ * session instead of running a full handshake.
+ *
+ * Unless a session was opened with ORM_NO_COMPRESSION it offers compression in its HELLO. Once
+ * the server agreed, long chat messages are sent compressed, and compressed chat messages are
+ * inflated before they're reported, by the single compressor of the context.
+ */
+#define SESSION_BUFFER_INITIAL 4096
+#define SESSION_BUFFER_MAX     (2 * FRAME_MAX_SIZE + 1) // Room for a whole frame behind an incomplete one
+#define CONTEXT_MAX_EVENTS     256
+
+/*
+ * A reply received from the server, decoded the same way for both protocols:
+ *      - Type: Kind of reply, taken from the frame opcode or the text prefix
+ *      - State: New client state of login, conversation and disconnect replies
+ *      - Username: Username attached to a state change or the author of a chat message
+ *      - Room: Room a room message was sent to
+ *      - Sent: Unix time a direct message was sent at
+ *      - Text: Text of the reply or chat message
+ */
+typedef struct serverMessage {
+    serverReplies type;
+    clientStates state;
+    char username[USERNAME_MAX];
+    char room[ROOMNAME_MAX];
+    long long sent;
+    char text[DEFAULT_BUFLEN];
+} serverMessage;
+
+typedef enum { SESSION_CONNECTING, SESSION_HANDSHAKING, SESSION_NEGOTIATING, SESSION_READY, SESSION_CLOSED } sessionPhases;
+
+/*
+ * A connection to the server:
+ *      - Phase: Whether the socket is still connecting, in the TLS handshake, waiting for the
+ *        answer to the HELLO frame, ready for commands or closed
+ *      - Address of the server, and the TLS session of sessions opened with ORM_TLS
+ *      - Protocol the session speaks, along with the features the server agreed to
+ *      - State: Client state as the server sees it, along with the username and the user
+ *        the session is in a conversation with or has a request from or to
+ *      - Received bytes that weren't handled yet, from inStart up to inLength
+ *      - Bytes the socket didn't take yet, from outStart up to outLength. A TLS write that
+ *        couldn't finish is repeated from there, always with at least as many bytes
+ *      - Links in the context's list of open sessions, or of sessions closed during OrmRun
+ */
+struct ormSession {
+    ormContext *context;
+    int socket;
+    sessionPhases phase;
+    int flags;
+    struct sockaddr_in address;
+    SSL *tls;
+    protocolModes protocol;
+    int features;
+    clientStates state;
+    char username[USERNAME_MAX];
+    char partner[USERNAME_MAX];
+    ormCallback callback;
+    void *userData;
+    char *in;
+    size_t inStart;
+    size_t inLength;
+    size_t inCapacity;
+    char *out;
+    size_t outStart;
+    size_t outLength;
+    size_t outCapacity;
+    struct ormSession *next;
+    struct ormSession *prev;
+};
+
+struct ormContext {
+    int epollFd;
+    ormSession *sessions;        // Open sessions
+    ormSession *closed;          // Closed while OrmRun was handling events, freed once it's done
+    int count;
+    int running;                 // Whether OrmRun is handling events
+    SSL_CTX *tls;                // Set up by OrmContextTls
+    SSL_SESSION *tlsSession;     // Last session ticket, along with the server that issued it
+    struct sockaddr_in tlsPeer;
+    serverMessage message;       // Reply being reported
+    char line[DEFAULT_BUFLEN];   // Command line being built
+    char frameBuffer[FRAME_MAX_SIZE];
+    compressor compressor;
+};
+
+void CopyText(char *destination, size_t size, char *text, size_t length)
+{
+    if(length >= size) length = size - 1;
+    memcpy(destination, text, length);
+    destination[length] = 0;
+}
+// Copies a field prefixed with its length as a single byte, returns the size of the field along with its length
+size_t DecodeField(char *destination, size_t size, char *field, size_t length)
+{
+    if(length == 0)
+    {
+        destination[0] = 0;
+        return 0;
+    }
+    size_t fieldLength = (unsigned char)field[0];
+    if(fieldLength + 1 > length) fieldLength = length - 1;
+    CopyText(destination, size, field + 1, fieldLength);
+    return fieldLength + 1;
+}
+// A chat message that doesn't inflate is reported as an error, it's the sender's fault rather than the server's
+void DecodeFrame(frame *f, serverMessage *message, compressor *c)
+{
+    message->type = (serverReplies)f->opcode;
+    message->username[0] = 0;
+    message->room[0] = 0;
+    message->text[0] = 0;
+    switch(message->type)
+    {
+        case REPLY_LOGIN:
+        case REPLY_TALKTO:
+        case REPLY_DISCONNECT:
+            message->state = f->length ? (clientStates)f->payload[0] : LOGGING_OUT;
+            if(f->length > 1) CopyText(message->username, USERNAME_MAX, f->payload + 1, f->length - 1);
+            break;
+        case REPLY_MESSAGE:
+        {
+            size_t usernameLength = f->length ? (unsigned char)f->payload[0] : 0;
+            if(usernameLength + 1 > f->length) usernameLength = f->length ? f->length - 1 : 0;
+            CopyText(message->username, USERNAME_MAX, f->payload + 1, usernameLength);
+            char *text = f->payload + 1 + usernameLength;
+            size_t textLength = f->length > usernameLength + 1 ? f->length - usernameLength - 1 : 0;
+            if(f->flags & FRAME_FLAG_COMPRESSED)
+            {
+                long inflated = DecompressText(c, text, textLength, message->text, DEFAULT_BUFLEN - 1);
+                if(inflated >= 0) message->text[inflated] = 0;
+                else
+                {
+                    message->type = REPLY_ERROR;
+                    snprintf(message->text, DEFAULT_BUFLEN, "Couldn't decompress a message of %s", message->username);
+                }
+            }
+            else if(textLength) CopyText(message->text, DEFAULT_BUFLEN, text, textLength);
+            break;
+        }
+        case REPLY_ROOM_MESSAGE:
+        {
+            size_t offset = DecodeField(message->room, ROOMNAME_MAX, f->payload, f->length);
+            offset += DecodeField(message->username, USERNAME_MAX, f->payload + offset, f->length - offset);
+            CopyText(message->text, DEFAULT_BUFLEN, f->payload + offset, f->length - offset);
+            break;
+        }
+        case REPLY_DIRECT_MESSAGE:
+        {
+            size_t offset = f->length < 8 ? f->length : 8;
+            uint64_t sent = 0;
+            size_t i;
+            for(i = 0; i < offset; i++) sent = (sent << 8) | (unsigned char)f->payload[i];
+            message->sent = (long long)sent;
+            offset += DecodeField(message->username, USERNAME_MAX, f->payload + offset, f->length - offset);
+            CopyText(message->text, DEFAULT_BUFLEN, f->payload + offset, f->length - offset);
+            break;
+        }
+        case REPLY_PRESENCE: // Rendered the way the text protocol sends it, e.g "+john -jane"
+        {
+            char marks[3] = { '-', '+', '*' };
+            size_t offset = 0, used = 0;
+            while(offset + 2 <= f->length && used + USERNAME_MAX + 2 < DEFAULT_BUFLEN)
+            {
+                unsigned char status = (unsigned char)f->payload[offset];
+                char username[USERNAME_MAX];
+                offset += 1 + DecodeField(username, USERNAME_MAX, f->payload + offset + 1, f->length - offset - 1);
+                used += sprintf(message->text + used, "%s%c%s", used ? " " : "", status < 3 ? marks[status] : '?', username);
+            }
+            break;
+        }
+        default:
+            CopyText(message->text, DEFAULT_BUFLEN, f->payload, f->length);
+    }
+}
+// Skips the prefix of a text message, without going past its end
+char* TextAfter(char *receivedMessage, size_t prefixLength)
 {
-    if(send(socket, message, strlen(message), 0) < 0)
+    size_t length = strlen(receivedMessage);
+    return receivedMessage + (prefixLength < length ? prefixLength : length);
+}
+// Converts a message of the text protocol into its reply type and contents
+void DecodeText(char *receivedMessage, serverMessage *message)
+{
+    int s = (int)LOGGING_OUT;
+    message->username[0] = 0;
+    message->room[0] = 0;
+    message->text[0] = 0;
+    if(startsWith(receivedMessage, "ERROR:"))
+    {
+        message->type = REPLY_ERROR;
+        strncpy(message->text, TextAfter(receivedMessage, 7), DEFAULT_BUFLEN - 1);
+    }
+    else if(startsWith(receivedMessage, "LOG:"))
+    {
+        message->type = REPLY_LOG;
+        strncpy(message->text, TextAfter(receivedMessage, 5), DEFAULT_BUFLEN - 1);
+    }
+    else if(startsWith(receivedMessage, "TalkTo:")) // An error message from the command TalkTo
     {
-        perror("Send failed");
-        close(socket);
-        exit(1);
+        message->type = REPLY_TALKTO_ERROR;
+        strncpy(message->text, TextAfter(receivedMessage, 8), DEFAULT_BUFLEN - 1);
     }
+    else if(startsWith(receivedMessage, "MESSAGE:")) // The author is kept as part of the text, e.g "[john]: hi"
+    {
+        message->type = REPLY_MESSAGE;
+        strncpy(message->text, TextAfter(receivedMessage, 8), DEFAULT_BUFLEN - 1);
+    }
+    else if(startsWith(receivedMessage, "ROOM:")) // The room and author are kept as part of the text, e.g "[general][john]: hi"
+    {
+        message->type = REPLY_ROOM_MESSAGE;
+        strncpy(message->text, TextAfter(receivedMessage, 5), DEFAULT_BUFLEN - 1);
+    }
+    else if(startsWith(receivedMessage, "DIRECT:")) // The author is kept as part of the text, e.g "DIRECT:1700000000 [john]: hi"
+    {
+        int offset = 0;
+        message->type = REPLY_DIRECT_MESSAGE;
+        message->sent = 0;
+        sscanf(receivedMessage, "DIRECT:%lld %n", &message->sent, &offset);
+        strncpy(message->text, TextAfter(receivedMessage, offset ? (size_t)offset : 7), DEFAULT_BUFLEN - 1);
+    }
+    else if(startsWith(receivedMessage, "PRESENCE:")) // Users marked with their new status, e.g "PRESENCE:+john -jane"
+    {
+        message->type = REPLY_PRESENCE;
+        strncpy(message->text, TextAfter(receivedMessage, 9), DEFAULT_BUFLEN - 1);
+    }
+    else if(startsWith(receivedMessage, "PING:"))
+    {
+        message->type = REPLY_PING;
+    }
+    else if(startsWith(receivedMessage, "DISCONNECT:"))
+    {
+        message->type = REPLY_DISCONNECT;
+        sscanf(receivedMessage, "DISCONNECT: %d", &s);
+    }
+    else if(startsWith(receivedMessage, "TALKTO:"))
+    {
+        message->type = REPLY_TALKTO;
+        sscanf(receivedMessage, "TALKTO: %d", &s);
+        if(strlen(receivedMessage) > 10) strncpy(message->username, receivedMessage + 10, USERNAME_MAX - 1);
+    }
+    else // Successful login, the new state followed by the username
+    {
+        message->type = REPLY_LOGIN;
+        sscanf(receivedMessage, "%d", &s);
+        if(strlen(receivedMessage) > 2) strncpy(message->username, receivedMessage + 2, USERNAME_MAX - 1);
+    }
+    message->state = (clientStates)s;
+    message->text[DEFAULT_BUFLEN - 1] = 0;
 }
-// This is a blocking function as it uses recv
-void ReceiveMessage(int socket, int *readSize, char *receivedMessage)
+/*
+ * Takes the next complete reply out of the session's receive buffer, returns 0 if there's none yet.
+ * In the binary protocol a frame split across reads stays in the buffer until the rest of it arrives,
+ * in the text protocol everything a single read returned is one reply. Returns -1 on a malformed frame.
+ */
+int NextMessage(ormSession *s, serverMessage *message)
 {
-    while((*readSize = recv(socket, receivedMessage, DEFAULT_BUFLEN, 0)) > 0) { break; }
-    if(*readSize == -1)
+    if(s->inStart == s->inLength) return 0;
+    if(s->protocol != PROTOCOL_BINARY)
     {
-        perror("recv: Couldn't receive message from socket");
-        close(socket);
-        exit(1);
+        s->in[s->inLength] = 0;
+        DecodeText(s->in + s->inStart, message);
+        s->inStart = s->inLength = 0;
+        return 1;
     }
+    frame f;
+    int size = ParseFrame(s->in + s->inStart, s->inLength - s->inStart, &f);
+    if(size <= 0) return size;
+    DecodeFrame(&f, message, &s->context->compressor);
+    s->inStart += size;
+    return 1;
 }
 
-void ReadLine(char* message)
+void SessionEvent(ormSession *s, ormEventTypes type, char *username, char *room, long long sent, char *text)
 {
-    fgets(message, DEFAULT_BUFLEN, stdin);
-    // Trimming out the newline character, see https://en.cppreference.com/w/c/string/byte/strcspn
-    message[strcspn(message, "\n")] = 0;
+    ormEvent event = { .type = type, .state = (ormStates)s->state, .username = username ? username : "",
+                       .room = room ? room : "", .sent = sent, .text = text ? text : "" };
+    s->callback(s, &event, s->userData);
 }
 
-void TryConnect(int *sock, struct sockaddr_in *server, char* ip)
+// Hands a session that was taken off the context to the caller, or keeps it until OrmRun is done with its events
+void SessionRelease(ormSession *s)
 {
-    // Create socket
-    *sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (*sock == -1)
+    ormContext *context = s->context;
+    if(context->running)
     {
-        printf("Could not create socket\n");
-        exit(1);
+        s->next = context->closed;
+        context->closed = s;
+        return;
     }
-    printf("Socket created\n");
+    free(s->in);
+    free(s->out);
+    free(s);
+}
+// Closes the socket and takes the session off the context's list of open sessions
+void SessionShutdown(ormSession *s)
+{
+    ormContext *context = s->context;
+    if(s->tls)
+    {
+        if(s->phase == SESSION_NEGOTIATING || s->phase == SESSION_READY) SSL_shutdown(s->tls); // Tell the server, as far as the socket takes it
+        ERR_clear_error();
+        SSL_free(s->tls);
+        s->tls = NULL;
+    }
+    close(s->socket); // Closing the descriptor also removes it from epoll
+    s->socket = -1;
+    s->phase = SESSION_CLOSED;
+    s->state = LOGGING_OUT;
+    if(s->prev) s->prev->next = s->next;
+    else context->sessions = s->next;
+    if(s->next) s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+    context->count--;
+}
+// Reports a connection that broke down as the last event of the session, the session is freed afterwards
+void SessionFail(ormSession *s, char *reason)
+{
+    if(s->phase == SESSION_CLOSED) return;
+    SessionShutdown(s);
+    SessionEvent(s, ORM_EVENT_CLOSED, NULL, NULL, 0, reason);
+    SessionRelease(s);
+}
 
-    // Configuring server information
-    server->sin_addr.s_addr = inet_addr(ip);
-    server->sin_family = AF_INET;
-    server->sin_port = htons(DEFAULT_PORT);
+/*
+ * Reads from the connection the way recv does, decrypting for TLS sessions, with errno set to
+ * EAGAIN once nothing is left.
+ */
+ssize_t SessionRecv(ormSession *s, char *buffer, size_t length)
+{
+    if(!s->tls) return recv(s->socket, buffer, length, MSG_DONTWAIT);
+    ERR_clear_error();
+    int readSize = SSL_read(s->tls, buffer, (int)length);
+    if(readSize > 0) return readSize;
+    switch(SSL_get_error(s->tls, readSize))
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            return errno ? -1 : 0;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+// Writes to the connection the way send does, encrypting for TLS sessions
+ssize_t SessionSend(ormSession *s, char *data, size_t length)
+{
+    if(!s->tls) return send(s->socket, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    ERR_clear_error();
+    int sent = SSL_write(s->tls, data, (int)length);
+    if(sent > 0) return sent;
+    int error = SSL_get_error(s->tls, sent);
+    if(error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) errno = EAGAIN;
+    else if(error != SSL_ERROR_SYSCALL || !errno) errno = EPROTO;
+    return -1;
+}
 
-    // Connect to remote server
-    if (connect(*sock, (struct sockaddr*)server, sizeof(*server)) < 0)
+// Watches the socket for writability only while something is waiting to be sent
+int SessionWatch(ormSession *s, int writable)
+{
+    struct epoll_event event = { .events = EPOLLIN | (writable ? EPOLLOUT : 0), .data.ptr = s };
+    return epoll_ctl(s->context->epollFd, EPOLL_CTL_MOD, s->socket, &event);
+}
+// Sends whatever the socket takes right away and keeps the rest until it's writable again
+int SessionWrite(ormSession *s, char *data, size_t length)
+{
+    if(s->outStart == s->outLength)
     {
-        perror("Connect failed. Error");
-        exit(1);
+        ssize_t sent = SessionSend(s, data, length);
+        if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return ORM_ERROR; // Reported by the next OrmRun, the socket reads as broken as well
+        if(sent < 0) sent = 0;
+        if((size_t)sent == length) return ORM_OK;
+        data += sent;
+        length -= sent;
+        s->outStart = s->outLength = 0;
+        if(SessionWatch(s, 1) < 0) return ORM_ERROR;
     }
+    if(s->outLength + length > s->outCapacity)
+    {
+        if(s->outStart)
+        {
+            memmove(s->out, s->out + s->outStart, s->outLength - s->outStart);
+            s->outLength -= s->outStart;
+            s->outStart = 0;
+        }
+        size_t capacity = s->outCapacity ? s->outCapacity : SESSION_BUFFER_INITIAL;
+        while(capacity < s->outLength + length) capacity *= 2;
+        char *out = (char*)realloc(s->out, capacity);
+        if(!out) return ORM_ERROR;
+        s->out = out;
+        s->outCapacity = capacity;
+    }
+    memcpy(s->out + s->outLength, data, length);
+    s->outLength += length;
+    return ORM_OK;
+}
+// Sends a command line as the user typed it, in the protocol the session speaks
+int SessionSendLine(ormSession *s, clientCommands cmd, char *line)
+{
+    size_t length = strlen(line);
+    if(s->protocol != PROTOCOL_BINARY) return SessionWrite(s, line, length);
+    // The command is resolved here once, the server dispatches on the opcode without parsing anything
+    char *frameBuffer = s->context->frameBuffer;
+    size_t argsOffset = cmd == UNKNOWN ? length : strlen(clientCommandsString[cmd]) + 1;
+    if(argsOffset > length) argsOffset = length;
+    if(length - argsOffset > FRAME_MAX_PAYLOAD) length = argsOffset + FRAME_MAX_PAYLOAD;
+    if(cmd == DATA && (s->features & PROTOCOL_FEATURE_DEFLATE))
+    {
+        long compressed = CompressText(&s->context->compressor, line + argsOffset, length - argsOffset,
+                                       frameBuffer + FRAME_HEADER_SIZE, FRAME_MAX_PAYLOAD);
+        if(compressed >= 0)
+        {
+            WriteFrameHeader(frameBuffer, (uint32_t)compressed, DATA, FRAME_FLAG_COMPRESSED);
+            return SessionWrite(s, frameBuffer, FRAME_HEADER_SIZE + compressed);
+        }
+    }
+    return SessionWrite(s, frameBuffer, BuildFrame(frameBuffer, (uint8_t)cmd, line + argsOffset, length - argsOffset));
 }
 
-// The following functions are called in the listening thread
-void HandleDisconnect(clientStates *clientState, char *chatUsername, char *receivedMessage)
+void SessionConnected(ormSession *s)
 {
-    int s;
-    sscanf(receivedMessage, "DISCONNECT: %d", &s);
-    *clientState = (clientStates)s;
-    printf("Disconnected from conversation with %s\n>", chatUsername);
-    fflush(stdout);
-    memset(chatUsername, 0, USERNAME_MAX);
+    char *text = NULL;
+    s->phase = SESSION_READY;
+    if(s->tls)
+    {
+        text = s->context->line;
+        snprintf(text, sizeof(s->context->line), "%s%s", SSL_get_version(s->tls), SSL_session_reused(s->tls) ? ", resumed" : "");
+    }
+    SessionEvent(s, ORM_EVENT_CONNECTED, NULL, NULL, 0, text);
 }
-void HandleTalkTo(clientStates *clientState, char *chatUsername, char *receivedMessage)
+// The connection is set up, the protocol is negotiated next unless the text protocol was asked for
+void SessionStart(ormSession *s)
 {
-    int s;
-    sscanf(receivedMessage, "TALKTO: %d", &s);
-    *clientState = (clientStates)s;
-    if(*clientState == CHATTING)
+    if(s->flags & ORM_TEXT_PROTOCOL)
     {
-        printf("You are now chatting with %s.\n>", chatUsername);
-        fflush(stdout);
+        s->protocol = PROTOCOL_TEXT;
+        SessionConnected(s);
+        return;
     }
-    else if(*clientState == IDLE)
+    // Offers the binary protocol, a server that doesn't support it answers with a text error
+    char hello[FRAME_HEADER_SIZE + PROTOCOL_MAGIC_LEN + 2];
+    s->phase = SESSION_NEGOTIATING;
+    uint8_t features = (s->flags & ORM_NO_COMPRESSION) ? 0 : PROTOCOL_FEATURES;
+    if(SessionWrite(s, hello, BuildHello(hello, PROTOCOL_VERSION, features)) < 0) SessionFail(s, strerror(errno));
+}
+
+// Keeps the newest session ticket of the context's server, the reference is taken over from OpenSSL
+int ContextNewTicket(SSL *tls, SSL_SESSION *ticket)
+{
+    ormSession *s = (ormSession*)SSL_get_app_data(tls);
+    ormContext *context = s->context;
+    if(context->tlsSession) SSL_SESSION_free(context->tlsSession);
+    context->tlsSession = ticket;
+    context->tlsPeer = s->address;
+    return 1;
+}
+// Explains why a handshake failed, the certificate check being the usual reason
+void SessionHandshakeFailed(ormSession *s)
+{
+    char *reason = s->context->line;
+    long verify = SSL_get_verify_result(s->tls);
+    unsigned long tlsError = ERR_get_error();
+    if(verify != X509_V_OK)
+        snprintf(reason, sizeof(s->context->line), "TLS handshake failed: %s", X509_verify_cert_error_string(verify));
+    else if(tlsError)
+        snprintf(reason, sizeof(s->context->line), "TLS handshake failed: %s", ERR_reason_error_string(tlsError));
+    else
+        snprintf(reason, sizeof(s->context->line), "TLS handshake failed: %s", errno ? strerror(errno) : "The server has closed the connection");
+    SessionFail(s, reason);
+}
+// Continues the TLS handshake, watching the socket for whatever it waits for
+void SessionHandshake(ormSession *s)
+{
+    ERR_clear_error();
+    int status = SSL_do_handshake(s->tls);
+    int error = status == 1 ? SSL_ERROR_NONE : SSL_get_error(s->tls, status);
+    if(error != SSL_ERROR_NONE && error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE)
     {
-        printf("Request denied!\n>");
-        fflush(stdout);
-        memset(chatUsername, 0, USERNAME_MAX);
+        SessionHandshakeFailed(s);
+        return;
+    }
+    if(SessionWatch(s, error == SSL_ERROR_WANT_WRITE) < 0)
+    {
+        SessionFail(s, strerror(errno));
+        return;
+    }
+    if(status == 1) SessionStart(s);
+}
+// Starts the handshake of a session opened with ORM_TLS, resuming the last session with the same server
+void SessionStartTls(ormSession *s)
+{
+    ormContext *context = s->context;
+    char ip[INET_ADDRSTRLEN];
+    s->tls = SSL_new(context->tls);
+    if(!s->tls || SSL_set_fd(s->tls, s->socket) != 1)
+    {
+        SessionFail(s, "Failed to create the TLS session");
+        return;
+    }
+    SSL_set_app_data(s->tls, s);
+    inet_ntop(AF_INET, &s->address.sin_addr, ip, sizeof(ip));
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(s->tls), ip); // The certificate has to be issued for the address connected to
+    if(context->tlsSession && context->tlsPeer.sin_addr.s_addr == s->address.sin_addr.s_addr &&
+       context->tlsPeer.sin_port == s->address.sin_port)
+        SSL_set_session(s->tls, context->tlsSession);
+    SSL_set_connect_state(s->tls);
+    s->phase = SESSION_HANDSHAKING;
+    SessionHandshake(s);
+}
+// The connection attempt has finished, with TLS the handshake comes first
+void SessionConnectDone(ormSession *s)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(getsockopt(s->socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0) error = errno;
+    if(error)
+    {
+        SessionFail(s, strerror(error));
+        return;
+    }
+    if(s->flags & ORM_TLS) SessionStartTls(s);
+    else SessionStart(s);
+}
+// Looks at the answer to the HELLO frame, returns 0 until it has arrived
+int SessionNegotiate(ormSession *s)
+{
+    char *data = s->in + s->inStart;
+    size_t length = s->inLength - s->inStart;
+    frame f;
+    int size = data[0] == 0 ? ParseFrame(data, length, &f) : -1;
+    if(size == 0) return 0;
+    if(size > 0 && ParseHello(&f))
+    {
+        s->protocol = PROTOCOL_BINARY;
+        s->features = ParseHelloFeatures(&f);
+        s->inStart += size; // Replies that came along with the answer are handled right after it
     }
     else
     {
-        strncpy(chatUsername, receivedMessage+10, USERNAME_MAX);
-        if(*clientState == CONNECTING) printf("Sent chat request to %s...\n", chatUsername);
-        else if(*clientState == PENDING_REQUEST) printf("User %s wants to chat, will you accept? [y/N]\n>", chatUsername);
-        fflush(stdout);
+        s->protocol = PROTOCOL_TEXT;
+        s->inStart = s->inLength = 0; // Drop the error the server answered with
+    }
+    SessionConnected(s);
+    return 1;
+}
+
+// Keeps the session's state in line with a reply and reports it
+void SessionReply(ormSession *s, serverMessage *m)
+{
+    switch(m->type)
+    {
+        case REPLY_LOGIN: // The text protocol also ends up here for anything it doesn't recognize
+            if(s->state != LOGGING_IN) break;
+            s->state = m->state;
+            strncpy(s->username, m->username, USERNAME_MAX - 1);
+            SessionEvent(s, ORM_EVENT_LOGIN, s->username, NULL, 0, NULL);
+            break;
+        case REPLY_ERROR:
+            SessionEvent(s, ORM_EVENT_ERROR, NULL, NULL, 0, m->text);
+            break;
+        case REPLY_LOG:
+            SessionEvent(s, ORM_EVENT_LOG, NULL, NULL, 0, m->text);
+            break;
+        case REPLY_TALKTO_ERROR: // Errors from the TalkTo command reset the state back to IDLE
+            s->state = IDLE;
+            s->partner[0] = 0;
+            SessionEvent(s, ORM_EVENT_TALKTO_ERROR, NULL, NULL, 0, m->text);
+            break;
+        case REPLY_TALKTO:
+            s->state = m->state;
+            if(m->username[0]) strncpy(s->partner, m->username, USERNAME_MAX - 1);
+            SessionEvent(s, ORM_EVENT_TALKTO, s->partner, NULL, 0, NULL);
+            if(s->state == IDLE) s->partner[0] = 0; // Request denied
+            break;
+        case REPLY_DISCONNECT:
+            s->state = m->state;
+            SessionEvent(s, ORM_EVENT_DISCONNECT, s->partner, NULL, 0, NULL);
+            s->partner[0] = 0;
+            break;
+        case REPLY_MESSAGE:
+            SessionEvent(s, ORM_EVENT_MESSAGE, m->username, NULL, 0, m->text);
+            break;
+        case REPLY_ROOM_MESSAGE:
+            SessionEvent(s, ORM_EVENT_ROOM_MESSAGE, m->username, m->room, 0, m->text);
+            break;
+        case REPLY_DIRECT_MESSAGE:
+            SessionEvent(s, ORM_EVENT_DIRECT_MESSAGE, m->username, NULL, m->sent, m->text);
+            break;
+        case REPLY_PRESENCE:
+            SessionEvent(s, ORM_EVENT_PRESENCE, NULL, NULL, 0, m->text);
+            break;
+        case REPLY_PING: // The server checks whether an idle client is still there
+            SessionSendLine(s, PING, "Ping");
+            break;
+        default:
+            break;
     }
 }
 
-int AssertResponse(clientStates *clientState, char *receivedMessage)
+/*
+ * Reads what's available on the socket and reports every complete reply. The receive buffer grows
+ * while a frame doesn't fit, the part that was handled is only dropped once the rest of the
+ * buffer runs low.
+ */
+void SessionReceive(ormSession *s)
 {
-    if(strlen(receivedMessage) == 0)
+    if(s->inStart == s->inLength)
+        s->inStart = s->inLength = 0;
+    else if(s->inStart && s->inCapacity - 1 - s->inLength < s->inCapacity / 4)
     {
-        printf("Login request failed: empty reply from server.\n");
-        *clientState = LOGGING_OUT;
-        return 0;
+        memmove(s->in, s->in + s->inStart, s->inLength - s->inStart);
+        s->inLength -= s->inStart;
+        s->inStart = 0;
     }
-    return 1;
+    if(s->inLength + 1 == s->inCapacity)
+    {
+        size_t capacity = s->inCapacity * 2 < SESSION_BUFFER_MAX ? s->inCapacity * 2 : SESSION_BUFFER_MAX;
+        char *in = capacity > s->inCapacity ? (char*)realloc(s->in, capacity) : NULL;
+        if(!in)
+        {
+            SessionFail(s, "Reply doesn't fit into the receive buffer");
+            return;
+        }
+        s->in = in;
+        s->inCapacity = capacity;
+    }
+
+    ssize_t readSize = SessionRecv(s, s->in + s->inLength, s->inCapacity - 1 - s->inLength);
+    if(readSize < 0)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) SessionFail(s, strerror(errno));
+        return;
+    }
+    if(readSize == 0)
+    {
+        SessionFail(s, "The server has closed the connection");
+        return;
+    }
+    s->inLength += readSize;
+
+    if(s->phase == SESSION_NEGOTIATING && !SessionNegotiate(s)) return;
+    serverMessage *message = &s->context->message;
+    int status;
+    while(s->phase == SESSION_READY && (status = NextMessage(s, message)) != 0)
+    {
+        if(status < 0)
+        {
+            SessionFail(s, "Received a malformed frame from the server");
+            return;
+        }
+        SessionReply(s, message);
+    }
+}
+void SessionReadable(ormSession *s)
+{
+    if(s->phase == SESSION_HANDSHAKING)
+    {
+        SessionHandshake(s);
+        return;
+    }
+    // What's left of a record a single read didn't take is only held by OpenSSL, epoll won't report it
+    do SessionReceive(s);
+    while(s->tls && s->phase != SESSION_CLOSED && SSL_pending(s->tls));
+}
+
+void SessionWritable(ormSession *s)
+{
+    if(s->phase == SESSION_CONNECTING)
+    {
+        if(SessionWatch(s, 0) < 0)
+        {
+            SessionFail(s, strerror(errno));
+            return;
+        }
+        SessionConnectDone(s);
+        return;
+    }
+    if(s->phase == SESSION_HANDSHAKING)
+    {
+        SessionHandshake(s);
+        return;
+    }
+    while(s->outStart < s->outLength)
+    {
+        ssize_t sent = SessionSend(s, s->out + s->outStart, s->outLength - s->outStart);
+        if(sent < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) SessionFail(s, strerror(errno));
+            return;
+        }
+        s->outStart += sent;
+    }
+    s->outStart = s->outLength = 0;
+    if(SessionWatch(s, 0) < 0) SessionFail(s, strerror(errno));
+}
+
+ormContext* OrmContextCreate()
+{
+    ormContext *context = (ormContext*)calloc(1, sizeof(ormContext));
+    if(!context) return NULL;
+    context->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(context->epollFd < 0)
+    {
+        free(context);
+        return NULL;
+    }
+    return context;
+}
+void OrmContextDestroy(ormContext *context)
+{
+    while(context->sessions) OrmClose(context->sessions);
+    if(context->tlsSession) SSL_SESSION_free(context->tlsSession);
+    if(context->tls) SSL_CTX_free(context->tls);
+    CompressorDestroy(&context->compressor);
+    close(context->epollFd);
+    free(context);
+}
+int OrmContextTls(ormContext *context, const char *caFile)
+{
+    if(context->tls) SSL_CTX_free(context->tls);
+    context->tls = SSL_CTX_new(TLS_client_method());
+    if(!context->tls) return ORM_ERROR;
+    if((caFile ? SSL_CTX_load_verify_locations(context->tls, caFile, NULL) : SSL_CTX_set_default_verify_paths(context->tls)) != 1)
+    {
+        SSL_CTX_free(context->tls);
+        context->tls = NULL;
+        errno = ENOENT;
+        return ORM_ERROR;
+    }
+    SSL_CTX_set_min_proto_version(context->tls, TLS1_2_VERSION);
+    SSL_CTX_set_verify(context->tls, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_mode(context->tls, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_options(context->tls, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // Tickets aren't kept by OpenSSL, only the newest one is, by ContextNewTicket
+    SSL_CTX_set_session_cache_mode(context->tls, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(context->tls, ContextNewTicket);
+    return ORM_OK;
+}
+int OrmContextFd(ormContext *context)
+{
+    return context->epollFd;
+}
+
+int OrmRun(ormContext *context, int timeout)
+{
+    struct epoll_event events[CONTEXT_MAX_EVENTS];
+    int count = epoll_wait(context->epollFd, events, CONTEXT_MAX_EVENTS, timeout);
+    if(count < 0) return errno == EINTR ? context->count : ORM_ERROR;
+
+    context->running = 1;
+    int i;
+    for(i = 0; i < count; i++)
+    {
+        ormSession *s = (ormSession*)events[i].data.ptr;
+        if(s->phase != SESSION_CLOSED && (events[i].events & (EPOLLOUT | EPOLLERR)) &&
+           (s->phase == SESSION_CONNECTING || s->phase == SESSION_HANDSHAKING || s->outStart < s->outLength))
+            SessionWritable(s);
+        // Hang-ups are reported by recv as well, so they share the same path
+        if(s->phase != SESSION_CLOSED && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            SessionReadable(s);
+    }
+    context->running = 0;
+    while(context->closed)
+    {
+        ormSession *s = context->closed;
+        context->closed = s->next;
+        SessionRelease(s);
+    }
+    return context->count;
+}
+
+ormSession* OrmConnect(ormContext *context, const char *ip, int port, int flags, ormCallback callback, void *userData)
+{
+    struct sockaddr_in server = { .sin_family = AF_INET, .sin_port = htons(port) };
+    if(inet_pton(AF_INET, ip, &server.sin_addr) != 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if((flags & ORM_TLS) && !context->tls && OrmContextTls(context, NULL) < 0) return NULL;
+    ormSession *s = (ormSession*)calloc(1, sizeof(ormSession));
+    if(!s) return NULL;
+    s->in = (char*)malloc(SESSION_BUFFER_INITIAL);
+    s->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(!s->in || s->socket < 0)
+    {
+        if(s->socket >= 0) close(s->socket);
+        free(s->in);
+        free(s);
+        return NULL;
+    }
+    int flag = 1;
+    setsockopt(s->socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)); // Commands are small, don't let Nagle delay them
+
+    // Finishing the connection is reported as writability, by epoll like everything else
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT, .data.ptr = s };
+    if((connect(s->socket, (struct sockaddr*)&server, sizeof(server)) < 0 && errno != EINPROGRESS) ||
+       epoll_ctl(context->epollFd, EPOLL_CTL_ADD, s->socket, &event) < 0)
+    {
+        int error = errno;
+        close(s->socket);
+        free(s->in);
+        free(s);
+        errno = error;
+        return NULL;
+    }
+    s->context = context;
+    s->phase = SESSION_CONNECTING;
+    s->flags = flags;
+    s->address = server;
+    s->protocol = PROTOCOL_TEXT;
+    s->state = LOGGING_IN;
+    s->callback = callback;
+    s->userData = userData;
+    s->inCapacity = SESSION_BUFFER_INITIAL;
+    s->next = context->sessions;
+    if(context->sessions) context->sessions->prev = s;
+    context->sessions = s;
+    context->count++;
+    return s;
+}
+void OrmClose(ormSession *s)
+{
+    if(s->phase == SESSION_CLOSED) return;
+    SessionShutdown(s);
+    SessionRelease(s);
+}
+
+int OrmCommand(ormSession *s, const char *line)
+{
+    if(s->phase != SESSION_READY) return ORM_NOT_READY;
+    clientCommands cmd = StringToCommandClient((char*)line);
+    if(cmd == UNKNOWN) return ORM_INVALID;
+    if(cmd == LOGOUT)
+    {
+        OrmClose(s);
+        return ORM_OK;
+    }
+    if(cmd == TALKTO && s->state == IDLE) s->state = CONNECTING; // Until the server answers the request
+    return SessionSendLine(s, cmd, (char*)line);
+}
+// Builds a command line out of the command and its argument, which must fit into a single message
+int SessionCommand(ormSession *s, char *command, const char *argument, size_t limit)
+{
+    if(strlen(argument) >= limit) return ORM_INVALID;
+    snprintf(s->context->line, sizeof(s->context->line), "%s %s", command, argument);
+    return OrmCommand(s, s->context->line);
+}
+int OrmLogin(ormSession *s, const char *username)
+{
+    return SessionCommand(s, "Login", username, USERNAME_MAX);
+}
+int OrmTalkTo(ormSession *s, const char *username)
+{
+    return SessionCommand(s, "TalkTo", username, USERNAME_MAX);
+}
+int OrmAnswer(ormSession *s, int accept)
+{
+    if(s->state != PENDING_REQUEST) return ORM_INVALID;
+    return OrmCommand(s, accept ? "TalkTo Accept" : "TalkTo Reject");
+}
+int OrmSend(ormSession *s, const char *text)
+{
+    return SessionCommand(s, "Data", text, FRAME_MAX_PAYLOAD - CLIENT_CMD_MAX);
+}
+
+ormStates OrmState(ormSession *s)
+{
+    return (ormStates)s->state;
+}
+const char* OrmUsername(ormSession *s)
+{
+    return s->username;
+}
+const char* OrmPartner(ormSession *s)
+{
+    return s->partner;
+}
+void* OrmUserData(ormSession *s)
+{
+    return s->userData;
 }
 
 #endif //CLIENT_H
@@ -0,0 +1,1091 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+#include "compress.h"
+#include "outqueue.h"
+#include "presence.h"
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/*
+ * Cluster mode (-C), several server processes sharing a single set of users.
+ *
+ * Every node is started with the same list of cluster addresses and its own position in it (-n).
+ * Usernames are owned by nodes through consistent hashing: every node puts CLUSTER_POINTS points
+ * derived from its address on a hash ring, and a username belongs to the node with the first point
+ * at or after the hash of the name. The owner doesn't have to host the user, it keeps the
+ * directory of the node every user it owns is logged in on:
+ *      - A login claims the username from its owner first, which keeps usernames unique across
+ *        the cluster. The login is only answered once the owner granted the claim.
+ *      - Status changes of a user go to its owner, which gives the name back once the user is
+ *        offline and passes the change on to every other node. Every node keeps the whole user
+ *        index up to date that way, so Users and Presence work as they do on a single node.
+ *      - Requests for a user that isn't local, a TalkTo or a Msg, are sent to the owner of the
+ *        user, which forwards them to the node the user is on. Replies carry the node they came
+ *        from, so the rest of a conversation goes straight there.
+ *      - Direct messages for a user that's offline are stored by the owner of the name. A user
+ *        logging in on another node fetches them from there, see ClusterFetch.
+ *
+ * A user on another node is stood in for by a proxy, a client that isn't in the registry and has
+ * no socket, see ClusterProxyCreate. The conversation code treats a proxy like any binary protocol
+ * client, and what's sent to it is forwarded to the node hosting the user, whose server handles it
+ * as a reply for that user, see ClusterDeliver. Chat messages are forwarded straight from the
+ * pooled buffer they were received into, compressed ones as they are.
+ *
+ * Nodes talk over persistent links, a TCP connection in each direction between every two nodes:
+ * a node only writes to the connections it opened and only reads from the ones it accepted. A
+ * single cluster thread drives all of them. Frames for another node are pushed to the mailbox of
+ * its link by any thread, and the cluster thread writes everything a link has queued with a single
+ * writev, so a burst of messages costs one system call per link instead of one per message.
+ * Frames are client protocol frames whose payload starts with a routing prefix, see ClusterFrame.
+ *
+ * A link that drops is connected again every CLUSTER_RETRY_MS. Until then the node behind it is
+ * down: its users are taken offline, conversations with them end and frames for it are dropped.
+ * Once it's back, every node replays its users to it, claiming the names it owns again.
+ */
+#define CLUSTER_NODES_MAX  64
+#define CLUSTER_POINTS     64                  // Points of a node on the hash ring
+#define CLUSTER_RETRY_MS   500                 // Delay between two attempts to connect a link
+#define CLUSTER_QUEUE_MAX  (16 * 1024 * 1024)  // Bytes queued for a link above which frames for it are dropped
+#define CLUSTER_EVENTS     64
+#define CLUSTER_BUCKETS_INITIAL 1024
+#define CLUSTER_MAGIC      "ORMC"
+#define CLUSTER_MAGIC_LEN  4
+// Routing prefix: origin node, sender and recipient, the usernames prefixed with their length
+#define CLUSTER_PREFIX_MAX (3 + 2 * (USERNAME_MAX - 1))
+
+// Results of ClusterLocate besides the node hosting a user
+#define CLUSTER_NOWHERE   -1 // Not logged in, or hosted by a node that's down
+#define CLUSTER_ASK_OWNER -2 // Owned by another node, which knows where the user is
+
+/*
+ * Frames only sent between nodes, their opcodes are neither requests nor replies. Everything else
+ * is a reply for the recipient. Payloads after the routing prefix:
+ *      - HELLO: The magic and the position of the node, first frame on a link and without a prefix
+ *      - CLAIM: A token the answer is matched with, 64 bit big endian
+ *      - CLAIMED: The token followed by a claimResults byte
+ *      - PRESENCE: The new presenceStatus and the node hosting the user as single bytes
+ *      - FETCH: Nothing, asks the owner of the recipient for the direct messages stored for them
+ */
+typedef enum { CLUSTER_HELLO = 0x60, CLUSTER_CLAIM, CLUSTER_CLAIMED, CLUSTER_PRESENCE, CLUSTER_FETCH } clusterOps;
+typedef enum { CLAIM_TAKEN = 0, CLAIM_GRANTED, CLAIM_UNREACHABLE } claimResults;
+
+/*
+ * Flags of frames between nodes, next to the frame flags of the reply they carry:
+ *      - ROUTE: Sent to the owner of the recipient, which passes it on to the node hosting them
+ *      - SYNC: Replayed to a node whose link came back, it's only applied there
+ *      - BOUNCE: A direct message sent to the owner of the recipient to be stored, as they're offline
+ */
+#define CLUSTER_FLAG_ROUTE  0x80
+#define CLUSTER_FLAG_SYNC   0x40
+#define CLUSTER_FLAG_BOUNCE 0x20
+
+typedef struct clusterLink {
+    int node;
+    struct sockaddr_in address;  // Cluster address of the node, the one every link to it connects to
+    char name[32];               // Address as given on the command line, hashed onto the ring
+    int socket;                  // -1 while the link is down
+    int connecting;
+    int up;                      // Connected, frames for the node are taken. Read by any thread
+    outMessage *mailbox;         // Pushed to by any thread, drained by the cluster thread
+    outMessage *outHead;         // Frames the socket didn't take yet
+    outMessage *outTail;
+    size_t outBytes;
+    uint64_t retryAt;            // Monotonic nanoseconds of the next attempt to connect
+} clusterLink;
+
+// Connection accepted from another node, frames are received into a pooled large buffer
+typedef struct clusterPeer {
+    struct clusterPeer *next;    // In clusterPeers
+    struct clusterPeer *prev;
+    int socket;
+    int node;                    // -1 until its HELLO arrived
+    char *buffer;
+    size_t length;
+} clusterPeer;
+
+typedef struct clusterPoint {
+    uint32_t hash;
+    int node;
+} clusterPoint;
+
+// Directory entry of a username this node owns
+typedef struct clusterEntry {
+    struct clusterEntry *next;
+    char username[USERNAME_MAX];
+    uint32_t hash;
+    int node;
+} clusterEntry;
+
+// Login waiting for the owner of its username
+typedef struct clusterClaim {
+    struct clusterClaim *next;
+    uint64_t token;
+    clientData *client;          // Referenced until the claim is answered
+    int node;
+    char username[USERNAME_MAX];
+} clusterClaim;
+
+// Frame received from another node, with its routing prefix taken apart
+typedef struct clusterFrame {
+    uint8_t opcode;
+    uint8_t flags;
+    int origin;                  // Node the frame was sent from first
+    char from[USERNAME_MAX];
+    char to[USERNAME_MAX];
+    char *data;                  // Payload after the prefix, in the pooled buffer the frame was received into
+    size_t length;
+    char *buffer;
+} clusterFrame;
+
+/*
+ * Defined by the server:
+ *      - ClusterDeliver: Handles a reply for one of the node's users, or for a user it owns
+ *      - ClusterClaimed: Completes the login of a client once the owner answered its claim
+ *      - ClusterApplyPresence: Applies a status change of a user on another node
+ *      - ClusterNodeDown: Forgets everything about the users of a node that's down
+ *      - ClusterAnnounce: Replays the node's users to a node whose link came up
+ *      - ClusterFetch: Sends the direct messages stored for a user it owns to the node hosting them
+ */
+void ClusterDeliver(clusterFrame *f);
+void ClusterClaimed(clientData *client, char *username, claimResults result);
+void ClusterApplyPresence(char *username, presenceStatus status, int node);
+void ClusterNodeDown(int node);
+void ClusterAnnounce(int node);
+void ClusterFetch(clusterFrame *f);
+extern __thread compressor relayCompressor; // Also used by ClusterDeliver on the cluster thread
+
+int clusterSize = 0;               // Nodes in the cluster, 0 if the server runs on its own
+int clusterSelf = 0;
+clusterLink clusterLinks[CLUSTER_NODES_MAX];
+clusterPoint *clusterRing;
+unsigned int clusterRingLen = 0;
+clusterEntry **clusterBuckets;     // Directory, guarded by clusterDirectoryLock
+unsigned int clusterBucketCount = 0;
+unsigned int clusterEntryCount = 0;
+pthread_mutex_t clusterDirectoryLock = PTHREAD_MUTEX_INITIALIZER;
+clusterClaim *clusterClaims = NULL;
+uint64_t clusterNextToken = 0;
+pthread_mutex_t clusterClaimLock = PTHREAD_MUTEX_INITIALIZER;
+clusterPeer *clusterPeers = NULL; // Only touched by the cluster thread
+int clusterListenFd = -1;
+int clusterEventFd = -1;           // Signaled when a link's mailbox goes from empty to non-empty
+int clusterEpollFd = -1;
+int clusterRunning = 0;
+pthread_t clusterThread;
+__thread char clusterScratch[FRAME_MAX_SIZE]; // Frames for other nodes are put together in here
+
+// Finalizer of MurmurHash3, spreads the FNV hashes of similar names and addresses over the ring
+uint32_t ClusterMix(uint32_t hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+int ClusterPointCompare(const void *a, const void *b)
+{
+    uint32_t first = ((clusterPoint*)a)->hash, second = ((clusterPoint*)b)->hash;
+    return first < second ? -1 : first > second;
+}
+// Node owning the username, the node itself when there's no cluster
+int ClusterOwner(char *username)
+{
+    if(!clusterSize) return clusterSelf;
+    uint32_t hash = ClusterMix(HashUsername(username));
+    unsigned int low = 0, high = clusterRingLen;
+    while(low < high)
+    {
+        unsigned int middle = low + (high - low) / 2;
+        if(clusterRing[middle].hash < hash) low = middle + 1;
+        else high = middle;
+    }
+    return clusterRing[low < clusterRingLen ? low : 0].node;
+}
+int ClusterLinkUp(int node)
+{
+    return node == clusterSelf || __atomic_load_n(&clusterLinks[node].up, __ATOMIC_ACQUIRE);
+}
+
+// clusterDirectoryLock must be held
+clusterEntry** ClusterDirectorySlot(char *username, uint32_t hash)
+{
+    clusterEntry **slot = &clusterBuckets[hash & (clusterBucketCount - 1)];
+    while(*slot && ((*slot)->hash != hash || strcmp((*slot)->username, username) != 0)) slot = &(*slot)->next;
+    return slot;
+}
+// Doubles the buckets of the directory, clusterDirectoryLock must be held
+void ClusterDirectoryGrow()
+{
+    clusterEntry **buckets = (clusterEntry**)calloc(clusterBucketCount * 2, sizeof(clusterEntry*));
+    if(!buckets) return; // Chains just get longer
+    unsigned int i;
+    for(i = 0; i < clusterBucketCount; i++)
+    {
+        while(clusterBuckets[i])
+        {
+            clusterEntry *e = clusterBuckets[i];
+            clusterBuckets[i] = e->next;
+            e->next = buckets[e->hash & (clusterBucketCount * 2 - 1)];
+            buckets[e->hash & (clusterBucketCount * 2 - 1)] = e;
+        }
+    }
+    free(clusterBuckets);
+    clusterBuckets = buckets;
+    clusterBucketCount *= 2;
+}
+/*
+ * Records the node a username this node owns is logged in on. Fails if the name is already taken,
+ * unless force is set, as it is for replayed claims. Always succeeds when there's no cluster.
+ */
+int ClusterDirectoryClaim(char *username, int node, int force)
+{
+    if(!clusterSize) return 1;
+    uint32_t hash = HashUsername(username);
+    pthread_mutex_lock(&clusterDirectoryLock);
+    clusterEntry **slot = ClusterDirectorySlot(username, hash);
+    if(*slot)
+    {
+        if(force) (*slot)->node = node;
+        pthread_mutex_unlock(&clusterDirectoryLock);
+        return force;
+    }
+    clusterEntry *e = (clusterEntry*)malloc(sizeof(clusterEntry));
+    if(!e)
+    {
+        pthread_mutex_unlock(&clusterDirectoryLock);
+        return 0;
+    }
+    strncpy(e->username, username, USERNAME_MAX - 1);
+    e->username[USERNAME_MAX - 1] = 0;
+    e->hash = hash;
+    e->node = node;
+    e->next = NULL;
+    *slot = e;
+    if(++clusterEntryCount > clusterBucketCount) ClusterDirectoryGrow();
+    pthread_mutex_unlock(&clusterDirectoryLock);
+    return 1;
+}
+// Gives the username back, as long as it's still held by the node
+void ClusterDirectoryRelease(char *username, int node)
+{
+    if(!clusterSize) return;
+    pthread_mutex_lock(&clusterDirectoryLock);
+    clusterEntry **slot = ClusterDirectorySlot(username, HashUsername(username));
+    clusterEntry *e = *slot;
+    if(e && e->node == node)
+    {
+        *slot = e->next;
+        clusterEntryCount--;
+        free(e);
+    }
+    pthread_mutex_unlock(&clusterDirectoryLock);
+}
+// Node a username this node owns is logged in on, CLUSTER_NOWHERE if it isn't
+int ClusterDirectoryFind(char *username)
+{
+    pthread_mutex_lock(&clusterDirectoryLock);
+    clusterEntry *e = *ClusterDirectorySlot(username, HashUsername(username));
+    int node = e ? e->node : CLUSTER_NOWHERE;
+    pthread_mutex_unlock(&clusterDirectoryLock);
+    return node;
+}
+// Gives back every username held by a node that's down
+void ClusterDirectoryForget(int node)
+{
+    pthread_mutex_lock(&clusterDirectoryLock);
+    unsigned int i;
+    for(i = 0; i < clusterBucketCount; i++)
+    {
+        clusterEntry **slot = &clusterBuckets[i];
+        while(*slot)
+        {
+            clusterEntry *e = *slot;
+            if(e->node != node)
+            {
+                slot = &e->next;
+                continue;
+            }
+            *slot = e->next;
+            clusterEntryCount--;
+            free(e);
+        }
+    }
+    pthread_mutex_unlock(&clusterDirectoryLock);
+}
+
+/*
+ * Finds the node a user that isn't local is logged in on. Returns CLUSTER_ASK_OWNER if only the
+ * owner of the name knows, and CLUSTER_NOWHERE if the user is offline or can't be reached.
+ */
+int ClusterLocate(char *username)
+{
+    if(!clusterSize) return CLUSTER_NOWHERE;
+    int owner = ClusterOwner(username);
+    if(owner != clusterSelf) return ClusterLinkUp(owner) ? CLUSTER_ASK_OWNER : CLUSTER_NOWHERE;
+    int node = ClusterDirectoryFind(username);
+    return node == clusterSelf || !ClusterLinkUp(node) ? CLUSTER_NOWHERE : node;
+}
+
+/*
+ * Builds a frame for another node: the header, the routing prefix and head are copied, the payload
+ * is referenced from its pooled buffer. What doesn't fit into a single frame is cut off the end,
+ * as it is for chat messages relayed on a single node.
+ */
+outMessage* ClusterFrame(uint8_t opcode, uint8_t flags, int origin, char *from, char *to, char *head, size_t headLength,
+                         char *payload, size_t payloadLength, char *payloadBuffer)
+{
+    size_t fromLength = strnlen(from, USERNAME_MAX - 1);
+    size_t toLength = strnlen(to, USERNAME_MAX - 1);
+    size_t prefixLength = 3 + fromLength + toLength;
+    if(headLength > FRAME_MAX_PAYLOAD - prefixLength)
+    {
+        headLength = FRAME_MAX_PAYLOAD - prefixLength;
+        payloadLength = 0;
+    }
+    if(payloadLength > FRAME_MAX_PAYLOAD - prefixLength - headLength) payloadLength = FRAME_MAX_PAYLOAD - prefixLength - headLength;
+
+    char *p = clusterScratch;
+    WriteFrameHeader(p, (uint32_t)(prefixLength + headLength + payloadLength), opcode, flags);
+    p += FRAME_HEADER_SIZE;
+    *p++ = (char)origin;
+    *p++ = (char)fromLength;
+    memcpy(p, from, fromLength);
+    p += fromLength;
+    *p++ = (char)toLength;
+    memcpy(p, to, toLength);
+    p += toLength;
+    if(headLength) memcpy(p, head, headLength);
+    p += headLength;
+    return OutMessageCreate(NULL, clusterScratch, p - clusterScratch, payload, payloadLength, payloadBuffer);
+}
+// Takes a frame apart, returns 0 if its prefix is malformed
+int ClusterParse(frame *in, char *buffer, clusterFrame *out)
+{
+    unsigned char *p = (unsigned char*)in->payload;
+    size_t length = in->length;
+    if(length < 3 || p[1] >= USERNAME_MAX || length < 3u + p[1]) return 0;
+    size_t fromLength = p[1];
+    size_t toLength = p[2 + fromLength];
+    if(toLength >= USERNAME_MAX || length < 3 + fromLength + toLength) return 0;
+    out->opcode = in->opcode;
+    out->flags = in->flags;
+    out->origin = p[0];
+    if(out->origin >= clusterSize) return 0;
+    memcpy(out->from, p + 2, fromLength);
+    out->from[fromLength] = 0;
+    memcpy(out->to, p + 3 + fromLength, toLength);
+    out->to[toLength] = 0;
+    out->data = in->payload + 3 + fromLength + toLength;
+    out->length = length - 3 - fromLength - toLength;
+    out->buffer = buffer;
+    return 1;
+}
+
+/*
+ * Hands a frame to the link to a node, from any thread. Returns 0 if the node is down, in which
+ * case the frame has been freed.
+ */
+int ClusterSend(int node, outMessage *out)
+{
+    if(!out) return 0;
+    clusterLink *link = &clusterLinks[node];
+    if(node == clusterSelf || !__atomic_load_n(&link->up, __ATOMIC_ACQUIRE))
+    {
+        OutMessageFree(out);
+        METRIC_ADD(clusterDropped, 1);
+        return 0;
+    }
+    outMessage *head = __atomic_load_n(&link->mailbox, __ATOMIC_RELAXED);
+    do
+    {
+        out->next = head;
+    } while(!__atomic_compare_exchange_n(&link->mailbox, &head, out, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    METRIC_ADD(clusterOut, 1);
+    if(head == NULL)
+    {
+        uint64_t one = 1;
+        if(write(clusterEventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            LogError("Failed to wake up the cluster thread: %m");
+    }
+    return 1;
+}
+// Sends the frame to every node that's up besides this one and the given one
+void ClusterBroadcast(uint8_t opcode, uint8_t flags, char *to, char *head, size_t headLength, int except)
+{
+    int node;
+    for(node = 0; node < clusterSize; node++)
+    {
+        if(node == clusterSelf || node == except || !ClusterLinkUp(node)) continue;
+        ClusterSend(node, ClusterFrame(opcode, flags, clusterSelf, "", to, head, headLength, NULL, 0, NULL));
+    }
+}
+
+/*
+ * Creates the proxy of a user on another node, which stands in for the user in a conversation
+ * with a local client, see SendParts. The node may be CLUSTER_ASK_OWNER until the node hosting the
+ * user answers. A proxy always speaks the binary protocol with every feature, which the node hosting
+ * the user translates into what its client negotiated. It's referenced once, by the conversation of
+ * the local client. Without a local client, the proxy sends on behalf of the node itself, as the
+ * owner of a name does with the messages it stored.
+ */
+clientData* ClusterProxyCreate(char *username, int node, clientData *local)
+{
+    clientData *proxy = (clientData*)ObjectPoolAlloc(&clientPool);
+    if(!proxy)
+    {
+        LogError("Failed to create the proxy of %s: %m", username);
+        return NULL;
+    }
+    memset(proxy, 0, sizeof(clientData));
+    proxy->clientSocket = -1;
+    strncpy(proxy->username, username, USERNAME_MAX - 1);
+    proxy->usernameHash = HashUsername(proxy->username);
+    proxy->state = IDLE;
+    proxy->chattingWith = local; // The partner never changes, the local client's conversation holds the proxy
+    proxy->protocol = PROTOCOL_BINARY;
+    proxy->protocolVersion = PROTOCOL_VERSION;
+    proxy->features = PROTOCOL_FEATURES;
+    proxy->presenceSlot = -1;
+    proxy->remote = 1;
+    proxy->node = node;
+    proxy->refCount = 1;
+    pthread_mutex_init(&proxy->lock, NULL);
+    return proxy;
+}
+/*
+ * Forwards a frame for the user a proxy stands in for to the node hosting them, or to the owner
+ * of the name while that node isn't known yet. The frame is one a binary client would be sent,
+ * its payload is passed on from its pooled buffer. Returns 0 if it couldn't be sent.
+ */
+int ClusterForward(clientData *proxy, char *message, size_t length, char *payload, size_t payloadLength, char *payloadBuffer)
+{
+    if(length < FRAME_HEADER_SIZE) return 0;
+    int node = __atomic_load_n(&proxy->node, __ATOMIC_RELAXED);
+    uint8_t flags = (uint8_t)message[5];
+    if(node == CLUSTER_ASK_OWNER)
+    {
+        node = ClusterOwner(proxy->username);
+        flags |= CLUSTER_FLAG_ROUTE;
+    }
+    char *from = proxy->chattingWith ? proxy->chattingWith->username : "";
+    return ClusterSend(node, ClusterFrame((uint8_t)message[4], flags, clusterSelf, from, proxy->username,
+                                         message + FRAME_HEADER_SIZE, length - FRAME_HEADER_SIZE, payload, payloadLength, payloadBuffer));
+}
+
+// Tells the owner of a username about a status change of the user, which passes it on to every node
+void ClusterPublish(char *username, presenceStatus status)
+{
+    if(!clusterSize) return;
+    char change[2] = { (char)status, (char)clusterSelf };
+    int owner = ClusterOwner(username);
+    if(owner != clusterSelf)
+    {
+        ClusterSend(owner, ClusterFrame(CLUSTER_PRESENCE, 0, clusterSelf, "", username, change, sizeof(change), NULL, 0, NULL));
+        return;
+    }
+    if(status == PRESENCE_OFFLINE) ClusterDirectoryRelease(username, clusterSelf);
+    ClusterBroadcast(CLUSTER_PRESENCE, 0, username, change, sizeof(change), -1);
+}
+// Replays a local user to a node whose link came up, claiming the name again if the node owns it
+void ClusterSync(int node, char *username, presenceStatus status)
+{
+    char change[2] = { (char)status, (char)clusterSelf };
+    char token[8] = { 0 };
+    if(ClusterOwner(username) == node)
+        ClusterSend(node, ClusterFrame(CLUSTER_CLAIM, CLUSTER_FLAG_SYNC, clusterSelf, "", username, token, sizeof(token), NULL, 0, NULL));
+    ClusterSend(node, ClusterFrame(CLUSTER_PRESENCE, CLUSTER_FLAG_SYNC, clusterSelf, "", username, change, sizeof(change), NULL, 0, NULL));
+}
+
+void ClusterWriteToken(char *out, uint64_t token)
+{
+    int i;
+    for(i = 0; i < 8; i++) out[i] = (char)(token >> (56 - 8 * i));
+}
+uint64_t ClusterReadToken(char *in)
+{
+    uint64_t token = 0;
+    int i;
+    for(i = 0; i < 8; i++) token = (token << 8) | (unsigned char)in[i];
+    return token;
+}
+// Removes the claim with the token, returns NULL if it was answered already
+clusterClaim* ClusterTakeClaim(uint64_t token)
+{
+    pthread_mutex_lock(&clusterClaimLock);
+    clusterClaim **slot = &clusterClaims;
+    while(*slot && (*slot)->token != token) slot = &(*slot)->next;
+    clusterClaim *claim = *slot;
+    if(claim) *slot = claim->next;
+    pthread_mutex_unlock(&clusterClaimLock);
+    return claim;
+}
+void ClusterAnswerClaim(clusterClaim *claim, claimResults result)
+{
+    ClusterClaimed(claim->client, claim->username, result);
+    ClientDataRelease(claim->client);
+    free(claim);
+}
+/*
+ * Asks the owner of a username for it on behalf of a client that's logging in, ClusterClaimed is
+ * called with the answer. Returns 0 if the owner can't be reached.
+ */
+int ClusterClaim(clientData *client, char *username, int owner)
+{
+    clusterClaim *claim = (clusterClaim*)malloc(sizeof(clusterClaim));
+    if(!claim) return 0;
+    ClientDataRef(client);
+    claim->client = client;
+    claim->node = owner;
+    strncpy(claim->username, username, USERNAME_MAX - 1);
+    claim->username[USERNAME_MAX - 1] = 0;
+    char token[8];
+    pthread_mutex_lock(&clusterClaimLock);
+    claim->token = ++clusterNextToken;
+    claim->next = clusterClaims;
+    clusterClaims = claim;
+    pthread_mutex_unlock(&clusterClaimLock);
+    ClusterWriteToken(token, claim->token);
+
+    uint64_t id = claim->token;
+    if(ClusterSend(owner, ClusterFrame(CLUSTER_CLAIM, 0, clusterSelf, "", username, token, sizeof(token), NULL, 0, NULL))) return 1;
+    claim = ClusterTakeClaim(id); // Unless the link went down in between and failed it already
+    if(!claim) return 1;
+    ClientDataRelease(claim->client);
+    free(claim);
+    return 0;
+}
+// Fails every claim waiting for a node that's down
+void ClusterFailClaims(int node)
+{
+    clusterClaim *failed = NULL;
+    pthread_mutex_lock(&clusterClaimLock);
+    clusterClaim **slot = &clusterClaims;
+    while(*slot)
+    {
+        clusterClaim *claim = *slot;
+        if(claim->node != node)
+        {
+            slot = &claim->next;
+            continue;
+        }
+        *slot = claim->next;
+        claim->next = failed;
+        failed = claim;
+    }
+    pthread_mutex_unlock(&clusterClaimLock);
+    while(failed)
+    {
+        clusterClaim *next = failed->next;
+        ClusterAnswerClaim(failed, CLAIM_UNREACHABLE);
+        failed = next;
+    }
+}
+
+// Handles a frame of the cluster's own, everything else is a reply for a user. Runs on the cluster thread
+void ClusterHandle(clusterFrame *f)
+{
+    if(f->opcode == CLUSTER_CLAIM && f->length >= 8)
+    {
+        char answer[9];
+        int sync = f->flags & CLUSTER_FLAG_SYNC;
+        memcpy(answer, f->data, 8);
+        answer[8] = (char)(ClusterDirectoryClaim(f->to, f->origin, sync) ? CLAIM_GRANTED : CLAIM_TAKEN);
+        if(!sync) ClusterSend(f->origin, ClusterFrame(CLUSTER_CLAIMED, 0, clusterSelf, "", f->to, answer, sizeof(answer), NULL, 0, NULL));
+    }
+    else if(f->opcode == CLUSTER_CLAIMED && f->length >= 9)
+    {
+        clusterClaim *claim = ClusterTakeClaim(ClusterReadToken(f->data));
+        if(claim) ClusterAnswerClaim(claim, f->data[8] == CLAIM_GRANTED ? CLAIM_GRANTED : CLAIM_TAKEN);
+    }
+    else if(f->opcode == CLUSTER_PRESENCE && f->length >= 2)
+    {
+        presenceStatus status = (presenceStatus)(unsigned char)f->data[0];
+        int node = (unsigned char)f->data[1];
+        if(status > PRESENCE_BUSY || node >= clusterSize) return;
+        // The owner keeps its directory in line and passes the change on, a replayed change is only for this node
+        if(!(f->flags & CLUSTER_FLAG_SYNC) && ClusterOwner(f->to) == clusterSelf)
+        {
+            if(status == PRESENCE_OFFLINE) ClusterDirectoryRelease(f->to, node);
+            else ClusterDirectoryClaim(f->to, node, 1);
+            ClusterBroadcast(CLUSTER_PRESENCE, 0, f->to, f->data, 2, f->origin);
+        }
+        ClusterApplyPresence(f->to, status, node);
+    }
+    else if(f->opcode == CLUSTER_FETCH) ClusterFetch(f);
+    else if(f->opcode < CLUSTER_HELLO) ClusterDeliver(f);
+}
+
+// Closes a link, the node behind it is down if it was up
+void ClusterLinkDown(clusterLink *link)
+{
+    int wasUp = link->up;
+    __atomic_store_n(&link->up, 0, __ATOMIC_RELEASE);
+    if(link->socket >= 0) close(link->socket); // Closing the descriptor also removes it from epoll
+    link->socket = -1;
+    link->connecting = 0;
+    link->retryAt = MetricsNanos() + CLUSTER_RETRY_MS * 1000000ull;
+    outMessage *out = __atomic_exchange_n(&link->mailbox, NULL, __ATOMIC_ACQUIRE);
+    while(out)
+    {
+        outMessage *next = out->next;
+        OutMessageFree(out);
+        out = next;
+    }
+    while(link->outHead)
+    {
+        out = link->outHead;
+        link->outHead = out->next;
+        OutMessageFree(out);
+    }
+    link->outTail = NULL;
+    link->outBytes = 0;
+    if(!wasUp) return;
+    LogWarn("Cluster node %d is down", link->node);
+    ClusterDirectoryForget(link->node);
+    ClusterFailClaims(link->node);
+    ClusterNodeDown(link->node);
+}
+void ClusterLinkAppend(clusterLink *link, outMessage *out)
+{
+    out->next = NULL;
+    if(link->outTail) link->outTail->next = out;
+    else link->outHead = out;
+    link->outTail = out;
+    link->outBytes += OutMessageRemaining(out);
+}
+void ClusterConnect(clusterLink *link)
+{
+    link->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(link->socket < 0)
+    {
+        LogError("Failed to create the link to cluster node %d: %m", link->node);
+        ClusterLinkDown(link);
+        return;
+    }
+    int flag = 1;
+    setsockopt(link->socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)); // Frames are batched by the cluster thread already
+    if(connect(link->socket, (struct sockaddr*)&link->address, sizeof(link->address)) < 0 && errno != EINPROGRESS)
+    {
+        ClusterLinkDown(link);
+        return;
+    }
+    link->connecting = 1;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = link };
+    epoll_ctl(clusterEpollFd, EPOLL_CTL_ADD, link->socket, &event);
+}
+// The connection attempt finished, the node is up once it succeeded and the HELLO leads the way
+void ClusterConnected(clusterLink *link)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    link->connecting = 0;
+    if(getsockopt(link->socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error)
+    {
+        ClusterLinkDown(link);
+        return;
+    }
+    char hello[CLUSTER_MAGIC_LEN + 1];
+    memcpy(hello, CLUSTER_MAGIC, CLUSTER_MAGIC_LEN);
+    hello[CLUSTER_MAGIC_LEN] = (char)clusterSelf;
+    outMessage *out = OutMessageCreate(NULL, clusterScratch, BuildFrame(clusterScratch, CLUSTER_HELLO, hello, sizeof(hello)), NULL, 0, NULL);
+    if(!out)
+    {
+        ClusterLinkDown(link);
+        return;
+    }
+    ClusterLinkAppend(link, out);
+    __atomic_store_n(&link->up, 1, __ATOMIC_RELEASE);
+    LogInfo("Cluster node %d is up", link->node);
+    ClusterAnnounce(link->node);
+}
+// Moves what was pushed to the link's mailbox into its queue, in the order it was pushed in
+void ClusterDrain(clusterLink *link)
+{
+    outMessage *item = __atomic_exchange_n(&link->mailbox, NULL, __ATOMIC_ACQUIRE);
+    outMessage *ordered = NULL;
+    while(item)
+    {
+        outMessage *next = item->next;
+        item->next = ordered;
+        ordered = item;
+        item = next;
+    }
+    while(ordered)
+    {
+        outMessage *next = ordered->next;
+        if(link->outBytes >= CLUSTER_QUEUE_MAX) // The node doesn't keep up
+        {
+            OutMessageFree(ordered);
+            METRIC_ADD(clusterDropped, 1);
+        }
+        else ClusterLinkAppend(link, ordered);
+        ordered = next;
+    }
+}
+// Writes as much of the link's queue as the socket takes, QUEUE_FLUSH_PARTS frames per system call
+void ClusterFlush(clusterLink *link)
+{
+    while(link->outHead)
+    {
+        struct iovec parts[QUEUE_FLUSH_PARTS * 2];
+        int count = 0, frames;
+        outMessage *out = link->outHead;
+        for(frames = 0; out && frames < QUEUE_FLUSH_PARTS; frames++, out = out->next)
+            count += OutMessageParts(out, parts + count);
+        ssize_t written = TryWrite(link->socket, parts, count, 0);
+        if(written < 0)
+        {
+            ClusterLinkDown(link);
+            return;
+        }
+        if(written == 0) return; // Written once the socket reports it's writable again
+        link->outBytes -= written;
+        while(link->outHead && written > 0)
+        {
+            out = link->outHead;
+            size_t remaining = OutMessageRemaining(out);
+            if((size_t)written < remaining)
+            {
+                out->sent += written;
+                break;
+            }
+            written -= remaining;
+            link->outHead = out->next;
+            if(!link->outHead) link->outTail = NULL;
+            OutMessageFree(out);
+        }
+    }
+}
+
+void ClusterPeerClose(clusterPeer *peer)
+{
+    if(peer->node >= 0) LogInfo("Cluster node %d has disconnected", peer->node);
+    if(peer->prev) peer->prev->next = peer->next;
+    else clusterPeers = peer->next;
+    if(peer->next) peer->next->prev = peer->prev;
+    close(peer->socket);
+    BufferRelease(peer->buffer);
+    free(peer);
+}
+// Reads from a connection of another node from now on, returns NULL if it had to be closed
+clusterPeer* ClusterPeerAdd(int socket)
+{
+    clusterPeer *peer = (clusterPeer*)calloc(1, sizeof(clusterPeer));
+    char *buffer = BufferAlloc(BUFFER_LARGE_SIZE);
+    if(!peer || !buffer)
+    {
+        LogError("Failed to accept cluster connection: %m");
+        free(peer);
+        BufferRelease(buffer);
+        close(socket);
+        return NULL;
+    }
+    peer->socket = socket;
+    peer->node = -1;
+    peer->buffer = buffer;
+    peer->next = clusterPeers;
+    if(clusterPeers) clusterPeers->prev = peer;
+    clusterPeers = peer;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = peer };
+    epoll_ctl(clusterEpollFd, EPOLL_CTL_ADD, socket, &event);
+    return peer;
+}
+void ClusterAcceptPeers()
+{
+    while(1)
+    {
+        int socket = accept4(clusterListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(socket < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) LogError("Cluster accept failed: %m");
+            return;
+        }
+        ClusterPeerAdd(socket);
+    }
+}
+// Handles a frame received from a node, returns 0 if the connection has to be closed
+int ClusterPeerFrame(clusterPeer *peer, frame *in)
+{
+    if(peer->node < 0)
+    {
+        if(in->opcode != CLUSTER_HELLO || in->length < CLUSTER_MAGIC_LEN + 1 || memcmp(in->payload, CLUSTER_MAGIC, CLUSTER_MAGIC_LEN) != 0)
+            return 0;
+        peer->node = (unsigned char)in->payload[CLUSTER_MAGIC_LEN];
+        LogInfo("Cluster node %d has connected", peer->node);
+        return peer->node < clusterSize;
+    }
+    clusterFrame f;
+    if(!ClusterParse(in, peer->buffer, &f)) return 0;
+    METRIC_ADD(clusterIn, 1);
+    ClusterHandle(&f);
+    return 1;
+}
+/*
+ * Reads everything the node sent, the socket is edge-triggered. A frame split across reads is kept
+ * at the start of the buffer, which is swapped for a new one if a forwarded message still references it.
+ */
+void ClusterPeerRead(clusterPeer *peer)
+{
+    while(1)
+    {
+        ssize_t received = recv(peer->socket, peer->buffer + peer->length, BUFFER_LARGE_SIZE - 1 - peer->length, 0);
+        if(received < 0 && errno == EINTR) continue;
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if(received <= 0)
+        {
+            ClusterPeerClose(peer);
+            return;
+        }
+        peer->length += received;
+        size_t consumed = 0;
+        frame in;
+        int size;
+        while((size = ParseFrame(peer->buffer + consumed, peer->length - consumed, &in)) > 0)
+        {
+            consumed += size;
+            if(!ClusterPeerFrame(peer, &in)) break;
+        }
+        if(size < 0 || size > 0)
+        {
+            LogWarn("Cluster connection of node %d sent a malformed frame", peer->node);
+            ClusterPeerClose(peer);
+            return;
+        }
+        char *buffer = peer->buffer;
+        if(BufferShared(buffer))
+        {
+            peer->buffer = BufferAlloc(BUFFER_LARGE_SIZE);
+            if(!peer->buffer)
+            {
+                peer->buffer = buffer;
+                ClusterPeerClose(peer);
+                return;
+            }
+            memcpy(peer->buffer, buffer + consumed, peer->length - consumed);
+            BufferRelease(buffer);
+        }
+        else memmove(buffer, buffer + consumed, peer->length - consumed);
+        peer->length -= consumed;
+    }
+}
+
+// Starts connecting the links that are due, returns the milliseconds until the next one is, -1 if none is
+int ClusterConnectDue()
+{
+    uint64_t now = MetricsNanos(), next = 0;
+    int node;
+    for(node = 0; node < clusterSize; node++)
+    {
+        clusterLink *link = &clusterLinks[node];
+        if(node == clusterSelf || link->socket >= 0) continue;
+        if(link->retryAt <= now) ClusterConnect(link);
+        if(link->socket < 0 && (!next || link->retryAt < next)) next = link->retryAt;
+    }
+    if(!next) return -1;
+    return next > now ? (int)((next - now) / 1000000) + 1 : 0;
+}
+
+void* ClusterThread(void *arg)
+{
+    MetricsAttach(metricsReactors + 2); // Third background block
+    struct epoll_event events[CLUSTER_EVENTS];
+    while(__atomic_load_n(&clusterRunning, __ATOMIC_ACQUIRE))
+    {
+        int count = epoll_wait(clusterEpollFd, events, CLUSTER_EVENTS, ClusterConnectDue());
+        if(count < 0 && errno != EINTR)
+        {
+            LogError("Cluster epoll_wait failed: %m");
+            break;
+        }
+        int i;
+        for(i = 0; i < count; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if(ptr == &clusterListenFd) ClusterAcceptPeers();
+            else if(ptr == &clusterEventFd)
+            {
+                uint64_t value;
+                while(read(clusterEventFd, &value, sizeof(value)) > 0);
+            }
+            else if((clusterLink*)ptr >= clusterLinks && (clusterLink*)ptr < clusterLinks + CLUSTER_NODES_MAX)
+            {
+                clusterLink *link = (clusterLink*)ptr;
+                if(link->socket < 0) continue; // Went down earlier in this iteration
+                if(link->connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) ClusterConnected(link);
+                else if(events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) ClusterLinkDown(link);
+            }
+            else ClusterPeerRead((clusterPeer*)ptr);
+        }
+        // Everything queued for a node during this iteration goes out together
+        int node;
+        for(node = 0; node < clusterSize; node++)
+        {
+            clusterLink *link = &clusterLinks[node];
+            if(!link->up) continue;
+            ClusterDrain(link);
+            ClusterFlush(link);
+        }
+    }
+    CompressorDestroy(&relayCompressor);
+    BufferCacheFlush();
+    return NULL;
+}
+
+// Parses "ip:port", returns 0 if it isn't one
+int ClusterParseAddress(char *text, struct sockaddr_in *address)
+{
+    char host[32];
+    char *colon = strrchr(text, ':');
+    if(!colon || colon == text || (size_t)(colon - text) >= sizeof(host)) return 0;
+    memcpy(host, text, colon - text);
+    host[colon - text] = 0;
+    int port = atoi(colon + 1);
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons((uint16_t)port);
+    return port > 0 && port <= 65535 && inet_pton(AF_INET, host, &address->sin_addr) == 1;
+}
+// Puts the points of every node on the hash ring, derived from its address so every node agrees on them
+int ClusterBuildRing()
+{
+    clusterRing = (clusterPoint*)malloc(clusterSize * CLUSTER_POINTS * sizeof(clusterPoint));
+    if(!clusterRing) return 0;
+    int node, point;
+    for(node = 0; node < clusterSize; node++)
+    {
+        for(point = 0; point < CLUSTER_POINTS; point++)
+        {
+            char key[48];
+            snprintf(key, sizeof(key), "%s#%d", clusterLinks[node].name, point);
+            clusterRing[clusterRingLen].hash = ClusterMix(HashUsername(key));
+            clusterRing[clusterRingLen++].node = node;
+        }
+    }
+    qsort(clusterRing, clusterRingLen, sizeof(clusterPoint), ClusterPointCompare);
+    return 1;
+}
+
+int ClusterListen()
+{
+    clusterListenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    if(clusterListenFd >= 0) setsockopt(clusterListenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    return clusterListenFd >= 0 && bind(clusterListenFd, (struct sockaddr*)&clusterLinks[clusterSelf].address, sizeof(struct sockaddr_in)) == 0 &&
+           listen(clusterListenFd, SOMAXCONN) == 0;
+}
+/*
+ * Joins the cluster given with -C, if any, the cluster thread is started by ClusterRun. A listener
+ * taken over from the previous server is kept, see handoff.h.
+ */
+int ClusterInit()
+{
+    if(!config.clusterNodes) return 1;
+    char *list = strdup(config.clusterNodes);
+    char *item, *save = NULL;
+    if(!list) return 0;
+    for(item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        clusterLink *link = &clusterLinks[clusterSize];
+        if(clusterSize == CLUSTER_NODES_MAX || strlen(item) >= sizeof(link->name) || !ClusterParseAddress(item, &link->address))
+        {
+            LogError("Invalid cluster address %s, or more than %d of them", item, CLUSTER_NODES_MAX);
+            free(list);
+            return 0;
+        }
+        strcpy(link->name, item);
+        link->node = clusterSize++;
+        link->socket = -1;
+    }
+    free(list);
+    if(config.clusterNode < 0 || config.clusterNode >= clusterSize)
+    {
+        LogError("Node %d isn't in the cluster list", config.clusterNode);
+        return 0;
+    }
+    clusterSelf = config.clusterNode;
+    clusterBuckets = (clusterEntry**)calloc(CLUSTER_BUCKETS_INITIAL, sizeof(clusterEntry*));
+    if(!clusterBuckets || !ClusterBuildRing()) return 0;
+    clusterBucketCount = CLUSTER_BUCKETS_INITIAL;
+
+    if(clusterListenFd < 0 && !ClusterListen())
+    {
+        LogError("Failed to listen on cluster address %s: %m", clusterLinks[clusterSelf].name);
+        return 0;
+    }
+    clusterEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    clusterEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(clusterEventFd < 0 || clusterEpollFd < 0) return 0;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.ptr = &clusterListenFd };
+    epoll_ctl(clusterEpollFd, EPOLL_CTL_ADD, clusterListenFd, &event);
+    event.data.ptr = &clusterEventFd;
+    epoll_ctl(clusterEpollFd, EPOLL_CTL_ADD, clusterEventFd, &event);
+    return 1;
+}
+// Starts the cluster thread, again after ClusterPause
+int ClusterRun()
+{
+    if(!clusterSize) return 1;
+    clusterRunning = 1;
+    if(pthread_create(&clusterThread, NULL, ClusterThread, NULL) != 0)
+    {
+        LogError("Failed to start the cluster thread");
+        clusterRunning = 0;
+        return 0;
+    }
+    LogInfo("Cluster node %d of %d, listening on %s", clusterSelf, clusterSize, clusterLinks[clusterSelf].name);
+    return 1;
+}
+// Stops the cluster thread, the links and everything queued for them stay as they are
+void ClusterPause()
+{
+    if(!clusterRunning) return;
+    __atomic_store_n(&clusterRunning, 0, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if(write(clusterEventFd, &one, sizeof(one)) < 0) LogError("Failed to wake up the cluster thread: %m");
+    pthread_join(clusterThread, NULL);
+}
+// Takes over a link of the previous server that was up, see handoff.h
+void ClusterAdoptLink(int node, int socket)
+{
+    clusterLink *link = &clusterLinks[node];
+    link->socket = socket;
+    link->connecting = 0;
+    link->up = 1;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = link };
+    epoll_ctl(clusterEpollFd, EPOLL_CTL_ADD, socket, &event);
+}
+// Leaves the cluster, the reactors must be stopped by now
+void ClusterStop()
+{
+    if(!clusterRunning) return;
+    ClusterPause();
+    int node;
+    for(node = 0; node < clusterSize; node++)
+    {
+        clusterLinks[node].up = 0; // Nobody is told about the nodes going down anymore
+        if(node != clusterSelf && clusterLinks[node].socket >= 0) ClusterLinkDown(&clusterLinks[node]);
+    }
+    ClusterDirectoryForget(clusterSelf);
+    unsigned int i;
+    for(i = 0; i < clusterBucketCount; i++)
+    {
+        while(clusterBuckets[i])
+        {
+            clusterEntry *next = clusterBuckets[i]->next;
+            free(clusterBuckets[i]);
+            clusterBuckets[i] = next;
+        }
+    }
+    free(clusterBuckets);
+    free(clusterRing);
+    while(clusterPeers) ClusterPeerClose(clusterPeers);
+    close(clusterListenFd);
+    close(clusterEventFd);
+    close(clusterEpollFd);
+}
+
+#endif // CLUSTER_H
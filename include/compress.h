@@ -0,0 +1,109 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#include "protocol.h"
+#include <zlib.h>
+
+/*
+ * Per-message compression of chat text, shared by the server and the client.
+ *
+ * Chat messages are compressed one at a time as raw deflate streams, so every message can be
+ * inflated on its own, by whoever receives it and in any order. Short messages barely compress
+ * on their own, so both compressor and decompressor start out from the same preset dictionary of
+ * common chat text, and only messages of at least COMPRESS_THRESHOLD bytes are compressed at all.
+ *
+ * The dictionary is part of the protocol: changing it breaks every peer that still has the old
+ * one, so a new dictionary needs a new feature bit in the HELLO.
+ *
+ * A compressor keeps its zlib streams between messages, they're reset rather than set up again
+ * for each one. It's only used by a single thread at a time.
+ */
+#define COMPRESS_THRESHOLD 512 // Messages shorter than this are sent as they are
+#define COMPRESS_LEVEL     6
+#define COMPRESS_WINDOW    -15 // Raw deflate with the largest window, no zlib header or checksum
+
+/*
+ * Deflate looks back from the end of the dictionary, so the most common strings are at its end.
+ * Kept as an array rather than a string, the terminator isn't part of it.
+ */
+const char compressDictionary[] =
+    "https://www. .com/ .org/ .html?id= github.com/ youtube.com/watch?v= "
+    "error: warning: undefined reference to Segmentation fault (core dumped) Traceback (most recent call last): "
+    "#include <stdio.h> int main(int argc, char *argv[]) return 0; } else { for(i = 0; i < if( == NULL) "
+    "function return this. const let var null undefined true false "
+    "Monday Tuesday Wednesday Thursday Friday Saturday Sunday morning afternoon evening tonight tomorrow yesterday "
+    "meeting deadline project release version update issue problem question answer "
+    "because however actually probably definitely already something anything everything nothing someone "
+    "thanks thank you please sorry welcome congratulations happy birthday good luck "
+    "I think that I don't know what you mean I'm not sure if it's going to be let me know if you have any "
+    "do you want to can you send me could you please would you like have you seen did you get "
+    "what do you think about how are you doing where are you when will you be there "
+    "it was really nice to see you the other day we should do that again sometime soon "
+    "I'll be there in a few minutes, see you later. Talk to you tomorrow! "
+    "lol haha ok okay yeah yes no sure great cool nice awesome :) :D ;) :( <3 "
+    "the and that have for not with you this but his from they say her she will one all would there their "
+    "what about which when make can like time just him know take people into year your good some could them "
+    "see other than then now look only come its over think also back after use two how our work first well "
+    "way even new want any these give day most us is are was were been has had do does did ";
+
+typedef struct compressor {
+    z_stream deflater;
+    z_stream inflater;
+    int deflaterReady;
+    int inflaterReady;
+} compressor;
+
+/*
+ * Compresses a message into out, which holds capacity bytes. Returns the compressed length, or -1
+ * if the message is better sent as it is: it's below the threshold or didn't get any smaller.
+ */
+long CompressText(compressor *c, char *text, size_t length, char *out, size_t capacity)
+{
+    if(length < COMPRESS_THRESHOLD) return -1;
+    if(!c->deflaterReady)
+    {
+        if(deflateInit2(&c->deflater, COMPRESS_LEVEL, Z_DEFLATED, COMPRESS_WINDOW, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+        c->deflaterReady = 1;
+    }
+    else deflateReset(&c->deflater);
+    deflateSetDictionary(&c->deflater, (const Bytef*)compressDictionary, sizeof(compressDictionary) - 1);
+
+    // Anything that doesn't end up smaller than the message runs out of room and is sent as it is
+    if(capacity > length - 1) capacity = length - 1;
+    c->deflater.next_in = (Bytef*)text;
+    c->deflater.avail_in = (uInt)length;
+    c->deflater.next_out = (Bytef*)out;
+    c->deflater.avail_out = (uInt)capacity;
+    if(deflate(&c->deflater, Z_FINISH) != Z_STREAM_END) return -1;
+    return (long)(capacity - c->deflater.avail_out);
+}
+
+/*
+ * Inflates a compressed message into out, which holds capacity bytes. Returns the length of the
+ * message, or -1 if the data isn't a complete compressed message or the message doesn't fit.
+ */
+long DecompressText(compressor *c, char *data, size_t length, char *out, size_t capacity)
+{
+    if(!c->inflaterReady)
+    {
+        if(inflateInit2(&c->inflater, COMPRESS_WINDOW) != Z_OK) return -1;
+        c->inflaterReady = 1;
+    }
+    else inflateReset(&c->inflater);
+    inflateSetDictionary(&c->inflater, (const Bytef*)compressDictionary, sizeof(compressDictionary) - 1);
+
+    c->inflater.next_in = (Bytef*)data;
+    c->inflater.avail_in = (uInt)length;
+    c->inflater.next_out = (Bytef*)out;
+    c->inflater.avail_out = (uInt)capacity;
+    if(inflate(&c->inflater, Z_FINISH) != Z_STREAM_END || c->inflater.avail_in) return -1;
+    return (long)(capacity - c->inflater.avail_out);
+}
+
+void CompressorDestroy(compressor *c)
+{
+    if(c->deflaterReady) deflateEnd(&c->deflater);
+    if(c->inflaterReady) inflateEnd(&c->inflater);
+    c->deflaterReady = c->inflaterReady = 0;
+}
+
+#endif // COMPRESS_H
@@ -0,0 +1,294 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+#include "shared.h"
+#include <getopt.h>
+
+// Outbound queue watermarks in bytes, see outqueue.h
+#define QUEUE_HIGH_WATERMARK (1024 * 1024)
+#define QUEUE_LOW_WATERMARK  (256 * 1024)
+// Microseconds the first message queued in an event loop iteration may wait for others to be written along with it
+#define FLUSH_DELAY_US 0
+// Directory and group commit interval of the offline message store, see store.h
+#define STORE_PATH          "messages"
+#define STORE_SYNC_INTERVAL 5
+// Milliseconds presence changes are collected for before they're pushed, see presence.h
+#define PRESENCE_WINDOW 100
+// Seconds a connection has to log in, a conversation request waits for an answer and a client may stay silent, see timer.h
+#define LOGIN_TIMEOUT   30
+#define REQUEST_TIMEOUT 30
+#define IDLE_TIMEOUT    300
+// Milliseconds an idle client has to answer a heartbeat before it's disconnected
+#define HEARTBEAT_TIMEOUT 10000
+// Commands a client may send per second and command class, see admission.h
+#define RATE_LIMIT_MESSAGES 10000
+#define RATE_LIMIT_QUERIES  50
+#define RATE_LIMIT_REQUESTS 100
+#define RATE_LIMIT_MAX      1000000000 // Highest rate, a bucket holds the rate times a billion and must fit into a long long
+// Event loop lag in milliseconds and bytes queued for all clients past which new logins are deferred
+#define OVERLOAD_LAG   100
+#define OVERLOAD_QUEUE (256 * 1024 * 1024)
+// Log levels, see log.h
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+// Debug lines per second and thread that get through for every single message
+#define LOG_SAMPLE_RATE 100
+
+typedef enum { SLOW_CONSUMER_DROP, SLOW_CONSUMER_DISCONNECT } slowConsumerPolicies;
+typedef enum { BACKEND_EPOLL, BACKEND_URING } ioBackends;
+typedef enum { RATE_CLASS_MESSAGES, RATE_CLASS_QUERIES, RATE_CLASS_REQUESTS, RATE_CLASSES } rateClasses;
+
+/*
+ * Runtime settings of the server. Every field starts out with a sensible
+ * default and can be overridden from the command line through ParseArguments.
+ */
+typedef struct serverConfig {
+    unsigned int maxClients; // Connections past this limit are closed right after accept, can be changed through the admin socket
+    int reactors;            // Amount of event loop threads, 0 means one per online core
+    size_t queueHigh;        // Outbound queue size above which a client is a slow consumer
+    size_t queueLow;         // Outbound queue size below which reading from a slow consumer resumes
+    slowConsumerPolicies slowConsumerPolicy;
+    long flushDelay;         // Flush deadline of queued messages in microseconds, 0 flushes after every event loop iteration
+    int cork;                // Whether partial flushes are sent with MSG_MORE so the kernel holds back small segments
+    char *adminPath;         // Unix socket the metrics are served on, none if NULL
+    char *logPath;           // File the log is appended to, stdout if NULL
+    int logLevel;            // Lines below this level are dropped
+    unsigned int logSampleRate;
+    char *storePath;         // Directory the offline messages are kept in
+    int storeSyncInterval;   // Milliseconds between two syncs of the offline messages to disk
+    int presenceWindow;      // Milliseconds presence changes are coalesced over
+    int loginTimeout;        // Seconds a new connection has to log in, 0 waits forever
+    int requestTimeout;      // Seconds a conversation request waits for an answer, 0 waits forever
+    int idleTimeout;         // Seconds of silence after which a client is sent a heartbeat, 0 never reaps idle clients
+    char *tlsCert;           // PEM certificate chain, every connection speaks TLS if set
+    char *tlsKey;            // PEM private key, taken from the certificate file if NULL
+    ioBackends backend;      // How the reactors wait for their sockets, io_uring falls back to epoll where it's missing
+    int port;                // Port the clients connect to
+    char *clusterNodes;      // Comma separated ip:port cluster addresses of every node, no cluster if NULL, see cluster.h
+    int clusterNode;         // Position of this node in clusterNodes
+    char *handoffPath;       // Unix socket a restarted server takes the connections over through, see handoff.h
+    unsigned int rateLimits[RATE_CLASSES]; // Commands per second of each class a client may send, 0 doesn't limit the class
+    int overloadLag;         // Event loop lag in milliseconds past which logins are deferred, 0 ignores the lag
+    size_t overloadQueue;    // Bytes queued for all clients past which logins are deferred, 0 ignores the queues
+    char *capturePath;       // Trace file the client traffic is captured to from the start, none if NULL, see capture.h
+} serverConfig;
+
+serverConfig config = {
+    .maxClients = MAX_CLIENT,
+    .reactors = 0,
+    .queueHigh = QUEUE_HIGH_WATERMARK,
+    .queueLow = QUEUE_LOW_WATERMARK,
+    .slowConsumerPolicy = SLOW_CONSUMER_DROP,
+    .flushDelay = FLUSH_DELAY_US,
+    .cork = 0,
+    .adminPath = NULL,
+    .logPath = NULL,
+    .logLevel = LOG_LEVEL_INFO,
+    .logSampleRate = LOG_SAMPLE_RATE,
+    .storePath = STORE_PATH,
+    .storeSyncInterval = STORE_SYNC_INTERVAL,
+    .presenceWindow = PRESENCE_WINDOW,
+    .loginTimeout = LOGIN_TIMEOUT,
+    .requestTimeout = REQUEST_TIMEOUT,
+    .idleTimeout = IDLE_TIMEOUT,
+    .tlsCert = NULL,
+    .tlsKey = NULL,
+    .backend = BACKEND_EPOLL,
+    .port = DEFAULT_PORT,
+    .clusterNodes = NULL,
+    .clusterNode = 0,
+    .handoffPath = NULL,
+    .rateLimits = { RATE_LIMIT_MESSAGES, RATE_LIMIT_QUERIES, RATE_LIMIT_REQUESTS },
+    .overloadLag = OVERLOAD_LAG,
+    .overloadQueue = OVERLOAD_QUEUE,
+    .capturePath = NULL,
+};
+
+// Parses the comma separated rates of the message, query and request classes, returns 0 if malformed or above RATE_LIMIT_MAX
+int ParseRateLimits(char *list, unsigned int *limits)
+{
+    int i;
+    for(i = 0; i < RATE_CLASSES; i++)
+    {
+        char *end;
+        long rate = strtol(list, &end, 10);
+        if(end == list || rate < 0 || rate > RATE_LIMIT_MAX || *end != (i < RATE_CLASSES - 1 ? ',' : 0)) return 0;
+        limits[i] = (unsigned int)rate;
+        list = end + 1;
+    }
+    return 1;
+}
+
+void PrintUsage(char *name)
+{
+    printf("Usage: %s [options]\n"
+           "\t-c <count> - Maximum amount of connected clients (default %d)\n"
+           "\t-r <count> - Amount of reactor threads (default: one per core)\n"
+           "\t-W <bytes> - Outbound queue high watermark (default %d)\n"
+           "\t-L <bytes> - Outbound queue low watermark (default %d)\n"
+           "\t-S <name>  - What happens to messages for slow consumers: drop or disconnect (default drop)\n"
+           "\t-F <us>    - Flush deadline of queued messages in microseconds (default %d)\n"
+           "\t-K         - Cork sockets with MSG_MORE while a flush is split over several writes\n"
+           "\t-A <path>  - Serve the server statistics on a unix socket\n"
+           "\t-l <path>  - Append the log to a file instead of stdout\n"
+           "\t-v         - Log debug lines\n"
+           "\t-V <lines> - Debug lines logged per second and thread for every single message (default %d)\n"
+           "\t-D <path>  - Directory offline messages are kept in (default %s)\n"
+           "\t-Y <ms>    - Interval at which offline messages are synced to disk (default %d)\n"
+           "\t-P <ms>    - Window presence changes are coalesced over before they're pushed (default %d)\n"
+           "\t-N <s>     - Time a new connection has to log in, 0 waits forever (default %d)\n"
+           "\t-T <s>     - Time a conversation request waits for an answer, 0 waits forever (default %d)\n"
+           "\t-I <s>     - Silence after which a client has to answer a heartbeat, 0 never reaps idle clients (default %d)\n"
+           "\t-e <path>  - Certificate chain in PEM format, turns on TLS for every connection\n"
+           "\t-k <path>  - Private key of the certificate in PEM format (default: read from the certificate file)\n"
+           "\t-b <name>  - I/O backend of the reactors: epoll or io_uring, which falls back to epoll if the kernel lacks it (default epoll)\n"
+           "\t-p <port>  - Port clients connect to (default %d)\n"
+           "\t-C <list>  - Run as a cluster node, the list holds the ip:port cluster address of every node, the same on all of them\n"
+           "\t-n <index> - Position of this node in the cluster list, starting at 0 (default 0)\n"
+           "\t-H <path>  - Take over the connections of the server listening on this unix socket, then listen on it for the next restart\n"
+           "\t-R <list>  - Commands per second a client may send as messages,queries,requests, 0 doesn't limit a class (default %d,%d,%d)\n"
+           "\t-O <ms>    - Event loop lag past which new logins are told to retry later, 0 ignores it (default %d)\n"
+           "\t-Q <bytes> - Bytes queued for all clients past which new logins are told to retry later, 0 ignores them (default %d)\n"
+           "\t-X <path>  - Capture the commands of every client to a trace file the replay tool plays back\n"
+           "\t-h         - Show this message\n", name, MAX_CLIENT, QUEUE_HIGH_WATERMARK, QUEUE_LOW_WATERMARK, FLUSH_DELAY_US, LOG_SAMPLE_RATE,
+           STORE_PATH, STORE_SYNC_INTERVAL, PRESENCE_WINDOW, LOGIN_TIMEOUT, REQUEST_TIMEOUT, IDLE_TIMEOUT, DEFAULT_PORT,
+           RATE_LIMIT_MESSAGES, RATE_LIMIT_QUERIES, RATE_LIMIT_REQUESTS, OVERLOAD_LAG, OVERLOAD_QUEUE);
+}
+
+void ParseArguments(int argc, char *argv[])
+{
+    int opt;
+    while((opt = getopt(argc, argv, "c:r:W:L:S:F:KA:l:vV:D:Y:P:N:T:I:e:k:b:p:C:n:H:R:O:Q:X:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                config.maxClients = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                config.reactors = atoi(optarg);
+                break;
+            case 'W':
+                config.queueHigh = strtoul(optarg, NULL, 10);
+                break;
+            case 'L':
+                config.queueLow = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                if(strcmp(optarg, "drop") == 0) config.slowConsumerPolicy = SLOW_CONSUMER_DROP;
+                else if(strcmp(optarg, "disconnect") == 0) config.slowConsumerPolicy = SLOW_CONSUMER_DISCONNECT;
+                else
+                {
+                    PrintUsage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'F':
+                config.flushDelay = strtol(optarg, NULL, 10);
+                if(config.flushDelay < 0) config.flushDelay = 0;
+                break;
+            case 'K':
+                config.cork = 1;
+                break;
+            case 'A':
+                config.adminPath = optarg;
+                break;
+            case 'l':
+                config.logPath = optarg;
+                break;
+            case 'v':
+                config.logLevel = LOG_LEVEL_DEBUG;
+                break;
+            case 'V':
+                config.logSampleRate = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'D':
+                config.storePath = optarg;
+                break;
+            case 'Y':
+                config.storeSyncInterval = atoi(optarg);
+                if(config.storeSyncInterval < 0) config.storeSyncInterval = 0;
+                break;
+            case 'P':
+                config.presenceWindow = atoi(optarg);
+                if(config.presenceWindow < 0) config.presenceWindow = 0;
+                break;
+            case 'N':
+                config.loginTimeout = atoi(optarg);
+                if(config.loginTimeout < 0) config.loginTimeout = 0;
+                break;
+            case 'T':
+                config.requestTimeout = atoi(optarg);
+                if(config.requestTimeout < 0) config.requestTimeout = 0;
+                break;
+            case 'I':
+                config.idleTimeout = atoi(optarg);
+                if(config.idleTimeout < 0) config.idleTimeout = 0;
+                break;
+            case 'e':
+                config.tlsCert = optarg;
+                break;
+            case 'k':
+                config.tlsKey = optarg;
+                break;
+            case 'b':
+                if(strcmp(optarg, "epoll") == 0) config.backend = BACKEND_EPOLL;
+                else if(strcmp(optarg, "io_uring") == 0) config.backend = BACKEND_URING;
+                else
+                {
+                    PrintUsage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                config.port = atoi(optarg);
+                if(config.port <= 0 || config.port > 65535)
+                {
+                    PrintUsage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                config.clusterNodes = optarg;
+                break;
+            case 'n':
+                config.clusterNode = atoi(optarg);
+                break;
+            case 'H':
+                config.handoffPath = optarg;
+                break;
+            case 'R':
+                if(!ParseRateLimits(optarg, config.rateLimits))
+                {
+                    PrintUsage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'O':
+                config.overloadLag = atoi(optarg);
+                if(config.overloadLag < 0) config.overloadLag = 0;
+                break;
+            case 'Q':
+                config.overloadQueue = strtoul(optarg, NULL, 10);
+                break;
+            case 'X':
+                config.capturePath = optarg;
+                break;
+            case 'h':
+                PrintUsage(argv[0]);
+                exit(0);
+            default:
+                PrintUsage(argv[0]);
+                exit(1);
+        }
+    }
+    if(config.queueLow > config.queueHigh) config.queueLow = config.queueHigh;
+    if(config.reactors <= 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        config.reactors = cores > 0 ? (int)cores : 1;
+    }
+}
+
+#endif // CONFIG_H
@@ -0,0 +1,380 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+#include "ormclient.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+/*
+ * Console front end of the client, built on libormclient. It only includes the library's
+ * interface, everything it knows about the server comes through the events of its sessions.
+ */
+#define INPUT_MAX 65536
+// Milliseconds between the dots printed while waiting for a conversation request to be answered
+#define CONNECTING_TICK_MS 2000
+// Milliseconds a script waits for an expected event before it fails
+#define SCRIPT_EXPECT_TIMEOUT 5000
+
+// Bytes read from stdin that don't form a complete line yet
+char inputBuffer[INPUT_MAX];
+size_t inputLength = 0;
+
+long long MonotonicMillis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Reads what's available on the descriptor into the input buffer, returns 0 at the end of the input
+int FillInputBuffer(int fd)
+{
+    int readSize;
+    do
+    {
+        readSize = read(fd, inputBuffer + inputLength, sizeof(inputBuffer) - inputLength);
+    } while(readSize < 0 && errno == EINTR);
+    if(readSize <= 0) return 0;
+    inputLength += readSize;
+    return 1;
+}
+// Takes the next line typed by the user out of the input buffer, without its newline. Returns 0 if there's none yet
+int NextLine(char *message)
+{
+    char *end = (char*)memchr(inputBuffer, '\n', inputLength);
+    size_t length = end ? (size_t)(end - inputBuffer) : inputLength;
+    if(!end && inputLength < sizeof(inputBuffer)) return 0; // A line longer than the buffer is cut off
+    if(length >= INPUT_MAX) length = INPUT_MAX - 1;
+    memcpy(message, inputBuffer, length);
+    message[length] = 0;
+    size_t consumed = end ? length + 1 : length;
+    memmove(inputBuffer, inputBuffer + consumed, inputLength - consumed);
+    inputLength -= consumed;
+    return 1;
+}
+// Checks whether the first word of a line is the given one
+int FirstWordIs(char *line, char *word)
+{
+    size_t length = strlen(word);
+    return strncmp(line, word, length) == 0 && (line[length] == 0 || line[length] == ' ');
+}
+
+void PrintHelp()
+{
+    printf("Available commands:\n\tLogin [username] - Log in using a unique username\n\t"
+            "Logout - Logs out and exits the application\n\t"
+            "Users [prefix <text>] [offset <n>] [limit <n>] [count] - List users, or just count them\n\t"
+            "TalkTo [username] - Open conversation with user\n\t"
+            "Disconnect - Disconnects currently opened conversation\n\t"
+            "Data [message] - Send message to user in current conversation\n\t"
+            "Join [room] - Join a group chat room, it's created if it doesn't exist yet\n\t"
+            "Leave [room] - Leave a group chat room\n\t"
+            "Rooms - List all rooms\n\t"
+            "Say [room] [message] - Send message to everyone in a room\n\t"
+            "Stats - Show server statistics\n\t"
+            "Msg [username] [message] - Send a direct message, it's kept until the user logs in if they're offline\n\t"
+            "Msg - Get the rest of the messages sent while you were offline\n\t"
+            "Presence [on|off] - Get told whenever users log in, log out or start or end a conversation\n>");
+}
+void PrintPresence(const char *text)
+{
+    char changes[INPUT_MAX];
+    char *change, *save = NULL;
+    int first = 1;
+    snprintf(changes, sizeof(changes), "%s", text);
+    printf("Presence:");
+    for(change = strtok_r(changes, " ", &save); change; change = strtok_r(NULL, " ", &save))
+    {
+        printf("%s %s %s", first ? "" : ",", change + 1, change[0] == '+' ? "is online" : change[0] == '*' ? "is busy" : "went offline");
+        first = 0;
+    }
+    printf("\n>");
+}
+
+// Prints an event the way the interactive client shows it, followed by the prompt
+void PrintEvent(ormEvent *event)
+{
+    switch(event->type)
+    {
+        case ORM_EVENT_CONNECTED:
+            if(event->text[0]) printf("Connected (%s)\n", event->text);
+            else printf("Connected\n");
+            PrintHelp();
+            break;
+        case ORM_EVENT_CLOSED:
+            printf("%s\n", event->text);
+            break;
+        case ORM_EVENT_LOGIN:
+            printf("Login successful! Your username is %s\n>", event->username);
+            break;
+        case ORM_EVENT_ERROR:
+            printf("ERROR: %s\n>", event->text);
+            break;
+        case ORM_EVENT_LOG:
+            printf("LOG: %s\n>", event->text);
+            break;
+        case ORM_EVENT_TALKTO_ERROR:
+            printf("TalkTo: %s\n>", event->text);
+            break;
+        case ORM_EVENT_TALKTO:
+            if(event->state == ORM_CHATTING) printf("You are now chatting with %s.\n>", event->username);
+            else if(event->state == ORM_IDLE) printf("Request denied!\n>");
+            else if(event->state == ORM_CONNECTING) printf("Sent chat request to %s...\n", event->username);
+            else if(event->state == ORM_PENDING_REQUEST) printf("User %s wants to chat, will you accept? [y/N]\n>", event->username);
+            break;
+        case ORM_EVENT_DISCONNECT:
+            printf("Disconnected from conversation with %s\n>", event->username);
+            break;
+        case ORM_EVENT_MESSAGE:                                 // Received message from another user
+            if(event->username[0]) printf("[%s]: ", event->username);
+            printf("%s\n>", event->text);
+            break;
+        case ORM_EVENT_ROOM_MESSAGE:                            // Received message from a room the user has joined
+            if(event->room[0]) printf("[%s][%s]: ", event->room, event->username);
+            printf("%s\n>", event->text);
+            break;
+        case ORM_EVENT_DIRECT_MESSAGE:                          // Received direct message, possibly kept while the user was offline
+        {
+            char sent[32];
+            time_t sentTime = (time_t)event->sent;
+            strftime(sent, sizeof(sent), "%d.%m. %H:%M", localtime(&sentTime));
+            if(event->username[0]) printf("[%s][%s]: ", sent, event->username);
+            else printf("[%s]", sent);
+            printf("%s\n>", event->text);
+            break;
+        }
+        case ORM_EVENT_PRESENCE:                                // Users that logged in, logged out or started or ended a conversation
+            PrintPresence(event->text);
+            break;
+    }
+    fflush(stdout);
+}
+
+/*
+ * Renders an event as a single plain line for scripts, e.g "MESSAGE: [john]: hi". Returns the length.
+ * Expectations of a script are matched against these lines.
+ */
+int RenderEvent(ormEvent *event, char *line, size_t size)
+{
+    static char *states[] = { "logging in", "logging out", "idle", "connecting", "pending", "chatting" };
+    switch(event->type)
+    {
+        case ORM_EVENT_CONNECTED:      return event->text[0] ? snprintf(line, size, "CONNECTED: %s", event->text) : snprintf(line, size, "CONNECTED");
+        case ORM_EVENT_CLOSED:         return snprintf(line, size, "CLOSED: %s", event->text);
+        case ORM_EVENT_LOGIN:          return snprintf(line, size, "LOGIN: %s", event->username);
+        case ORM_EVENT_ERROR:          return snprintf(line, size, "ERROR: %s", event->text);
+        case ORM_EVENT_LOG:            return snprintf(line, size, "LOG: %s", event->text);
+        case ORM_EVENT_TALKTO_ERROR:   return snprintf(line, size, "TalkTo: %s", event->text);
+        case ORM_EVENT_TALKTO:         return snprintf(line, size, "TALKTO: %s %s", states[event->state], event->username);
+        case ORM_EVENT_DISCONNECT:     return snprintf(line, size, "DISCONNECT: %s", event->username);
+        case ORM_EVENT_MESSAGE:        return event->username[0] ? snprintf(line, size, "MESSAGE: [%s]: %s", event->username, event->text)
+                                                                 : snprintf(line, size, "MESSAGE: %s", event->text);
+        case ORM_EVENT_ROOM_MESSAGE:   return event->room[0] ? snprintf(line, size, "ROOM: [%s][%s]: %s", event->room, event->username, event->text)
+                                                             : snprintf(line, size, "ROOM: %s", event->text);
+        case ORM_EVENT_DIRECT_MESSAGE: return event->username[0] ? snprintf(line, size, "DIRECT: %lld [%s]: %s", event->sent, event->username, event->text)
+                                                                 : snprintf(line, size, "DIRECT: %lld %s", event->sent, event->text);
+        case ORM_EVENT_PRESENCE:       return snprintf(line, size, "PRESENCE: %s", event->text);
+    }
+    return snprintf(line, size, "UNKNOWN");
+}
+
+/*
+ * Headless mode, every session runs the same command script on its own. A script line is either
+ * a command as it would be typed, where $n stands for the number of the session, or one of:
+ *      - Wait <ms>: Go on after that many milliseconds
+ *      - Expect <text>: Go on once an event contains the text, fail if none does in time
+ *      - Reconnect: Close the connection and open a new one, e.g to resume a TLS session
+ * Lines starting with # are comments. A session is closed once it's through the script.
+ */
+typedef struct scriptSession {
+    ormSession *session;
+    unsigned int index;
+    unsigned int line;         // Next line of the script
+    long long waitUntil;       // Monotonic milliseconds the script waits until, 0 if it doesn't
+    char expect[256];          // Text an event has to contain before the script goes on, empty if none
+    long long expectDeadline;
+    int connected;
+    int done;
+    int failed;
+} scriptSession;
+
+char **scriptLines;
+unsigned int scriptLength = 0;
+int scriptVerbose = 0;         // Prefix every line with the number of its session
+ormContext *scriptContext;
+char *scriptIp;
+int scriptPort;
+int scriptFlags;
+
+int LoadScript(char *path)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if(!file) return 0;
+    unsigned int capacity = 0;
+    char line[INPUT_MAX];
+    while(fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if(!line[0] || line[0] == '#') continue;
+        if(scriptLength == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            char **lines = (char**)realloc(scriptLines, capacity * sizeof(char*));
+            if(!lines) return 0;
+            scriptLines = lines;
+        }
+        scriptLines[scriptLength] = strdup(line);
+        if(!scriptLines[scriptLength++]) return 0;
+    }
+    if(file != stdin) fclose(file);
+    return 1;
+}
+// Copies a script line, replacing $n with the number of the session
+void ExpandLine(char *line, unsigned int index, char *expanded, size_t size)
+{
+    size_t used = 0;
+    while(*line && used + 12 < size)
+    {
+        if(line[0] == '$' && line[1] == 'n')
+        {
+            used += snprintf(expanded + used, size - used, "%u", index);
+            line += 2;
+        }
+        else expanded[used++] = *line++;
+    }
+    expanded[used] = 0;
+}
+
+void ScriptEvent(ormSession *session, ormEvent *event, void *userData)
+{
+    scriptSession *script = (scriptSession*)userData;
+    char line[INPUT_MAX];
+    RenderEvent(event, line, sizeof(line));
+    if(scriptVerbose) printf("[%u] %s\n", script->index, line);
+    else printf("%s\n", line);
+
+    if(event->type == ORM_EVENT_CONNECTED) script->connected = 1;
+    if(script->expect[0] && strstr(line, script->expect)) script->expect[0] = 0;
+    if(event->type == ORM_EVENT_CLOSED)
+    {
+        if(script->line < scriptLength) script->failed = 1; // Closed before the end of the script
+        script->done = 1;
+        script->session = NULL;
+    }
+}
+void ScriptFinish(scriptSession *script, int failed)
+{
+    if(script->session) OrmClose(script->session);
+    script->session = NULL;
+    script->done = 1;
+    script->failed |= failed;
+}
+// Runs the script of a session until it has to wait for something
+void ScriptStep(scriptSession *script, long long now)
+{
+    char line[INPUT_MAX];
+    if(script->done || !script->connected) return;
+    if(script->expect[0])
+    {
+        if(now < script->expectDeadline) return;
+        fprintf(stderr, "[%u] Timed out waiting for: %s\n", script->index, script->expect);
+        ScriptFinish(script, 1);
+        return;
+    }
+    if(script->waitUntil && now < script->waitUntil) return;
+    script->waitUntil = 0;
+    while(script->line < scriptLength && !script->done)
+    {
+        ExpandLine(scriptLines[script->line++], script->index, line, sizeof(line));
+        if(FirstWordIs(line, "Wait"))
+        {
+            script->waitUntil = now + atol(line + 4);
+            return;
+        }
+        if(FirstWordIs(line, "Expect"))
+        {
+            snprintf(script->expect, sizeof(script->expect), "%s", line[6] ? line + 7 : "");
+            script->expectDeadline = now + SCRIPT_EXPECT_TIMEOUT;
+            return;
+        }
+        if(FirstWordIs(line, "Reconnect"))
+        {
+            OrmClose(script->session);
+            script->connected = 0;
+            script->session = OrmConnect(scriptContext, scriptIp, scriptPort, scriptFlags, ScriptEvent, script);
+            if(!script->session)
+            {
+                fprintf(stderr, "[%u] Connect failed: %s\n", script->index, strerror(errno));
+                ScriptFinish(script, 1);
+            }
+            return;
+        }
+        if(FirstWordIs(line, "Logout"))
+        {
+            ScriptFinish(script, 0);
+            return;
+        }
+        int status = OrmCommand(script->session, line);
+        if(status == ORM_INVALID) fprintf(stderr, "[%u] Invalid command: %s\n", script->index, line);
+        else if(status == ORM_ERROR) fprintf(stderr, "[%u] Failed to send: %s\n", script->index, line);
+    }
+    if(script->line == scriptLength) ScriptFinish(script, 0);
+}
+
+// Runs the script on the given amount of sessions of the context, returns the amount of sessions that failed
+int RunScript(ormContext *context, char *ip, int port, int flags, unsigned int count)
+{
+    scriptSession *scripts = (scriptSession*)calloc(count, sizeof(scriptSession));
+    if(!scripts)
+    {
+        perror("Failed to create the sessions");
+        return (int)count;
+    }
+    scriptContext = context;
+    scriptIp = ip;
+    scriptPort = port;
+    scriptFlags = flags;
+    scriptVerbose = count > 1;
+    unsigned int i;
+    for(i = 0; i < count; i++)
+    {
+        scripts[i].index = i;
+        scripts[i].session = OrmConnect(context, ip, port, flags, ScriptEvent, &scripts[i]);
+        if(!scripts[i].session)
+        {
+            fprintf(stderr, "[%u] Connect failed: %s\n", i, strerror(errno));
+            scripts[i].done = scripts[i].failed = 1;
+        }
+    }
+    while(1)
+    {
+        long long now = MonotonicMillis();
+        long long next = -1;
+        unsigned int active = 0;
+        for(i = 0; i < count; i++)
+        {
+            ScriptStep(&scripts[i], now);
+            if(scripts[i].done) continue;
+            active++;
+            long long deadline = scripts[i].expect[0] ? scripts[i].expectDeadline : scripts[i].waitUntil;
+            if(deadline && (next < 0 || deadline < next)) next = deadline;
+        }
+        if(!active) break;
+        if(OrmRun(context, next < 0 ? -1 : (int)(next > now ? next - now : 0)) < 0)
+        {
+            perror("Event loop failed");
+            break;
+        }
+    }
+    int failed = 0;
+    for(i = 0; i < count; i++) failed += scripts[i].failed || !scripts[i].done;
+    free(scripts);
+    fflush(stdout);
+    return failed;
+}
+
+#endif // CONSOLE_H
@@ -0,0 +1,796 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+#include "reactor.h"
+#include <sys/un.h>
+
+/*
+ * Hot restart (-H), a new server process takes over from a running one without its clients noticing.
+ *
+ * A server started with -H listens on that unix socket for its successor. A new server started with
+ * the same path connects to it before it opens any socket of its own:
+ *      - The old server parks its reactors, see PauseReactors, and stops the cluster thread. TLS
+ *        connections are closed, their OpenSSL state can't be moved to another process, but the
+ *        ticket key goes along, so they resume their sessions when they reconnect.
+ *      - The offline messages are committed, acknowledging their senders, and the mailboxes of the
+ *        reactors are drained into the queues of the clients.
+ *      - The listeners, every client socket and the cluster connections are passed with SCM_RIGHTS,
+ *        up to HANDOFF_FDS_CHUNK per message, followed by a snapshot of the registry: usernames,
+ *        conversations, rooms, presence subscriptions, incomplete frames and outbound queues, the
+ *        users of other nodes, the directory and the pending claims.
+ *      - The new server rebuilds its state from the snapshot, answers with HANDOFF_ACK and the old
+ *        one exits once it sent HANDOFF_BYE, after which the new one starts its reactors. Clients
+ *        only see a pause.
+ * Nothing is left half done: the old server resumes as it was if the new one doesn't answer within
+ * HANDOFF_TIMEOUT seconds or goes away, and the new one exits unless the old one said goodbye.
+ *
+ * Both have to be started with the same port and cluster list. A client keeps its reactor, modulo
+ * the amount of reactors of the new server. Connections still waiting in the accept queue of a
+ * listener the new server has no reactor for are lost.
+ */
+#define HANDOFF_MAGIC      "ORMH"
+#define HANDOFF_VERSION    1
+#define HANDOFF_FDS_CHUNK  250   // Descriptors passed with a single message, the kernel takes 253 at most
+#define HANDOFF_TIMEOUT    10    // Seconds the old server waits for the new one before resuming
+#define HANDOFF_ACK        'A'
+#define HANDOFF_BYE        'B'
+#define HANDOFF_PARTNER_REMOTE -2 // Partner of a client that's stood in for by a proxy, see cluster.h
+
+typedef struct handoffHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t descriptors;
+    uint64_t length;       // Bytes of the snapshot following the descriptors
+} handoffHeader;
+
+/*
+ * Snapshot being written or read, in host byte order as both servers run on the same machine.
+ * Descriptors are referred to by their position in the list they're passed in.
+ */
+typedef struct handoff {
+    char *data;
+    size_t length;
+    size_t capacity;
+    size_t offset;         // Read position
+    int failed;            // Ran out of memory while writing, or past the end while reading
+    int *fds;
+    unsigned int fdCount;
+    unsigned int fdCapacity;
+} handoff;
+
+int handoffSocket = -1;      // Listening for the next server
+int handoffConnection = -1;  // Connection to the previous server while it's being taken over from
+handoff handoffTaken;        // Snapshot of the previous server, still to be restored
+int *handoffListeners = NULL; // Listeners of the previous server's reactors
+int handoffListenerCount = 0;
+int handoffClusterSize = 0;  // Cluster the previous server was a node of, checked once this one joined
+int handoffClusterSelf = 0;
+
+void HandoffPut(handoff *h, void *data, size_t length)
+{
+    if(h->failed) return;
+    if(h->length + length > h->capacity)
+    {
+        size_t capacity = h->capacity ? h->capacity : 64 * 1024;
+        while(capacity < h->length + length) capacity *= 2;
+        char *grown = (char*)realloc(h->data, capacity);
+        if(!grown)
+        {
+            h->failed = 1;
+            return;
+        }
+        h->data = grown;
+        h->capacity = capacity;
+    }
+    memcpy(h->data + h->length, data, length);
+    h->length += length;
+}
+int HandoffGet(handoff *h, void *out, size_t length)
+{
+    if(h->failed || h->length - h->offset < length)
+    {
+        h->failed = 1;
+        memset(out, 0, length);
+        return 0;
+    }
+    memcpy(out, h->data + h->offset, length);
+    h->offset += length;
+    return 1;
+}
+#define HANDOFF_PUT(h, value) HandoffPut(h, &(value), sizeof(value))
+#define HANDOFF_GET(h, value) HandoffGet(h, &(value), sizeof(value))
+
+// Adds a descriptor to the ones passed along, returns its position
+int HandoffPutFd(handoff *h, int fd)
+{
+    if(h->fdCount == h->fdCapacity)
+    {
+        unsigned int capacity = h->fdCapacity ? h->fdCapacity * 2 : 256;
+        int *grown = (int*)realloc(h->fds, capacity * sizeof(int));
+        if(!grown)
+        {
+            h->failed = 1;
+            return -1;
+        }
+        h->fds = grown;
+        h->fdCapacity = capacity;
+    }
+    h->fds[h->fdCount] = fd;
+    return (int)h->fdCount++;
+}
+// Returns the descriptor at the position read next, -1 if there's none
+int HandoffGetFd(handoff *h)
+{
+    int index;
+    if(!HANDOFF_GET(h, index) || index < 0) return -1;
+    if((unsigned int)index >= h->fdCount)
+    {
+        h->failed = 1;
+        return -1;
+    }
+    int fd = h->fds[index];
+    h->fds[index] = -1; // Taken, it isn't closed with the ones left over
+    return fd;
+}
+void HandoffPutBytes(handoff *h, char *data, uint64_t length)
+{
+    HANDOFF_PUT(h, length);
+    HandoffPut(h, data, length);
+}
+// Points at the next bytes in place, NULL if the snapshot ends before them
+char* HandoffGetBytes(handoff *h, uint64_t *length)
+{
+    if(!HANDOFF_GET(h, *length) || h->length - h->offset < *length)
+    {
+        h->failed = 1;
+        return NULL;
+    }
+    char *data = h->data + h->offset;
+    h->offset += *length;
+    return data;
+}
+// Closes whatever descriptors weren't taken and frees the snapshot
+void HandoffFree(handoff *h, int closeFds)
+{
+    unsigned int i;
+    for(i = 0; closeFds && i < h->fdCount; i++)
+        if(h->fds[i] >= 0) close(h->fds[i]);
+    free(h->data);
+    free(h->fds);
+    memset(h, 0, sizeof(handoff));
+}
+
+int HandoffWriteAll(int socket, char *data, size_t length)
+{
+    while(length)
+    {
+        ssize_t written = send(socket, data, length, MSG_NOSIGNAL);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) return 0;
+        data += written;
+        length -= written;
+    }
+    return 1;
+}
+int HandoffReadAll(int socket, char *data, size_t length)
+{
+    while(length)
+    {
+        ssize_t received = recv(socket, data, length, 0);
+        if(received < 0 && errno == EINTR) continue;
+        if(received <= 0) return 0;
+        data += received;
+        length -= received;
+    }
+    return 1;
+}
+
+// Writes everything queued for a client, what was already sent of the first message is left out
+void HandoffPutQueue(handoff *h, outMessage *head)
+{
+    uint64_t length = 0;
+    outMessage *out;
+    for(out = head; out; out = out->next) length += OutMessageRemaining(out);
+    HANDOFF_PUT(h, length);
+    for(out = head; out; out = out->next)
+    {
+        struct iovec parts[2];
+        int count = OutMessageParts(out, parts), i;
+        for(i = 0; i < count; i++) HandoffPut(h, parts[i].iov_base, parts[i].iov_len);
+    }
+}
+
+/*
+ * Writes the snapshot of the paused server. The listeners and the cluster come first, the new
+ * server needs them before it creates its reactors and joins the cluster.
+ */
+void HandoffSnapshot(handoff *h)
+{
+    int i;
+    HANDOFF_PUT(h, reactorCount);
+    for(i = 0; i < reactorCount; i++)
+    {
+        int index = HandoffPutFd(h, reactors[i]->listenFd);
+        HANDOFF_PUT(h, index);
+    }
+    unsigned char keys[TLS_TICKET_KEYS];
+    int tickets = TlsTicketKeys(keys, 0);
+    HANDOFF_PUT(h, tickets);
+    if(tickets) HandoffPut(h, keys, sizeof(keys));
+    HANDOFF_PUT(h, clusterSize);
+    HANDOFF_PUT(h, clusterSelf);
+    int index = clusterSize ? HandoffPutFd(h, clusterListenFd) : -1;
+    HANDOFF_PUT(h, index);
+
+    // Clients are referred to by their slot, the partner of a conversation may come later in the table
+    unsigned int slot;
+    HANDOFF_PUT(h, lastId);
+    HANDOFF_PUT(h, clientsLen);
+    for(slot = 0; slot < clientsLen; slot++)
+    {
+        clientData *c = clients[slot];
+        index = HandoffPutFd(h, c->clientSocket);
+        HANDOFF_PUT(h, index);
+        HANDOFF_PUT(h, c->owner->id);
+        HANDOFF_PUT(h, c->id);
+        HandoffPut(h, c->username, USERNAME_MAX);
+        HANDOFF_PUT(h, c->state);
+        HANDOFF_PUT(h, c->protocol);
+        HANDOFF_PUT(h, c->protocolVersion);
+        HANDOFF_PUT(h, c->features);
+        HANDOFF_PUT(h, c->readPaused);
+
+        clientData *partner = c->chattingWith;
+        int partnerSlot = -1;
+        if(partner && partner->remote) partnerSlot = HANDOFF_PARTNER_REMOTE;
+        else if(partner && partner->slot < clientsLen && clients[partner->slot] == partner) partnerSlot = (int)partner->slot;
+        HANDOFF_PUT(h, partnerSlot);
+        if(partnerSlot == HANDOFF_PARTNER_REMOTE)
+        {
+            HandoffPut(h, partner->username, USERNAME_MAX);
+            HANDOFF_PUT(h, partner->node);
+            HANDOFF_PUT(h, partner->state);
+        }
+
+        int subscribed = c->presenceSlot >= 0;
+        HANDOFF_PUT(h, subscribed);
+        HANDOFF_PUT(h, c->roomCount);
+        for(i = 0; i < c->roomCount; i++) HandoffPut(h, c->rooms[i]->name, ROOMNAME_MAX);
+        HandoffPutBytes(h, c->inBuffer, c->inLength);
+        HandoffPutQueue(h, c->outHead);
+    }
+
+    // Users logged in on other nodes, the local ones are added back along with their clients
+    unsigned int count = 0, u;
+    for(u = 0; u < userIndexLen; u++) count += userIndex[u].node != clusterSelf;
+    HANDOFF_PUT(h, count);
+    for(u = 0; u < userIndexLen; u++)
+    {
+        if(userIndex[u].node == clusterSelf) continue;
+        HandoffPut(h, userIndex[u].username, USERNAME_MAX);
+        HANDOFF_PUT(h, userIndex[u].node);
+        HANDOFF_PUT(h, userIndex[u].busy);
+    }
+    if(!clusterSize) return;
+
+    int node;
+    for(node = 0; node < clusterSize; node++)
+    {
+        clusterLink *link = &clusterLinks[node];
+        int up = node != clusterSelf && link->up && link->socket >= 0;
+        index = up ? HandoffPutFd(h, link->socket) : -1;
+        HANDOFF_PUT(h, index);
+        if(!up) continue;
+        ClusterDrain(link);
+        HandoffPutQueue(h, link->outHead);
+    }
+    clusterPeer *peer;
+    count = 0;
+    for(peer = clusterPeers; peer; peer = peer->next) count++;
+    HANDOFF_PUT(h, count);
+    for(peer = clusterPeers; peer; peer = peer->next)
+    {
+        index = HandoffPutFd(h, peer->socket);
+        HANDOFF_PUT(h, index);
+        HANDOFF_PUT(h, peer->node);
+        HandoffPutBytes(h, peer->buffer, peer->length);
+    }
+    HANDOFF_PUT(h, clusterEntryCount);
+    for(u = 0; u < clusterBucketCount; u++)
+    {
+        clusterEntry *e;
+        for(e = clusterBuckets[u]; e; e = e->next)
+        {
+            HandoffPut(h, e->username, USERNAME_MAX);
+            HANDOFF_PUT(h, e->node);
+        }
+    }
+    // Claims of clients that are gone don't need an answer anymore
+    pthread_mutex_lock(&clusterClaimLock);
+    clusterClaim *claim;
+    count = 0;
+    for(claim = clusterClaims; claim; claim = claim->next) count += claim->client->clientSocket >= 0;
+    HANDOFF_PUT(h, count);
+    for(claim = clusterClaims; claim; claim = claim->next)
+    {
+        if(claim->client->clientSocket < 0) continue;
+        HANDOFF_PUT(h, claim->token);
+        HANDOFF_PUT(h, claim->client->slot);
+        HANDOFF_PUT(h, claim->node);
+        HandoffPut(h, claim->username, USERNAME_MAX);
+    }
+    HANDOFF_PUT(h, clusterNextToken);
+    pthread_mutex_unlock(&clusterClaimLock);
+}
+
+// Delivers what's still posted to the reactors, which are parked, from the calling thread
+void HandoffDrain()
+{
+    int i, pending = 1;
+    while(pending)
+    {
+        pending = 0;
+        for(i = 0; i < reactorCount; i++)
+        {
+            if(!__atomic_load_n(&reactors[i]->mailbox, __ATOMIC_ACQUIRE)) continue;
+            currentReactor = reactors[i];
+            MetricsAttach(i);
+            DrainMailbox(reactors[i]);
+            pending = 1;
+        }
+    }
+    currentReactor = NULL;
+}
+// Closes every TLS connection, with their reactors parked
+void HandoffCloseTls()
+{
+    int i;
+    for(i = 0; i < reactorCount; i++)
+    {
+        unsigned int count, c;
+        clientData **list = ReactorClients(reactors[i], &count);
+        if(!list) continue;
+        currentReactor = reactors[i];
+        MetricsAttach(i);
+        for(c = 0; c < count; c++)
+        {
+            if(list[c]->tls && list[c]->clientSocket >= 0) ClientDisconnect(list[c]);
+            ClientDataRelease(list[c]);
+        }
+        free(list);
+    }
+    currentReactor = NULL;
+}
+
+// Passes the descriptors HANDOFF_FDS_CHUNK at a time, each chunk along with a single byte
+int HandoffSendFds(int socket, int *fds, unsigned int count)
+{
+    unsigned int sent = 0;
+    while(sent < count)
+    {
+        unsigned int chunk = count - sent < HANDOFF_FDS_CHUNK ? count - sent : HANDOFF_FDS_CHUNK;
+        char control[CMSG_SPACE(HANDOFF_FDS_CHUNK * sizeof(int))];
+        char byte = 0;
+        struct iovec part = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr msg = { .msg_iov = &part, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(chunk * sizeof(int)) };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(chunk * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds + sent, chunk * sizeof(int));
+        if(sendmsg(socket, &msg, MSG_NOSIGNAL) != 1) return 0;
+        sent += chunk;
+    }
+    return 1;
+}
+int HandoffReceiveFds(int socket, int *fds, unsigned int count)
+{
+    unsigned int received = 0;
+    while(received < count)
+    {
+        unsigned int chunk = count - received < HANDOFF_FDS_CHUNK ? count - received : HANDOFF_FDS_CHUNK;
+        char control[CMSG_SPACE(HANDOFF_FDS_CHUNK * sizeof(int))];
+        char byte;
+        struct iovec part = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr msg = { .msg_iov = &part, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+        if(recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != 1 || (msg.msg_flags & MSG_CTRUNC)) return 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+           cmsg->cmsg_len != CMSG_LEN(chunk * sizeof(int)))
+            return 0;
+        memcpy(fds + received, CMSG_DATA(cmsg), chunk * sizeof(int));
+        received += chunk;
+    }
+    return 1;
+}
+
+/*
+ * Hands the server over to the new one connected through the socket. Only returns if that failed,
+ * in which case the server carries on as before.
+ */
+void HandoffGive(int connection)
+{
+    LogInfo("Handing the server over to a new process...");
+    PauseReactors();
+    ClusterPause();
+    HandoffCloseTls();
+    HandoffDrain(); // Logins completed by the cluster thread may still read the store
+    StoreClose(1);
+    HandoffDrain();
+
+    handoff h;
+    memset(&h, 0, sizeof(handoff));
+    MetricsAttach(metricsReactors + 2); // The cluster thread's block, for the frames dropped while draining its links
+    pthread_mutex_lock(&conversationLock);
+    pthread_rwlock_rdlock(&clientsAccess);
+    pthread_rwlock_rdlock(&userIndexLock);
+    HandoffSnapshot(&h);
+    pthread_rwlock_unlock(&userIndexLock);
+    pthread_rwlock_unlock(&clientsAccess);
+    pthread_mutex_unlock(&conversationLock);
+
+    handoffHeader header = { .version = HANDOFF_VERSION, .descriptors = h.fdCount, .length = h.length };
+    memcpy(header.magic, HANDOFF_MAGIC, sizeof(header.magic));
+    struct timeval timeout = { .tv_sec = HANDOFF_TIMEOUT };
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    char answer = 0, bye = HANDOFF_BYE;
+    if(!h.failed && HandoffWriteAll(connection, (char*)&header, sizeof(header)) && HandoffSendFds(connection, h.fds, h.fdCount) &&
+       HandoffWriteAll(connection, h.data, h.length) && HandoffReadAll(connection, &answer, 1) && answer == HANDOFF_ACK &&
+       HandoffWriteAll(connection, &bye, 1))
+    {
+        LogInfo("Handed %u client(s) over, exiting", clientsLen);
+        CaptureStop(); // The reactors are parked, so the trace is complete
+        exit(0); // The descriptors live on in the new server, and so do the clients
+    }
+    LogError("Hand over failed, resuming: %s", h.failed ? "out of memory" : "the new server didn't take over");
+    HandoffFree(&h, 0);
+    if(!StoreOpen()) LogError("Failed to reopen the message store, offline messages are lost until a restart");
+    if(!ClusterRun()) LogError("Failed to restart the cluster thread");
+    ResumeReactors();
+}
+
+void* HandoffThread(void *arg)
+{
+    while(1)
+    {
+        int connection = accept4(handoffSocket, NULL, NULL, SOCK_CLOEXEC);
+        if(connection < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            LogError("Hand over socket accept failed: %m");
+            break;
+        }
+        HandoffGive(connection);
+        close(connection);
+    }
+    return NULL;
+}
+// Waits for the next server on the unix socket, taking over the path from the previous server if any
+int HandoffListen(char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        LogError("Hand over socket path is too long");
+        return 0;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    handoffSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(handoffSocket < 0 || bind(handoffSocket, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(handoffSocket, 1) < 0)
+    {
+        LogError("Failed to create hand over socket: %m");
+        return 0;
+    }
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, HandoffThread, NULL) != 0)
+    {
+        LogError("Failed to start hand over thread");
+        return 0;
+    }
+    pthread_detach(thread);
+    LogInfo("Hand over socket listening on %s", path);
+    return 1;
+}
+
+/*
+ * Connects to the server listening on the path and receives its descriptors and snapshot. Returns 1
+ * without taking anything over if there's no server, 0 if the hand over failed.
+ */
+int HandoffTake(char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        LogError("Hand over socket path is too long");
+        return 0;
+    }
+    strcpy(address.sun_path, path);
+    handoffConnection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(handoffConnection < 0) return 0;
+    if(connect(handoffConnection, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        close(handoffConnection);
+        handoffConnection = -1;
+        return 1; // Nobody to take over from, a socket left behind by a server that's gone included
+    }
+    LogInfo("Taking over from the server listening on %s...", path);
+
+    handoff *h = &handoffTaken;
+    handoffHeader header;
+    if(!HandoffReadAll(handoffConnection, (char*)&header, sizeof(header)) || memcmp(header.magic, HANDOFF_MAGIC, sizeof(header.magic)) != 0 ||
+       header.version != HANDOFF_VERSION)
+    {
+        LogError("The previous server doesn't hand over in a known format");
+        return 0;
+    }
+    h->fds = (int*)malloc((header.descriptors ? header.descriptors : 1) * sizeof(int));
+    h->data = (char*)malloc(header.length ? header.length : 1);
+    if(!h->fds || !h->data) return 0;
+    if(!HandoffReceiveFds(handoffConnection, h->fds, header.descriptors))
+    {
+        LogError("Failed to receive the descriptors of the previous server: %m");
+        return 0;
+    }
+    h->fdCount = header.descriptors;
+    if(!HandoffReadAll(handoffConnection, h->data, header.length))
+    {
+        LogError("Failed to receive the state of the previous server: %m");
+        return 0;
+    }
+    h->length = header.length;
+
+    // The listeners go to the reactors and the cluster before anything else is restored
+    if(!HANDOFF_GET(h, handoffListenerCount) || handoffListenerCount < 0) return 0;
+    handoffListeners = (int*)malloc((handoffListenerCount ? handoffListenerCount : 1) * sizeof(int));
+    if(!handoffListeners) return 0;
+    int i;
+    for(i = 0; i < handoffListenerCount; i++) handoffListeners[i] = HandoffGetFd(h);
+    int tickets;
+    unsigned char keys[TLS_TICKET_KEYS];
+    HANDOFF_GET(h, tickets);
+    if(tickets && HandoffGet(h, keys, sizeof(keys)) && !TlsTicketKeys(keys, 1) && tlsContext)
+        LogWarn("Failed to keep the TLS ticket key, sessions of the previous server can't be resumed");
+    HANDOFF_GET(h, handoffClusterSize);
+    HANDOFF_GET(h, handoffClusterSelf);
+    clusterListenFd = HandoffGetFd(h);
+    return !h->failed;
+}
+
+/*
+ * Queues bytes for a client as they are, in messages as large as the pool allows. The watermark
+ * isn't checked, the previous server queued them already.
+ */
+int HandoffQueue(clientData *client, char *data, uint64_t length)
+{
+    while(length)
+    {
+        size_t chunk = BUFFER_LARGE_SIZE - sizeof(outMessage);
+        if(chunk > length) chunk = length;
+        outMessage *out = OutMessageCreate(NULL, data, chunk, NULL, 0, NULL);
+        if(!out) return 0;
+        if(client->outTail) client->outTail->next = out;
+        else client->outHead = out;
+        client->outTail = out;
+        QueueUpdateDepth(client, chunk);
+        data += chunk;
+        length -= chunk;
+    }
+    return 1;
+}
+// Rebuilds a client of the previous server from what was read about it, NULL if it had to be dropped
+clientData* HandoffRestoreClient(int fd, int owner, clientData *saved)
+{
+    reactor *r = reactors[owner % reactorCount];
+    MetricsAttach(r->id); // Before the reactor's thread runs, its block is this thread's
+    clientData *client = fd >= 0 ? ClientDataAdd(fd, r) : NULL;
+    if(!client)
+    {
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+    client->id = saved->id;
+    client->state = saved->state;
+    client->protocol = saved->protocol;
+    client->protocolVersion = saved->protocolVersion;
+    client->features = saved->features;
+    client->readPaused = saved->readPaused;
+    if(saved->username[0] && ClientDataSetUsername(client, saved->username))
+    {
+        UserIndexInsert(client->username, clusterSelf);
+        UserIndexSetBusy(client->username, client->state == CHATTING);
+    }
+    TimerInit(&client->idleTimer, &r->timers, OnIdleTimeout, client);
+    TimerInit(&client->requestTimer, &r->timers, OnRequestTimeout, client);
+    client->lastActive = r->timers.current;
+    client->heartbeatSent = 0;
+    if(client->state == LOGGING_IN && config.loginTimeout) TimerArm(&client->idleTimer, config.loginTimeout * 1000ll);
+    else if(client->state != LOGGING_IN && config.idleTimeout) TimerArm(&client->idleTimer, config.idleTimeout * 1000ll);
+    if(client->state == CONNECTING && config.requestTimeout) TimerArm(&client->requestTimer, config.requestTimeout * 1000ll);
+    return client;
+}
+
+/*
+ * Rebuilds the state of the previous server, with the reactors created but not running yet, and
+ * tells it to exit. Nothing to do if there was no server to take over from.
+ */
+int HandoffRestore()
+{
+    if(handoffConnection < 0) return 1;
+    handoff *h = &handoffTaken;
+    if(handoffClusterSize != clusterSize || (clusterSize && handoffClusterSelf != clusterSelf))
+    {
+        LogError("The previous server runs with another cluster list or node");
+        return 0;
+    }
+    unsigned int clientCount, count, i;
+    unsigned long nextId;
+    HANDOFF_GET(h, nextId);
+    HANDOFF_GET(h, clientCount);
+    count = clientCount;
+    clientData **restored = (clientData**)calloc(count ? count : 1, sizeof(clientData*));
+    int *partners = (int*)malloc((count ? count : 1) * sizeof(int));
+    clientData **proxies = (clientData**)calloc(count ? count : 1, sizeof(clientData*));
+    if(!restored || !partners || !proxies) return 0;
+    for(i = 0; i < count && !h->failed; i++)
+    {
+        int fd = HandoffGetFd(h), owner, j;
+        clientData saved;
+        HANDOFF_GET(h, owner);
+        HANDOFF_GET(h, saved.id);
+        HandoffGet(h, saved.username, USERNAME_MAX);
+        saved.username[USERNAME_MAX - 1] = 0;
+        HANDOFF_GET(h, saved.state);
+        HANDOFF_GET(h, saved.protocol);
+        HANDOFF_GET(h, saved.protocolVersion);
+        HANDOFF_GET(h, saved.features);
+        HANDOFF_GET(h, saved.readPaused);
+        clientData *client = restored[i] = h->failed ? NULL : HandoffRestoreClient(fd, owner < 0 ? 0 : owner, &saved);
+        HANDOFF_GET(h, partners[i]);
+        if(partners[i] == HANDOFF_PARTNER_REMOTE)
+        {
+            char partner[USERNAME_MAX];
+            int node;
+            clientStates state;
+            HandoffGet(h, partner, USERNAME_MAX);
+            partner[USERNAME_MAX - 1] = 0;
+            HANDOFF_GET(h, node);
+            HANDOFF_GET(h, state);
+            if(client && (proxies[i] = ClusterProxyCreate(partner, node, client))) proxies[i]->state = state;
+        }
+        int subscribed, rooms;
+        HANDOFF_GET(h, subscribed);
+        HANDOFF_GET(h, rooms);
+        if(client && subscribed) PresenceSubscribe(client, ReactorId(client->owner));
+        for(j = 0; j < rooms && j < CLIENT_ROOMS_MAX; j++)
+        {
+            char name[ROOMNAME_MAX];
+            HandoffGet(h, name, ROOMNAME_MAX);
+            name[ROOMNAME_MAX - 1] = 0;
+            if(client) RoomJoin(client, name, ReactorId(client->owner));
+        }
+        uint64_t length;
+        char *data = HandoffGetBytes(h, &length);
+        if(client && data && length && length < BUFFER_LARGE_SIZE) KeepIncompleteFrame(client, data, length, length + 1);
+        data = HandoffGetBytes(h, &length);
+        if(client && data && !HandoffQueue(client, data, length)) LogWarn("Failed to restore the queue of client %lu", client->id);
+    }
+    // Conversations once every client is back, a partner may come after its client
+    for(i = 0; i < count && !h->failed; i++)
+    {
+        if(!restored[i]) continue;
+        if(proxies[i]) restored[i]->chattingWith = proxies[i];
+        else if(partners[i] >= 0 && (unsigned int)partners[i] < count) restored[i]->chattingWith = restored[partners[i]];
+    }
+    lastId = nextId;
+
+    HANDOFF_GET(h, count);
+    for(i = 0; i < count && !h->failed; i++)
+    {
+        char username[USERNAME_MAX];
+        int node, busy;
+        HandoffGet(h, username, USERNAME_MAX);
+        username[USERNAME_MAX - 1] = 0;
+        HANDOFF_GET(h, node);
+        HANDOFF_GET(h, busy);
+        UserIndexInsert(username, node);
+        UserIndexSetBusy(username, busy);
+    }
+    if(clusterSize)
+    {
+        MetricsAttach(metricsReactors + 2);
+        int node;
+        for(node = 0; node < clusterSize && !h->failed; node++)
+        {
+            int fd = HandoffGetFd(h);
+            if(fd < 0) continue;
+            ClusterAdoptLink(node, fd);
+            uint64_t length;
+            char *data = HandoffGetBytes(h, &length);
+            while(data && length)
+            {
+                size_t chunk = BUFFER_LARGE_SIZE - sizeof(outMessage);
+                if(chunk > length) chunk = length;
+                outMessage *out = OutMessageCreate(NULL, data, chunk, NULL, 0, NULL);
+                if(!out) break;
+                ClusterLinkAppend(&clusterLinks[node], out);
+                data += chunk;
+                length -= chunk;
+            }
+        }
+        HANDOFF_GET(h, count);
+        for(i = 0; i < count && !h->failed; i++)
+        {
+            int fd = HandoffGetFd(h), node;
+            HANDOFF_GET(h, node);
+            uint64_t length;
+            char *data = HandoffGetBytes(h, &length);
+            clusterPeer *peer = fd >= 0 ? ClusterPeerAdd(fd) : NULL;
+            if(!peer) continue;
+            peer->node = node;
+            if(data && length < BUFFER_LARGE_SIZE)
+            {
+                memcpy(peer->buffer, data, length);
+                peer->length = length;
+            }
+        }
+        HANDOFF_GET(h, count);
+        for(i = 0; i < count && !h->failed; i++)
+        {
+            char username[USERNAME_MAX];
+            int node;
+            HandoffGet(h, username, USERNAME_MAX);
+            username[USERNAME_MAX - 1] = 0;
+            HANDOFF_GET(h, node);
+            ClusterDirectoryClaim(username, node, 1);
+        }
+        HANDOFF_GET(h, count);
+        for(i = 0; i < count && !h->failed; i++)
+        {
+            clusterClaim *claim = (clusterClaim*)malloc(sizeof(clusterClaim));
+            if(!claim) break;
+            unsigned int slot;
+            HANDOFF_GET(h, claim->token);
+            HANDOFF_GET(h, slot);
+            HANDOFF_GET(h, claim->node);
+            HandoffGet(h, claim->username, USERNAME_MAX);
+            claim->username[USERNAME_MAX - 1] = 0;
+            claim->client = slot < clientCount ? restored[slot] : NULL;
+            if(!claim->client || h->failed)
+            {
+                free(claim);
+                continue;
+            }
+            ClientDataRef(claim->client);
+            claim->client->claiming = 1;
+            claim->next = clusterClaims;
+            clusterClaims = claim;
+        }
+        HANDOFF_GET(h, clusterNextToken);
+    }
+    free(restored);
+    free(partners);
+    free(proxies);
+    int failed = h->failed;
+    HandoffFree(h, 1);
+    if(failed)
+    {
+        LogError("The state of the previous server is damaged");
+        return 0;
+    }
+
+    // From here on the previous server is gone, or it resumes and this one has to go
+    char answer = HANDOFF_ACK;
+    if(!HandoffWriteAll(handoffConnection, &answer, 1) || !HandoffReadAll(handoffConnection, &answer, 1) || answer != HANDOFF_BYE)
+    {
+        LogError("The previous server resumed before the hand over completed");
+        return 0;
+    }
+    close(handoffConnection);
+    handoffConnection = -1;
+    LogInfo("Took over %u client(s) from the previous server", clientsLen);
+    return 1;
+}
+
+#endif // HANDOFF_H
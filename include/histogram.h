@@ -0,0 +1,80 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram. Every power of two
+ * is split into HISTOGRAM_SUB_BUCKETS linear buckets, so a recorded value is
+ * kept with a relative error below 1 / HISTOGRAM_SUB_BUCKETS over the whole
+ * 64 bit range, in a fixed amount of memory and with O(1) recording.
+ *
+ * Values are unitless, the callers record nanoseconds. Histograms recorded on
+ * different threads are merged by adding up their buckets.
+ */
+#define HISTOGRAM_SUB_BITS    5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS     ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+} histogram;
+
+void HistogramReset(histogram *h)
+{
+    memset(h, 0, sizeof(histogram));
+    h->min = UINT64_MAX;
+}
+// Values below HISTOGRAM_SUB_BUCKETS get a bucket of their own, larger ones share it with their power of two neighbours
+unsigned int HistogramIndex(uint64_t value)
+{
+    if(value < HISTOGRAM_SUB_BUCKETS) return (unsigned int)value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (unsigned int)((shift + 1) * HISTOGRAM_SUB_BUCKETS + (value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+// Highest value that falls into the bucket
+uint64_t HistogramValueAt(unsigned int index)
+{
+    if(index < HISTOGRAM_SUB_BUCKETS) return index;
+    int shift = (int)(index / HISTOGRAM_SUB_BUCKETS) - 1;
+    uint64_t lowest = (uint64_t)(index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+void HistogramRecord(histogram *h, uint64_t value)
+{
+    h->counts[HistogramIndex(value)]++;
+    h->total++;
+    h->sum += value;
+    if(value < h->min) h->min = value;
+    if(value > h->max) h->max = value;
+}
+void HistogramMerge(histogram *destination, histogram *source)
+{
+    unsigned int i;
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++) destination->counts[i] += source->counts[i];
+    destination->total += source->total;
+    destination->sum += source->sum;
+    if(source->min < destination->min) destination->min = source->min;
+    if(source->max > destination->max) destination->max = source->max;
+}
+// Returns the value below which the given percentage of the recorded values fall
+uint64_t HistogramPercentile(histogram *h, double percentile)
+{
+    if(h->total == 0) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if(rank < 1) rank = 1;
+    uint64_t seen = 0;
+    unsigned int i;
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if(seen >= rank) return HistogramValueAt(i) < h->max ? HistogramValueAt(i) : h->max;
+    }
+    return h->max;
+}
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,229 @@
+#ifndef LOG_H
+#define LOG_H
+#include "shared.h"
+#include "config.h"
+#include <stdarg.h>
+
+/*
+ * Asynchronous leveled logger of the server.
+ *
+ * Every thread that logs gets its own ring of fixed-size entries, with the thread itself as
+ * the only producer and the drain thread as the only consumer. Logging formats the line straight
+ * into the next free entry and publishes it with a single release store, so threads never wait on
+ * each other or on the output. The drain thread collects the entries of every ring, prefixes them
+ * with their time and level and writes them out in large batches, to stdout or to the file given
+ * with -l. When a ring is full the line is dropped and counted instead of blocking the thread.
+ *
+ * Levels below LOG_LEVEL are removed at compile time, e.g. -DLOG_LEVEL=LOG_LEVEL_INFO strips every
+ * debug line, and the remaining ones are filtered at runtime by the -v option. Lines logged for
+ * every single message use LogDebugSampled, which lets through at most -V lines per second per
+ * thread and reports how many it held back. The levels themselves are defined in config.h.
+ */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG // Lowest level compiled in
+#endif
+
+#define LOG_RING_SIZE      1024 // Entries per thread, must be a power of two
+#define LOG_LINE_MAX       256  // Longer lines are truncated
+#define LOG_BATCH_SIZE     (64 * 1024)
+#define LOG_DRAIN_INTERVAL 10   // Milliseconds the drain thread sleeps once every ring is empty
+
+typedef struct logEntry {
+    struct timespec time;
+    int level;
+    int length;
+    char text[LOG_LINE_MAX];
+} logEntry;
+
+typedef struct logRing {
+    struct logRing *next;
+    unsigned int head __attribute__((aligned(64))); // Written by the owning thread only
+    unsigned long dropped;
+    time_t sampleSecond;                             // Sampling state, owning thread only
+    unsigned int sampleCount;
+    unsigned long suppressed;
+    unsigned int tail __attribute__((aligned(64))); // Written by the drain thread only
+    unsigned long droppedReported;
+    logEntry entries[LOG_RING_SIZE];
+} logRing;
+
+char *logLevelString[4] = { "DEBUG: ", "INFO: ", "WARN: ", "ERROR: " };
+
+logRing *logRings = NULL;             // Every ring ever registered, rings live until the logger shuts down
+pthread_mutex_t logRingsLock = PTHREAD_MUTEX_INITIALIZER;
+__thread logRing *localRing = NULL;
+int logFd = STDOUT_FILENO;
+int logRunning = 0;
+pthread_t logThread;
+
+logRing* LogRegister()
+{
+    logRing *ring;
+    if(posix_memalign((void**)&ring, 64, sizeof(logRing)) != 0) return NULL;
+    memset(ring, 0, offsetof(logRing, entries));
+    pthread_mutex_lock(&logRingsLock);
+    ring->next = logRings;
+    __atomic_store_n(&logRings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&logRingsLock);
+    localRing = ring;
+    return ring;
+}
+
+void LogWrite(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void LogWrite(int level, const char *format, ...)
+{
+    if(level < config.logLevel) return;
+    int savedErrno = errno; // Kept for %m
+    logRing *ring = localRing ? localRing : LogRegister();
+    if(!ring) return;
+
+    unsigned int head = ring->head;
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    logEntry *entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+    clock_gettime(CLOCK_REALTIME, &entry->time);
+    entry->level = level;
+    errno = savedErrno;
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(entry->text, LOG_LINE_MAX, format, args);
+    va_end(args);
+    entry->length = length < 0 ? 0 : (length < LOG_LINE_MAX ? length : LOG_LINE_MAX - 1);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Decides whether a sampled debug line of the calling thread gets through, see LogDebugSampled
+int LogSample()
+{
+    logRing *ring = localRing ? localRing : LogRegister();
+    if(!ring) return 0;
+    time_t now = time(NULL);
+    if(now != ring->sampleSecond)
+    {
+        unsigned long suppressed = ring->suppressed;
+        ring->sampleSecond = now;
+        ring->sampleCount = 0;
+        ring->suppressed = 0;
+        if(suppressed) LogWrite(LOG_LEVEL_DEBUG, "%lu debug lines suppressed in the last second", suppressed);
+    }
+    if(ring->sampleCount < config.logSampleRate)
+    {
+        ring->sampleCount++;
+        return 1;
+    }
+    ring->suppressed++;
+    return 0;
+}
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LogDebug(...) LogWrite(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LogDebugSampled(...) do { if(config.logLevel <= LOG_LEVEL_DEBUG && LogSample()) LogWrite(LOG_LEVEL_DEBUG, __VA_ARGS__); } while(0)
+#else
+#define LogDebug(...) ((void)0)
+#define LogDebugSampled(...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LogInfo(...) LogWrite(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LogInfo(...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LogWarn(...) LogWrite(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LogWarn(...) ((void)0)
+#endif
+#define LogError(...) LogWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Appends every published entry of the ring to the batch, writing the batch out whenever it fills up
+size_t LogDrainRing(logRing *ring, char *batch, size_t used, time_t *lastSecond, char *stamp)
+{
+    unsigned int tail = ring->tail;
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if(dropped != ring->droppedReported)
+    {
+        used += snprintf(batch + used, LOG_BATCH_SIZE - used, "WARN: %lu log lines dropped, the log ring was full\n", dropped - ring->droppedReported);
+        ring->droppedReported = dropped;
+    }
+    for(; tail != head; tail++)
+    {
+        logEntry *entry = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+        if(used + LOG_LINE_MAX + 64 > LOG_BATCH_SIZE)
+        {
+            if(write(logFd, batch, used) < 0) perror("Failed to write log");
+            used = 0;
+        }
+        // Formatting the date is only needed once per second
+        if(entry->time.tv_sec != *lastSecond)
+        {
+            struct tm date;
+            localtime_r(&entry->time.tv_sec, &date);
+            strftime(stamp, 32, "%Y-%m-%d %H:%M:%S", &date);
+            *lastSecond = entry->time.tv_sec;
+        }
+        used += snprintf(batch + used, LOG_BATCH_SIZE - used, "[%s.%06ld] %s%.*s\n", stamp, entry->time.tv_nsec / 1000,
+                         logLevelString[entry->level], entry->length, entry->text);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return used;
+}
+// Drains every ring until the logger is shut down, then once more so nothing logged before is lost
+void* LogThread(void *arg)
+{
+    char *batch = (char*)malloc(LOG_BATCH_SIZE);
+    char stamp[32];
+    time_t lastSecond = 0;
+    if(!batch) return NULL;
+    while(1)
+    {
+        int running = __atomic_load_n(&logRunning, __ATOMIC_ACQUIRE);
+        size_t used = 0;
+        logRing *ring;
+        for(ring = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+            used = LogDrainRing(ring, batch, used, &lastSecond, stamp);
+        if(used && write(logFd, batch, used) < 0) perror("Failed to write log");
+        if(!running) break;
+        if(!used)
+        {
+            struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_DRAIN_INTERVAL * 1000000L };
+            nanosleep(&interval, NULL);
+        }
+    }
+    free(batch);
+    return NULL;
+}
+
+void LogShutdown()
+{
+    if(!__atomic_exchange_n(&logRunning, 0, __ATOMIC_ACQ_REL)) return;
+    pthread_join(logThread, NULL);
+    if(logFd != STDOUT_FILENO) close(logFd);
+}
+// Starts the drain thread, lines logged before are kept in their rings until then
+int LogInit(char *path)
+{
+    if(path)
+    {
+        logFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(logFd < 0)
+        {
+            perror("ERROR: Failed to open log file");
+            logFd = STDOUT_FILENO;
+            return 0;
+        }
+    }
+    logRunning = 1;
+    if(pthread_create(&logThread, NULL, LogThread, NULL) != 0)
+    {
+        logRunning = 0;
+        perror("ERROR: Failed to start log thread");
+        return 0;
+    }
+    atexit(LogShutdown); // Fatal errors exit right away, their last lines still have to be written
+    return 1;
+}
+
+#endif // LOG_H
@@ -1,127 +1,400 @@
 #ifndef MAP_H
 #define MAP_H
 #include "shared.h"
+#include "protocol.h"
+#include "pool.h"
+#include "log.h"
+#include "timer.h"
+#include <stdint.h>
 
 /*
  * Structure that contains information about clients
  * connected to the server:
  *      - ID: Unique identifier
+ *      - Slot: Position of the client in the registry's
+ *              dense client table
  *      - Socket: Socket file descriptor
- *      - Thread
+ *      - Owner: Reactor whose thread reads from and writes
+ *               to the socket
  *      - Username: Unique display name visible to
  *                  other clients
  *      - State
  *      - Reference to another client in a conversation
  *        with each other.
+ *      - Reference count, the client is freed once the
+ *        registry and every queued message let go of it.
+ *      - Lock guarding the state and conversation partner,
+ *        as they are read from other reactors.
+ *      - Protocol and features negotiated on the first
+ *        message, and the partially received frame, only allocated from the
+ *        buffer pool while a frame is split across reads.
+ *      - Outbound queue of messages the socket didn't take
+ *        yet, and whether reading is paused until it drains.
+ *      - Link in the owner's list of clients with messages
+ *        queued during the current event loop iteration.
+ *      - Rooms the client has joined, along with its slot in
+ *        each room's member list.
+ *      - Slot in the presence subscriber list, -1 if the
+ *        client isn't subscribed.
+ *      - Timers of the owner's timing wheel: the login
+ *        deadline, later the idle timeout, and the timeout
+ *        of the conversation request the client sent.
+ *      - Tick of the last message received from the client
+ *        and of the heartbeat waiting for an answer, 0 if none.
+ *      - TLS session, NULL for plaintext connections, whether
+ *        it's still handshaking, whether the kernel encrypts
+ *        what's written and the length of a record that has
+ *        to be written again, see tls.h.
+ *      - io_uring requests in flight for the client, each
+ *        holding a reference: whether receiving is armed or
+ *        being cancelled, the length of the send in flight
+ *        and whether a full socket is waited for, see reactor.h.
+ *      - Whether the client is a proxy for a user on
+ *        another cluster node, that node, and whether its
+ *        login waits for the username's owner, see cluster.h.
  */
 typedef struct clientData {
     unsigned long id;
+    unsigned int slot;
     int clientSocket;
-    pthread_t clientThread;
+    struct reactor *owner;
     char username[USERNAME_MAX];
+    uint32_t usernameHash;
     clientStates state;
     struct clientData *chattingWith;
-    struct clientData *nextClient;
+    int refCount;
+    pthread_mutex_t lock;
+    protocolModes protocol;
+    int protocolVersion;
+    int features;            // PROTOCOL_FEATURE_* the client negotiated
+    char *inBuffer;
+    size_t inLength;
+    size_t inCapacity;
+    struct outMessage *outHead;
+    struct outMessage *outTail;
+    size_t outBytes;
+    int readPaused;
+    struct clientData *nextDirty;
+    int dirty;
+    struct room *rooms[CLIENT_ROOMS_MAX];
+    unsigned int roomSlots[CLIENT_ROOMS_MAX];
+    int roomCount;
+    int presenceSlot;
+    timer idleTimer;
+    timer requestTimer;
+    long long lastActive;
+    long long heartbeatSent;
+    struct ssl_st *tls;
+    int tlsHandshake;
+    int tlsKernel;
+    size_t tlsRetry;
+    int ringOps;
+    int ringRecv;
+    int ringCancel;
+    int ringSending;
+    size_t ringSendLength;
+    int ringWritable;
+    int remote;
+    int node;
+    int claiming;
+    long long rateTokens[RATE_CLASSES]; // Token buckets of the command classes in billionths of a token, see admission.h
+    uint64_t rateRefilled[RATE_CLASSES]; // MetricsNanos time a bucket was last refilled at, 0 for a full bucket that was never used
+    int rateWarned;          // Classes whose exhaustion the client was already told about, one bit each
 } clientData;
+
 /*
- * Using a singly-linked list for storing an arbitrary amount of clients,
- * which also makes accessing client information easy through pointers.
+ * The registry keeps every connected client in two structures:
+ *      - A dense table of client pointers, each client knowing its own slot. Removal moves
+ *        the last client into the freed slot, so listing every client walks one contiguous array.
+ *      - A username index for logged in clients, split into shards that each hold an
+ *        open-addressing hash table (linear probing) under their own read-write lock.
+ *        Lookups of different usernames rarely touch the same lock, and lookups of the
+ *        same username only ever share it for reading.
  */
+#define REGISTRY_SHARDS 64
+#define SHARD_INITIAL_CAPACITY 16
+
+typedef struct registryShard {
+    pthread_rwlock_t lock;
+    clientData **table; // NULL entries are free, the capacity is always a power of two
+    unsigned int capacity;
+    unsigned int count;
+} registryShard;
+
 unsigned long lastId = 0;
-clientData* clients;
+objectPool clientPool;           // Client structures are recycled through a slab pool
+clientData **clients;            // Dense client table
 unsigned int clientsLen = 0;
-pthread_mutex_t clientsLenAccess;
+unsigned int clientsCapacity = 0;
+pthread_rwlock_t clientsAccess;  // Guards the dense table, taken for reading while listing clients
+registryShard usernameIndex[REGISTRY_SHARDS];
+
+// FNV-1a, the low bits pick the shard and the rest the position inside its table
+uint32_t HashUsername(char *username)
+{
+    uint32_t hash = 2166136261u;
+    while(*username)
+    {
+        hash ^= (unsigned char)*username++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+registryShard* ShardOf(uint32_t hash)
+{
+    return &usernameIndex[hash % REGISTRY_SHARDS];
+}
 
 int ClientDataInit()
 {
-    // Initialize mutex for thread-safe access
-    pthread_mutex_init(&clientsLenAccess, NULL);
+    // Initialize locks for thread-safe access
+    pthread_rwlock_init(&clientsAccess, NULL);
+    ObjectPoolInit(&clientPool, sizeof(clientData));
+    int i;
+    for(i = 0; i < REGISTRY_SHARDS; i++)
+    {
+        pthread_rwlock_init(&usernameIndex[i].lock, NULL);
+        usernameIndex[i].table = (clientData**)calloc(SHARD_INITIAL_CAPACITY, sizeof(clientData*));
+        usernameIndex[i].capacity = SHARD_INITIAL_CAPACITY;
+        usernameIndex[i].count = 0;
+        if(!usernameIndex[i].table) return -1;
+    }
     return 0;
 }
 int ClientDataDestroy()
 {
-    pthread_mutex_destroy(&clientsLenAccess);
+    int i;
+    for(i = 0; i < REGISTRY_SHARDS; i++)
+    {
+        pthread_rwlock_destroy(&usernameIndex[i].lock);
+        free(usernameIndex[i].table);
+    }
+    pthread_rwlock_destroy(&clientsAccess);
 
-    // We must free every element from memory iteratively
-    clientData *c = clients;
-    while(c != NULL)
+    unsigned int c;
+    for(c = 0; c < clientsLen; c++)
     {
-        clientData *prev = c;
-        c = prev->nextClient;
-        free(prev);
+        pthread_mutex_destroy(&clients[c]->lock);
+        BufferRelease(clients[c]->inBuffer);
     }
+    free(clients);
+    ObjectPoolDestroy(&clientPool);
+    BufferPoolDestroy();
     return 0;
 }
-clientData* ClientDataFind(char username[USERNAME_MAX])
+void ClientDataRef(clientData *client)
+{
+    __atomic_add_fetch(&client->refCount, 1, __ATOMIC_RELAXED);
+}
+void ClientDataRelease(clientData *client)
 {
-    clientData* c = clients;
-    while(c != NULL)
+    if(__atomic_sub_fetch(&client->refCount, 1, __ATOMIC_ACQ_REL) == 0)
     {
-        if(strcmp(username, c->username) == 0) return c;
-        c = c->nextClient;
+        pthread_mutex_destroy(&client->lock);
+        BufferRelease(client->inBuffer);
+        ObjectPoolFree(&clientPool, client);
     }
-    return NULL;
 }
-int ClientDataRemove(clientData *client)
-{
-    clientData* prev = NULL;
-    clientData* c = clients;
 
-    if(!clients) return 0;
-    if(client == clients)
+// Probes the shard for the username, returns the position holding it or the free position where it would go
+unsigned int ShardProbe(registryShard *shard, char *username, uint32_t hash)
+{
+    unsigned int mask = shard->capacity - 1;
+    unsigned int i = (hash / REGISTRY_SHARDS) & mask;
+    while(shard->table[i])
     {
-        clients = clients->nextClient;
+        if(shard->table[i]->usernameHash == hash && strcmp(shard->table[i]->username, username) == 0) break;
+        i = (i + 1) & mask;
     }
-    else
+    return i;
+}
+// Doubles the capacity of the shard, the write lock must be held
+int ShardGrow(registryShard *shard)
+{
+    clientData **old = shard->table;
+    unsigned int oldCapacity = shard->capacity;
+    clientData **table = (clientData**)calloc(oldCapacity * 2, sizeof(clientData*));
+    if(!table) return 0;
+
+    shard->table = table;
+    shard->capacity = oldCapacity * 2;
+    unsigned int i;
+    for(i = 0; i < oldCapacity; i++)
+        if(old[i]) shard->table[ShardProbe(shard, old[i]->username, old[i]->usernameHash)] = old[i];
+    free(old);
+    return 1;
+}
+/*
+ * Removes the entry at the given position. Instead of leaving a tombstone, the entries that
+ * follow it in the same probe run are shifted back so that lookups can stop at the first free position.
+ */
+void ShardErase(registryShard *shard, unsigned int i)
+{
+    unsigned int mask = shard->capacity - 1;
+    unsigned int j = i;
+    shard->table[i] = NULL;
+    while(1)
     {
-        // Search for the node that precedes the queried client
-        while(c != NULL)
+        j = (j + 1) & mask;
+        if(!shard->table[j]) break;
+        unsigned int home = (shard->table[j]->usernameHash / REGISTRY_SHARDS) & mask;
+        // Move the entry back only if its home position doesn't lie cyclically within (i, j]
+        if((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j)))
         {
-            if(c->nextClient == client)
-            {
-                prev = c;
-                break;
-            }
-            c = c->nextClient;
+            shard->table[i] = shard->table[j];
+            shard->table[j] = NULL;
+            i = j;
         }
-        prev->nextClient = client->nextClient;
     }
+    shard->count--;
+}
 
-    free(client);
-    pthread_mutex_lock(&clientsLenAccess);
-    clientsLen--;
-    pthread_mutex_unlock(&clientsLenAccess);
+/*
+ * Looks up a logged in client. The returned client stays valid as long as the caller holds
+ * conversationLock, since clients are only removed from the registry with it held.
+ */
+clientData* ClientDataFind(char username[USERNAME_MAX])
+{
+    uint32_t hash = HashUsername(username);
+    registryShard *shard = ShardOf(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    clientData *c = shard->table[ShardProbe(shard, username, hash)];
+    pthread_rwlock_unlock(&shard->lock);
+    return c;
+}
+// Looks up a logged in client and references it, so it stays valid without holding conversationLock
+clientData* ClientDataAcquire(char username[USERNAME_MAX])
+{
+    uint32_t hash = HashUsername(username);
+    registryShard *shard = ShardOf(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    clientData *c = shard->table[ShardProbe(shard, username, hash)];
+    if(c) ClientDataRef(c);
+    pthread_rwlock_unlock(&shard->lock);
+    return c;
+}
+// Gives the client a username, fails if the username is already taken
+int ClientDataSetUsername(clientData *client, char *username)
+{
+    uint32_t hash = HashUsername(username);
+    registryShard *shard = ShardOf(hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    // Keep the load factor under one half so probe runs stay short
+    if((shard->count + 1) * 2 > shard->capacity && !ShardGrow(shard))
+    {
+        pthread_rwlock_unlock(&shard->lock);
+        return 0;
+    }
+    unsigned int i = ShardProbe(shard, username, hash);
+    if(shard->table[i])
+    {
+        pthread_rwlock_unlock(&shard->lock);
+        return 0;
+    }
+    strncpy(client->username, username, USERNAME_MAX);
+    client->usernameHash = hash;
+    shard->table[i] = client;
+    shard->count++;
+    pthread_rwlock_unlock(&shard->lock);
     return 1;
 }
-clientData* ClientDataAdd(int socket)
+// Removes the client from the registry and drops the registry's reference to it
+int ClientDataRemove(clientData *client)
 {
-    clientData *newClient = (clientData*)malloc(sizeof(clientData));
-    if(!newClient)
+    if(client->username[0])
     {
-        perror("ERROR: Failed to create new client");
-        return NULL;
+        registryShard *shard = ShardOf(client->usernameHash);
+        pthread_rwlock_wrlock(&shard->lock);
+        unsigned int i = ShardProbe(shard, client->username, client->usernameHash);
+        if(shard->table[i] == client) ShardErase(shard, i);
+        pthread_rwlock_unlock(&shard->lock);
     }
 
-    if(!clients) // List is empty
+    pthread_rwlock_wrlock(&clientsAccess);
+    if(client->slot >= clientsLen || clients[client->slot] != client) // Already removed
     {
-        clients = newClient;
+        pthread_rwlock_unlock(&clientsAccess);
+        return 0;
     }
-    else
+    // Fill the hole with the last client to keep the table dense
+    clientData *last = clients[clientsLen - 1];
+    clients[client->slot] = last;
+    last->slot = client->slot;
+    clientsLen--;
+    pthread_rwlock_unlock(&clientsAccess);
+
+    ClientDataRelease(client);
+    return 1;
+}
+clientData* ClientDataAdd(int socket, struct reactor *owner)
+{
+    clientData *newClient = (clientData*)ObjectPoolAlloc(&clientPool);
+    if(!newClient)
     {
-        newClient->nextClient = clients;
-        clients = newClient;
+        LogError("Failed to create new client: %m");
+        return NULL;
     }
 
-    pthread_mutex_lock(&clientsLenAccess);
-    clientsLen++;
-    newClient->id = lastId;
-    lastId++;
-    pthread_mutex_unlock(&clientsLenAccess);
-
     newClient->clientSocket = socket;
+    newClient->owner = owner;
     newClient->state = LOGGING_IN;
     newClient->username[0] = 0;
+    newClient->usernameHash = 0;
     newClient->chattingWith = NULL;
+    newClient->protocol = PROTOCOL_UNKNOWN;
+    newClient->protocolVersion = 0;
+    newClient->features = 0;
+    newClient->inBuffer = NULL;
+    newClient->inLength = 0;
+    newClient->inCapacity = 0;
+    newClient->outHead = NULL;
+    newClient->outTail = NULL;
+    newClient->outBytes = 0;
+    newClient->readPaused = 0;
+    newClient->nextDirty = NULL;
+    newClient->dirty = 0;
+    newClient->roomCount = 0;
+    newClient->presenceSlot = -1;
+    newClient->tls = NULL;
+    newClient->tlsHandshake = 0;
+    newClient->tlsKernel = 0;
+    newClient->tlsRetry = 0;
+    newClient->ringOps = 0;
+    newClient->ringRecv = 0;
+    newClient->ringCancel = 0;
+    newClient->ringSending = 0;
+    newClient->ringSendLength = 0;
+    newClient->ringWritable = 0;
+    newClient->remote = 0;
+    newClient->node = 0;
+    newClient->claiming = 0;
+    memset(newClient->rateRefilled, 0, sizeof(newClient->rateRefilled));
+    newClient->rateWarned = 0;
+    newClient->refCount = 1; // Reference held by the registry
+    pthread_mutex_init(&newClient->lock, NULL);
+
+    pthread_rwlock_wrlock(&clientsAccess);
+    if(clientsLen == clientsCapacity)
+    {
+        unsigned int capacity = clientsCapacity ? clientsCapacity * 2 : 64;
+        clientData **table = (clientData**)realloc(clients, capacity * sizeof(clientData*));
+        if(!table)
+        {
+            pthread_rwlock_unlock(&clientsAccess);
+            LogError("Failed to grow client table: %m");
+            pthread_mutex_destroy(&newClient->lock);
+            ObjectPoolFree(&clientPool, newClient);
+            return NULL;
+        }
+        clients = table;
+        clientsCapacity = capacity;
+    }
+    newClient->slot = clientsLen;
+    clients[clientsLen++] = newClient;
+    newClient->id = lastId;
+    lastId++;
+    pthread_rwlock_unlock(&clientsAccess);
+
     return newClient;
 }
 
@@ -0,0 +1,339 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include "shared.h"
+#include "map.h"
+#include "histogram.h"
+#include "capture.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <poll.h>
+
+/*
+ * Server metrics. Every reactor thread counts into its own threadMetrics block, which is
+ * aligned to a cache line so the hot counters of two threads never share one. A block only
+ * ever has a single writer, so counters are bumped with relaxed loads and stores instead of
+ * locked read-modify-write instructions, and the hot path never takes a lock or touches a
+ * cache line written by another thread.
+ *
+ * The blocks are only summed up when someone asks for them, through the Stats command or the
+ * admin unix socket (-A). Readers may see a block mid-update, which at worst makes a report
+ * lag behind by the last few events.
+ */
+#define CACHE_LINE_SIZE 64
+#define METRICS_BACKGROUND 3 // Blocks after the reactors' ones, for the message store's sync thread, the presence thread and the cluster thread
+#define LOOP_LAG_WEIGHT 8             // Event loop iterations the lag is smoothed over
+#define LOOP_LAG_FRESH  1000000000ull // Nanoseconds after which the lag of an idle reactor no longer counts
+
+typedef struct threadMetrics {
+    uint64_t messagesIn;     // Complete messages received from clients
+    uint64_t bytesIn;
+    uint64_t messagesOut;    // Messages fully written to client sockets
+    uint64_t bytesOut;
+    uint64_t posted;         // Messages handed to another reactor's mailbox
+    uint64_t accepted;
+    uint64_t rejected;       // Connections closed right away as the server was full
+    uint64_t disconnected;
+    uint64_t queuedBytes;    // Bytes waiting in the outbound queues of the thread's clients
+    uint64_t peakQueue;      // Largest single outbound queue seen
+    uint64_t dropped;        // Messages discarded because their recipient was a slow consumer
+    uint64_t slowDisconnected;
+    uint64_t paused;         // Times reading from a slow consumer was paused
+    uint64_t stored;         // Direct messages kept for offline recipients
+    uint64_t storedDelivered;
+    uint64_t storeSyncs;     // Group commits of the message store
+    uint64_t loginTimeouts;  // Connections closed as they didn't log in in time
+    uint64_t requestTimeouts;
+    uint64_t idleTimeouts;   // Clients disconnected as they didn't answer a heartbeat
+    uint64_t tlsHandshakes;  // Completed TLS handshakes, resumed ones included
+    uint64_t tlsResumed;
+    uint64_t tlsKernel;      // Connections whose records the kernel encrypts
+    uint64_t tlsFailures;
+    uint64_t compressedIn;   // Compressed chat messages received
+    uint64_t compressedRelayed; // Deliveries of those forwarded as they were
+    uint64_t inflated;       // Deliveries of those inflated for a client without compression
+    uint64_t clusterOut;     // Frames handed to the links to other cluster nodes
+    uint64_t clusterIn;      // Frames received from other cluster nodes
+    uint64_t clusterRouted;  // Frames forwarded as the owner of their recipient
+    uint64_t clusterDropped; // Frames for a node that was down or didn't keep up
+    uint64_t rateLimited;    // Commands dropped as the client exceeded the rate of their class
+    uint64_t loginsDeferred; // Logins told to retry later as the server was overloaded
+    uint64_t loopBusySince;  // Start of the reactor's current event loop iteration in nanoseconds, 0 while it waits
+    uint64_t loopLag;        // Smoothed duration of the reactor's event loop iterations in nanoseconds
+    uint64_t loopLagAt;      // When loopLag was last updated
+    uint64_t commands[UNKNOWN + 1];
+    histogram handlerLatency; // Nanoseconds spent handling a single command
+} __attribute__((aligned(CACHE_LINE_SIZE))) threadMetrics;
+
+threadMetrics *metricsTable;
+int metricsThreads = 0;
+int metricsReactors = 0;
+__thread threadMetrics *localMetrics = NULL; // Block of the calling thread, set by MetricsAttach
+time_t metricsStart;
+
+// Single writer updates, see the comment above
+#define METRIC_ADD(field, value) __atomic_store_n(&localMetrics->field, __atomic_load_n(&localMetrics->field, __ATOMIC_RELAXED) + (value), __ATOMIC_RELAXED)
+#define METRIC_MAX(field, value) do { if((uint64_t)(value) > localMetrics->field) __atomic_store_n(&localMetrics->field, (uint64_t)(value), __ATOMIC_RELAXED); } while(0)
+
+int MetricsInit(int reactors)
+{
+    int threads = reactors + METRICS_BACKGROUND;
+    if(posix_memalign((void**)&metricsTable, CACHE_LINE_SIZE, threads * sizeof(threadMetrics)) != 0) return -1;
+    memset(metricsTable, 0, threads * sizeof(threadMetrics));
+    int i;
+    for(i = 0; i < threads; i++) HistogramReset(&metricsTable[i].handlerLatency);
+    metricsThreads = threads;
+    metricsReactors = reactors;
+    metricsStart = time(NULL);
+    return 0;
+}
+void MetricsDestroy()
+{
+    free(metricsTable);
+}
+void MetricsAttach(int thread)
+{
+    localMetrics = &metricsTable[thread];
+}
+
+uint64_t MetricsNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+ * Event loop lag of the reactors. An event that comes in while a reactor is busy waits for the
+ * rest of the iteration, so the time an iteration takes is how late the reactor is to react.
+ * A reactor stuck in a single long iteration counts as lagging from the moment it started it.
+ */
+void MetricsLoopBusy(uint64_t now)
+{
+    __atomic_store_n(&localMetrics->loopBusySince, now, __ATOMIC_RELAXED);
+}
+void MetricsLoopIdle(uint64_t now)
+{
+    uint64_t busySince = localMetrics->loopBusySince;
+    uint64_t sample = now > busySince ? now - busySince : 0;
+    uint64_t lag = (localMetrics->loopLag * (LOOP_LAG_WEIGHT - 1) + sample) / LOOP_LAG_WEIGHT;
+    __atomic_store_n(&localMetrics->loopLag, lag, __ATOMIC_RELAXED);
+    __atomic_store_n(&localMetrics->loopLagAt, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&localMetrics->loopBusySince, 0, __ATOMIC_RELAXED);
+}
+// Lag of the slowest reactor in nanoseconds
+uint64_t MetricsLoopLag(uint64_t now)
+{
+    uint64_t worst = 0;
+    int i;
+    for(i = 0; i < metricsReactors; i++)
+    {
+        threadMetrics *m = &metricsTable[i];
+        uint64_t busySince = __atomic_load_n(&m->loopBusySince, __ATOMIC_RELAXED);
+        if(busySince && now > busySince && now - busySince > worst) worst = now - busySince;
+        uint64_t at = __atomic_load_n(&m->loopLagAt, __ATOMIC_RELAXED);
+        uint64_t lag = __atomic_load_n(&m->loopLag, __ATOMIC_RELAXED);
+        if(now < at + LOOP_LAG_FRESH && lag > worst) worst = lag;
+    }
+    return worst;
+}
+
+// Sums up the blocks of every thread, the peak queue is the largest of them
+void MetricsAggregate(threadMetrics *total)
+{
+    memset(total, 0, sizeof(threadMetrics));
+    HistogramReset(&total->handlerLatency);
+    int i;
+    for(i = 0; i < metricsThreads; i++)
+    {
+        threadMetrics *m = &metricsTable[i];
+        total->messagesIn += __atomic_load_n(&m->messagesIn, __ATOMIC_RELAXED);
+        total->bytesIn += __atomic_load_n(&m->bytesIn, __ATOMIC_RELAXED);
+        total->messagesOut += __atomic_load_n(&m->messagesOut, __ATOMIC_RELAXED);
+        total->bytesOut += __atomic_load_n(&m->bytesOut, __ATOMIC_RELAXED);
+        total->posted += __atomic_load_n(&m->posted, __ATOMIC_RELAXED);
+        total->accepted += __atomic_load_n(&m->accepted, __ATOMIC_RELAXED);
+        total->rejected += __atomic_load_n(&m->rejected, __ATOMIC_RELAXED);
+        total->disconnected += __atomic_load_n(&m->disconnected, __ATOMIC_RELAXED);
+        total->queuedBytes += __atomic_load_n(&m->queuedBytes, __ATOMIC_RELAXED);
+        total->dropped += __atomic_load_n(&m->dropped, __ATOMIC_RELAXED);
+        total->slowDisconnected += __atomic_load_n(&m->slowDisconnected, __ATOMIC_RELAXED);
+        total->paused += __atomic_load_n(&m->paused, __ATOMIC_RELAXED);
+        total->stored += __atomic_load_n(&m->stored, __ATOMIC_RELAXED);
+        total->storedDelivered += __atomic_load_n(&m->storedDelivered, __ATOMIC_RELAXED);
+        total->storeSyncs += __atomic_load_n(&m->storeSyncs, __ATOMIC_RELAXED);
+        total->loginTimeouts += __atomic_load_n(&m->loginTimeouts, __ATOMIC_RELAXED);
+        total->requestTimeouts += __atomic_load_n(&m->requestTimeouts, __ATOMIC_RELAXED);
+        total->idleTimeouts += __atomic_load_n(&m->idleTimeouts, __ATOMIC_RELAXED);
+        total->tlsHandshakes += __atomic_load_n(&m->tlsHandshakes, __ATOMIC_RELAXED);
+        total->tlsResumed += __atomic_load_n(&m->tlsResumed, __ATOMIC_RELAXED);
+        total->tlsKernel += __atomic_load_n(&m->tlsKernel, __ATOMIC_RELAXED);
+        total->tlsFailures += __atomic_load_n(&m->tlsFailures, __ATOMIC_RELAXED);
+        total->compressedIn += __atomic_load_n(&m->compressedIn, __ATOMIC_RELAXED);
+        total->compressedRelayed += __atomic_load_n(&m->compressedRelayed, __ATOMIC_RELAXED);
+        total->inflated += __atomic_load_n(&m->inflated, __ATOMIC_RELAXED);
+        total->clusterOut += __atomic_load_n(&m->clusterOut, __ATOMIC_RELAXED);
+        total->clusterIn += __atomic_load_n(&m->clusterIn, __ATOMIC_RELAXED);
+        total->clusterRouted += __atomic_load_n(&m->clusterRouted, __ATOMIC_RELAXED);
+        total->clusterDropped += __atomic_load_n(&m->clusterDropped, __ATOMIC_RELAXED);
+        total->rateLimited += __atomic_load_n(&m->rateLimited, __ATOMIC_RELAXED);
+        total->loginsDeferred += __atomic_load_n(&m->loginsDeferred, __ATOMIC_RELAXED);
+        uint64_t peak = __atomic_load_n(&m->peakQueue, __ATOMIC_RELAXED);
+        if(peak > total->peakQueue) total->peakQueue = peak;
+        int c;
+        for(c = 0; c <= UNKNOWN; c++) total->commands[c] += __atomic_load_n(&m->commands[c], __ATOMIC_RELAXED);
+        HistogramMerge(&total->handlerLatency, &m->handlerLatency);
+    }
+}
+
+// Renders the aggregated metrics as human readable text, returns its length
+size_t MetricsFormat(char *buffer, size_t size, unsigned int clients)
+{
+    threadMetrics total;
+    MetricsAggregate(&total);
+    long uptime = (long)(time(NULL) - metricsStart);
+    histogram *h = &total.handlerLatency;
+
+    size_t used = snprintf(buffer, size,
+        "Server statistics:\n"
+        "Uptime: %ld s, reactors: %d, clients: %u\n"
+        "Connections: %lu accepted (%.1f/s), %lu rejected, %lu disconnected\n"
+        "Received: %lu messages, %lu bytes\n"
+        "Sent: %lu messages, %lu bytes, %lu posted to other reactors\n"
+        "Queues: %lu bytes queued, peak queue %lu bytes, %lu dropped, %lu slow consumers disconnected, %lu paused\n"
+        "Offline messages: %lu stored, %lu delivered, %lu syncs\n"
+        "Timeouts: %lu logins, %lu requests, %lu idle\n"
+        "TLS: %lu handshakes, %lu resumed, %lu kernel offloaded, %lu failed\n"
+        "Compression: %lu messages received compressed, %lu forwarded as they were, %lu inflated\n"
+        "Cluster: %lu frames sent, %lu received, %lu routed, %lu dropped\n"
+        "Admission: limit %u clients, %lu commands rate limited, %lu logins deferred, event loop lag %.2f ms\n"
+        "Handler latency (us): p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n"
+        "Commands:",
+        uptime, metricsReactors, clients,
+        (unsigned long)total.accepted, uptime ? (double)total.accepted / uptime : (double)total.accepted,
+        (unsigned long)total.rejected, (unsigned long)total.disconnected,
+        (unsigned long)total.messagesIn, (unsigned long)total.bytesIn,
+        (unsigned long)total.messagesOut, (unsigned long)total.bytesOut, (unsigned long)total.posted,
+        (unsigned long)total.queuedBytes, (unsigned long)total.peakQueue, (unsigned long)total.dropped,
+        (unsigned long)total.slowDisconnected, (unsigned long)total.paused,
+        (unsigned long)total.stored, (unsigned long)total.storedDelivered, (unsigned long)total.storeSyncs,
+        (unsigned long)total.loginTimeouts, (unsigned long)total.requestTimeouts, (unsigned long)total.idleTimeouts,
+        (unsigned long)total.tlsHandshakes, (unsigned long)total.tlsResumed, (unsigned long)total.tlsKernel, (unsigned long)total.tlsFailures,
+        (unsigned long)total.compressedIn, (unsigned long)total.compressedRelayed, (unsigned long)total.inflated,
+        (unsigned long)total.clusterOut, (unsigned long)total.clusterIn, (unsigned long)total.clusterRouted, (unsigned long)total.clusterDropped,
+        __atomic_load_n(&config.maxClients, __ATOMIC_RELAXED), (unsigned long)total.rateLimited, (unsigned long)total.loginsDeferred,
+        MetricsLoopLag(MetricsNanos()) / 1000000.0,
+        HistogramPercentile(h, 50) / 1000.0, HistogramPercentile(h, 99) / 1000.0,
+        HistogramPercentile(h, 99.9) / 1000.0, h->total ? h->max / 1000.0 : 0.0);
+    int c;
+    for(c = 0; c <= UNKNOWN && used < size; c++)
+        used += snprintf(buffer + used, size - used, " %s %lu", c < UNKNOWN ? clientCommandsString[c] : "Unknown", (unsigned long)total.commands[c]);
+    return used < size ? used : size - 1;
+}
+
+/*
+ * Admin socket, a unix socket that answers every connection with the current metrics and closes it,
+ * e.g "socat - UNIX-CONNECT:/tmp/orm.sock". A connection that sends a line right away runs it as a
+ * command instead, which changes limits while the server runs:
+ *      - limit <count>: Maximum amount of connected clients, the ones past it stay connected
+ *      - rates <messages>,<queries>,<requests>: Commands per second a client may send of each class
+ *      - capture <path> or capture off: Starts or stops capturing the client traffic to a trace file
+ * It runs on its own thread, away from the reactors.
+ */
+#define ADMIN_COMMAND_WAIT 100 // Milliseconds a connection has to send a command before it's sent the metrics
+#define ADMIN_COMMAND_MAX  256
+
+int adminSocket = -1;
+
+// Runs an admin command, returns the length of its answer
+size_t AdminCommand(char *command, char *answer, size_t size)
+{
+    command[strcspn(command, "\r\n")] = 0;
+    if(strncmp(command, "limit ", 6) == 0)
+    {
+        char *end;
+        long limit = strtol(command + 6, &end, 10);
+        if(end == command + 6 || *end || limit < 0) return snprintf(answer, size, "Invalid limit\n");
+        __atomic_store_n(&config.maxClients, (unsigned int)limit, __ATOMIC_RELAXED);
+        LogInfo("Connection limit changed to %ld", limit);
+        return snprintf(answer, size, "Connection limit set to %ld, %u clients connected\n", limit, __atomic_load_n(&clientsLen, __ATOMIC_RELAXED));
+    }
+    if(strncmp(command, "rates ", 6) == 0)
+    {
+        unsigned int limits[RATE_CLASSES];
+        if(!ParseRateLimits(command + 6, limits)) return snprintf(answer, size, "Invalid rates\n");
+        int i;
+        for(i = 0; i < RATE_CLASSES; i++) __atomic_store_n(&config.rateLimits[i], limits[i], __ATOMIC_RELAXED);
+        LogInfo("Rate limits changed to %u,%u,%u", limits[0], limits[1], limits[2]);
+        return snprintf(answer, size, "Rate limits set to %u messages, %u queries, %u requests per second\n", limits[0], limits[1], limits[2]);
+    }
+    if(strcmp(command, "capture off") == 0)
+    {
+        CaptureStop();
+        return snprintf(answer, size, "Capture stopped\n");
+    }
+    if(strncmp(command, "capture ", 8) == 0)
+    {
+        if(!CaptureStart(command + 8)) return snprintf(answer, size, "Capture is already running or the file couldn't be opened\n");
+        return snprintf(answer, size, "Capturing to %s\n", command + 8);
+    }
+    if(*command && strcmp(command, "stats") != 0)
+        return snprintf(answer, size, "Unknown command, expected limit <count>, rates <messages>,<queries>,<requests>, capture <path>|off or stats\n");
+    size_t length = MetricsFormat(answer, size, __atomic_load_n(&clientsLen, __ATOMIC_RELAXED));
+    answer[length++] = '\n';
+    return length;
+}
+void* AdminThread(void *arg)
+{
+    char *report = (char*)malloc(DEFAULT_BUFLEN);
+    if(!report) return NULL;
+    while(1)
+    {
+        int connection = accept4(adminSocket, NULL, NULL, SOCK_CLOEXEC);
+        if(connection < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            LogError("Admin socket accept failed: %m");
+            break;
+        }
+        char command[ADMIN_COMMAND_MAX];
+        ssize_t received = 0;
+        struct pollfd waiting = { .fd = connection, .events = POLLIN };
+        if(poll(&waiting, 1, ADMIN_COMMAND_WAIT) > 0) received = recv(connection, command, sizeof(command) - 1, 0);
+        command[received > 0 ? received : 0] = 0;
+        size_t length = AdminCommand(command, report, DEFAULT_BUFLEN);
+        if(send(connection, report, length, MSG_NOSIGNAL) < 0) LogWarn("Failed to send admin report: %m");
+        close(connection);
+    }
+    free(report);
+    return NULL;
+}
+int StartAdminSocket(char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        LogError("Admin socket path is too long");
+        return 0;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path); // Left behind by a previous run
+
+    adminSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(adminSocket < 0 || bind(adminSocket, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(adminSocket, 16) < 0)
+    {
+        LogError("Failed to create admin socket: %m");
+        return 0;
+    }
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, AdminThread, NULL) != 0)
+    {
+        LogError("Failed to start admin thread");
+        return 0;
+    }
+    pthread_detach(thread);
+    LogInfo("Admin socket listening on %s", path);
+    return 1;
+}
+
+#endif // METRICS_H
@@ -0,0 +1,110 @@
+#ifndef ORMCLIENT_H
+#define ORMCLIENT_H
+#include <stddef.h>
+
+/*
+ * Public interface of libormclient, the client side of the chat protocol as a library.
+ *
+ * Sessions are connections to a server, any amount of them is driven by a single context on the
+ * calling thread. Everything is asynchronous: connecting, logging in and every other command only
+ * queue what has to be sent, and OrmRun waits for the sockets of the context and reports whatever
+ * the server sent as events to the callback of the session. The context's descriptor can be
+ * watched alongside other descriptors, e.g stdin, with OrmRun called once it's readable.
+ *
+ * The library keeps track of the state of every session, answers the server's heartbeats and
+ * negotiates the binary protocol unless the session was opened with ORM_TEXT_PROTOCOL.
+ * Sessions opened with ORM_TLS speak TLS, and resume the TLS session of the last one the
+ * context connected to the same server, see OrmContextTls. Long chat messages are compressed
+ * if the server supports it, which is invisible to library users.
+ *
+ * This header is all that library users include, it doesn't pull in any other project header.
+ */
+#define ORM_DEFAULT_PORT 27015
+
+// Flags of OrmConnect
+#define ORM_TEXT_PROTOCOL  1 // Skip protocol negotiation, for servers that only speak the text protocol
+#define ORM_TLS            2 // Connect through TLS, for servers started with a certificate
+#define ORM_NO_COMPRESSION 4 // Don't offer compression, long chat messages are sent and received as they are
+
+// Errors returned by the functions below
+#define ORM_OK              0
+#define ORM_ERROR          -1 // System error, errno tells which one
+#define ORM_INVALID        -2 // Not a command, or an argument that doesn't fit
+#define ORM_NOT_READY      -3 // The session isn't connected yet, or has been closed
+
+// Same values as the states the server keeps for every client
+typedef enum { ORM_LOGGING_IN, ORM_LOGGING_OUT, ORM_IDLE, ORM_CONNECTING, ORM_PENDING_REQUEST, ORM_CHATTING } ormStates;
+
+typedef enum {
+    ORM_EVENT_CONNECTED,      // Connected and the protocol is negotiated, commands can be sent. Text holds the TLS version, e.g "TLSv1.3, resumed"
+    ORM_EVENT_CLOSED,         // The connection is gone, text holds the reason. Last event of the session
+    ORM_EVENT_LOGIN,          // Logged in as username
+    ORM_EVENT_ERROR,          // Error reply, text holds it
+    ORM_EVENT_LOG,            // Informational reply, e.g the user list
+    ORM_EVENT_TALKTO_ERROR,   // A conversation request couldn't be sent, the session is idle again
+    ORM_EVENT_TALKTO,         // Conversation state changed to state, with username if a request was sent or received
+    ORM_EVENT_DISCONNECT,     // The conversation with username has ended
+    ORM_EVENT_MESSAGE,        // Chat message of username in the current conversation
+    ORM_EVENT_ROOM_MESSAGE,   // Message of username to room
+    ORM_EVENT_DIRECT_MESSAGE, // Direct message of username sent at unix time sent
+    ORM_EVENT_PRESENCE        // Presence changes, e.g "+john *jane -joe" for online, busy and offline
+} ormEventTypes;
+
+typedef struct ormEvent {
+    ormEventTypes type;
+    ormStates state;          // State of the session after the event
+    const char *username;     // Empty if the event isn't about a user
+    const char *room;
+    long long sent;
+    const char *text;         // Empty if the event has no text
+} ormEvent;
+
+typedef struct ormContext ormContext;
+typedef struct ormSession ormSession;
+
+// Called for every event of a session, the strings of the event are only valid during the call
+typedef void (*ormCallback)(ormSession *session, ormEvent *event, void *userData);
+
+ormContext* OrmContextCreate();
+// Closes every session that is still open, without any further events
+void OrmContextDestroy(ormContext *context);
+/*
+ * Sets up TLS for the sessions of the context opened with ORM_TLS, trusting the certificates in
+ * the PEM file caFile, or the system's ones if NULL. The server's certificate has to be issued
+ * for the address connected to. Without this, sessions opened with ORM_TLS trust the system's
+ * certificates.
+ */
+int OrmContextTls(ormContext *context, const char *caFile);
+// Descriptor that becomes readable whenever OrmRun has something to do
+int OrmContextFd(ormContext *context);
+/*
+ * Waits up to timeout milliseconds, -1 without limit, for any session of the context, handles
+ * what arrived and calls the callbacks. Returns the number of open sessions, or ORM_ERROR.
+ */
+int OrmRun(ormContext *context, int timeout);
+
+// Starts connecting to the server, ORM_EVENT_CONNECTED or ORM_EVENT_CLOSED tells how it went
+ormSession* OrmConnect(ormContext *context, const char *ip, int port, int flags, ormCallback callback, void *userData);
+// Closes the connection right away, which logs the user out. There are no more events afterwards
+void OrmClose(ormSession *session);
+
+/*
+ * Sends a command line the way a user types it, e.g "Users prefix jo". Logout closes the session,
+ * and TalkTo moves it to ORM_CONNECTING until the request is answered or times out.
+ */
+int OrmCommand(ormSession *session, const char *line);
+int OrmLogin(ormSession *session, const char *username);
+int OrmTalkTo(ormSession *session, const char *username);
+// Answers a conversation request received in ORM_PENDING_REQUEST
+int OrmAnswer(ormSession *session, int accept);
+// Sends a chat message to the current conversation
+int OrmSend(ormSession *session, const char *text);
+
+ormStates OrmState(ormSession *session);
+// Username of the session, empty until it's logged in
+const char* OrmUsername(ormSession *session);
+// User the session is in a conversation with or has a request from or to, empty if none
+const char* OrmPartner(ormSession *session);
+void* OrmUserData(ormSession *session);
+
+#endif // ORMCLIENT_H
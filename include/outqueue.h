@@ -0,0 +1,233 @@
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+#include "map.h"
+#include "config.h"
+#include "metrics.h"
+#include "tls.h"
+#include <sys/uio.h>
+
+/*
+ * Outbound queue of a connection. Replies and relayed chat messages are never written by the
+ * handler producing them, they're appended to the recipient's queue and the recipient is marked
+ * dirty. The reactor owning the client flushes every dirty queue once per event loop iteration
+ * (or once the configured flush deadline passes), so every message produced for a socket during
+ * one iteration goes out in a single writev. Client sockets are non-blocking, whatever a socket
+ * doesn't take stays queued until epoll reports it as writable again.
+ *
+ * Every queue is bounded by two watermarks:
+ *      - Above the high watermark the client counts as a slow consumer. Reading its requests is
+ *        paused, and new messages for it are handled by the configured policy: they're either
+ *        dropped or the client is disconnected.
+ *      - Reading is resumed once the queue drains below the low watermark.
+ *
+ * A queued message has the same layout as a message posted to another reactor's mailbox, so
+ * posted messages are moved into the queue as they are.
+ */
+#define QUEUE_FLUSH_PARTS 64          // Messages written with a single system call while flushing
+#define QUEUE_BATCH_BYTES (64 * 1024)  // Queue size at which a dirty client is flushed without waiting for the iteration to end
+
+typedef struct outMessage {
+    struct outMessage *next;
+    clientData *client;      // Recipient, only referenced while the message sits in a mailbox
+    struct room *room;       // Set instead of the recipient for room messages posted to a mailbox, see room.h
+    char *payload;           // Sent after the message, it points into payloadBuffer
+    size_t payloadLength;
+    char *payloadBuffer;     // Pooled buffer referenced until the message is written
+    size_t sent;             // Bytes of the message and payload already written
+    void (*task)(clientData *client, char *data, size_t length); // Run by the reactor owning the client instead of sending the message
+    size_t length;
+    char message[];
+} outMessage;
+
+// Builds a message that copies the first part and references the payload's pooled buffer
+outMessage* OutMessageCreate(clientData *client, char *message, size_t length, char *payload, size_t payloadLength, char *payloadBuffer)
+{
+    outMessage *out = (outMessage*)BufferAlloc(sizeof(outMessage) + length);
+    if(!out)
+    {
+        LogError("Failed to queue message: %m");
+        return NULL;
+    }
+    out->next = NULL;
+    out->client = client;
+    out->room = NULL;
+    out->task = NULL;
+    out->length = length;
+    out->sent = 0;
+    if(length) memcpy(out->message, message, length);
+    out->payload = payload;
+    out->payloadLength = payloadLength;
+    out->payloadBuffer = payloadBuffer;
+    if(out->payloadBuffer) BufferRef(payloadBuffer);
+    return out;
+}
+void OutMessageFree(outMessage *out)
+{
+    BufferRelease(out->payloadBuffer);
+    BufferRelease((char*)out);
+}
+size_t OutMessageRemaining(outMessage *out)
+{
+    return out->length + out->payloadLength - out->sent;
+}
+// Describes the unsent part of the message, returns the amount of parts used
+int OutMessageParts(outMessage *out, struct iovec *parts)
+{
+    int count = 0;
+    if(out->sent < out->length)
+    {
+        parts[count].iov_base = out->message + out->sent;
+        parts[count++].iov_len = out->length - out->sent;
+    }
+    if(out->payloadLength)
+    {
+        size_t payloadSent = out->sent > out->length ? out->sent - out->length : 0;
+        parts[count].iov_base = out->payload + payloadSent;
+        parts[count++].iov_len = out->payloadLength - payloadSent;
+    }
+    return count;
+}
+
+/*
+ * Writes as much of the parts as the socket takes without blocking, flags are passed on to sendmsg.
+ * Returns the amount of bytes written, or -1 if the connection has failed.
+ */
+ssize_t TryWrite(int socket, struct iovec *parts, int count, int flags)
+{
+    struct msghdr msg = { .msg_iov = parts, .msg_iovlen = count };
+    while(1)
+    {
+        // MSG_NOSIGNAL prevents the whole server from being killed by SIGPIPE when the peer is already gone
+        ssize_t written = sendmsg(socket, &msg, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(written >= 0) return written;
+        if(errno == EINTR) continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+}
+
+/*
+ * Writes to the client's connection, through TLS unless it's plaintext or the kernel encrypts it.
+ * Nothing is written before the handshake is done.
+ */
+ssize_t ClientWrite(clientData *client, struct iovec *parts, int count, int flags)
+{
+    if(!client->tls || client->tlsKernel) return TryWrite(client->clientSocket, parts, count, flags);
+    if(client->tlsHandshake) return 0;
+    return TlsWrite(client, parts, count);
+}
+
+/*
+ * Fails the client's connection from wherever a write went wrong. The client can't be freed here,
+ * the event loop may still be holding a reference to it. Shutting the socket down makes the event
+ * loop report it as closed, and reading is resumed so the disconnect is noticed even from a slow consumer.
+ */
+void QueueAbort(clientData *client)
+{
+    client->readPaused = 0;
+    shutdown(client->clientSocket, SHUT_RDWR);
+}
+
+void QueueUpdateDepth(clientData *client, long change)
+{
+    client->outBytes += change;
+    METRIC_ADD(queuedBytes, change);
+    METRIC_MAX(peakQueue, client->outBytes);
+}
+/*
+ * Appends a message to the client's queue, taking ownership of it. Returns 0 if the message
+ * was refused because the client is a slow consumer, in which case it has already been freed.
+ */
+int QueueAppend(clientData *client, outMessage *out)
+{
+    if(client->outBytes >= config.queueHigh)
+    {
+        OutMessageFree(out);
+        if(config.slowConsumerPolicy == SLOW_CONSUMER_DISCONNECT)
+        {
+            METRIC_ADD(slowDisconnected, 1);
+            LogWarn("Disconnecting slow consumer %lu with %zu queued bytes", client->id, client->outBytes);
+            QueueAbort(client);
+        }
+        else
+        {
+            METRIC_ADD(dropped, 1);
+        }
+        return 0;
+    }
+    out->client = NULL; // Queued messages don't keep their recipient referenced, the client owns them
+    out->next = NULL;
+    if(client->outTail) client->outTail->next = out;
+    else client->outHead = out;
+    client->outTail = out;
+    QueueUpdateDepth(client, OutMessageRemaining(out));
+
+    if(!client->readPaused && client->outBytes > config.queueHigh)
+    {
+        client->readPaused = 1;
+        METRIC_ADD(paused, 1);
+    }
+    return 1;
+}
+// Takes what was written off the front of the queue, freeing every message that went out completely
+void QueueConsume(clientData *client, size_t written)
+{
+    QueueUpdateDepth(client, -(long)written);
+    METRIC_ADD(bytesOut, written);
+    // Free every message that was written completely and advance the first one that wasn't
+    while(client->outHead && written > 0)
+    {
+        outMessage *out = client->outHead;
+        size_t remaining = OutMessageRemaining(out);
+        if(written < remaining)
+        {
+            out->sent += written;
+            break;
+        }
+        written -= remaining;
+        client->outHead = out->next;
+        if(!client->outHead) client->outTail = NULL;
+        OutMessageFree(out);
+        METRIC_ADD(messagesOut, 1);
+    }
+}
+/*
+ * Writes as much of the queue as the socket takes, QUEUE_FLUSH_PARTS messages per system call.
+ * When corking is enabled every write but the last one of the flush is marked with MSG_MORE,
+ * so the kernel doesn't push out a small trailing segment before the rest follows.
+ * Returns 1 once the queue is empty, 0 if the socket is full and -1 if the connection has failed.
+ * A queue with an io_uring send in flight is left alone, see reactor.h.
+ */
+int QueueFlush(clientData *client)
+{
+    if(client->ringSending) return 0;
+    while(client->outHead)
+    {
+        struct iovec parts[QUEUE_FLUSH_PARTS * 2];
+        int count = 0;
+        outMessage *out = client->outHead;
+        int messages;
+        for(messages = 0; out && messages < QUEUE_FLUSH_PARTS; messages++, out = out->next)
+            count += OutMessageParts(out, parts + count);
+
+        ssize_t written = ClientWrite(client, parts, count, (config.cork && out) ? MSG_MORE : 0);
+        if(written < 0) return -1;
+        if(written == 0) return 0;
+        QueueConsume(client, (size_t)written);
+    }
+    return 1;
+}
+// Frees every queued message, used once the client's connection is closed
+void QueueClear(clientData *client)
+{
+    while(client->outHead)
+    {
+        outMessage *out = client->outHead;
+        client->outHead = out->next;
+        OutMessageFree(out);
+    }
+    client->outTail = NULL;
+    QueueUpdateDepth(client, -(long)client->outBytes);
+}
+
+#endif // OUTQUEUE_H
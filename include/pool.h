@@ -0,0 +1,239 @@
+#ifndef POOL_H
+#define POOL_H
+#include "shared.h"
+#include "protocol.h"
+#include <stddef.h>
+
+/*
+ * Allocators for the objects and buffers every connection needs, so that connecting,
+ * disconnecting and passing messages around doesn't go through malloc and free.
+ *
+ * Object pool: Objects of a single size carved out of larger slabs. Freed objects are
+ * kept on a free list and handed out again, the slabs are only released on shutdown.
+ *
+ * Buffer pool: Buffers in two size classes, a small one that fits typical chat messages
+ * and partial frames, and a large one that fits the biggest possible frame. Every thread
+ * keeps a small cache of free buffers per class and only takes the shared lock when its
+ * cache runs empty or overflows, as buffers are allocated on one reactor and often freed on another.
+ * Buffers are reference counted, so a received message can be shared by every message
+ * relaying it and is only recycled once the last of them has been sent.
+ */
+#define SLAB_OBJECTS 256
+
+typedef struct poolSlab {
+    struct poolSlab *next;
+    char objects[];
+} poolSlab;
+
+typedef struct objectPool {
+    size_t objectSize;
+    void *freeList;        // The first bytes of a free object point to the next one
+    poolSlab *slabs;
+    size_t allocated;      // Objects currently handed out
+    pthread_mutex_t lock;
+} objectPool;
+
+void ObjectPoolInit(objectPool *pool, size_t objectSize)
+{
+    pool->objectSize = objectSize < sizeof(void*) ? sizeof(void*) : objectSize;
+    pool->freeList = NULL;
+    pool->slabs = NULL;
+    pool->allocated = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+}
+void ObjectPoolDestroy(objectPool *pool)
+{
+    while(pool->slabs)
+    {
+        poolSlab *next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->freeList = NULL;
+    pthread_mutex_destroy(&pool->lock);
+}
+void* ObjectPoolAlloc(objectPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    if(!pool->freeList)
+    {
+        // Carve a new slab into objects and chain them all onto the free list
+        poolSlab *slab = (poolSlab*)malloc(sizeof(poolSlab) + pool->objectSize * SLAB_OBJECTS);
+        if(!slab)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        int i;
+        for(i = SLAB_OBJECTS - 1; i >= 0; i--)
+        {
+            void *object = slab->objects + i * pool->objectSize;
+            *(void**)object = pool->freeList;
+            pool->freeList = object;
+        }
+    }
+    void *object = pool->freeList;
+    pool->freeList = *(void**)object;
+    pool->allocated++;
+    pthread_mutex_unlock(&pool->lock);
+    return object;
+}
+void ObjectPoolFree(objectPool *pool, void *object)
+{
+    if(!object) return;
+    pthread_mutex_lock(&pool->lock);
+    *(void**)object = pool->freeList;
+    pool->freeList = object;
+    pool->allocated--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#define BUFFER_SMALL_SIZE  512
+#define BUFFER_LARGE_SIZE  (FRAME_MAX_SIZE + 1)
+#define BUFFER_CLASSES     2
+#define BUFFER_CACHE_SIZE  64  // Free buffers kept by a single thread per class
+
+typedef struct poolBuffer {
+    struct poolBuffer *next;   // Only used while the buffer is free
+    int sizeClass;
+    int refCount;
+    char data[];
+} poolBuffer;
+
+typedef struct bufferClass {
+    size_t size;
+    poolBuffer *freeList;
+    size_t freeCount;
+    pthread_mutex_t lock;
+} bufferClass;
+
+bufferClass bufferClasses[BUFFER_CLASSES] = {
+    { .size = BUFFER_SMALL_SIZE, .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .size = BUFFER_LARGE_SIZE, .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+// Maximum amount of free large buffers kept around, the rest is given back to the system
+#define BUFFER_LARGE_KEEP 256
+
+__thread poolBuffer *bufferCache[BUFFER_CLASSES];
+__thread int bufferCacheCount[BUFFER_CLASSES];
+
+// Returns the usable size of the buffer class that fits size bytes, or 0 if none does
+size_t BufferClassSize(size_t size)
+{
+    int c;
+    for(c = 0; c < BUFFER_CLASSES; c++)
+        if(size <= bufferClasses[c].size) return bufferClasses[c].size;
+    return 0;
+}
+poolBuffer* BufferFromData(char *data)
+{
+    return (poolBuffer*)(data - offsetof(poolBuffer, data));
+}
+// Allocates a buffer that holds at least size bytes and returns a pointer to its data
+char* BufferAlloc(size_t size)
+{
+    int c;
+    for(c = 0; c < BUFFER_CLASSES && size > bufferClasses[c].size; c++);
+    if(c == BUFFER_CLASSES) return NULL;
+
+    poolBuffer *buffer = bufferCache[c];
+    if(buffer)
+    {
+        bufferCache[c] = buffer->next;
+        bufferCacheCount[c]--;
+        buffer->refCount = 1;
+        return buffer->data;
+    }
+    bufferClass *sizeClass = &bufferClasses[c];
+    pthread_mutex_lock(&sizeClass->lock);
+    buffer = sizeClass->freeList;
+    if(buffer)
+    {
+        sizeClass->freeList = buffer->next;
+        sizeClass->freeCount--;
+    }
+    pthread_mutex_unlock(&sizeClass->lock);
+
+    if(!buffer)
+    {
+        buffer = (poolBuffer*)malloc(sizeof(poolBuffer) + sizeClass->size);
+        if(!buffer) return NULL;
+        buffer->sizeClass = c;
+    }
+    buffer->refCount = 1;
+    return buffer->data;
+}
+void BufferRef(char *data)
+{
+    __atomic_add_fetch(&BufferFromData(data)->refCount, 1, __ATOMIC_RELAXED);
+}
+// Checks whether anyone besides the caller holds a reference to the buffer
+int BufferShared(char *data)
+{
+    return __atomic_load_n(&BufferFromData(data)->refCount, __ATOMIC_ACQUIRE) > 1;
+}
+// Drops a reference to the buffer, the last one gives it back to the pool
+void BufferRelease(char *data)
+{
+    if(!data) return;
+    poolBuffer *buffer = BufferFromData(data);
+    if(__atomic_sub_fetch(&buffer->refCount, 1, __ATOMIC_ACQ_REL) != 0) return;
+    int c = buffer->sizeClass;
+    if(bufferCacheCount[c] < BUFFER_CACHE_SIZE)
+    {
+        buffer->next = bufferCache[c];
+        bufferCache[c] = buffer;
+        bufferCacheCount[c]++;
+        return;
+    }
+    bufferClass *sizeClass = &bufferClasses[c];
+    pthread_mutex_lock(&sizeClass->lock);
+    if(c == BUFFER_CLASSES - 1 && sizeClass->freeCount >= BUFFER_LARGE_KEEP)
+    {
+        pthread_mutex_unlock(&sizeClass->lock);
+        free(buffer);
+        return;
+    }
+    buffer->next = sizeClass->freeList;
+    sizeClass->freeList = buffer;
+    sizeClass->freeCount++;
+    pthread_mutex_unlock(&sizeClass->lock);
+}
+// Gives the buffers cached by the calling thread back to the shared free lists, called before a thread exits
+void BufferCacheFlush()
+{
+    int c;
+    for(c = 0; c < BUFFER_CLASSES; c++)
+    {
+        while(bufferCache[c])
+        {
+            poolBuffer *buffer = bufferCache[c];
+            bufferCache[c] = buffer->next;
+            pthread_mutex_lock(&bufferClasses[c].lock);
+            buffer->next = bufferClasses[c].freeList;
+            bufferClasses[c].freeList = buffer;
+            bufferClasses[c].freeCount++;
+            pthread_mutex_unlock(&bufferClasses[c].lock);
+        }
+        bufferCacheCount[c] = 0;
+    }
+}
+void BufferPoolDestroy()
+{
+    BufferCacheFlush();
+    int c;
+    for(c = 0; c < BUFFER_CLASSES; c++)
+    {
+        while(bufferClasses[c].freeList)
+        {
+            poolBuffer *next = bufferClasses[c].freeList->next;
+            free(bufferClasses[c].freeList);
+            bufferClasses[c].freeList = next;
+        }
+        bufferClasses[c].freeCount = 0;
+    }
+}
+
+#endif // POOL_H
@@ -0,0 +1,261 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+#include "room.h"
+#include "config.h"
+#include "metrics.h"
+
+/*
+ * Presence subscriptions. Instead of polling Users, a client can subscribe with the Presence command
+ * and gets pushed the users that logged in, logged out, started or ended a conversation.
+ *
+ * Changes are collected for a short window (-P) that starts with the first one, and every user
+ * appears at most once per window with its latest status. A user whose status ends the window
+ * where it started, e.g. one that logged in and out again, doesn't appear at all. The presence
+ * thread then serializes the changes once and hands them out like a room message, subscribers
+ * being the members of a room that isn't listed in the room index. Nothing is collected while
+ * there are no subscribers, so the work done is proportional to the changes, not the users.
+ *
+ * The subscriber lists follow the rules of room member lists, see room.h.
+ */
+#define PRESENCE_PENDING_INITIAL 64
+#define PRESENCE_BATCH_MAX       ROOM_MESSAGE_MAX // Bytes of changes sent at most in a single message
+
+typedef enum { PRESENCE_OFFLINE = 0, PRESENCE_ONLINE, PRESENCE_BUSY } presenceStatus;
+
+// Marks the changes in the text protocol, e.g "PRESENCE:+john *jane -joe"
+char presenceMarks[3] = { '-', '+', '*' };
+
+typedef struct presenceChange {
+    char username[USERNAME_MAX];
+    uint32_t hash;
+    presenceStatus before;  // Status subscribers saw last
+    presenceStatus after;
+} presenceChange;
+
+// Defined by the server, hands a message to every reactor with members in the room
+void RoomBroadcast(room *r, roomBroadcast *b);
+
+room *presenceRoom;                 // Subscribers, never in the room index
+unsigned int presenceSubscribers = 0;
+presenceChange *presencePending;    // Changes of the current window in the order they happened
+unsigned int presencePendingLen = 0;
+unsigned int presencePendingCapacity = 0;
+int *presenceSlots;                 // Open-addressing index into presencePending, -1 is free
+unsigned int presenceSlotCount = 0;
+pthread_mutex_t presenceLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t presenceChanged = PTHREAD_COND_INITIALIZER;
+int presenceRunning = 0;
+pthread_t presenceThread;
+
+// presenceLock must be held
+int PresenceGrow()
+{
+    unsigned int capacity = presencePendingCapacity * 2;
+    presenceChange *pending = (presenceChange*)realloc(presencePending, capacity * sizeof(presenceChange));
+    if(!pending) return 0;
+    presencePending = pending;
+    int *slots = (int*)malloc(capacity * 2 * sizeof(int));
+    if(!slots) return 0;
+    free(presenceSlots);
+    presenceSlots = slots;
+    presencePendingCapacity = capacity;
+    presenceSlotCount = capacity * 2;
+    memset(presenceSlots, -1, presenceSlotCount * sizeof(int));
+    unsigned int i;
+    for(i = 0; i < presencePendingLen; i++)
+    {
+        unsigned int slot = presencePending[i].hash & (presenceSlotCount - 1);
+        while(presenceSlots[slot] >= 0) slot = (slot + 1) & (presenceSlotCount - 1);
+        presenceSlots[slot] = (int)i;
+    }
+    return 1;
+}
+
+// Records a status change of a user, called with conversationLock held so changes arrive in order
+void PresencePublish(char *username, uint32_t hash, presenceStatus before, presenceStatus after)
+{
+    if(__atomic_load_n(&presenceSubscribers, __ATOMIC_RELAXED) == 0 || before == after) return;
+    pthread_mutex_lock(&presenceLock);
+    unsigned int slot = hash & (presenceSlotCount - 1);
+    while(presenceSlots[slot] >= 0)
+    {
+        presenceChange *change = &presencePending[presenceSlots[slot]];
+        if(change->hash == hash && strcmp(change->username, username) == 0)
+        {
+            change->after = after; // Coalesced with the earlier change in this window
+            pthread_mutex_unlock(&presenceLock);
+            return;
+        }
+        slot = (slot + 1) & (presenceSlotCount - 1);
+    }
+    if(presencePendingLen == presencePendingCapacity)
+    {
+        if(!PresenceGrow())
+        {
+            pthread_mutex_unlock(&presenceLock);
+            LogError("Failed to record presence change");
+            return;
+        }
+        slot = hash & (presenceSlotCount - 1);
+        while(presenceSlots[slot] >= 0) slot = (slot + 1) & (presenceSlotCount - 1);
+    }
+    presenceChange *change = &presencePending[presencePendingLen];
+    strncpy(change->username, username, USERNAME_MAX - 1);
+    change->username[USERNAME_MAX - 1] = 0;
+    change->hash = hash;
+    change->before = before;
+    change->after = after;
+    presenceSlots[slot] = (int)presencePendingLen++;
+    if(presencePendingLen == 1) pthread_cond_signal(&presenceChanged); // Opens the window
+    pthread_mutex_unlock(&presenceLock);
+}
+
+/*
+ * Adds the client to the subscribers, from the thread of the reactor owning it. The slot of a
+ * subscriber is kept in presenceSlot, -1 if it isn't subscribed.
+ */
+int PresenceSubscribe(clientData *client, int reactorId)
+{
+    roomMembers *list = &presenceRoom->members[reactorId];
+    if(client->presenceSlot >= 0) return 1;
+    if(list->len == list->capacity)
+    {
+        unsigned int capacity = list->capacity ? list->capacity * 2 : 16;
+        clientData **clients = (clientData**)realloc(list->clients, capacity * sizeof(clientData*));
+        if(!clients) return 0;
+        list->clients = clients;
+        list->capacity = capacity;
+    }
+    list->clients[list->len] = client;
+    client->presenceSlot = (int)list->len;
+    __atomic_store_n(&list->len, list->len + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&presenceSubscribers, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+void PresenceUnsubscribe(clientData *client, int reactorId)
+{
+    roomMembers *list = &presenceRoom->members[reactorId];
+    if(client->presenceSlot < 0) return;
+    clientData *last = list->clients[list->len - 1];
+    list->clients[client->presenceSlot] = last;
+    last->presenceSlot = client->presenceSlot;
+    client->presenceSlot = -1;
+    __atomic_store_n(&list->len, list->len - 1, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&presenceSubscribers, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Serializes changes in both encodings, starting at the given one. Returns NULL if no buffer is
+ * available, sets the position of the first change that didn't fit otherwise.
+ */
+roomBroadcast* BuildPresenceMessage(presenceChange *changes, unsigned int count, unsigned int *next)
+{
+    roomBroadcast *b = (roomBroadcast*)BufferAlloc(sizeof(roomBroadcast) + FRAME_HEADER_SIZE + 2 * PRESENCE_BATCH_MAX + 16);
+    if(!b)
+    {
+        LogError("Failed to allocate presence message: %m");
+        return NULL;
+    }
+    // Binary: status and username length as single bytes, followed by the username, for every change
+    char *start = b->data;
+    char *p = start + FRAME_HEADER_SIZE;
+    unsigned int i;
+    for(i = *next; i < count; i++)
+    {
+        size_t usernameLength = strnlen(changes[i].username, USERNAME_MAX - 1);
+        if((size_t)(p - start) + 2 + usernameLength > FRAME_HEADER_SIZE + PRESENCE_BATCH_MAX) break;
+        *p++ = (char)changes[i].after;
+        *p++ = (char)usernameLength;
+        memcpy(p, changes[i].username, usernameLength);
+        p += usernameLength;
+    }
+    WriteFrameHeader(start, (uint32_t)(p - start - FRAME_HEADER_SIZE), REPLY_PRESENCE, 0);
+    b->frameLength = p - start;
+
+    // Text: every username prefixed with its mark, separated by spaces
+    b->textLength = sprintf(p, "PRESENCE:");
+    unsigned int j;
+    for(j = *next; j < i; j++)
+        b->textLength += sprintf(p + b->textLength, "%s%c%s", j > *next ? " " : "", presenceMarks[changes[j].after], changes[j].username);
+    *next = i;
+    return b;
+}
+
+void* PresenceThread(void *arg)
+{
+    MetricsAttach(metricsReactors + 1); // Second background block
+    struct timespec window = { .tv_sec = config.presenceWindow / 1000, .tv_nsec = (config.presenceWindow % 1000) * 1000000L };
+    presenceChange *changes = NULL;
+    unsigned int capacity = 0;
+    while(1)
+    {
+        pthread_mutex_lock(&presenceLock);
+        while(presenceRunning && presencePendingLen == 0) pthread_cond_wait(&presenceChanged, &presenceLock);
+        pthread_mutex_unlock(&presenceLock);
+        if(!__atomic_load_n(&presenceRunning, __ATOMIC_ACQUIRE)) break;
+        if(config.presenceWindow) nanosleep(&window, NULL);
+
+        // Takes the changes of the window, the ones that ended where they started are left out
+        pthread_mutex_lock(&presenceLock);
+        unsigned int count = 0, i;
+        if(capacity < presencePendingLen)
+        {
+            presenceChange *grown = (presenceChange*)realloc(changes, presencePendingCapacity * sizeof(presenceChange));
+            if(grown)
+            {
+                changes = grown;
+                capacity = presencePendingCapacity;
+            }
+        }
+        for(i = 0; i < presencePendingLen && count < capacity; i++)
+            if(presencePending[i].before != presencePending[i].after) changes[count++] = presencePending[i];
+        presencePendingLen = 0;
+        memset(presenceSlots, -1, presenceSlotCount * sizeof(int));
+        pthread_mutex_unlock(&presenceLock);
+
+        unsigned int next = 0;
+        while(next < count)
+        {
+            roomBroadcast *b = BuildPresenceMessage(changes, count, &next);
+            if(!b) break;
+            RoomBroadcast(presenceRoom, b);
+            BufferRelease((char*)b);
+        }
+    }
+    free(changes);
+    BufferCacheFlush();
+    return NULL;
+}
+
+int PresenceInit()
+{
+    presenceRoom = RoomCreate("", 0);
+    presencePending = (presenceChange*)malloc(PRESENCE_PENDING_INITIAL * sizeof(presenceChange));
+    presenceSlots = (int*)malloc(PRESENCE_PENDING_INITIAL * 2 * sizeof(int));
+    if(!presenceRoom || !presencePending || !presenceSlots) return 0;
+    presencePendingCapacity = PRESENCE_PENDING_INITIAL;
+    presenceSlotCount = PRESENCE_PENDING_INITIAL * 2;
+    memset(presenceSlots, -1, presenceSlotCount * sizeof(int));
+
+    presenceRunning = 1;
+    if(pthread_create(&presenceThread, NULL, PresenceThread, NULL) != 0)
+    {
+        LogError("Failed to start presence thread");
+        presenceRunning = 0;
+        return 0;
+    }
+    return 1;
+}
+void PresenceDestroy()
+{
+    pthread_mutex_lock(&presenceLock);
+    __atomic_store_n(&presenceRunning, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&presenceChanged);
+    pthread_mutex_unlock(&presenceLock);
+    pthread_join(presenceThread, NULL);
+    RoomRelease(presenceRoom);
+    free(presencePending);
+    free(presenceSlots);
+}
+
+#endif // PRESENCE_H
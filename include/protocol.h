@@ -0,0 +1,138 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+#include "shared.h"
+#include <stdint.h>
+
+/*
+ * Binary wire protocol shared by the server and the client.
+ *
+ * Every message is a frame made out of a fixed 8 byte header followed by the payload:
+ *      - Length: Payload length, 32 bit big endian
+ *      - Opcode: A clientCommands value for requests, a serverReplies value for replies
+ *      - Flags: Per-frame options, see FRAME_FLAG_*
+ *      - Reserved: Two bytes that must be zero
+ *
+ * The client starts the conversation with a HELLO frame carrying the protocol magic,
+ * its highest supported version and the optional features it supports, and the server
+ * answers with the version it picked and the features both sides are going to use.
+ * A server without binary support answers with a text error instead, in which case the
+ * client falls back to the text protocol where every recv() is a single message.
+ * Text messages never start with a zero byte while a frame always does, since the payload
+ * length can't go over DEFAULT_BUFLEN, which is how the server tells the two apart.
+ */
+#define FRAME_HEADER_SIZE 8
+#define FRAME_MAX_PAYLOAD DEFAULT_BUFLEN
+#define FRAME_MAX_SIZE    (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD)
+
+#define PROTOCOL_MAGIC      "ORMB"
+#define PROTOCOL_MAGIC_LEN  4
+#define PROTOCOL_VERSION    1
+#define OPCODE_HELLO        0x7F
+
+/*
+ * Optional features, announced in the HELLO. A HELLO without the features byte, e.g from a
+ * peer that predates them, announces none.
+ *      - DEFLATE: Data messages and the chat messages relaying them may be compressed, see compress.h
+ */
+#define PROTOCOL_FEATURE_DEFLATE 0x01
+#define PROTOCOL_FEATURES        PROTOCOL_FEATURE_DEFLATE // Everything this build supports
+
+/*
+ * Frame flags:
+ *      - COMPRESSED: The text of a Data or REPLY_MESSAGE frame is compressed, the username in
+ *        front of the text of REPLY_MESSAGE isn't. Only sent to peers that negotiated DEFLATE.
+ */
+#define FRAME_FLAG_COMPRESSED 0x01
+
+typedef enum { PROTOCOL_UNKNOWN = 0, PROTOCOL_TEXT, PROTOCOL_BINARY } protocolModes;
+
+/*
+ * Replies sent by the server. Their payloads are:
+ *      - REPLY_LOGIN, REPLY_TALKTO, REPLY_DISCONNECT: New state as a single byte,
+ *        optionally followed by a username
+ *      - REPLY_MESSAGE: Username length as a single byte, the username and the message
+ *      - REPLY_ROOM_MESSAGE: Room name length as a single byte and the room name,
+ *        followed by the same payload as REPLY_MESSAGE
+ *      - REPLY_DIRECT_MESSAGE: Unix time the message was sent at, 64 bit big endian,
+ *        followed by the same payload as REPLY_MESSAGE
+ *      - REPLY_PRESENCE: For every user whose status changed, the new status and the
+ *        username length as single bytes, followed by the username
+ *      - REPLY_PING: Empty, a heartbeat the client has to answer with a Ping
+ *      - Everything else: Human readable text
+ */
+typedef enum { REPLY_LOGIN = 0x40, REPLY_ERROR, REPLY_LOG, REPLY_TALKTO_ERROR, REPLY_TALKTO, REPLY_MESSAGE, REPLY_DISCONNECT, REPLY_ROOM_MESSAGE, REPLY_DIRECT_MESSAGE, REPLY_PRESENCE, REPLY_PING, REPLY_LAST } serverReplies;
+
+// Prefixes used to render the replies in the text protocol
+char *replyPrefixString[REPLY_LAST - REPLY_LOGIN] = { "", "ERROR: ", "LOG: ", "TalkTo: ", "TALKTO: ", "MESSAGE:", "DISCONNECT: ", "ROOM:", "DIRECT:", "PRESENCE:", "PING:" };
+
+typedef struct frame {
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t length;
+    char *payload;  // Points into the buffer the frame was parsed from
+} frame;
+
+void WriteFrameHeader(char *buffer, uint32_t length, uint8_t opcode, uint8_t flags)
+{
+    buffer[0] = (char)(length >> 24);
+    buffer[1] = (char)(length >> 16);
+    buffer[2] = (char)(length >> 8);
+    buffer[3] = (char)length;
+    buffer[4] = (char)opcode;
+    buffer[5] = (char)flags;
+    buffer[6] = 0;
+    buffer[7] = 0;
+}
+
+/*
+ * Incremental frame decoder, parses a single frame from the start of the buffer.
+ * Returns the size of the frame, 0 if more bytes are needed to complete it,
+ * or -1 if the data can't be a valid frame.
+ */
+int ParseFrame(char *buffer, size_t length, frame *out)
+{
+    if(length < FRAME_HEADER_SIZE) return 0;
+
+    unsigned char *header = (unsigned char*)buffer;
+    uint32_t payloadLength = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+    if(payloadLength > FRAME_MAX_PAYLOAD || header[6] != 0 || header[7] != 0) return -1;
+    if(length < FRAME_HEADER_SIZE + payloadLength) return 0;
+
+    out->length = payloadLength;
+    out->opcode = header[4];
+    out->flags = header[5];
+    out->payload = buffer + FRAME_HEADER_SIZE;
+    return (int)(FRAME_HEADER_SIZE + payloadLength);
+}
+
+// Builds a complete frame into the buffer, which must hold at least FRAME_HEADER_SIZE + length bytes
+size_t BuildFrame(char *buffer, uint8_t opcode, char *payload, size_t length)
+{
+    WriteFrameHeader(buffer, (uint32_t)length, opcode, 0);
+    if(length) memcpy(buffer + FRAME_HEADER_SIZE, payload, length);
+    return FRAME_HEADER_SIZE + length;
+}
+
+// The HELLO payload is the magic followed by a version byte and a features byte, in both directions
+size_t BuildHello(char *buffer, uint8_t version, uint8_t features)
+{
+    char payload[PROTOCOL_MAGIC_LEN + 2];
+    memcpy(payload, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LEN);
+    payload[PROTOCOL_MAGIC_LEN] = (char)version;
+    payload[PROTOCOL_MAGIC_LEN + 1] = (char)features;
+    return BuildFrame(buffer, OPCODE_HELLO, payload, sizeof(payload));
+}
+// Returns the version announced by a HELLO frame, or 0 if the frame isn't one
+int ParseHello(frame *f)
+{
+    if(f->opcode != OPCODE_HELLO || f->length < PROTOCOL_MAGIC_LEN + 1) return 0;
+    if(memcmp(f->payload, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LEN) != 0) return 0;
+    return (unsigned char)f->payload[PROTOCOL_MAGIC_LEN];
+}
+// Returns the features announced by a HELLO frame that ParseHello accepted
+int ParseHelloFeatures(frame *f)
+{
+    return f->length > PROTOCOL_MAGIC_LEN + 1 ? (unsigned char)f->payload[PROTOCOL_MAGIC_LEN + 1] : 0;
+}
+
+#endif // PROTOCOL_H
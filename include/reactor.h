@@ -0,0 +1,1171 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+#include "server.h"
+#include "config.h"
+#include "uring.h"
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+/*
+ * Event loops that drive every connection of the server. Each reactor runs on its
+ * own thread with its own SO_REUSEPORT listener, so the kernel spreads new
+ * connections across them and a client stays on the reactor that accepted it.
+ *
+ * The listener and all client sockets are registered with epoll in edge-triggered
+ * mode: a socket is only reported again once new data arrives, so every callback
+ * has to drain its socket until the call would block.
+ *
+ * Clients don't own a thread or any buffers, messages are received into the
+ * reactor's pooled buffer and fully handled before the next read. Only when a
+ * frame is split across reads is the incomplete part copied into a pooled
+ * buffer of the client, a small one at first and a large one once the frame
+ * outgrows it. When a handler keeps a reference to the buffer, e.g. to relay a
+ * chat message to another reactor, the reactor reads into a fresh one instead.
+ *
+ * A reactor only writes to the sockets of its own clients. Messages meant for a
+ * client of another reactor are pushed to that reactor's mailbox, a lock-free
+ * multi-producer queue, and the reactor is woken up through its eventfd.
+ * Client sockets are non-blocking in both directions, whatever a socket doesn't
+ * take is kept in the client's outbound queue until epoll reports it writable.
+ *
+ * Writes are batched per event loop iteration: handlers and posted messages only
+ * queue, and the clients that got something are linked into the reactor's dirty
+ * list. The list is flushed once all events of the iteration were handled, or
+ * after the configured flush deadline, so a burst costs one writev per client.
+ *
+ * Login deadlines, conversation requests and idle clients are timed out by the
+ * reactor's timing wheel, see timer.h. The event loop never waits past the next
+ * slot of the wheel that holds timers.
+ *
+ * With the io_uring backend (-b io_uring) a reactor runs on a ring instead, see
+ * uring.h, and the system calls mostly go away:
+ *      - A multishot accept keeps accepting on the listener, and a multishot poll
+ *        reports the eventfd, each with a single request.
+ *      - Every plaintext client has a multishot receive in flight that picks a
+ *        buffer from the ring's provided buffers whenever data arrives. A chat
+ *        message is relayed straight from that buffer like from the read buffer,
+ *        which is only swapped for a new one if it's still referenced. Receiving
+ *        from a slow consumer is cancelled until its queue drains.
+ *      - The sends of a flush are handed to the kernel together, a single
+ *        io_uring_enter for every dirty client. They're issued with MSG_DONTWAIT,
+ *        so the kernel runs each one while the call is in progress and completes
+ *        it right away, with whatever the socket took. Nothing refers to the
+ *        queue once the call returns, and a socket that was full is waited for
+ *        with a poll request before the rest is sent.
+ *      - TLS clients are driven through a multishot poll of their socket, which
+ *        reports the same readiness as epoll does, and go through the same
+ *        handlers.
+ * Every request in flight for a client holds a reference to it, and disconnecting
+ * cancels them before the socket is closed. A kernel without the needed io_uring
+ * support leaves the reactor on epoll.
+ *
+ * The reactors can be parked, see PauseReactors, which the hand over to a restarted
+ * server relies on, see handoff.h. A parked reactor sits on a condition variable
+ * after its last iteration, so whoever paused them has its clients to itself. A
+ * reactor on io_uring first cancels every request and waits for their completions,
+ * since nothing but its own thread may submit to the ring, and arms them again once
+ * it's resumed.
+ */
+#define MAX_EVENTS 256
+#define RING_SENDS 64                 // Sends prepared before they're handed to the kernel
+#define RING_ACCEPT_RETRY_MS 100      // Delay before accepting again after running out of descriptors or memory
+
+// Kinds of io_uring requests, kept in the low bits of their user data next to the client or reactor they're for
+#define RING_RECV     0
+#define RING_SEND     1
+#define RING_POLL     2
+#define RING_WRITABLE 3
+#define RING_ACCEPT   4
+#define RING_WAKE     5
+#define RING_CANCEL   6
+#define RING_QUIESCE  7
+#define RING_KIND_MASK 7
+
+typedef struct reactor {
+    int id;
+    int epollFd;
+    int listenFd;
+    int eventFd;             // Signaled when the mailbox goes from empty to non-empty
+    pthread_t thread;
+    outMessage *mailbox;     // Pushed to by any thread, drained by the reactor's own thread
+    clientData *dirty;       // Clients with messages queued since the last flush, each one referenced
+    long long flushDeadline; // Monotonic time in microseconds by which the dirty clients are flushed
+    timerWheel timers;       // Timeouts of the reactor's clients
+    char *readBuffer;        // Pooled large buffer, one extra byte is kept to null-terminate text messages
+    char returnMessage[DEFAULT_BUFLEN];
+    uring *ring;             // NULL when the reactor runs on epoll
+    timer acceptTimer;       // Accepting again after the multishot accept failed
+    int sendCount;           // Sends prepared since they were last handed to the kernel
+    int parking;             // Requests completing while the ring winds down to park aren't armed again
+    struct msghdr sends[RING_SENDS];
+    struct iovec sendParts[RING_SENDS][QUEUE_FLUSH_PARTS * 2];
+} reactor;
+
+long long NowMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+reactor **reactors;
+int reactorCount = 0;
+__thread reactor *currentReactor = NULL; // Reactor running on the calling thread, NULL outside of reactor threads
+pthread_mutex_t parkLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t parkChanged = PTHREAD_COND_INITIALIZER;
+int reactorsPausing = 0; // Set while the reactors are asked to park
+int reactorsParked = 0;
+
+void OnAcceptRetry(timer *t);
+
+int ReactorInit(reactor *r, int id, int listenFd)
+{
+    r->id = id;
+    r->listenFd = listenFd;
+    r->mailbox = NULL;
+    r->dirty = NULL;
+    r->flushDeadline = 0;
+    r->ring = NULL;
+    r->sendCount = 0;
+    r->parking = 0;
+    TimerWheelInit(&r->timers, NowMicros());
+    TimerInit(&r->acceptTimer, &r->timers, OnAcceptRetry, r);
+    r->readBuffer = BufferAlloc(BUFFER_LARGE_SIZE);
+    if(!r->readBuffer)
+    {
+        LogError("Failed to allocate receive buffer: %m");
+        return 0;
+    }
+    r->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(r->eventFd < 0)
+    {
+        LogError("Failed to create eventfd: %m");
+        return 0;
+    }
+    if(config.backend == BACKEND_URING)
+    {
+        r->ring = UringCreate();
+        if(r->ring)
+        {
+            r->epollFd = -1;
+            LogInfo("Reactor %d runs on io_uring", id);
+            return 1;
+        }
+        LogWarn("Reactor %d can't use io_uring, falling back to epoll: %m", id);
+    }
+    r->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(r->epollFd < 0)
+    {
+        LogError("Failed to create epoll instance: %m");
+        close(r->eventFd);
+        return 0;
+    }
+
+    // The listener and the eventfd are told apart from clients by pointing at the reactor's own fields
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.ptr = &r->listenFd };
+    struct epoll_event wakeEvent = { .events = EPOLLIN | EPOLLET, .data.ptr = &r->eventFd };
+    if(epoll_ctl(r->epollFd, EPOLL_CTL_ADD, listenFd, &event) < 0 ||
+       epoll_ctl(r->epollFd, EPOLL_CTL_ADD, r->eventFd, &wakeEvent) < 0)
+    {
+        LogError("Failed to register reactor descriptors: %m");
+        close(r->eventFd);
+        close(r->epollFd);
+        return 0;
+    }
+    return 1;
+}
+
+void ReactorDestroy(reactor *r)
+{
+    // Drop messages that were never delivered
+    outMessage *item = __atomic_exchange_n(&r->mailbox, NULL, __ATOMIC_ACQUIRE);
+    while(item)
+    {
+        outMessage *next = item->next;
+        if(item->client) ClientDataRelease(item->client);
+        if(item->room) RoomRelease(item->room);
+        OutMessageFree(item);
+        item = next;
+    }
+    while(r->dirty)
+    {
+        clientData *client = r->dirty;
+        r->dirty = client->nextDirty;
+        ClientDataRelease(client);
+    }
+    BufferRelease(r->readBuffer);
+    if(r->ring) UringDestroy(r->ring);
+    close(r->eventFd);
+    if(r->epollFd >= 0) close(r->epollFd);
+    close(r->listenFd);
+}
+
+int ReactorId(reactor *r)
+{
+    return r->id;
+}
+
+// Called from any thread to have the reactor owning the client send it a message, room messages have no client
+void ReactorPost(reactor *r, clientData *client, outMessage *out)
+{
+    if(client) ClientDataRef(client);
+    out->client = client;
+
+    outMessage *head = __atomic_load_n(&r->mailbox, __ATOMIC_RELAXED);
+    do
+    {
+        out->next = head;
+    } while(!__atomic_compare_exchange_n(&r->mailbox, &head, out, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Only the first message needs to wake the reactor up, it drains the whole mailbox at once
+    if(head == NULL)
+    {
+        uint64_t one = 1;
+        if(write(r->eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            LogError("Failed to wake up reactor: %m");
+    }
+}
+
+/*
+ * Links a client of the calling reactor into its dirty list, the first one also sets the flush deadline.
+ * A queue that already holds a full batch is written right away, so draining a large burst from one
+ * socket doesn't pile everything it produces up in memory until the iteration ends.
+ */
+void ReactorMarkDirty(clientData *client)
+{
+    if(client->outBytes >= QUEUE_BATCH_BYTES && QueueFlush(client) < 0)
+        QueueAbort(client);
+    if(client->dirty) return;
+    reactor *r = currentReactor;
+    if(!r->dirty) r->flushDeadline = config.flushDelay ? NowMicros() + config.flushDelay : 0;
+    ClientDataRef(client);
+    client->dirty = 1;
+    client->nextDirty = r->dirty;
+    r->dirty = client;
+}
+
+/*
+ * Moves a posted message into its recipient's queue as it is, room messages are queued for every
+ * local member. A task is run with the message as its data, whether the client is still connected or not.
+ */
+void DeliverPosted(reactor *r, outMessage *out)
+{
+    if(out->task)
+    {
+        out->task(out->client, out->message, out->length);
+        ClientDataRelease(out->client);
+        OutMessageFree(out);
+        return;
+    }
+    if(out->room)
+    {
+        RoomDeliver(out->room, r->id, (roomBroadcast*)out->payloadBuffer);
+        RoomRelease(out->room);
+        OutMessageFree(out);
+        return;
+    }
+    clientData *client = out->client;
+    if(client->clientSocket < 0) // Disconnected since the message was posted
+        OutMessageFree(out);
+    else if(QueueAppend(client, out))
+        ReactorMarkDirty(client);
+    ClientDataRelease(client);
+}
+
+void DrainMailbox(reactor *r)
+{
+    uint64_t count;
+    while(read(r->eventFd, &count, sizeof(count)) > 0);
+
+    // Messages are pushed to the front of the list, reverse it to deliver them in the order they were posted
+    outMessage *item = __atomic_exchange_n(&r->mailbox, NULL, __ATOMIC_ACQUIRE);
+    outMessage *ordered = NULL;
+    while(item)
+    {
+        outMessage *next = item->next;
+        item->next = ordered;
+        ordered = item;
+        item = next;
+    }
+    while(ordered)
+    {
+        outMessage *next = ordered->next;
+        DeliverPosted(r, ordered);
+        ordered = next;
+    }
+}
+
+/*
+ * Sets up a connection accepted by either backend, the caller watches its socket. Returns NULL if
+ * the connection was refused or closed again.
+ */
+clientData* AcceptClient(reactor *r, int clientSocket)
+{
+    if(__atomic_load_n(&clientsLen, __ATOMIC_RELAXED) >= __atomic_load_n(&config.maxClients, __ATOMIC_RELAXED))
+    {
+        LogWarn("Server cannot connect to any more clients!");
+        METRIC_ADD(rejected, 1);
+        close(clientSocket);
+        return NULL;
+    }
+    METRIC_ADD(accepted, 1);
+
+    LogInfo("Connection accepted on reactor %d, socket = %d", r->id, clientSocket);
+    InitClientSocket(clientSocket);
+
+    clientData* newClient = ClientDataAdd(clientSocket, r);
+    if(!newClient)
+    {
+        LogError("Failed to create client object");
+        close(clientSocket);
+        return NULL;
+    }
+    CaptureConnection(newClient, TRACE_OPEN);
+    if(tlsContext && !TlsAccept(newClient))
+    {
+        ClientDisconnect(newClient);
+        return NULL;
+    }
+    TimerInit(&newClient->idleTimer, &r->timers, OnIdleTimeout, newClient);
+    TimerInit(&newClient->requestTimer, &r->timers, OnRequestTimeout, newClient);
+    newClient->lastActive = r->timers.current;
+    newClient->heartbeatSent = 0;
+    if(config.loginTimeout) TimerArm(&newClient->idleTimer, config.loginTimeout * 1000ll);
+    return newClient;
+}
+
+// Accepts every pending connection, as the listener is edge-triggered
+void OnAccept(reactor *r)
+{
+    struct sockaddr_in client;
+    socklen_t c = sizeof(struct sockaddr_in);
+    while(1)
+    {
+        int clientSocket = accept4(r->listenFd, (struct sockaddr*)&client, &c, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if(clientSocket < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno != EWOULDBLOCK && errno != EAGAIN)
+                LogError("Error when accepting connection: %m");
+            return;
+        }
+        clientData *newClient = AcceptClient(r, clientSocket);
+        if(!newClient) continue;
+
+        // Writability stays registered, with edge-triggering it's only reported after the socket was full
+        struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = newClient };
+        if(epoll_ctl(r->epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0)
+        {
+            LogError("Failed to register client socket: %m");
+            ClientDisconnect(newClient);
+            continue;
+        }
+        LogInfo("Client has connected with ID %lu", newClient->id);
+    }
+}
+
+/*
+ * Moves the incomplete frame of a client, length bytes starting at data, into a new pooled buffer
+ * that holds at least size bytes. The client's previous buffer is released.
+ */
+int KeepIncompleteFrame(clientData *client, char *data, size_t length, size_t size)
+{
+    char *buffer = BufferAlloc(size);
+    if(!buffer)
+    {
+        LogError("Failed to allocate receive buffer: %m");
+        return 0;
+    }
+    memcpy(buffer, data, length);
+    BufferRelease(client->inBuffer);
+    client->inBuffer = buffer;
+    client->inLength = length;
+    client->inCapacity = BufferClassSize(size);
+    return 1;
+}
+
+/*
+ * Flushes the client's outbound queue. Returns 1 if the client has to be read from next,
+ * either because reading was resumed or because the connection failed and has to be cleaned up.
+ */
+int OnWritable(reactor *r, clientData *client)
+{
+    if(client->tlsHandshake) return 1; // The handshake is continued by the read path
+    int status = QueueFlush(client);
+    if(status < 0)
+    {
+        QueueAbort(client);
+        return 1;
+    }
+    if(client->readPaused && client->outBytes <= config.queueLow)
+    {
+        client->readPaused = 0; // Pending requests are read right away, the socket won't report them again
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Handles length bytes received into buffer, which is either the client's own buffer holding an
+ * incomplete frame or a pooled buffer of the reactor that starts with a new frame. An incomplete
+ * frame at the end is kept in the client's buffer. Returns 0 if the client has to be disconnected.
+ */
+int HandleReceived(reactor *r, clientData *client, char *buffer, size_t length)
+{
+    long consumed = HandleInput(client, buffer, length, r->returnMessage);
+    if(consumed < 0)
+    {
+        LogWarn("Client %lu has sent a malformed frame", client->id);
+        return 0;
+    }
+    size_t leftover = length - consumed;
+    if(buffer != client->inBuffer)
+        return !leftover || KeepIncompleteFrame(client, buffer + consumed, leftover, leftover + 1);
+    if(!leftover)
+    {
+        // Nothing left over, the buffer goes back to the pool until a frame gets split again
+        BufferRelease(client->inBuffer);
+        client->inBuffer = NULL;
+        client->inLength = 0;
+        client->inCapacity = 0;
+    }
+    else if(BufferShared(buffer))
+        return KeepIncompleteFrame(client, buffer + consumed, leftover, leftover + 1);
+    else
+    {
+        memmove(client->inBuffer, buffer + consumed, leftover);
+        client->inLength = leftover;
+    }
+    return 1;
+}
+
+// Reads every message currently available on the client's socket
+void OnReadable(reactor *r, clientData *client)
+{
+    int readSize;
+    if(client->tlsHandshake)
+    {
+        int status = TlsHandshake(client);
+        if(status == 0) return;
+        if(status < 0)
+        {
+            ClientDisconnect(client);
+            return;
+        }
+        // Whatever was queued during the handshake can go out now
+        if(client->outHead) ReactorMarkDirty(client);
+    }
+    while(1)
+    {
+        // Slow consumers aren't read from until their queue drains, see OnWritable
+        if(client->readPaused) return;
+        // A small buffer that filled up without completing the frame is swapped for a large one
+        if(client->inLength && client->inLength + 1 == client->inCapacity &&
+           !KeepIncompleteFrame(client, client->inBuffer, client->inLength, BUFFER_LARGE_SIZE))
+            break;
+        // Continue an incomplete frame in the client's own buffer, otherwise read straight into the reactor's
+        char *buffer = client->inLength ? client->inBuffer : r->readBuffer;
+        size_t capacity = client->inLength ? client->inCapacity : BUFFER_LARGE_SIZE;
+        size_t used = client->inLength;
+        readSize = client->tls ? TlsRecv(client, buffer + used, capacity - used - 1)
+                               : recv(client->clientSocket, buffer + used, capacity - used - 1, MSG_DONTWAIT);
+        if(readSize > 0)
+        {
+            METRIC_ADD(bytesIn, readSize);
+            client->lastActive = r->timers.current; // Checked by the idle timeout once it fires
+            if(!HandleReceived(r, client, buffer, used + readSize)) break;
+            if(buffer == r->readBuffer && BufferShared(r->readBuffer))
+            {
+                // Messages relaying parts of the buffer are still queued, read into a fresh one from now on
+                BufferRelease(r->readBuffer);
+                r->readBuffer = BufferAlloc(BUFFER_LARGE_SIZE);
+                if(!r->readBuffer)
+                {
+                    LogError("Failed to allocate receive buffer: %m");
+                    exit(1);
+                }
+            }
+            continue;
+        }
+        if(readSize < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return; // Socket drained, wait for the next notification
+            LogError("recv failed: %m");
+        }
+        break;
+    }
+    ClientDisconnect(client);
+}
+
+uint64_t RingData(void *ptr, int kind)
+{
+    return (uint64_t)(uintptr_t)ptr | (uint64_t)kind;
+}
+
+// Every request for a client holds a reference to it until its last completion
+void RingHold(clientData *client)
+{
+    ClientDataRef(client);
+    client->ringOps++;
+}
+void RingDone(clientData *client)
+{
+    client->ringOps--;
+    ClientDataRelease(client);
+}
+
+void RingArmAccept(reactor *r)
+{
+    if(r->parking) return;
+    struct io_uring_sqe *sqe = UringRequest(r->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+    sqe->user_data = RingData(r, RING_ACCEPT);
+}
+void OnAcceptRetry(timer *t)
+{
+    RingArmAccept((reactor*)t->data);
+}
+
+void RingArmWake(reactor *r)
+{
+    if(r->parking) return;
+    struct io_uring_sqe *sqe = UringRequest(r->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = r->eventFd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = RingData(r, RING_WAKE);
+}
+
+// Keeps receiving into the ring's provided buffers until the connection ends or receiving is cancelled
+void RingArmRecv(reactor *r, clientData *client)
+{
+    if(r->parking) return;
+    struct io_uring_sqe *sqe = UringRequest(r->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->clientSocket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = RingData(client, RING_RECV);
+    client->ringRecv = 1;
+    RingHold(client);
+}
+
+// Receiving from a slow consumer stops until its queue drains, see OnRingSent
+void RingCancelRecv(reactor *r, clientData *client)
+{
+    if(!client->ringRecv || client->ringCancel) return;
+    struct io_uring_sqe *sqe = UringRequest(r->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = RingData(client, RING_RECV);
+    sqe->user_data = RingData(r, RING_CANCEL);
+    client->ringCancel = 1;
+}
+
+// Receives again from a client once reading was resumed, or once QueueAbort needs the disconnect noticed
+void RingResume(reactor *r, clientData *client)
+{
+    if(client->clientSocket >= 0 && !client->readPaused && !client->ringRecv) RingArmRecv(r, client);
+}
+
+// TLS connections go through the same handlers as with epoll, so their readiness is all that's watched
+void RingArmPoll(reactor *r, clientData *client)
+{
+    if(r->parking) return;
+    struct io_uring_sqe *sqe = UringRequest(r->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client->clientSocket;
+    sqe->poll32_events = POLLIN | POLLOUT | POLLRDHUP;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = RingData(client, RING_POLL);
+    RingHold(client);
+}
+
+// Waits for room in the socket of a client whose last send wasn't taken completely
+void RingArmWritable(reactor *r, clientData *client)
+{
+    if(client->ringWritable || r->parking) return;
+    struct io_uring_sqe *sqe = UringRequest(r->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client->clientSocket;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = RingData(client, RING_WRITABLE);
+    client->ringWritable = 1;
+    RingHold(client);
+}
+
+/*
+ * Prepares a send of the client's queue, QUEUE_FLUSH_PARTS messages at most, which is handed to the
+ * kernel along with the other sends of the flush. Only one send of a client is in flight at a time.
+ */
+void RingSend(reactor *r, clientData *client)
+{
+    if(client->ringSending || client->ringWritable || !client->outHead) return;
+    if(r->sendCount == RING_SENDS)
+    {
+        if(UringEnter(r->ring, 0, -1) < 0) LogError("Failed to submit to io_uring: %m");
+        r->sendCount = 0;
+    }
+    struct msghdr *msg = &r->sends[r->sendCount];
+    struct iovec *parts = r->sendParts[r->sendCount++];
+    int count = 0;
+    outMessage *out = client->outHead;
+    int messages;
+    for(messages = 0; out && messages < QUEUE_FLUSH_PARTS; messages++, out = out->next)
+        count += OutMessageParts(out, parts + count);
+    size_t length = 0;
+    int i;
+    for(i = 0; i < count; i++) length += parts[i].iov_len;
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_iov = parts;
+    msg->msg_iovlen = count;
+
+    struct io_uring_sqe *sqe = UringRequest(r->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->clientSocket;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT | ((config.cork && out) ? MSG_MORE : 0);
+    sqe->user_data = RingData(client, RING_SEND);
+    client->ringSending = 1;
+    client->ringSendLength = length;
+    RingHold(client);
+}
+
+// Hands the prepared sends to the kernel, which completes them before the call returns
+void RingSubmitSends(reactor *r)
+{
+    if(!r->sendCount) return;
+    if(UringEnter(r->ring, 0, -1) < 0) LogError("Failed to submit to io_uring: %m");
+    r->sendCount = 0;
+}
+
+void RingWatch(reactor *r, clientData *client)
+{
+    if(client->tls) RingArmPoll(r, client);
+    else RingArmRecv(r, client);
+    LogInfo("Client has connected with ID %lu", client->id);
+}
+
+/*
+ * Handles data received into one of the ring's buffers. Data that starts a frame is handled right
+ * where it is, the rest of an incomplete frame is appended to the client's buffer as far as it fits
+ * at a time. Returns 0 if the client has to be disconnected.
+ */
+int RingReceived(reactor *r, clientData *client, char *data, size_t length)
+{
+    METRIC_ADD(bytesIn, length);
+    client->lastActive = r->timers.current;
+    if(!client->inLength) return HandleReceived(r, client, data, length);
+    while(length)
+    {
+        if(!client->inLength || client->inLength + 1 == client->inCapacity)
+        {
+            size_t size = client->inLength + length + 1;
+            if(size > BUFFER_LARGE_SIZE) size = BUFFER_LARGE_SIZE;
+            if(!KeepIncompleteFrame(client, client->inLength ? client->inBuffer : data, client->inLength, size)) return 0;
+        }
+        size_t chunk = client->inCapacity - 1 - client->inLength;
+        if(chunk > length) chunk = length;
+        memcpy(client->inBuffer + client->inLength, data, chunk);
+        client->inLength += chunk;
+        data += chunk;
+        length -= chunk;
+        if(!HandleReceived(r, client, client->inBuffer, client->inLength)) return 0;
+    }
+    return 1;
+}
+
+void OnRingRecv(reactor *r, clientData *client, struct io_uring_cqe *cqe)
+{
+    if(cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short id = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        char *buffer = r->ring->buffers[id];
+        if(cqe->res > 0 && client->clientSocket >= 0 && !RingReceived(r, client, buffer, (size_t)cqe->res))
+            ClientDisconnect(client);
+        if(BufferShared(buffer))
+        {
+            // Messages relaying parts of the buffer are still queued, the kernel gets a fresh one instead
+            BufferRelease(buffer);
+            r->ring->buffers[id] = BufferAlloc(BUFFER_LARGE_SIZE);
+            if(!r->ring->buffers[id])
+            {
+                LogError("Failed to allocate receive buffer: %m");
+                exit(1);
+            }
+        }
+        UringBufferRecycle(r->ring, id);
+    }
+    if(client->clientSocket >= 0 && client->readPaused) RingCancelRecv(r, client);
+    if(cqe->flags & IORING_CQE_F_MORE) return;
+
+    client->ringRecv = 0;
+    client->ringCancel = 0;
+    if(client->clientSocket >= 0)
+    {
+        // Running out of provided buffers only ends the request, and a cancelled one is armed again once reading resumes
+        if(cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+        {
+            if(!client->readPaused) RingArmRecv(r, client);
+        }
+        else
+        {
+            if(cqe->res < 0) LogError("recv failed: %s", strerror(-cqe->res));
+            ClientDisconnect(client);
+        }
+    }
+    RingDone(client);
+}
+
+/*
+ * Takes what the kernel sent off the client's queue. A socket that didn't take everything is
+ * waited for before the rest is sent, otherwise the rest goes out with the next flush.
+ */
+void OnRingSent(reactor *r, clientData *client, int result)
+{
+    client->ringSending = 0;
+    if(client->clientSocket < 0) return;
+    if(result < 0 && result != -EAGAIN && result != -EINTR)
+    {
+        LogDebug("Send to client %lu failed: %s", client->id, strerror(-result));
+        QueueAbort(client);
+    }
+    else
+    {
+        size_t written = result > 0 ? (size_t)result : 0;
+        if(written) QueueConsume(client, written);
+        if(written < client->ringSendLength) RingArmWritable(r, client);
+        else if(client->outHead) ReactorMarkDirty(client);
+        if(client->readPaused && client->outBytes <= config.queueLow) client->readPaused = 0;
+    }
+    RingResume(r, client);
+}
+
+// Readiness of a TLS connection, handled like an epoll event
+void OnRingPoll(reactor *r, clientData *client, struct io_uring_cqe *cqe)
+{
+    if(cqe->res > 0 && client->clientSocket >= 0)
+    {
+        int readable = cqe->res & (POLLIN | POLLRDHUP | POLLHUP | POLLERR);
+        if(cqe->res & (POLLHUP | POLLERR)) client->readPaused = 0; // Nothing is going to drain the queue anymore
+        if(cqe->res & POLLOUT) readable |= OnWritable(r, client);
+        if(readable) OnReadable(r, client);
+    }
+    if(cqe->flags & IORING_CQE_F_MORE) return;
+    if(client->clientSocket >= 0) RingArmPoll(r, client);
+    RingDone(client);
+}
+
+void OnRingCompletion(reactor *r, struct io_uring_cqe *cqe)
+{
+    int kind = (int)(cqe->user_data & RING_KIND_MASK);
+    void *ptr = (void*)(uintptr_t)(cqe->user_data & ~(uint64_t)RING_KIND_MASK);
+    clientData *client = (clientData*)ptr;
+    switch(kind)
+    {
+    case RING_ACCEPT:
+        if(cqe->res >= 0)
+        {
+            clientData *newClient = AcceptClient(r, cqe->res);
+            if(newClient) RingWatch(r, newClient);
+        }
+        else if(cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECONNABORTED && !r->parking)
+        {
+            // Out of descriptors or memory, accepting again right away would only fail again
+            LogError("Error when accepting connection: %s", strerror(-cqe->res));
+            TimerArm(&r->acceptTimer, RING_ACCEPT_RETRY_MS);
+            return;
+        }
+        if(!(cqe->flags & IORING_CQE_F_MORE)) RingArmAccept(r);
+        break;
+    case RING_WAKE:
+        DrainMailbox(r);
+        if(!(cqe->flags & IORING_CQE_F_MORE)) RingArmWake(r);
+        break;
+    case RING_RECV:
+        OnRingRecv(r, client, cqe);
+        break;
+    case RING_SEND:
+        OnRingSent(r, client, cqe->res);
+        RingDone(client);
+        break;
+    case RING_POLL:
+        OnRingPoll(r, client, cqe);
+        break;
+    case RING_WRITABLE:
+        client->ringWritable = 0;
+        if(client->clientSocket >= 0) ReactorMarkDirty(client);
+        RingDone(client);
+        break;
+    default: // Cancellations, their result only tells whether there was anything left to cancel
+        break;
+    }
+}
+
+// Cancels every request still in flight for a client that's being disconnected, before its socket is closed
+void ReactorDetach(clientData *client)
+{
+    reactor *r = client->owner;
+    if(!r->ring || !client->ringOps) return;
+    struct io_uring_sqe *sqe = UringRequest(r->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = client->clientSocket;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = RingData(r, RING_CANCEL);
+    // Along with the sends prepared so far, the queue they point into is cleared next
+    if(UringEnter(r->ring, 0, -1) < 0) LogError("Failed to submit to io_uring: %m");
+    r->sendCount = 0;
+}
+
+/*
+ * Writes the queue of every dirty client, reading from the ones whose flush resumed reading. On
+ * io_uring the sends of plaintext clients are prepared instead, and handed to the kernel together.
+ */
+void FlushDirty(reactor *r)
+{
+    while(r->dirty)
+    {
+        clientData *client = r->dirty;
+        r->dirty = client->nextDirty;
+        client->dirty = 0;
+        if(client->clientSocket >= 0)
+        {
+            if(r->ring && !client->tls)
+            {
+                RingSend(r, client);
+                RingResume(r, client); // The queue may have been aborted when it was marked dirty
+            }
+            else if(OnWritable(r, client)) OnReadable(r, client); // May queue more messages, they're flushed by the same loop
+        }
+        ClientDataRelease(client);
+    }
+    if(r->ring) RingSubmitSends(r);
+}
+
+// Lists the connected clients of a reactor, each one referenced
+clientData** ReactorClients(reactor *r, unsigned int *count)
+{
+    pthread_rwlock_rdlock(&clientsAccess);
+    clientData **list = (clientData**)malloc((clientsLen ? clientsLen : 1) * sizeof(clientData*));
+    unsigned int i;
+    *count = 0;
+    for(i = 0; list && i < clientsLen; i++)
+    {
+        if(clients[i]->owner != r || clients[i]->clientSocket < 0) continue;
+        ClientDataRef(clients[i]);
+        list[(*count)++] = clients[i];
+    }
+    pthread_rwlock_unlock(&clientsAccess);
+    return list;
+}
+
+/*
+ * Watches the clients the reactor owns before its loop got to them: the ones taken over from the
+ * previous server when the reactor starts, and on io_uring the ones whose requests were cancelled
+ * while it was parked. Whatever is queued for them goes out with the next flush.
+ */
+void ReactorWatchClients(reactor *r, int registered)
+{
+    unsigned int count, i;
+    clientData **list = ReactorClients(r, &count);
+    if(!list) return;
+    for(i = 0; i < count; i++)
+    {
+        clientData *client = list[i];
+        if(r->ring)
+        {
+            if(client->tls) RingArmPoll(r, client);
+            else RingResume(r, client);
+        }
+        else if(!registered)
+        {
+            struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = client };
+            if(epoll_ctl(r->epollFd, EPOLL_CTL_ADD, client->clientSocket, &event) < 0)
+            {
+                LogError("Failed to register client socket: %m");
+                ClientDisconnect(client);
+            }
+        }
+        if(client->clientSocket >= 0 && client->outHead) ReactorMarkDirty(client);
+        ClientDataRelease(client);
+    }
+    free(list);
+}
+
+// Whether a client of the reactor still has a request in flight
+int RingClientsBusy(reactor *r)
+{
+    unsigned int count, i;
+    int busy = 0;
+    clientData **list = ReactorClients(r, &count);
+    if(!list) return 0;
+    for(i = 0; i < count; i++)
+    {
+        if(list[i]->ringOps) busy = 1;
+        ClientDataRelease(list[i]);
+    }
+    free(list);
+    return busy;
+}
+
+/*
+ * Cancels every request on the reactor's ring before it parks. Whatever completes in the meantime
+ * is handled as usual, only nothing is armed again until the reactor is resumed.
+ */
+void RingQuiesce(reactor *r)
+{
+    r->parking = 1;
+    TimerCancel(&r->acceptTimer);
+    RingSubmitSends(r);
+    struct io_uring_sqe *sqe = UringRequest(r->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = RingData(r, RING_QUIESCE);
+    int cancelled = 0;
+    while(!cancelled || RingClientsBusy(r))
+    {
+        if(UringEnter(r->ring, 1, 100000) < 0)
+        {
+            LogError("io_uring_enter failed: %m");
+            return;
+        }
+        struct io_uring_cqe *cqe;
+        while((cqe = UringCompletion(r->ring)))
+        {
+            struct io_uring_cqe completion = *cqe;
+            UringSeen(r->ring);
+            if((completion.user_data & RING_KIND_MASK) == RING_QUIESCE) cancelled = 1;
+            else OnRingCompletion(r, &completion);
+        }
+    }
+}
+
+// Called by a reactor at the end of an iteration, waits for ResumeReactors while the reactors are paused
+void ReactorPark(reactor *r)
+{
+    if(r->ring) RingQuiesce(r);
+    pthread_mutex_lock(&parkLock);
+    reactorsParked++;
+    pthread_cond_broadcast(&parkChanged);
+    while(reactorsPausing) pthread_cond_wait(&parkChanged, &parkLock);
+    reactorsParked--;
+    pthread_cond_broadcast(&parkChanged);
+    pthread_mutex_unlock(&parkLock);
+    if(r->ring)
+    {
+        r->parking = 0;
+        RingArmAccept(r);
+        RingArmWake(r);
+        ReactorWatchClients(r, 1);
+    }
+}
+
+// Parks every reactor and returns once all of them are, their clients can then be touched from the calling thread
+void PauseReactors()
+{
+    pthread_mutex_lock(&parkLock);
+    __atomic_store_n(&reactorsPausing, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&parkLock);
+    int i;
+    uint64_t one = 1;
+    for(i = 0; i < reactorCount; i++)
+    {
+        if(write(reactors[i]->eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            LogError("Failed to wake up reactor: %m");
+    }
+    pthread_mutex_lock(&parkLock);
+    while(reactorsParked < reactorCount) pthread_cond_wait(&parkChanged, &parkLock);
+    pthread_mutex_unlock(&parkLock);
+}
+void ResumeReactors()
+{
+    pthread_mutex_lock(&parkLock);
+    reactorsPausing = 0;
+    pthread_cond_broadcast(&parkChanged);
+    while(reactorsParked) pthread_cond_wait(&parkChanged, &parkLock);
+    pthread_mutex_unlock(&parkLock);
+}
+
+void ReactorRun(reactor *r)
+{
+    struct epoll_event events[MAX_EVENTS];
+    currentReactor = r;
+    ReactorWatchClients(r, 0);
+    while(1)
+    {
+        // Wait no longer than the flush deadline while messages are queued, or than the next timer
+        struct timespec timeout;
+        struct timespec *wait = NULL;
+        long long deadline = TimerWheelNext(&r->timers);
+        if(r->dirty && (deadline < 0 || r->flushDeadline < deadline)) deadline = r->flushDeadline;
+        if(deadline >= 0)
+        {
+            long long remaining = deadline - NowMicros();
+            if(remaining < 0) remaining = 0;
+            timeout.tv_sec = remaining / 1000000;
+            timeout.tv_nsec = (remaining % 1000000) * 1000;
+            wait = &timeout;
+        }
+        int count = epoll_pwait2(r->epollFd, events, MAX_EVENTS, wait, NULL);
+        if(count < 0)
+        {
+            if(errno == EINTR) continue;
+            LogError("epoll_wait failed: %m");
+            return;
+        }
+        MetricsLoopBusy(MetricsNanos());
+        // Before the events, so timers armed while handling them count from the current time
+        TimerWheelAdvance(&r->timers, NowMicros());
+
+        int i;
+        for(i = 0; i < count; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if(ptr == &r->listenFd)
+                OnAccept(r);
+            else if(ptr == &r->eventFd)
+                DrainMailbox(r);
+            else
+            {
+                // Hang-ups are reported by recv as well, so they share the same path
+                clientData *client = (clientData*)ptr;
+                int readable = events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+                if(events[i].events & (EPOLLHUP | EPOLLERR)) client->readPaused = 0; // Nothing is going to drain the queue anymore
+                if(events[i].events & EPOLLOUT) readable |= OnWritable(r, client);
+                if(readable) OnReadable(r, client);
+            }
+        }
+        if(r->dirty && (!config.flushDelay || NowMicros() >= r->flushDeadline))
+            FlushDirty(r);
+        MetricsLoopIdle(MetricsNanos());
+        if(__atomic_load_n(&reactorsPausing, __ATOMIC_ACQUIRE)) ReactorPark(r);
+    }
+}
+
+// Event loop on io_uring, the same as ReactorRun with completions instead of events
+void ReactorRunRing(reactor *r)
+{
+    currentReactor = r;
+    if(UringEnable(r->ring) < 0)
+    {
+        LogError("Failed to enable io_uring: %m");
+        return;
+    }
+    RingArmAccept(r);
+    RingArmWake(r);
+    ReactorWatchClients(r, 0);
+    while(1)
+    {
+        long long deadline = TimerWheelNext(&r->timers);
+        if(r->dirty && (deadline < 0 || r->flushDeadline < deadline)) deadline = r->flushDeadline;
+        long long timeout = -1;
+        if(deadline >= 0)
+        {
+            timeout = deadline - NowMicros();
+            if(timeout < 0) timeout = 0;
+        }
+        // Requests prepared since the last iteration are submitted by the same call
+        if(UringEnter(r->ring, 1, timeout) < 0)
+        {
+            LogError("io_uring_enter failed: %m");
+            return;
+        }
+        MetricsLoopBusy(MetricsNanos());
+        TimerWheelAdvance(&r->timers, NowMicros());
+
+        struct io_uring_cqe *cqe;
+        while((cqe = UringCompletion(r->ring)))
+        {
+            // Handlers may prepare requests whose completions follow right away, so this one is released first
+            struct io_uring_cqe completion = *cqe;
+            UringSeen(r->ring);
+            OnRingCompletion(r, &completion);
+        }
+        if(r->dirty && (!config.flushDelay || NowMicros() >= r->flushDeadline))
+            FlushDirty(r);
+        MetricsLoopIdle(MetricsNanos());
+        if(__atomic_load_n(&reactorsPausing, __ATOMIC_ACQUIRE)) ReactorPark(r);
+    }
+}
+
+void* ReactorThread(void *arg)
+{
+    reactor *r = (reactor*)arg;
+    MetricsAttach(r->id);
+    if(r->ring) ReactorRunRing(r);
+    else ReactorRun(r);
+    CompressorDestroy(&relayCompressor);
+    BufferCacheFlush();
+    return NULL;
+}
+
+/*
+ * Creates every reactor along with its listener, the first ones take over the listeners of the
+ * previous server if there are any, see handoff.h. Surplus listeners are closed.
+ */
+int CreateReactors(int count, int *listeners, int listenerCount)
+{
+    reactors = (reactor**)calloc(count, sizeof(reactor*));
+    if(!reactors) return 0;
+
+    int i;
+    for(i = count; i < listenerCount; i++)
+    {
+        LogWarn("Closing listener %d of the previous server, connections it didn't accept yet are dropped", i);
+        close(listeners[i]);
+    }
+    for(i = 0; i < count; i++)
+    {
+        int socketDesc;
+        struct sockaddr_in server;
+        if(i < listenerCount) socketDesc = listeners[i];
+        else InitServer(&socketDesc, &server);
+
+        // A reactor holds its own receive buffers, so it's kept off the stack
+        reactors[i] = (reactor*)malloc(sizeof(reactor));
+        if(!reactors[i] || !ReactorInit(reactors[i], i, socketDesc))
+        {
+            LogError("Failed to start reactor %d", i);
+            return 0;
+        }
+        reactorCount++;
+    }
+    return 1;
+}
+// Starts the thread of every reactor
+int RunReactors()
+{
+    int i;
+    for(i = 0; i < reactorCount; i++)
+    {
+        if(pthread_create(&reactors[i]->thread, NULL, ReactorThread, reactors[i]) != 0)
+        {
+            LogError("Failed to start reactor thread: %m");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void StopReactors()
+{
+    int i;
+    for(i = 0; i < reactorCount; i++)
+    {
+        pthread_join(reactors[i]->thread, NULL);
+        ReactorDestroy(reactors[i]);
+        free(reactors[i]);
+    }
+    free(reactors);
+    reactorCount = 0;
+}
+
+#endif // REACTOR_H
@@ -0,0 +1,444 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+#include "shared.h"
+#include "protocol.h"
+#include "histogram.h"
+#include "trace.h"
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <getopt.h>
+#include <signal.h>
+
+/*
+ * Replays a trace the server captured (see capture.h) against a server. Every connection of the
+ * trace gets a connection of its own, which is opened, sent its frames and closed at the times
+ * the trace has them, divided by the speed (-x). At speed 0 everything is sent as fast as the
+ * server takes it. Clients are replayed over the binary protocol, whichever protocol they spoke.
+ *
+ * The events of all connections are dispatched in the order of their times, so every connection
+ * sends its frames in the order they were captured. Frames that depend on other connections wait
+ * for them, at any speed: a frame goes out once its connection is in the state it was captured in,
+ * as the server's state replies tell, and once every login before it was answered. That way a
+ * TalkTo never reaches the server before its target logged in, an Accept waits for the request
+ * and a Data for the conversation. An event that waits holds up the ones behind it, and so does
+ * a connection that has more than REPLAY_WINDOW bytes waiting to be sent. A frame that waited
+ * REPLAY_HOLD_TIMEOUT goes out anyway and its connection isn't held up again, every frame sent
+ * out of sync counts as diverged, which means the server didn't see the captured traffic.
+ * A connection the trace closes shuts down its sending side once everything went out, and keeps
+ * reading the answers until the server closes it in turn.
+ *
+ * The response time is measured per connection: a command sent while the connection isn't waiting
+ * for an answer starts a probe, and the reply to that command ends it, see ReplayAnswer. Error
+ * replies end it as well but are counted apart from the response times. Commands nothing answers,
+ * like a Data the server dropped, count as unanswered after REPLAY_PROBE_TIMEOUT.
+ *
+ * -o saves the results of a run, -c prints how a run differs from results saved before, which
+ * turns a trace into a regression test of the server.
+ */
+#define REPLAY_WINDOW        (64 * 1024)
+#define REPLAY_PROBE_TIMEOUT 1000000000ull // Nanoseconds
+#define REPLAY_HOLD_TIMEOUT  1000000000ull // Nanoseconds a frame waits for the state it was captured in
+#define REPLAY_SWEEP_NS      10000000ull   // Longest wait while connections the trace closed still wait for answers
+#define REPLAY_DRAIN_MS      1000          // Answers still on their way get this long after the last event
+#define REPLAY_IN_SIZE       (2 * FRAME_MAX_SIZE)
+
+typedef enum { REPLAY_IDLE, REPLAY_CONNECTING, REPLAY_OPEN, REPLAY_CLOSED } replayStates;
+typedef enum { RESULT_SENT_RATE, RESULT_RECEIVED_RATE, RESULT_P50, RESULT_P99, RESULT_P999, RESULT_MAX, RESULT_MEAN, RESULT_BEHIND,
+               RESULT_ERRORS, RESULT_DIVERGED, RESULTS } replayResultIds;
+
+// Names the results are saved under and shown with, and whether a higher value is an improvement
+const char *replayResultNames[RESULTS] = { "sent_per_second", "received_per_second", "response_p50_us", "response_p99_us",
+                                           "response_p999_us", "response_max_us", "response_mean_us", "behind_schedule_max_ms",
+                                           "error_replies", "diverged_frames" };
+const int replayResultHigherBetter[RESULTS] = { 1, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+typedef struct replayConfig {
+    char *ip;
+    int port;
+    char *trace;
+    double speed;        // Factor the trace is sped up by, 0 sends as fast as possible
+    char *save;          // File the results are saved to, none if NULL
+    char *compare;       // File of results saved before the run is compared to, none if NULL
+} replayConfig;
+
+replayConfig replay = {
+    .ip = "127.0.0.1",
+    .port = DEFAULT_PORT,
+    .trace = NULL,
+    .speed = 1,
+    .save = NULL,
+    .compare = NULL,
+};
+
+typedef struct replayEvent {
+    uint64_t time;       // Microseconds since the capture started
+    uint32_t connection; // Index into the connections
+    uint32_t sequence;   // Position in the trace, keeps the order of events at the same time
+    uint8_t type;
+    uint8_t opcode;
+    uint8_t flags;
+    uint8_t state;       // clientStates value the connection was in when the frame was captured
+    uint32_t length;
+    char *payload;       // Points into the trace
+} replayEvent;
+
+typedef struct replayConnection {
+    uint64_t id;         // Connection id in the trace
+    int socket;
+    replayStates state;
+    char *in;
+    size_t inLength;
+    char *out;
+    size_t outLength;
+    size_t outCapacity;
+    uint64_t probeStart; // Send time of the command waiting for an answer, 0 if none is
+    uint8_t probeOpcode; // The command waiting for an answer
+    clientStates session; // State of the client on the server, as its state replies tell
+    char username[USERNAME_MAX];
+    int loginPending;    // Whether a Login was sent and not answered yet
+    int unsynced;        // Set once a frame gave up waiting for the state it was captured in
+    int dirty;           // Whether the connection has been queued to since the last flush
+    int closing;         // 1 once the trace closed it, 2 once everything was sent and the sending side shut down
+} replayConnection;
+
+typedef struct replayTrace {
+    char *data;
+    size_t length;
+    replayEvent *events;
+    uint32_t eventCount;
+    replayConnection *connections;
+    uint32_t connectionCount;
+    uint64_t frames;
+} replayTrace;
+
+typedef struct replayStats {
+    histogram response;  // Nanoseconds
+    histogram behind;    // Nanoseconds events were dispatched after their time
+    uint64_t sent;
+    uint64_t received;
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    uint64_t unanswered;
+    uint64_t errors;     // Commands answered with an error
+    uint64_t diverged;   // Frames sent while the replay wasn't where the capture was
+    uint64_t unsynced;   // Connections that stopped waiting for their captured state
+    uint64_t failed;     // Connections that couldn't be opened
+    uint64_t closed;     // Connections the server closed before the trace did
+    uint64_t skipped;    // Frames for connections that were closed already
+} replayStats;
+
+uint64_t NowNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void PrintUsage(char *name)
+{
+    printf("Usage: %s [options] <trace> [server ip]\n"
+           "\t-x <speed> - Factor the trace is sped up by, e.g 2 replays it twice as fast, 0 as fast as the server takes it (default %.0f)\n"
+           "\t-p <port>  - Server port (default %d)\n"
+           "\t-o <path>  - Save the results to a file\n"
+           "\t-c <path>  - Compare the results to ones saved before with -o\n"
+           "\t-h         - Show this message\n",
+           name, replay.speed, DEFAULT_PORT);
+}
+
+void ParseArguments(int argc, char *argv[])
+{
+    int opt;
+    while((opt = getopt(argc, argv, "x:p:o:c:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'x': replay.speed = atof(optarg); break;
+            case 'p': replay.port = atoi(optarg); break;
+            case 'o': replay.save = optarg; break;
+            case 'c': replay.compare = optarg; break;
+            case 'h':
+                PrintUsage(argv[0]);
+                exit(0);
+            default:
+                PrintUsage(argv[0]);
+                exit(1);
+        }
+    }
+    if(optind >= argc || replay.speed < 0)
+    {
+        PrintUsage(argv[0]);
+        exit(1);
+    }
+    replay.trace = argv[optind++];
+    if(optind < argc) replay.ip = argv[optind];
+}
+
+// Queues a frame on the connection, the send buffer grows as needed
+int ReplayQueue(replayConnection *c, uint8_t opcode, uint8_t flags, char *payload, size_t length)
+{
+    if(c->outLength + FRAME_HEADER_SIZE + length > c->outCapacity)
+    {
+        size_t capacity = c->outCapacity ? c->outCapacity : REPLAY_WINDOW;
+        while(c->outLength + FRAME_HEADER_SIZE + length > capacity) capacity *= 2;
+        char *out = (char*)realloc(c->out, capacity);
+        if(!out) return 0;
+        c->out = out;
+        c->outCapacity = capacity;
+    }
+    WriteFrameHeader(c->out + c->outLength, (uint32_t)length, opcode, flags);
+    memcpy(c->out + c->outLength + FRAME_HEADER_SIZE, payload, length);
+    c->outLength += FRAME_HEADER_SIZE + length;
+    return 1;
+}
+// Writes as much of the send buffer as the socket takes, returns -1 if the connection has failed
+int ReplayFlush(replayConnection *c)
+{
+    size_t written = 0;
+    while(written < c->outLength)
+    {
+        ssize_t sent = send(c->socket, c->out + written, c->outLength - written, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(sent < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        written += sent;
+    }
+    memmove(c->out, c->out + written, c->outLength - written);
+    c->outLength -= written;
+    return 0;
+}
+
+// Whether a command gets a reply it can be timed by, a TalkTo of a client waiting for its own request only ever cancels it
+int ReplayProbed(replayEvent *e)
+{
+    if(e->opcode == TALKTO) return e->state != CONNECTING;
+    return e->opcode != PING && e->opcode != LOGOUT && e->opcode < UNKNOWN;
+}
+// Whether a chat message payload, the username length, the username and the text, was sent by the connection's client
+int ReplayFromSelf(replayConnection *c, char *payload, size_t length)
+{
+    size_t nameLength = length ? (uint8_t)payload[0] : 0;
+    return length && nameLength < length && nameLength == strlen(c->username) && memcmp(payload + 1, c->username, nameLength) == 0;
+}
+/*
+ * Whether a frame the server sent answers the command being probed: 1 if it does, -1 if it's an
+ * error answering it, 0 if it has nothing to do with it, like a push of another client's doing.
+ */
+int ReplayAnswer(replayConnection *c, frame *f)
+{
+    if(f->opcode == REPLY_ERROR || (f->opcode == REPLY_TALKTO_ERROR && c->probeOpcode == TALKTO)) return -1;
+    switch(c->probeOpcode)
+    {
+        case LOGIN:
+            return f->opcode == REPLY_LOGIN;
+        case TALKTO: // Answered with the new state, which is never that of a request coming in
+            return f->opcode == REPLY_TALKTO && f->length && (uint8_t)f->payload[0] != PENDING_REQUEST;
+        case DISCONNECT:
+            return f->opcode == REPLY_DISCONNECT;
+        case DATA: // The server sends the message back to its sender
+            return f->opcode == REPLY_MESSAGE && ReplayFromSelf(c, f->payload, f->length);
+        case SAY: // The room name comes before the message
+        {
+            size_t offset = f->length ? 1 + (uint8_t)f->payload[0] : 0;
+            return f->opcode == REPLY_ROOM_MESSAGE && f->length && offset < f->length && ReplayFromSelf(c, f->payload + offset, f->length - offset);
+        }
+        default:
+            return f->opcode == REPLY_LOG;
+    }
+}
+
+// Finds the connection with the id in an open addressing table of indexes, returns the slot it's in or belongs in
+uint32_t ReplayProbe(uint32_t *table, uint32_t mask, replayConnection *connections, uint64_t id)
+{
+    uint32_t slot = (uint32_t)((id * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    while(table[slot] != UINT32_MAX && connections[table[slot]].id != id) slot = (slot + 1) & mask;
+    return slot;
+}
+int ReplayEventOrder(const void *a, const void *b)
+{
+    const replayEvent *x = (const replayEvent*)a, *y = (const replayEvent*)b;
+    if(x->time != y->time) return x->time < y->time ? -1 : 1;
+    return x->sequence < y->sequence ? -1 : x->sequence > y->sequence;
+}
+// Appends an event, returns 0 if out of memory
+int ReplayAddEvent(replayTrace *t, uint32_t *capacity, replayEvent *event)
+{
+    if(t->eventCount == *capacity)
+    {
+        uint32_t grown = *capacity ? *capacity * 2 : 1024;
+        replayEvent *events = (replayEvent*)realloc(t->events, grown * sizeof(replayEvent));
+        if(!events) return 0;
+        t->events = events;
+        *capacity = grown;
+    }
+    event->sequence = t->eventCount;
+    t->events[t->eventCount++] = *event;
+    return 1;
+}
+
+/*
+ * Reads the whole trace into memory and turns it into events sorted by time. A connection that was
+ * already open when the capture started is opened right before its first frame.
+ */
+int ReplayLoad(char *path, replayTrace *t)
+{
+    memset(t, 0, sizeof(replayTrace));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) < 0)
+    {
+        perror("Failed to open the trace");
+        if(fd >= 0) close(fd);
+        return 0;
+    }
+    t->length = info.st_size;
+    t->data = (char*)malloc(t->length ? t->length : 1);
+    size_t done = 0;
+    while(t->data && done < t->length)
+    {
+        ssize_t readSize = read(fd, t->data + done, t->length - done);
+        if(readSize <= 0) break;
+        done += readSize;
+    }
+    close(fd);
+    if(!t->data || done < t->length || !TraceReadHeader(t->data, t->length))
+    {
+        printf("%s isn't a trace this version can read\n", path);
+        return 0;
+    }
+
+    uint32_t eventCapacity = 0, connectionCapacity = 0, tableMask = 0;
+    uint32_t *table = NULL;
+    int64_t lastTime = 0;
+    int loaded = 1;
+    size_t offset = TRACE_HEADER_SIZE;
+    while(offset < t->length)
+    {
+        traceRecord record;
+        long size = TraceReadRecord(t->data + offset, t->length - offset, &record, &lastTime);
+        if(size < 0)
+        {
+            printf("WARN: The trace is cut off or damaged at byte %zu, replaying what came before\n", offset);
+            break;
+        }
+        offset += size;
+
+        // Keep the table of connection indexes under half full
+        if((t->connectionCount + 1) * 2 > tableMask)
+        {
+            uint32_t grown = tableMask ? (tableMask + 1) * 2 : 1024;
+            uint32_t *newTable = (uint32_t*)malloc(grown * sizeof(uint32_t));
+            if(!newTable)
+            {
+                loaded = 0;
+                break;
+            }
+            memset(newTable, 0xFF, grown * sizeof(uint32_t));
+            uint32_t i;
+            for(i = 0; i < t->connectionCount; i++) newTable[ReplayProbe(newTable, grown - 1, t->connections, t->connections[i].id)] = i;
+            free(table);
+            table = newTable;
+            tableMask = grown - 1;
+        }
+        uint32_t slot = ReplayProbe(table, tableMask, t->connections, record.connection);
+        replayEvent event = { .time = record.time > 0 ? (uint64_t)record.time : 0, .type = record.type, .opcode = record.opcode,
+                              .flags = record.flags, .state = record.state, .length = record.length, .payload = record.payload };
+        if(table[slot] == UINT32_MAX)
+        {
+            if(t->connectionCount == connectionCapacity)
+            {
+                connectionCapacity = connectionCapacity ? connectionCapacity * 2 : 256;
+                replayConnection *connections = (replayConnection*)realloc(t->connections, connectionCapacity * sizeof(replayConnection));
+                if(!connections)
+                {
+                    loaded = 0;
+                    break;
+                }
+                t->connections = connections;
+            }
+            replayConnection *c = &t->connections[t->connectionCount];
+            memset(c, 0, sizeof(replayConnection));
+            c->id = record.connection;
+            c->socket = -1;
+            table[slot] = t->connectionCount++;
+            if(record.type != TRACE_OPEN)
+            {
+                replayEvent open = event;
+                open.type = TRACE_OPEN;
+                open.connection = table[slot];
+                if(!ReplayAddEvent(t, &eventCapacity, &open))
+                {
+                    loaded = 0;
+                    break;
+                }
+            }
+        }
+        event.connection = table[slot];
+        if(!ReplayAddEvent(t, &eventCapacity, &event))
+        {
+            loaded = 0;
+            break;
+        }
+        if(record.type == TRACE_FRAME) t->frames++;
+    }
+    free(table);
+    if(!loaded)
+    {
+        printf("Out of memory loading the trace\n");
+        return 0;
+    }
+    qsort(t->events, t->eventCount, sizeof(replayEvent), ReplayEventOrder);
+    return 1;
+}
+
+// Releases a trace loaded by ReplayLoad, also after it failed halfway
+void ReplayFree(replayTrace *t)
+{
+    uint32_t i;
+    for(i = 0; i < t->connectionCount; i++)
+    {
+        free(t->connections[i].in);
+        free(t->connections[i].out);
+    }
+    free(t->connections);
+    free(t->events);
+    free(t->data);
+    memset(t, 0, sizeof(replayTrace));
+}
+
+// Loads results saved with -o, returns 0 if the file can't be read
+int ReplayLoadResults(char *path, double *results)
+{
+    FILE *file = fopen(path, "r");
+    if(!file) return 0;
+    int found = 0, i;
+    char name[64];
+    double value;
+    while(fscanf(file, "%63s %lf", name, &value) == 2)
+    {
+        for(i = 0; i < RESULTS; i++)
+        {
+            if(strcmp(name, replayResultNames[i]) == 0)
+            {
+                results[i] = value;
+                found++;
+            }
+        }
+    }
+    fclose(file);
+    return found == RESULTS;
+}
+int ReplaySaveResults(char *path, double *results)
+{
+    FILE *file = fopen(path, "w");
+    if(!file) return 0;
+    int i;
+    for(i = 0; i < RESULTS; i++) fprintf(file, "%s %.3f\n", replayResultNames[i], results[i]);
+    return fclose(file) == 0;
+}
+
+#endif // REPLAY_H
@@ -0,0 +1,275 @@
+#ifndef ROOM_H
+#define ROOM_H
+#include "map.h"
+#include "config.h"
+
+/*
+ * Group chat rooms. Rooms are created by the first client joining them and
+ * removed once the last member has left.
+ *
+ * The members of a room are kept in one list per reactor, and every list is only
+ * ever touched by the thread of its own reactor, as joining, leaving and
+ * disconnecting are all handled by the reactor owning the client. A message sent
+ * to the room is serialized once into a pooled buffer, then handed to each reactor
+ * with members in a single mailbox post, and every reactor queues that same buffer
+ * for its own members. Other threads only read the length of a list to skip
+ * reactors without members.
+ *
+ * The room index is a chained hash table behind a single read-write lock, since
+ * rooms are created and removed far less often than messages are sent to them.
+ */
+#define ROOM_BUCKETS_INITIAL 64
+// Room messages are stored in both protocol encodings in a single large pooled buffer
+#define ROOM_MESSAGE_MAX ((FRAME_MAX_PAYLOAD - 256) / 2)
+
+typedef struct roomMembers {
+    clientData **clients;
+    unsigned int len;      // Read by other reactors without a lock
+    unsigned int capacity;
+} roomMembers;
+
+typedef struct room {
+    struct room *next;        // Next room in the same bucket
+    char name[ROOMNAME_MAX];
+    uint32_t hash;
+    int refCount;             // Held by the index and by room messages posted to other reactors
+    unsigned int memberCount; // Members on every reactor, guarded by roomsAccess
+    roomMembers *members;     // One list per reactor
+} room;
+
+/*
+ * A message sent to a room, in a pooled buffer shared by every queued copy:
+ *      - The binary frame starts at data
+ *      - The text rendering follows right after the frame
+ */
+typedef struct roomBroadcast {
+    size_t frameLength;
+    size_t textLength;
+    char data[];
+} roomBroadcast;
+
+room **roomBuckets;
+unsigned int roomBucketCount = 0;
+unsigned int roomCount = 0;
+pthread_rwlock_t roomsAccess;
+
+int RoomsInit()
+{
+    pthread_rwlock_init(&roomsAccess, NULL);
+    roomBuckets = (room**)calloc(ROOM_BUCKETS_INITIAL, sizeof(room*));
+    if(!roomBuckets) return -1;
+    roomBucketCount = ROOM_BUCKETS_INITIAL;
+    return 0;
+}
+void RoomFree(room *r)
+{
+    int i;
+    for(i = 0; i < config.reactors; i++) free(r->members[i].clients);
+    free(r->members);
+    free(r);
+}
+void RoomsDestroy()
+{
+    unsigned int i;
+    for(i = 0; i < roomBucketCount; i++)
+    {
+        room *r = roomBuckets[i];
+        while(r)
+        {
+            room *next = r->next;
+            RoomFree(r);
+            r = next;
+        }
+    }
+    free(roomBuckets);
+    pthread_rwlock_destroy(&roomsAccess);
+}
+void RoomRef(room *r)
+{
+    __atomic_add_fetch(&r->refCount, 1, __ATOMIC_RELAXED);
+}
+void RoomRelease(room *r)
+{
+    if(__atomic_sub_fetch(&r->refCount, 1, __ATOMIC_ACQ_REL) == 0) RoomFree(r);
+}
+
+// roomsAccess must be held
+room* RoomLookup(char *name, uint32_t hash)
+{
+    room *r = roomBuckets[hash & (roomBucketCount - 1)];
+    while(r && (r->hash != hash || strcmp(r->name, name) != 0)) r = r->next;
+    return r;
+}
+// Doubles the amount of buckets, roomsAccess must be held for writing
+void RoomsGrow()
+{
+    unsigned int count = roomBucketCount * 2;
+    room **buckets = (room**)calloc(count, sizeof(room*));
+    if(!buckets) return; // Chains just get longer
+    unsigned int i;
+    for(i = 0; i < roomBucketCount; i++)
+    {
+        room *r = roomBuckets[i];
+        while(r)
+        {
+            room *next = r->next;
+            r->next = buckets[r->hash & (count - 1)];
+            buckets[r->hash & (count - 1)] = r;
+            r = next;
+        }
+    }
+    free(roomBuckets);
+    roomBuckets = buckets;
+    roomBucketCount = count;
+}
+room* RoomCreate(char *name, uint32_t hash)
+{
+    room *r = (room*)calloc(1, sizeof(room));
+    if(!r) return NULL;
+    r->members = (roomMembers*)calloc(config.reactors, sizeof(roomMembers));
+    if(!r->members)
+    {
+        free(r);
+        return NULL;
+    }
+    strncpy(r->name, name, ROOMNAME_MAX - 1);
+    r->hash = hash;
+    r->refCount = 1; // Reference held by the index
+    return r;
+}
+
+// Returns the position of the room in the client's list of rooms, or -1 if the client isn't a member
+int ClientRoomIndex(clientData *client, char *name)
+{
+    int i;
+    for(i = 0; i < client->roomCount; i++)
+        if(strcmp(client->rooms[i]->name, name) == 0) return i;
+    return -1;
+}
+
+// Gives up a member's hold on the room, the last member gone takes the room out of the index
+void RoomDropMember(room *r)
+{
+    pthread_rwlock_wrlock(&roomsAccess);
+    int empty = --r->memberCount == 0;
+    if(empty)
+    {
+        room **link = &roomBuckets[r->hash & (roomBucketCount - 1)];
+        while(*link != r) link = &(*link)->next;
+        *link = r->next;
+        roomCount--;
+    }
+    pthread_rwlock_unlock(&roomsAccess);
+    // Messages still posted to other reactors keep the room alive until they're delivered
+    if(empty) RoomRelease(r);
+}
+
+/*
+ * Adds the client to the room, creating the room if needed. Must be called from the thread of
+ * the reactor owning the client, which the member list of that reactor belongs to.
+ * Returns NULL if the room couldn't be created.
+ */
+room* RoomJoin(clientData *client, char *name, int reactorId)
+{
+    uint32_t hash = HashUsername(name);
+    pthread_rwlock_wrlock(&roomsAccess);
+    room *r = RoomLookup(name, hash);
+    if(!r)
+    {
+        r = RoomCreate(name, hash);
+        if(!r)
+        {
+            pthread_rwlock_unlock(&roomsAccess);
+            LogError("Failed to create room: %m");
+            return NULL;
+        }
+        if(roomCount >= roomBucketCount) RoomsGrow();
+        r->next = roomBuckets[hash & (roomBucketCount - 1)];
+        roomBuckets[hash & (roomBucketCount - 1)] = r;
+        roomCount++;
+    }
+    r->memberCount++; // Keeps the room in the index until the client leaves
+    pthread_rwlock_unlock(&roomsAccess);
+
+    roomMembers *list = &r->members[reactorId];
+    if(list->len == list->capacity)
+    {
+        unsigned int capacity = list->capacity ? list->capacity * 2 : 16;
+        clientData **clients = (clientData**)realloc(list->clients, capacity * sizeof(clientData*));
+        if(!clients)
+        {
+            LogError("Failed to grow room: %m");
+            RoomDropMember(r); // A room this join created goes away again
+            return NULL;
+        }
+        list->clients = clients;
+        list->capacity = capacity;
+    }
+    list->clients[list->len] = client;
+    client->rooms[client->roomCount] = r;
+    client->roomSlots[client->roomCount] = list->len;
+    client->roomCount++;
+    __atomic_store_n(&list->len, list->len + 1, __ATOMIC_RELEASE);
+    return r;
+}
+
+// Removes the client from the room at the given position of its list of rooms, same thread as RoomJoin
+void RoomLeave(clientData *client, int index, int reactorId)
+{
+    room *r = client->rooms[index];
+    roomMembers *list = &r->members[reactorId];
+
+    // Fill the hole with the last member and point that member at its new slot
+    unsigned int slot = client->roomSlots[index];
+    clientData *last = list->clients[list->len - 1];
+    list->clients[slot] = last;
+    last->roomSlots[ClientRoomIndex(last, r->name)] = slot;
+    __atomic_store_n(&list->len, list->len - 1, __ATOMIC_RELEASE);
+
+    client->roomCount--;
+    client->rooms[index] = client->rooms[client->roomCount];
+    client->roomSlots[index] = client->roomSlots[client->roomCount];
+    RoomDropMember(r);
+}
+void RoomLeaveAll(clientData *client, int reactorId)
+{
+    while(client->roomCount) RoomLeave(client, client->roomCount - 1, reactorId);
+}
+
+// Serializes a room message in both encodings, returns NULL if no buffer is available
+roomBroadcast* BuildRoomMessage(char *roomName, char *sender, char *text, size_t length)
+{
+    size_t roomLength = strnlen(roomName, ROOMNAME_MAX - 1);
+    size_t usernameLength = strnlen(sender, USERNAME_MAX - 1);
+    if(length > ROOM_MESSAGE_MAX) length = ROOM_MESSAGE_MAX;
+
+    size_t payloadLength = 2 + roomLength + usernameLength + length;
+    size_t textPrefix = ROOMNAME_MAX + USERNAME_MAX + 16;
+    roomBroadcast *b = (roomBroadcast*)BufferAlloc(sizeof(roomBroadcast) + FRAME_HEADER_SIZE + payloadLength + textPrefix + length);
+    if(!b)
+    {
+        LogError("Failed to allocate room message: %m");
+        return NULL;
+    }
+    // Binary: room name length, room name, username length, username and the message
+    char *p = b->data;
+    WriteFrameHeader(p, (uint32_t)payloadLength, REPLY_ROOM_MESSAGE, 0);
+    p += FRAME_HEADER_SIZE;
+    *p++ = (char)roomLength;
+    memcpy(p, roomName, roomLength);
+    p += roomLength;
+    *p++ = (char)usernameLength;
+    memcpy(p, sender, usernameLength);
+    p += usernameLength;
+    memcpy(p, text, length);
+    p += length;
+    b->frameLength = p - b->data;
+
+    // Text: the room and the author in brackets, e.g "ROOM:[general][john]: hi"
+    b->textLength = sprintf(p, "ROOM:[%.*s][%.*s]: ", (int)roomLength, roomName, (int)usernameLength, sender);
+    memcpy(p + b->textLength, text, length);
+    b->textLength += length;
+    return b;
+}
+
+#endif // ROOM_H
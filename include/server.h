@@ -2,227 +2,1448 @@
 #define SERVER_H
 #include "shared.h"
 #include "map.h"
+#include "protocol.h"
+#include "compress.h"
+#include "outqueue.h"
+#include "room.h"
+#include "store.h"
+#include "users.h"
+#include "presence.h"
+#include "cluster.h"
+#include "admission.h"
+#include <signal.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 
-int SendMessage(clientData *client, char *message)
+/*
+ * A client's socket is only ever written to by the reactor that owns it. Messages for clients
+ * owned by another reactor are posted to that reactor's mailbox, see reactor.h.
+ */
+struct reactor;
+extern struct reactor **reactors;
+extern __thread struct reactor *currentReactor;
+int ReactorId(struct reactor *r);
+void ReactorPost(struct reactor *r, clientData *client, outMessage *out);
+void ReactorMarkDirty(clientData *client);
+void ReactorDetach(clientData *client);
+
+/*
+ * Serializes every change to the client states and conversation pairings. These changes touch
+ * two clients that may belong to different reactors, and they are rare compared to chat messages,
+ * so a single lock is used for them. Changes are also made under the affected client's own lock,
+ * which is all the chat message path needs to take.
+ */
+pthread_mutex_t conversationLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Pooled buffer holding the message being handled, see HandleInput, and the flags of its frame
+__thread char *inputBuffer;
+__thread uint8_t inputFlags;
+// Inflates compressed chat messages for clients that didn't negotiate compression
+__thread compressor relayCompressor;
+
+/*
+ * Sends a message made out of two parts with a single system call. The payload may live in
+ * a pooled buffer shared with other messages, e.g. a chat message received from the sender,
+ * in which case payloadBuffer points to it. Queued messages and messages for another reactor's
+ * clients only copy the first part and keep a reference to that buffer instead of copying the payload.
+ */
+int SendParts(clientData *client, char *message, size_t length, char *payload, size_t payloadLength, char *payloadBuffer)
 {
-    if(send(client->clientSocket, message, strlen(message), 0) < 0)
+    if(client->remote) return ClusterForward(client, message, length, payload, payloadLength, payloadBuffer);
+    if(client->owner != currentReactor)
     {
-        perror("ERROR: send failed");
-        close(client->clientSocket);
-        ClientDataRemove(client);
-        return 0;
+        outMessage *out = OutMessageCreate(client, message, length, payload, payloadLength, payloadBuffer);
+        if(!out) return 0;
+        ReactorPost(client->owner, client, out);
+        METRIC_ADD(posted, 1);
+        return 1;
     }
+    if(client->clientSocket < 0) return 0; // Already disconnected
+
+    // Queued until the end of the event loop iteration, together with everything else the client gets in it
+    outMessage *out = OutMessageCreate(client, message, length, payload, payloadLength, payloadBuffer);
+    if(!out || !QueueAppend(client, out)) return 0;
+    ReactorMarkDirty(client);
     return 1;
 }
+int SendBytes(clientData *client, char *message, size_t length)
+{
+    return SendParts(client, message, length, NULL, 0, NULL);
+}
+// Scratch space the replies are built in before they're sent
+__thread char frameBuffer[FRAME_MAX_SIZE + USERNAME_MAX + 32];
+
+// Sends a reply made out of human readable text, e.g errors and logs
+int SendText(clientData *client, serverReplies reply, char *text)
+{
+    size_t length = strlen(text);
+    if(length > FRAME_MAX_PAYLOAD) length = FRAME_MAX_PAYLOAD;
+    if(client->protocol == PROTOCOL_BINARY)
+        return SendBytes(client, frameBuffer, BuildFrame(frameBuffer, reply, text, length));
+
+    int size = snprintf(frameBuffer, sizeof(frameBuffer), "%s%.*s", replyPrefixString[reply - REPLY_LOGIN], (int)length, text);
+    return SendBytes(client, frameBuffer, size);
+}
+// Sends a client its new state, optionally along with the username the change concerns
+int SendState(clientData *client, serverReplies reply, clientStates state, char *username)
+{
+    if(client->protocol == PROTOCOL_BINARY)
+    {
+        char payload[USERNAME_MAX + 1];
+        size_t length = username ? strnlen(username, USERNAME_MAX - 1) : 0;
+        payload[0] = (char)state;
+        memcpy(payload + 1, username, length);
+        return SendBytes(client, frameBuffer, BuildFrame(frameBuffer, reply, payload, length + 1));
+    }
+    int size = snprintf(frameBuffer, sizeof(frameBuffer), username ? "%s%d %s" : "%s%d", replyPrefixString[reply - REPLY_LOGIN], (int)state, username);
+    return SendBytes(client, frameBuffer, size);
+}
+/*
+ * Builds the part of a chat message that comes before its text, returns its length. Flags are only
+ * set on binary frames, a compressed text is never sent to a text protocol client.
+ */
+size_t BuildChatHeader(char *header, protocolModes protocol, char *sender, size_t *length, uint8_t flags)
+{
+    size_t usernameLength = strnlen(sender, USERNAME_MAX - 1);
+    if(protocol == PROTOCOL_BINARY)
+    {
+        if(*length > FRAME_MAX_PAYLOAD - usernameLength - 1) *length = FRAME_MAX_PAYLOAD - usernameLength - 1;
+        WriteFrameHeader(header, (uint32_t)(usernameLength + 1 + *length), REPLY_MESSAGE, flags);
+        header[FRAME_HEADER_SIZE] = (char)usernameLength;
+        memcpy(header + FRAME_HEADER_SIZE + 1, sender, usernameLength);
+        return FRAME_HEADER_SIZE + 1 + usernameLength;
+    }
+    return sprintf(header, "MESSAGE:[%.*s]: ", (int)usernameLength, sender);
+}
+/*
+ * Sends a chat message written by the user called sender. The text is never copied, it's sent
+ * straight from textBuffer, the pooled buffer it was received into.
+ */
+int SendChatMessage(clientData *client, char *sender, char *text, size_t length, char *textBuffer, uint8_t flags)
+{
+    char header[FRAME_HEADER_SIZE + USERNAME_MAX + 16];
+    size_t headerLength = BuildChatHeader(header, client->protocol, sender, &length, flags);
+    return SendParts(client, header, headerLength, text, length, textBuffer);
+}
+// Builds the part of a direct message that comes before its text, returns its length
+size_t BuildDirectHeader(char *header, protocolModes protocol, char *sender, int64_t sent, size_t *length)
+{
+    size_t usernameLength = strnlen(sender, USERNAME_MAX - 1);
+    if(*length > STORE_MESSAGE_MAX) *length = STORE_MESSAGE_MAX;
+    if(protocol == PROTOCOL_BINARY)
+    {
+        WriteFrameHeader(header, (uint32_t)(8 + 1 + usernameLength + *length), REPLY_DIRECT_MESSAGE, 0);
+        int i;
+        for(i = 0; i < 8; i++) header[FRAME_HEADER_SIZE + i] = (char)((uint64_t)sent >> (56 - 8 * i));
+        header[FRAME_HEADER_SIZE + 8] = (char)usernameLength;
+        memcpy(header + FRAME_HEADER_SIZE + 9, sender, usernameLength);
+        return FRAME_HEADER_SIZE + 9 + usernameLength;
+    }
+    return sprintf(header, "DIRECT:%lld [%.*s]: ", (long long)sent, (int)usernameLength, sender);
+}
+/*
+ * Sends a direct message. A message sent by a user that's online is relayed straight from textBuffer like
+ * a chat message, a stored one is copied since its segment may be removed before the message is written.
+ */
+int SendDirectMessage(clientData *client, char *sender, int64_t sent, char *text, size_t length, char *textBuffer)
+{
+    char header[FRAME_HEADER_SIZE + USERNAME_MAX + 48];
+    size_t headerLength = BuildDirectHeader(header, client->protocol, sender, sent, &length);
+    if(textBuffer) return SendParts(client, header, headerLength, text, length, textBuffer);
+    memcpy(frameBuffer, header, headerLength);
+    memcpy(frameBuffer + headerLength, text, length);
+    return SendBytes(client, frameBuffer, headerLength + length);
+}
+// Queues a room message for every member of the room owned by the calling reactor
+void RoomDeliver(room *r, int reactorId, roomBroadcast *b)
+{
+    roomMembers *list = &r->members[reactorId];
+    unsigned int i;
+    for(i = 0; i < list->len; i++)
+    {
+        clientData *member = list->clients[i];
+        if(member->protocol == PROTOCOL_BINARY)
+            SendParts(member, NULL, 0, b->data, b->frameLength, (char*)b);
+        else
+            SendParts(member, NULL, 0, b->data + b->frameLength, b->textLength, (char*)b);
+    }
+}
+// Hands a room message to every reactor with members in the room, each one queues it for its own members
+void RoomBroadcast(room *r, roomBroadcast *b)
+{
+    int i;
+    for(i = 0; i < config.reactors; i++)
+    {
+        if(__atomic_load_n(&r->members[i].len, __ATOMIC_ACQUIRE) == 0) continue;
+        if(reactors[i] == currentReactor)
+        {
+            RoomDeliver(r, i, b);
+            continue;
+        }
+        outMessage *out = OutMessageCreate(NULL, NULL, 0, NULL, 0, (char*)b);
+        if(!out) continue;
+        RoomRef(r); // Released by the receiving reactor once the message is queued for its members
+        out->room = r;
+        ReactorPost(reactors[i], NULL, out);
+        METRIC_ADD(posted, 1);
+    }
+}
+// Copies command arguments into a null-terminated string, cutting them short if needed
+void CopyArguments(char *destination, size_t size, char *args, size_t length)
+{
+    if(length >= size) length = size - 1;
+    memcpy(destination, args, length);
+    destination[length] = 0;
+}
+// Checks whether a command argument starts with the given word
+int ArgumentIs(char *args, size_t length, char *word)
+{
+    size_t wordLength = strlen(word);
+    return length >= wordLength && strncmp(args, word, wordLength) == 0;
+}
+/*
+ * Changes the state and conversation partner of a client, conversationLock must be held. A proxy
+ * keeps the local client it stands in for as its partner and only follows the state, and it's
+ * released once the local client's conversation moves on from it.
+ */
+void SetConversation(clientData *client, clientStates state, clientData *with)
+{
+    if(client->remote)
+    {
+        pthread_mutex_lock(&client->lock);
+        client->state = state;
+        pthread_mutex_unlock(&client->lock);
+        return;
+    }
+    if((state == CHATTING) != (client->state == CHATTING) && client->username[0])
+    {
+        UserIndexSetBusy(client->username, state == CHATTING);
+        PresencePublish(client->username, client->usernameHash, state == CHATTING ? PRESENCE_ONLINE : PRESENCE_BUSY,
+                        state == CHATTING ? PRESENCE_BUSY : PRESENCE_ONLINE);
+        ClusterPublish(client->username, state == CHATTING ? PRESENCE_BUSY : PRESENCE_ONLINE);
+    }
+    pthread_mutex_lock(&client->lock);
+    clientData *previous = client->chattingWith;
+    client->state = state;
+    client->chattingWith = with;
+    pthread_mutex_unlock(&client->lock);
+    if(previous && previous != with && previous->remote) ClientDataRelease(previous);
+}
+// Applies the per-socket options every accepted client connection needs
+void InitClientSocket(int clientSocket)
+{
+    int flag = 1;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)); // Chat messages are small, don't let Nagle delay them
+}
+/*
+ * Every reactor calls this to create its own listening socket on the same port. SO_REUSEPORT
+ * lets the kernel spread incoming connections across all of them.
+ */
 void InitServer(int *socketDesc, struct sockaddr_in *server)
 {
     // Create listening socket descriptor, this is where the server listens for incoming client connections
     *socketDesc = socket(AF_INET, SOCK_STREAM, 0);
     if (*socketDesc == -1)
     {
-        printf("ERROR: Could not create socket\n");
+        LogError("Could not create socket");
         exit(1);
     }
-    printf("INFO: Socket created\n");
+    LogInfo("Socket created");
 
     /*
      * This function sets the listening socket file descriptor as a non-blocking socket.
-     * This allows us to call the accept() function without blocking the main thread,
-     * which then lets us poll for incoming connections.
+     * This allows the event loop to accept every pending connection until accept() would block,
+     * which is required as the socket is watched in edge-triggered mode.
      * https://www.man7.org/linux/man-pages/man2/fcntl.2.html
      */
     int status = fcntl(*socketDesc, F_SETFL, fcntl(*socketDesc, F_GETFL, 0) | O_NONBLOCK);
     (void)status; // Silence unused variable warning
 
+    // Allow restarting the server right away without waiting for TIME_WAIT sockets to expire
+    int reuse = 1;
+    setsockopt(*socketDesc, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(*socketDesc, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
     // Prepare the sockaddr_in structure
     server->sin_family = AF_INET;
     server->sin_addr.s_addr = INADDR_ANY;
-    server->sin_port = htons(DEFAULT_PORT);
+    server->sin_port = htons(config.port);
 
     // Bind to port
     if(bind(*socketDesc, (struct sockaddr*)server, sizeof(*server)) < 0)
     {
-        perror("ERROR: Failed to bind to port");
+        LogError("Failed to bind to port: %m");
         exit(1);
     }
-    printf("INFO: Bind done\n");
+    LogInfo("Bind done");
 
     // Prepare the server to listen to incoming client connections
-    listen(*socketDesc, MAX_CLIENT);
+    listen(*socketDesc, SOMAXCONN);
 }
 
-void RejectChat(clientData *client, char *returnMessage)
+// conversationLock must be held
+void RejectChat(clientData *client)
 {
-    snprintf(returnMessage, DEFAULT_BUFLEN, "TALKTO: %d", (int)IDLE);
-    if(client->state != LOGGING_OUT) SendMessage(client, returnMessage);
+    if(client->state != LOGGING_OUT) SendState(client, REPLY_TALKTO, IDLE, NULL);
     if(client->chattingWith)
     {
-        SendMessage(client->chattingWith, returnMessage);
-        client->chattingWith->state = IDLE;
-        client->chattingWith->chattingWith = NULL;
+        SendState(client->chattingWith, REPLY_TALKTO, IDLE, NULL);
+        SetConversation(client->chattingWith, IDLE, NULL);
     }
-    client->state = IDLE;
-    client->chattingWith = NULL;
+    SetConversation(client, IDLE, NULL);
 }
 
-void HandleChatRequests(clientData *client, char *clientMessage, char *returnMessage)
+// conversationLock must be held
+void HandleChatRequestsLocked(clientData *client, char *args, size_t length)
 {
     if(client->state == CONNECTING) // If the client sending the request sent a message, it must be to cancel the conversation
     {
-        char response[8];
-        sscanf(clientMessage, "TalkTo %s", response);
-        if(strncmp(response, "Timeout", 7) == 0)
+        if(ArgumentIs(args, length, "Timeout")) // Sent by older clients that time out requests themselves
         {
-            printf("WARN: Client took too long to respond!\n");
-            RejectChat(client, returnMessage);
+            LogWarn("Client took too long to respond!");
+            RejectChat(client);
         }
         return;
     }
     else if(client->state == PENDING_REQUEST)
     {
-        char response[7];
-        sscanf(clientMessage, "TalkTo %s", response);
-        if(strncmp(response, "Accept", 6) == 0)
+        if(ArgumentIs(args, length, "Accept") && client->chattingWith)
         {
-            client->state = CHATTING;
-            client->chattingWith->state = CHATTING;
-            snprintf(returnMessage, DEFAULT_BUFLEN, "TALKTO: %d", (int)CHATTING);
-            SendMessage(client, returnMessage);
-            if(client->chattingWith)
-                SendMessage(client->chattingWith, returnMessage);
+            SetConversation(client, CHATTING, client->chattingWith);
+            SetConversation(client->chattingWith, CHATTING, client);
+            SendState(client, REPLY_TALKTO, CHATTING, NULL);
+            SendState(client->chattingWith, REPLY_TALKTO, CHATTING, NULL);
         }
         else // Rejected, both clients go back to their normal state
         {
-            RejectChat(client, returnMessage);
+            RejectChat(client);
         }
         return;
     }
     else if(client->state != IDLE) // Allow client to request a conversation only when idle
     {
-        SendMessage(client, "ERROR: You can't run this command now!");
+        SendText(client, REPLY_ERROR, "You can't run this command now!");
         return;
     }
     // Load username from client message
     char tempUsername[USERNAME_MAX];
-    strncpy(tempUsername, clientMessage+7, USERNAME_MAX);
+    size_t usernameLength = length < USERNAME_MAX ? length : USERNAME_MAX - 1;
+    memcpy(tempUsername, args, usernameLength);
+    tempUsername[usernameLength] = 0;
 
     if(strlen(tempUsername) == 0)
     {
-        SendMessage(client, "TalkTo: Empty username!");
+        SendText(client, REPLY_TALKTO_ERROR, "Empty username!");
         return;
     }
     if(strcmp(tempUsername, client->username) == 0)
     {
-        SendMessage(client, "TalkTo: You can't initiate a conversation with yourself!");
+        SendText(client, REPLY_TALKTO_ERROR, "You can't initiate a conversation with yourself!");
         return;
     }
     clientData* target = ClientDataFind(tempUsername);
     if(!target)
     {
-        SendMessage(client, "TalkTo: Couldn't find user!");
+        // A user on another cluster node is talked to through a proxy, the node hosting the user answers for it
+        int node = ClusterLocate(tempUsername);
+        if(node != CLUSTER_NOWHERE) target = ClusterProxyCreate(tempUsername, node, client);
+    }
+    if(!target)
+    {
+        SendText(client, REPLY_TALKTO_ERROR, "Couldn't find user!");
         return;
     }
     if(target->state != IDLE)
     {
-        SendMessage(client, "TalkTo: User is currently busy, try again later!");
+        SendText(client, REPLY_TALKTO_ERROR, "User is currently busy, try again later!");
         return;
     }
 
     // Send state change and the recipient's username back to client
-    snprintf(returnMessage, DEFAULT_BUFLEN, "TALKTO: %d %s", (int)CONNECTING, tempUsername);
-    SendMessage(client, returnMessage);
+    SendState(client, REPLY_TALKTO, CONNECTING, tempUsername);
     // Send state change and the sender's username to recipient
-    memset(returnMessage, 0, DEFAULT_BUFLEN);
-    snprintf(returnMessage, DEFAULT_BUFLEN, "TALKTO: %d %s", (int)PENDING_REQUEST, client->username);
-    SendMessage(target, returnMessage);
+    SendState(target, REPLY_TALKTO, PENDING_REQUEST, client->username);
     // Update clients' states server-side
-    client->state = CONNECTING;
-    client->chattingWith = target;
-    target->state = PENDING_REQUEST;
-    target->chattingWith = client;
+    SetConversation(client, CONNECTING, target);
+    SetConversation(target, PENDING_REQUEST, client);
+    // The requesting client's own reactor runs the request here, so its wheel can be used directly
+    if(config.requestTimeout) TimerArm(&client->requestTimer, config.requestTimeout * 1000ll);
+}
+void HandleChatRequests(clientData *client, char *args, size_t length)
+{
+    pthread_mutex_lock(&conversationLock);
+    HandleChatRequestsLocked(client, args, length);
+    pthread_mutex_unlock(&conversationLock);
+}
+
+/*
+ * Queues the messages kept for the client while it was offline. Delivery stops short of the high
+ * watermark, whatever is left waits for the client to ask for it with a bare Msg. In a cluster,
+ * the owner of the username is asked for the messages it stored as well.
+ */
+void DeliverStoredMessages(clientData *client)
+{
+    char reply[96];
+    unsigned int sent = 0, left = 0;
+    int owner = ClusterOwner(client->username);
+    if(owner != clusterSelf)
+        ClusterSend(owner, ClusterFrame(CLUSTER_FETCH, 0, clusterSelf, "", client->username, NULL, 0, NULL, 0, NULL));
+    pthread_mutex_lock(&storeLock);
+    storeMailbox *m = StoreMailboxFind(client->username, client->usernameHash);
+    while(m && sent < m->len)
+    {
+        storeRecord *record = StoreRecordAt(&m->records[sent]);
+        char sender[USERNAME_MAX];
+        size_t senderLength = record->senderLength < USERNAME_MAX ? record->senderLength : USERNAME_MAX - 1;
+        memcpy(sender, record->data + record->recipientLength, senderLength);
+        sender[senderLength] = 0;
+        if(client->outBytes + record->size > config.queueHigh) break;
+        if(!SendDirectMessage(client, sender, record->time, record->data + record->recipientLength + record->senderLength,
+                              record->textLength, NULL)) break;
+        sent++;
+    }
+    if(m) left = StoreMarkDelivered(m, sent);
+    pthread_mutex_unlock(&storeLock);
+
+    if(left)
+    {
+        snprintf(reply, sizeof(reply), "%u more offline messages are waiting, send Msg to get them", left);
+        SendText(client, REPLY_LOG, reply);
+    }
+}
+
+// Logs the client in as username, conversationLock must be held. Fails if the registry already has the username
+int ClaimUsername(clientData *client, char *username)
+{
+    if(!ClientDataSetUsername(client, username)) return 0;
+    UserIndexInsert(username, clusterSelf);
+    PresencePublish(client->username, client->usernameHash, PRESENCE_OFFLINE, PRESENCE_ONLINE);
+    ClusterPublish(client->username, PRESENCE_ONLINE);
+    SetConversation(client, IDLE, NULL);
+    return 1;
 }
+// Answers a login request, error is NULL if the client is logged in now
+void LoginAnswered(clientData *client, char *username, char *error)
+{
+    // The login deadline is over, from now on the client only has to stay responsive
+    if(!error)
+    {
+        TimerCancel(&client->idleTimer);
+        if(config.idleTimeout) TimerArm(&client->idleTimer, config.idleTimeout * 1000ll);
+    }
 
-void HandleLogin(clientData *client, char *clientMessage, char *returnMessage)
+    if(error)
+    {
+        SendText(client, REPLY_ERROR, error);
+    }
+    else // If the username is valid, let the client know about its new state and username
+    {
+        SendState(client, REPLY_LOGIN, IDLE, username);
+        DeliverStoredMessages(client);
+    }
+    LogInfo("Login request %s", error ? "rejected" : "accepted");
+}
+
+/*
+ * Logs a client in. In a cluster, a username owned by another node is claimed from it first and
+ * the login is only answered once it did, see CompleteLogin. Usernames this node owns are claimed
+ * in its own directory.
+ */
+void HandleLogin(clientData *client, char *args, size_t length)
 {
     if(client->state != LOGGING_IN)
     {
-        SendMessage(client, "ERROR: Already logged in");
+        SendText(client, REPLY_ERROR, "Already logged in");
+        return;
+    }
+    if(client->claiming)
+    {
+        SendText(client, REPLY_ERROR, "Login already in progress");
+        return;
+    }
+    // A text message ends at its terminator, while a binary username is taken as a whole and can't contain one
+    if(client->protocol == PROTOCOL_TEXT) length = strnlen(args, length);
+    else if(memchr(args, 0, length))
+    {
+        SendText(client, REPLY_ERROR, "Username contains a null byte!");
+        return;
+    }
+    if(ServerOverloaded())
+    {
+        char busy[64];
+        snprintf(busy, sizeof(busy), "Server is busy, retry after %ld ms", LoginRetryDelay(client));
+        METRIC_ADD(loginsDeferred, 1);
+        SendText(client, REPLY_ERROR, busy);
         return;
     }
     char tempUsername[USERNAME_MAX];
-    strncpy(tempUsername, clientMessage+6, USERNAME_MAX);
+    size_t usernameLength = length < USERNAME_MAX ? length : USERNAME_MAX - 1;
+    memcpy(tempUsername, args, usernameLength);
+    tempUsername[usernameLength] = 0;
 
-    // Empty and already taken usernames are invalid
-    int usernameInvalid = strlen(tempUsername) == 0 || strlen(clientMessage+6) >= USERNAME_MAX || (ClientDataFind(tempUsername) != NULL);
-    if(usernameInvalid)
+    int usernameInvalid = strlen(tempUsername) == 0 || length >= USERNAME_MAX;
+    int owner = usernameInvalid ? clusterSelf : ClusterOwner(tempUsername);
+    if(owner != clusterSelf)
     {
-        SendMessage(client, "ERROR: Username is taken or invalid!");
+        if(ClientDataFind(tempUsername)) usernameInvalid = 1;
+        else if(ClusterClaim(client, tempUsername, owner))
+        {
+            client->claiming = 1;
+            return;
+        }
+        else
+        {
+            LoginAnswered(client, tempUsername, "The server owning this username can't be reached, try again later!");
+            return;
+        }
     }
-    else // If the username is valid, apply changes server-side
+    else if(!usernameInvalid)
     {
-        strncpy(client->username, tempUsername, USERNAME_MAX);
-        client->state = IDLE;
-        snprintf(returnMessage, DEFAULT_BUFLEN, "%d %s", (int)IDLE, tempUsername); // Load the return message with relevant data (client's new state and username)
-        SendMessage(client, returnMessage);
+        // Already taken usernames are invalid, the directory and the registry claim the username atomically
+        pthread_mutex_lock(&conversationLock);
+        if(!ClusterDirectoryClaim(tempUsername, clusterSelf, 0)) usernameInvalid = 1;
+        else if(!ClaimUsername(client, tempUsername))
+        {
+            ClusterDirectoryRelease(tempUsername, clusterSelf);
+            usernameInvalid = 1;
+        }
+        pthread_mutex_unlock(&conversationLock);
     }
-    printf("INFO: Login request %s\n", usernameInvalid ? "rejected" : "accepted");
+    LoginAnswered(client, tempUsername, usernameInvalid ? "Username is taken or invalid!" : NULL);
+}
+// Finishes a login once the owner of the username answered its claim, run by the reactor owning the client
+void CompleteLogin(clientData *client, char *data, size_t length)
+{
+    claimResults result = (claimResults)data[0];
+    char *username = data + 1;
+    client->claiming = 0;
+    pthread_mutex_lock(&conversationLock);
+    int usernameInvalid = result != CLAIM_GRANTED || client->clientSocket < 0 || !ClaimUsername(client, username);
+    pthread_mutex_unlock(&conversationLock);
+    if(result == CLAIM_GRANTED && usernameInvalid) ClusterPublish(username, PRESENCE_OFFLINE); // Gives the username back
+    if(client->clientSocket < 0) return;
+    if(!usernameInvalid) LoginAnswered(client, username, NULL);
+    else LoginAnswered(client, username, result == CLAIM_UNREACHABLE ? "The server owning this username can't be reached, try again later!" :
+                                                                        "Username is taken or invalid!");
+}
+// Hands the answer to a claim to the reactor owning the client, called by the cluster thread
+void ClusterClaimed(clientData *client, char *username, claimResults result)
+{
+    char data[USERNAME_MAX + 1];
+    size_t usernameLength = strnlen(username, USERNAME_MAX - 1);
+    data[0] = (char)result;
+    memcpy(data + 1, username, usernameLength);
+    data[1 + usernameLength] = 0;
+    outMessage *out = OutMessageCreate(client, data, usernameLength + 2, NULL, 0, NULL);
+    if(!out) return;
+    out->task = CompleteLogin;
+    ReactorPost(client->owner, client, out);
 }
 
-void GetUserData(clientData *client, char *returnMessage)
+/*
+ * Lists the logged in users in alphabetical order. The arguments are any of:
+ *      - prefix <text>: Only users whose name starts with the text
+ *      - offset <n>, limit <n>: Skip the first n users, show at most n users
+ *      - count: Only the amount of users
+ * A list that doesn't fit into a single reply ends with the range shown, the next page starts right after it.
+ */
+void GetUserData(clientData *client, char *args, size_t length, char *returnMessage)
 {
+    char prefix[USERNAME_MAX] = "";
+    unsigned long offset = 0, limit = ULONG_MAX;
+    int countOnly = 0, paged = 0;
     if(client->state == LOGGING_IN)
     {
-        SendMessage(client, "ERROR: You're not authorized to run this command!");
+        SendText(client, REPLY_ERROR, "You're not authorized to run this command!");
         return;
     }
-    strcat(returnMessage, "LOG: List of users: \n");
-    clientData *clientPtr = clients;
-    while(clientPtr != NULL)
+    char options[128];
+    CopyArguments(options, sizeof(options), args, length);
+    char *option, *save = NULL;
+    for(option = strtok_r(options, " ", &save); option; option = strtok_r(NULL, " ", &save))
     {
-        strcat(returnMessage, clientPtr->username);
+        char *value = strcmp(option, "count") == 0 ? NULL : strtok_r(NULL, " ", &save);
+        if(strcmp(option, "count") == 0) countOnly = 1;
+        else if(value && strcmp(option, "prefix") == 0 && strlen(value) < USERNAME_MAX) strcpy(prefix, value);
+        else if(value && strcmp(option, "offset") == 0 && isdigit((unsigned char)value[0])) offset = strtoul(value, NULL, 10);
+        else if(value && strcmp(option, "limit") == 0 && isdigit((unsigned char)value[0])) limit = strtoul(value, NULL, 10);
+        else
+        {
+            SendText(client, REPLY_ERROR, "Usage: Users [prefix <text>] [offset <n>] [limit <n>] [count]");
+            return;
+        }
+        paged = 1;
+    }
 
-        if(clientPtr->id == client->id)
-            strcat(returnMessage, " (You)"); // Append the (You) indicator to the client querying usernames
-        if(clientPtr->state == CHATTING)
-            strcat(returnMessage, " (Busy)"); // Append the (Chatting) indicator to busy clients
-        if(clientPtr->nextClient)
-            strcat(returnMessage, "\n");
+    size_t prefixLength = strlen(prefix);
+    size_t used;
+    pthread_rwlock_rdlock(&userIndexLock);
+    unsigned int first = UserIndexLowerBound(prefix, prefixLength);
+    unsigned int last = UserIndexPrefixEnd(prefix, prefixLength, first);
+    unsigned long version = (unsigned long)userIndexVersion;
+    unsigned int total = last - first;
+    if(countOnly)
+    {
+        pthread_rwlock_unlock(&userIndexLock);
+        if(prefixLength) snprintf(returnMessage, DEFAULT_BUFLEN, "%u users starting with %s (version %lu)", total, prefix, version);
+        else snprintf(returnMessage, DEFAULT_BUFLEN, "%u users online (version %lu)", total, version);
+        SendText(client, REPLY_LOG, returnMessage);
+        return;
+    }
+    used = snprintf(returnMessage, DEFAULT_BUFLEN, "List of users: \n");
+    unsigned int start = offset < total ? first + (unsigned int)offset : last;
+    unsigned int i;
+    for(i = start; i < last && i - start < limit; i++)
+    {
+        userEntry *entry = &userIndex[i];
+        // Room is left for the range that ends a list cut short
+        if(used + USERNAME_MAX + 32 + 96 > DEFAULT_BUFLEN) break;
+        used += snprintf(returnMessage + used, DEFAULT_BUFLEN - used, "%s%s%s%s", i > start ? "\n" : "", entry->username,
+                         strcmp(entry->username, client->username) == 0 ? " (You)" : "", entry->busy ? " (Busy)" : "");
+    }
+    pthread_rwlock_unlock(&userIndexLock);
+    unsigned int shown = i - start;
+    if(!shown && paged)
+        snprintf(returnMessage + used, DEFAULT_BUFLEN - used, "Showing none of %u users (version %lu)", total, version);
+    else if(paged || start + shown < last)
+        snprintf(returnMessage + used, DEFAULT_BUFLEN - used, "\nShowing %u to %u of %u users (version %lu)",
+                 start - first + 1, start - first + shown, total, version);
+    if(SendText(client, REPLY_LOG, returnMessage))
+        LogDebug("Sent user list");
+}
 
-        clientPtr = clientPtr->nextClient;
+// Copies the room name at the start of the arguments, which ends at the first space. Returns its length, 0 if it's invalid
+size_t ParseRoomName(char *args, size_t length, char name[ROOMNAME_MAX])
+{
+    size_t nameLength = 0;
+    while(nameLength < length && args[nameLength] != ' ' && args[nameLength] != 0) nameLength++;
+    if(nameLength == 0 || nameLength >= ROOMNAME_MAX) return 0;
+    memcpy(name, args, nameLength);
+    name[nameLength] = 0;
+    return nameLength;
+}
+void HandleJoin(clientData *client, char *args, size_t length)
+{
+    char name[ROOMNAME_MAX];
+    char reply[ROOMNAME_MAX + 32];
+    if(client->state == LOGGING_IN)
+    {
+        SendText(client, REPLY_ERROR, "You're not authorized to run this command!");
+        return;
+    }
+    size_t nameLength = ParseRoomName(args, length, name);
+    if(!nameLength || nameLength != strnlen(args, length))
+    {
+        SendText(client, REPLY_ERROR, "Room name is empty, too long or contains spaces!");
+        return;
+    }
+    if(ClientRoomIndex(client, name) >= 0)
+    {
+        SendText(client, REPLY_ERROR, "You're already in this room!");
+        return;
+    }
+    if(client->roomCount >= CLIENT_ROOMS_MAX)
+    {
+        SendText(client, REPLY_ERROR, "You can't join any more rooms!");
+        return;
+    }
+    if(!RoomJoin(client, name, ReactorId(client->owner)))
+    {
+        SendText(client, REPLY_ERROR, "Couldn't join the room!");
+        return;
+    }
+    snprintf(reply, sizeof(reply), "Joined room %s", name);
+    SendText(client, REPLY_LOG, reply);
+}
+void HandleLeave(clientData *client, char *args, size_t length)
+{
+    char name[ROOMNAME_MAX];
+    char reply[ROOMNAME_MAX + 32];
+    int index = ParseRoomName(args, length, name) ? ClientRoomIndex(client, name) : -1;
+    if(index < 0)
+    {
+        SendText(client, REPLY_ERROR, "You're not in this room!");
+        return;
     }
-    if(SendMessage(client, returnMessage))
-        printf("INFO: Sent user list\n");
+    RoomLeave(client, index, ReactorId(client->owner));
+    snprintf(reply, sizeof(reply), "Left room %s", name);
+    SendText(client, REPLY_LOG, reply);
 }
+void GetRoomData(clientData *client, char *returnMessage)
+{
+    if(client->state == LOGGING_IN)
+    {
+        SendText(client, REPLY_ERROR, "You're not authorized to run this command!");
+        return;
+    }
+    size_t used = snprintf(returnMessage, DEFAULT_BUFLEN, "List of rooms: ");
+    pthread_rwlock_rdlock(&roomsAccess);
+    unsigned int i;
+    for(i = 0; i < roomBucketCount && used < DEFAULT_BUFLEN; i++)
+    {
+        room *r;
+        for(r = roomBuckets[i]; r && used < DEFAULT_BUFLEN; r = r->next)
+            used += snprintf(returnMessage + used, DEFAULT_BUFLEN - used, "\n%s (%u)%s", r->name, r->memberCount,
+                             ClientRoomIndex(client, r->name) >= 0 ? " (Joined)" : "");
+    }
+    pthread_rwlock_unlock(&roomsAccess);
+    SendText(client, REPLY_LOG, returnMessage);
+}
+// The room message is serialized once here, every member gets the same pooled buffer queued
+void SendToRoom(clientData *client, char *args, size_t length)
+{
+    char name[ROOMNAME_MAX];
+    size_t nameLength = ParseRoomName(args, length, name);
+    int index = nameLength ? ClientRoomIndex(client, name) : -1;
+    if(index < 0)
+    {
+        SendText(client, REPLY_ERROR, "You're not in this room!");
+        return;
+    }
+    size_t textOffset = nameLength < length ? nameLength + 1 : length;
+    if(length - textOffset > ROOM_MESSAGE_MAX)
+    {
+        SendText(client, REPLY_ERROR, "Message is too long for a room!");
+        return;
+    }
+    roomBroadcast *b = BuildRoomMessage(name, client->username, args + textOffset, length - textOffset);
+    if(!b) return;
+    RoomBroadcast(client->rooms[index], b);
+    BufferRelease((char*)b);
+}
+/*
+ * Relays a compressed chat message to both ends of the conversation. Clients that negotiated
+ * compression get the compressed text straight from the input buffer like any other chat message,
+ * the server never looks into it. The text is only inflated, once, for a client that didn't, and a
+ * text that doesn't inflate is reported to the sender instead.
+ */
+void SendCompressedTo(clientData *client, clientData *partner, char *data, size_t length)
+{
+    clientData *recipients[2] = { partner, client };
+    char *text = NULL;
+    long textLength = 0;
+    int i;
+    METRIC_ADD(compressedIn, 1);
+    for(i = 0; i < 2; i++)
+    {
+        if(recipients[i]->features & PROTOCOL_FEATURE_DEFLATE)
+        {
+            SendChatMessage(recipients[i], client->username, data, length, inputBuffer, FRAME_FLAG_COMPRESSED);
+            METRIC_ADD(compressedRelayed, 1);
+            continue;
+        }
+        if(!text)
+        {
+            text = BufferAlloc(BUFFER_LARGE_SIZE);
+            if(!text) return;
+            textLength = DecompressText(&relayCompressor, data, length, text, FRAME_MAX_PAYLOAD);
+            if(textLength < 0)
+            {
+                SendText(client, REPLY_ERROR, "Couldn't decompress the message!");
+                break;
+            }
+        }
+        SendChatMessage(recipients[i], client->username, text, textLength, text, 0);
+        METRIC_ADD(inflated, 1);
+    }
+    BufferRelease(text);
+}
+void SendTo(clientData *client, char *args, size_t length)
+{
+    // The partner is referenced so it can't be freed by its own reactor while the message is being sent
+    pthread_mutex_lock(&client->lock);
+    clientData *partner = client->state == CHATTING ? client->chattingWith : NULL;
+    if(partner) ClientDataRef(partner);
+    pthread_mutex_unlock(&client->lock);
 
-void SendTo(clientData *client, char *clientMessage, char *returnMessage)
+    if(!partner)
+    {
+        SendText(client, REPLY_ERROR, "Client is not in a conversation");
+        return;
+    }
+    if(inputFlags & FRAME_FLAG_COMPRESSED) SendCompressedTo(client, partner, args, length);
+    else
+    {
+        SendChatMessage(partner, client->username, args, length, inputBuffer, 0);
+        SendChatMessage(client, client->username, args, length, inputBuffer, 0);
+    }
+    ClientDataRelease(partner);
+}
+// Called by the message store's sync thread once a message for an offline user is on disk
+void StoreAcknowledge(clientData *client, char *recipient)
 {
-    if(client->state != CHATTING)
+    char reply[USERNAME_MAX + 96];
+    snprintf(reply, sizeof(reply), "%s is offline, the message will be delivered once they log in", recipient);
+    SendText(client, REPLY_LOG, reply);
+}
+/*
+ * Sends a direct message, "Msg <user> <message>". It's delivered right away if the recipient is
+ * online and kept in the message store otherwise, a bare Msg fetches the rest of the stored ones.
+ */
+void HandleDirectMessage(clientData *client, char *args, size_t length)
+{
+    char recipient[USERNAME_MAX];
+    char reply[USERNAME_MAX + 32];
+    if(client->state == LOGGING_IN)
     {
-        SendMessage(client, "ERROR: Client is not in a conversation");
+        SendText(client, REPLY_ERROR, "You're not authorized to run this command!");
         return;
     }
-    snprintf(returnMessage, DEFAULT_BUFLEN, "MESSAGE:[%s]: %s", client->username, clientMessage+5);
-    if(client->chattingWith)
+    if(length == 0)
+    {
+        DeliverStoredMessages(client);
+        return;
+    }
+    size_t recipientLength = 0;
+    while(recipientLength < length && args[recipientLength] != ' ' && args[recipientLength] != 0) recipientLength++;
+    size_t textOffset = recipientLength + 1;
+    if(recipientLength == 0 || recipientLength >= USERNAME_MAX || textOffset >= length)
     {
-        SendMessage(client->chattingWith, returnMessage);
-        SendMessage(client, returnMessage);
+        SendText(client, REPLY_ERROR, "Usage: Msg <username> <message>");
+        return;
     }
+    memcpy(recipient, args, recipientLength);
+    recipient[recipientLength] = 0;
+
+    // The lookup and the append happen under the lock logins claim usernames with, so a login either finds the message or is found
+    int stored = 0, node = CLUSTER_NOWHERE;
+    pthread_mutex_lock(&conversationLock);
+    clientData *target = ClientDataFind(recipient);
+    if(target) ClientDataRef(target);
+    else if((node = ClusterLocate(recipient)) == CLUSTER_NOWHERE) stored = StoreAppend(client, recipient, args + textOffset, length - textOffset);
+    pthread_mutex_unlock(&conversationLock);
+
+    if(node != CLUSTER_NOWHERE) // Sent through a proxy of the recipient, the node hosting them or the owner storing it acknowledges it
+    {
+        target = ClusterProxyCreate(recipient, node, client);
+        if(!target || !SendDirectMessage(target, client->username, (int64_t)time(NULL), args + textOffset, length - textOffset, inputBuffer))
+            SendText(client, REPLY_ERROR, "Couldn't send the message!");
+        if(target) ClientDataRelease(target);
+    }
+    else if(target)
+    {
+        SendDirectMessage(target, client->username, (int64_t)time(NULL), args + textOffset, length - textOffset, inputBuffer);
+        ClientDataRelease(target);
+        snprintf(reply, sizeof(reply), "Message sent to %s", recipient);
+        SendText(client, REPLY_LOG, reply);
+    }
+    else if(stored < 0) SendText(client, REPLY_ERROR, "The user's mailbox is full!");
+    else if(!stored) SendText(client, REPLY_ERROR, "Couldn't store the message!");
+    // Stored messages are acknowledged by StoreAcknowledge once they're on disk
 }
-void DisconnectChat(clientData *client, char *returnMessage)
+// Subscribes to presence changes with "Presence" or "Presence on", "Presence off" ends the subscription
+void HandlePresence(clientData *client, char *args, size_t length)
+{
+    if(client->state == LOGGING_IN)
+    {
+        SendText(client, REPLY_ERROR, "You're not authorized to run this command!");
+        return;
+    }
+    if(length == 0 || (length == 2 && ArgumentIs(args, length, "on")))
+    {
+        if(!PresenceSubscribe(client, ReactorId(client->owner)))
+        {
+            SendText(client, REPLY_ERROR, "Couldn't subscribe to presence changes!");
+            return;
+        }
+        // The version lines the changes up with a Users listing taken before
+        pthread_rwlock_rdlock(&userIndexLock);
+        unsigned long version = (unsigned long)userIndexVersion;
+        pthread_rwlock_unlock(&userIndexLock);
+        char reply[96];
+        snprintf(reply, sizeof(reply), "Subscribed to presence changes (version %lu)", version);
+        SendText(client, REPLY_LOG, reply);
+    }
+    else if(length == 3 && ArgumentIs(args, length, "off"))
+    {
+        PresenceUnsubscribe(client, ReactorId(client->owner));
+        SendText(client, REPLY_LOG, "Unsubscribed from presence changes");
+    }
+    else SendText(client, REPLY_ERROR, "Usage: Presence [on|off]");
+}
+// conversationLock must be held
+void CloseConversation(clientData *client)
 {
     if(client->state != LOGGING_OUT && client->state != CHATTING)
     {
-        SendMessage(client, "ERROR: Client is not in a conversation");
+        SendText(client, REPLY_ERROR, "Client is not in a conversation");
         return;
     }
     if(client->chattingWith)
     {
-        printf("Disconnecting from conversation...\n");
-        snprintf(returnMessage, DEFAULT_BUFLEN, "DISCONNECT: %d", (int)IDLE);
-        SendMessage(client->chattingWith, returnMessage);
-        SendMessage(client, returnMessage);
-        client->chattingWith->state = IDLE;
-        client->state = IDLE;
+        LogInfo("Disconnecting from conversation...");
+        SendState(client->chattingWith, REPLY_DISCONNECT, IDLE, NULL);
+        if(client->state != LOGGING_OUT) SendState(client, REPLY_DISCONNECT, IDLE, NULL);
+        SetConversation(client->chattingWith, IDLE, NULL);
+        SetConversation(client, IDLE, NULL);
+    }
+}
+void DisconnectChat(clientData *client)
+{
+    pthread_mutex_lock(&conversationLock);
+    CloseConversation(client);
+    pthread_mutex_unlock(&conversationLock);
+}
+
+void GetServerStats(clientData *client, char *returnMessage)
+{
+    if(client->state == LOGGING_IN)
+    {
+        SendText(client, REPLY_ERROR, "You're not authorized to run this command!");
+        return;
+    }
+    MetricsFormat(returnMessage, DEFAULT_BUFLEN, __atomic_load_n(&clientsLen, __ATOMIC_RELAXED));
+    SendText(client, REPLY_LOG, returnMessage);
+}
+
+/*
+ * Whether a client may run a command under its rate limit, see admission.h. The first command
+ * dropped gets an error telling the client when to retry, the ones after it until a command of
+ * the class goes through again are dropped silently.
+ */
+int AdmitCommand(clientData *client, clientCommands cmd, uint64_t now)
+{
+    int rateClass = CommandRateClass(client, cmd);
+    if(rateClass < 0) return 1;
+    long retry = RateTake(client, rateClass, now);
+    if(!retry)
+    {
+        client->rateWarned &= ~(1 << rateClass);
+        return 1;
+    }
+    METRIC_ADD(rateLimited, 1);
+    if(!(client->rateWarned & (1 << rateClass)))
+    {
+        char limited[96];
+        snprintf(limited, sizeof(limited), "Too many %s, retry after %ld ms", rateClassesString[rateClass], retry);
+        client->rateWarned |= 1 << rateClass;
+        SendText(client, REPLY_ERROR, limited);
+    }
+    return 0;
+}
+
+// Runs a single client command, args holds everything that follows the command itself
+void HandleCommand(clientData *client, clientCommands cmd, char *args, size_t length, char *returnMessage)
+{
+    uint64_t start = MetricsNanos();
+    CaptureCommand(client, cmd, inputFlags, args, length);
+    if(!AdmitCommand(client, cmd, start))
+    {
+        METRIC_ADD(messagesIn, 1);
+        return;
+    }
+    switch(cmd)
+    {
+        case LOGIN:
+            HandleLogin(client, args, length);
+            break;
+        case USERS:
+            GetUserData(client, args, length, returnMessage);
+            break;
+        case TALKTO:
+            HandleChatRequests(client, args, length);
+            break;
+        case DATA:
+            SendTo(client, args, length);
+            break;
+        case DISCONNECT:
+            DisconnectChat(client);
+            break;
+        case JOIN:
+            HandleJoin(client, args, length);
+            break;
+        case LEAVE:
+            HandleLeave(client, args, length);
+            break;
+        case ROOMS:
+            GetRoomData(client, returnMessage);
+            break;
+        case SAY:
+            SendToRoom(client, args, length);
+            break;
+        case STATS:
+            GetServerStats(client, returnMessage);
+            break;
+        case MSG:
+            HandleDirectMessage(client, args, length);
+            break;
+        case PRESENCE:
+            HandlePresence(client, args, length);
+            break;
+        case PING: // Answers a heartbeat, the idle timeout starts over
+            if(client->heartbeatSent)
+            {
+                client->heartbeatSent = 0;
+                TimerArm(&client->idleTimer, config.idleTimeout * 1000ll);
+            }
+            break;
+        default:
+            SendText(client, REPLY_ERROR, "Unknown command");
+    }
+    METRIC_ADD(messagesIn, 1);
+    METRIC_ADD(commands[cmd], 1);
+    HistogramRecord(&localMetrics->handlerLatency, MetricsNanos() - start);
+}
+
+// Parses a text protocol message, which must be null-terminated
+void HandleTextMessage(clientData *client, char *clientMessage, size_t length, char *returnMessage)
+{
+    clientCommands cmd = StringToCommandClient(clientMessage);
+    size_t argsOffset = cmd == UNKNOWN ? length : strlen(clientCommandsString[cmd]) + 1;
+    if(argsOffset > length) argsOffset = length;
+    HandleCommand(client, cmd, clientMessage + argsOffset, length - argsOffset, returnMessage);
+}
+
+// Answers the HELLO frame a binary protocol client starts with
+int NegotiateProtocol(clientData *client, frame *hello)
+{
+    int version = ParseHello(hello);
+    if(!version) return 0;
+
+    client->protocol = PROTOCOL_BINARY;
+    client->protocolVersion = version < PROTOCOL_VERSION ? version : PROTOCOL_VERSION;
+    client->features = ParseHelloFeatures(hello) & PROTOCOL_FEATURES;
+    SendBytes(client, frameBuffer, BuildHello(frameBuffer, (uint8_t)client->protocolVersion, (uint8_t)client->features));
+    return 1;
+}
+
+/*
+ * Handles every complete message at the start of data, which must have room for one more byte
+ * to null-terminate text messages. Returns the amount of bytes consumed, the rest is the start of
+ * a frame that has to be kept until more data arrives. Returns -1 if the client sent something
+ * that can't be parsed, in which case it has to be disconnected.
+ * The data must be at the start of a pooled buffer. Handlers relaying part of it take a
+ * reference to that buffer, which the caller has to check before reusing it.
+ */
+long HandleInput(clientData *client, char *data, size_t length, char *returnMessage)
+{
+    inputBuffer = data;
+    inputFlags = 0;
+    size_t consumed = 0;
+    frame f;
+    if(client->protocol == PROTOCOL_UNKNOWN)
+    {
+        if(data[0] != 0)
+        {
+            client->protocol = PROTOCOL_TEXT;
+        }
+        else
+        {
+            int size = ParseFrame(data, length, &f);
+            if(size == 0) return 0;
+            if(size < 0 || !NegotiateProtocol(client, &f)) return -1;
+            consumed = size;
+        }
+    }
+    if(client->protocol == PROTOCOL_TEXT)
+    {
+        // The text protocol has no framing, whatever a single read returned is one message
+        data[length] = 0;
+        LogDebugSampled("Client %lu has sent a %zu byte long message: %s", client->id, length, data);
+        HandleTextMessage(client, data, length, returnMessage);
+        return length;
+    }
+
+    // Dispatch straight on the opcode of every complete frame
+    while(consumed < length)
+    {
+        int size = ParseFrame(data + consumed, length - consumed, &f);
+        if(size < 0) return -1;
+        if(size == 0) break;
+        LogDebugSampled("Client %lu has sent a %u byte long frame with opcode %d", client->id, f.length, f.opcode);
+        consumed += size;
+        // Only the text of a Data message can be compressed, the server would have to inflate anything else
+        if((f.flags & FRAME_FLAG_COMPRESSED) && f.opcode != DATA)
+        {
+            SendText(client, REPLY_ERROR, "Only Data messages can be compressed!");
+            continue;
+        }
+        inputFlags = f.flags;
+        HandleCommand(client, f.opcode < UNKNOWN ? (clientCommands)f.opcode : UNKNOWN, f.payload, f.length, returnMessage);
+    }
+    return consumed;
+}
+
+// Releases everything held by a client whose connection has been closed
+void ClientDisconnect(clientData *client)
+{
+    LogInfo("Client %lu has disconnected", client->id);
+    METRIC_ADD(disconnected, 1);
+    CaptureConnection(client, TRACE_CLOSE);
+
+    TlsClose(client);
+    ReactorDetach(client);       // Cancels what the io_uring backend still has in flight for the socket
+    close(client->clientSocket); // Closing the descriptor also removes it from the event loop
+    client->clientSocket = -1;   // Messages still posted to this client are dropped from now on
+    QueueClear(client);
+    TimerCancel(&client->idleTimer);
+    TimerCancel(&client->requestTimer);
+    RoomLeaveAll(client, ReactorId(client->owner));
+    PresenceUnsubscribe(client, ReactorId(client->owner));
+
+    // Handle client that has been forcibly disconnected (e.g Ctrl-C)
+    pthread_mutex_lock(&conversationLock);
+    if(client->state == CONNECTING || client->state == PENDING_REQUEST)
+    {
+        SetConversation(client, LOGGING_OUT, client->chattingWith);
+        RejectChat(client);
+    }
+    else if(client->state == CHATTING)
+    {
+        SetConversation(client, LOGGING_OUT, client->chattingWith);
+        CloseConversation(client);
+    }
+    SetConversation(client, LOGGING_OUT, NULL);
+    if(client->username[0])
+    {
+        UserIndexRemove(client->username);
+        PresencePublish(client->username, client->usernameHash, PRESENCE_ONLINE, PRESENCE_OFFLINE);
+        ClusterPublish(client->username, PRESENCE_OFFLINE);
+    }
+    ClientDataRemove(client); // Removed while the lock is held, so no conversation can be started with it anymore
+    pthread_mutex_unlock(&conversationLock);
+}
+
+/*
+ * Cluster, see cluster.h. Replies forwarded by other nodes run on the cluster thread, which sends
+ * to local clients the way any other thread does, through the mailboxes of their reactors.
+ */
+// Answers a frame with a text reply, sent back to its node from the recipient to the sender
+void ClusterAnswer(clusterFrame *f, serverReplies reply, char *text)
+{
+    ClusterSend(f->origin, ClusterFrame(reply, 0, clusterSelf, f->to, f->from, text, strlen(text), NULL, 0, NULL));
+}
+void ClusterDirectMessage(clusterFrame *f);
+/*
+ * Keeps a direct message for a user that's offline. The sender is acknowledged once it's on disk,
+ * through a proxy if it's on another node.
+ */
+void ClusterStore(clusterFrame *f, char *sender, char *text, size_t textLength)
+{
+    clientData *client = f->origin == clusterSelf ? ClientDataAcquire(sender) : NULL;
+    if(!client) client = ClusterProxyCreate(sender, f->from[0] ? f->origin : clusterSelf, NULL); // Only acknowledged if it's been sent by a user
+    if(!client) return;
+    pthread_mutex_lock(&conversationLock);
+    int stored = StoreAppend(client, f->to, text, textLength);
+    pthread_mutex_unlock(&conversationLock);
+    if(stored < 0) SendText(client, REPLY_ERROR, "The user's mailbox is full!");
+    else if(!stored) SendText(client, REPLY_ERROR, "Couldn't store the message!");
+    ClientDataRelease(client);
+}
+/*
+ * The recipient of a frame isn't logged in anywhere, requests are answered and direct messages are
+ * stored by the owner of the recipient, or by this node if the owner can't be reached.
+ */
+void ClusterUnreachable(clusterFrame *f)
+{
+    if(f->opcode == REPLY_TALKTO && f->length && f->data[0] == PENDING_REQUEST) ClusterAnswer(f, REPLY_TALKTO_ERROR, "Couldn't find user!");
+    else if(f->opcode == REPLY_DIRECT_MESSAGE)
+    {
+        int owner = ClusterOwner(f->to);
+        if(owner != clusterSelf && !(f->flags & CLUSTER_FLAG_BOUNCE) &&
+           ClusterSend(owner, ClusterFrame(f->opcode, (f->flags & ~CLUSTER_FLAG_ROUTE) | CLUSTER_FLAG_BOUNCE, f->origin, f->from, f->to,
+                                           NULL, 0, f->data, f->length, f->buffer))) return;
+        f->flags |= CLUSTER_FLAG_BOUNCE;
+        ClusterDirectMessage(f);
+    }
+}
+// Relays a chat message of a remote partner, straight from the buffer it was received into unless it has to be inflated
+void ClusterRelayMessage(clusterFrame *f)
+{
+    if(!f->length || f->length < 1u + (unsigned char)f->data[0]) return;
+    char *text = f->data + 1 + (unsigned char)f->data[0];
+    size_t textLength = f->length - 1 - (unsigned char)f->data[0];
+    clientData *target = ClientDataAcquire(f->to);
+    if(!target) return;
+    pthread_mutex_lock(&target->lock);
+    clientData *partner = target->state == CHATTING ? target->chattingWith : NULL;
+    int fromPartner = partner && partner->remote && strcmp(partner->username, f->from) == 0;
+    pthread_mutex_unlock(&target->lock);
+    if(!fromPartner)
+    {
+        ClientDataRelease(target);
+        return;
+    }
+    if(!(f->flags & FRAME_FLAG_COMPRESSED) || (target->features & PROTOCOL_FEATURE_DEFLATE))
+        SendChatMessage(target, f->from, text, textLength, f->buffer, f->flags & FRAME_FLAG_COMPRESSED);
+    else
+    {
+        char *inflated = BufferAlloc(BUFFER_LARGE_SIZE);
+        long inflatedLength = inflated ? DecompressText(&relayCompressor, text, textLength, inflated, FRAME_MAX_PAYLOAD) : -1;
+        if(inflatedLength >= 0)
+        {
+            SendChatMessage(target, f->from, inflated, inflatedLength, inflated, 0);
+            METRIC_ADD(inflated, 1);
+        }
+        BufferRelease(inflated);
+    }
+    ClientDataRelease(target);
+}
+/*
+ * Delivers a direct message from a remote sender, or stores one for a user that's offline. Messages
+ * sent from the store of another node have no sender in their prefix and aren't acknowledged.
+ */
+void ClusterDirectMessage(clusterFrame *f)
+{
+    if(f->length < 9 || f->length < 9u + (unsigned char)f->data[8] || (unsigned char)f->data[8] >= USERNAME_MAX) return;
+    int64_t sent = 0;
+    int i;
+    for(i = 0; i < 8; i++) sent = (sent << 8) | (unsigned char)f->data[i];
+    char sender[USERNAME_MAX];
+    memcpy(sender, f->data + 9, (unsigned char)f->data[8]);
+    sender[(unsigned char)f->data[8]] = 0;
+    char *text = f->data + 9 + (unsigned char)f->data[8];
+    size_t textLength = f->length - 9 - (unsigned char)f->data[8];
+    if(f->flags & CLUSTER_FLAG_BOUNCE)
+    {
+        ClusterStore(f, sender, text, textLength);
+        return;
+    }
+    clientData *target = ClientDataAcquire(f->to);
+    if(!target)
+    {
+        ClusterUnreachable(f);
+        return;
+    }
+    char reply[USERNAME_MAX + 32];
+    SendDirectMessage(target, sender, sent, text, textLength, f->buffer);
+    ClientDataRelease(target);
+    if(!f->from[0]) return;
+    snprintf(reply, sizeof(reply), "Message sent to %s", f->to);
+    ClusterAnswer(f, REPLY_LOG, reply);
+}
+/*
+ * Sends the messages stored for a user this node owns to the node they logged in on, as many as
+ * DeliverStoredMessages would queue for a local client. The rest waits for the next bare Msg.
+ */
+void ClusterFetch(clusterFrame *f)
+{
+    char reply[96];
+    unsigned int sent = 0, left = 0;
+    if(ClusterDirectoryFind(f->to) != f->origin) return;
+    clientData *proxy = ClusterProxyCreate(f->to, f->origin, NULL);
+    if(!proxy) return;
+    size_t queued = 0;
+    pthread_mutex_lock(&storeLock);
+    storeMailbox *m = StoreMailboxFind(f->to, HashUsername(f->to));
+    while(m && sent < m->len)
+    {
+        storeRecord *record = StoreRecordAt(&m->records[sent]);
+        char sender[USERNAME_MAX];
+        size_t senderLength = record->senderLength < USERNAME_MAX ? record->senderLength : USERNAME_MAX - 1;
+        memcpy(sender, record->data + record->recipientLength, senderLength);
+        sender[senderLength] = 0;
+        if(queued + record->size > config.queueHigh) break;
+        if(!SendDirectMessage(proxy, sender, record->time, record->data + record->recipientLength + record->senderLength,
+                              record->textLength, NULL)) break;
+        queued += record->size;
+        sent++;
+    }
+    if(m) left = StoreMarkDelivered(m, sent);
+    pthread_mutex_unlock(&storeLock);
+
+    if(left)
+    {
+        snprintf(reply, sizeof(reply), "%u more offline messages are waiting, send Msg to get them", left);
+        SendText(proxy, REPLY_LOG, reply);
+    }
+    ClientDataRelease(proxy);
+}
+// Applies a conversation reply of a remote user to the local recipient, conversationLock must be held
+void ClusterConversation(clusterFrame *f)
+{
+    char text[256];
+    clientData *target = ClientDataFind(f->to);
+    if(!target || target->state == LOGGING_IN)
+    {
+        ClusterUnreachable(f);
+        return;
+    }
+    if(f->opcode == REPLY_LOG || f->opcode == REPLY_ERROR)
+    {
+        CopyArguments(text, sizeof(text), f->data, f->length);
+        SendText(target, f->opcode, text);
+        return;
+    }
+    if(f->opcode == REPLY_TALKTO && f->length && f->data[0] == PENDING_REQUEST) // A new request, the remote user gets a proxy here
+    {
+        clientData *proxy = target->state == IDLE ? ClusterProxyCreate(f->from, f->origin, target) : NULL;
+        if(!proxy)
+        {
+            ClusterAnswer(f, REPLY_TALKTO_ERROR, "User is currently busy, try again later!");
+            return;
+        }
+        SendState(target, REPLY_TALKTO, PENDING_REQUEST, f->from);
+        SetConversation(proxy, CONNECTING, target);
+        SetConversation(target, PENDING_REQUEST, proxy);
+        return;
+    }
+    // Everything else only concerns the conversation with the sender
+    clientData *partner = target->chattingWith;
+    if(!partner || !partner->remote || strcmp(partner->username, f->from) != 0) return;
+    __atomic_store_n(&partner->node, f->origin, __ATOMIC_RELAXED); // Answered by the node hosting the user, no need to ask the owner anymore
+    if(f->opcode == REPLY_TALKTO_ERROR)
+    {
+        if(target->state != CONNECTING) return;
+        CopyArguments(text, sizeof(text), f->data, f->length);
+        SendText(target, REPLY_TALKTO_ERROR, text);
+        SetConversation(target, IDLE, NULL);
+    }
+    else if((f->opcode != REPLY_TALKTO && f->opcode != REPLY_DISCONNECT) || !f->length) return;
+    else if(f->data[0] == CHATTING && target->state == CONNECTING) // The request was accepted
+    {
+        SetConversation(target, CHATTING, partner);
+        SetConversation(partner, CHATTING, target);
+        SendState(target, REPLY_TALKTO, CHATTING, NULL);
+    }
+    else if(f->data[0] == IDLE) // Rejected, timed out or ended
+    {
+        SendState(target, f->opcode, IDLE, NULL);
+        SetConversation(partner, IDLE, NULL);
+        SetConversation(target, IDLE, NULL);
+    }
+}
+// Handles a reply for a user of this node, or passes one on to the node hosting its recipient
+void ClusterDeliver(clusterFrame *f)
+{
+    if(f->flags & CLUSTER_FLAG_ROUTE)
+    {
+        int node = ClusterDirectoryFind(f->to);
+        if(node != clusterSelf)
+        {
+            if(node == CLUSTER_NOWHERE || !ClusterSend(node, ClusterFrame(f->opcode, f->flags & ~CLUSTER_FLAG_ROUTE, f->origin, f->from, f->to,
+                                                                          NULL, 0, f->data, f->length, f->buffer)))
+                ClusterUnreachable(f);
+            else METRIC_ADD(clusterRouted, 1);
+            return;
+        }
+        f->flags &= ~CLUSTER_FLAG_ROUTE;
+    }
+    if(f->opcode == REPLY_MESSAGE) ClusterRelayMessage(f);
+    else if(f->opcode == REPLY_DIRECT_MESSAGE) ClusterDirectMessage(f);
+    else
+    {
+        pthread_mutex_lock(&conversationLock);
+        ClusterConversation(f);
+        pthread_mutex_unlock(&conversationLock);
+    }
+}
+// Records a status change of a user on another node
+void ClusterApplyPresence(char *username, presenceStatus status, int node)
+{
+    int busy = 0;
+    pthread_mutex_lock(&conversationLock);
+    int host = UserIndexGet(username, &busy);
+    presenceStatus before = host < 0 ? PRESENCE_OFFLINE : busy ? PRESENCE_BUSY : PRESENCE_ONLINE;
+    if(node == clusterSelf || host == clusterSelf || (status == PRESENCE_OFFLINE && host != node)) // Stale
+    {
+        pthread_mutex_unlock(&conversationLock);
+        return;
+    }
+    if(status == PRESENCE_OFFLINE) UserIndexRemove(username);
+    else
+    {
+        UserIndexInsert(username, node);
+        UserIndexSetBusy(username, status == PRESENCE_BUSY);
+    }
+    PresencePublish(username, HashUsername(username), before, status);
+    pthread_mutex_unlock(&conversationLock);
+}
+// Takes the users of a node that's down offline and ends every conversation with them
+void ClusterNodeDown(int node)
+{
+    unsigned int count, i;
+    pthread_mutex_lock(&conversationLock);
+    userEntry *dropped = UserIndexDropNode(node, &count);
+    for(i = 0; i < count; i++)
+        PresencePublish(dropped[i].username, HashUsername(dropped[i].username), dropped[i].busy ? PRESENCE_BUSY : PRESENCE_ONLINE, PRESENCE_OFFLINE);
+    free(dropped);
+
+    pthread_rwlock_rdlock(&clientsAccess);
+    for(i = 0; i < clientsLen; i++)
+    {
+        clientData *c = clients[i];
+        clientData *partner = c->chattingWith;
+        if(!partner || !partner->remote) continue;
+        int partnerNode = __atomic_load_n(&partner->node, __ATOMIC_RELAXED);
+        if(partnerNode != node && (partnerNode != CLUSTER_ASK_OWNER || ClusterOwner(partner->username) != node)) continue;
+        SendState(c, c->state == CHATTING ? REPLY_DISCONNECT : REPLY_TALKTO, IDLE, NULL);
+        SetConversation(c, IDLE, NULL);
+    }
+    pthread_rwlock_unlock(&clientsAccess);
+    pthread_mutex_unlock(&conversationLock);
+}
+// Replays every user of this node to a node whose link came up
+void ClusterAnnounce(int node)
+{
+    unsigned int i;
+    pthread_mutex_lock(&conversationLock);
+    pthread_rwlock_rdlock(&clientsAccess);
+    for(i = 0; i < clientsLen; i++)
+    {
+        clientData *c = clients[i];
+        if(c->username[0] && c->state != LOGGING_OUT) ClusterSync(node, c->username, c->state == CHATTING ? PRESENCE_BUSY : PRESENCE_ONLINE);
+    }
+    pthread_rwlock_unlock(&clientsAccess);
+    pthread_mutex_unlock(&conversationLock);
+}
+
+/*
+ * Timeouts, fired by the timing wheel of the reactor owning the client, see timer.h.
+ * A client that timed out is sent what's still queued for it before the connection is closed,
+ * as far as the socket takes it right away, so it learns why.
+ */
+void ClientExpire(clientData *client)
+{
+    if(QueueFlush(client) < 0) LogDebug("Client %lu couldn't be told about its timeout", client->id);
+    ClientDisconnect(client);
+}
+// The conversation request of the client wasn't answered in time
+void OnRequestTimeout(timer *t)
+{
+    clientData *client = (clientData*)t->data;
+    pthread_mutex_lock(&conversationLock);
+    if(client->state == CONNECTING) // Otherwise the request was answered or cancelled in the meantime
+    {
+        LogInfo("Conversation request of client %lu timed out", client->id);
+        METRIC_ADD(requestTimeouts, 1);
+        SendText(client, REPLY_LOG, "The user didn't answer your request in time");
+        if(client->chattingWith) SendText(client->chattingWith, REPLY_LOG, "The conversation request timed out");
+        RejectChat(client);
+    }
+    pthread_mutex_unlock(&conversationLock);
+}
+/*
+ * Enforces the login deadline until the client is logged in, the idle timeout after that. The timer
+ * isn't moved for every message, it compares the time of the last one when it fires instead. A
+ * client that has been silent for too long is sent a heartbeat, and disconnected if it doesn't answer.
+ */
+void OnIdleTimeout(timer *t)
+{
+    clientData *client = (clientData*)t->data;
+    if(client->state == LOGGING_IN)
+    {
+        LogInfo("Client %lu didn't log in in time", client->id);
+        METRIC_ADD(loginTimeouts, 1);
+        SendText(client, REPLY_ERROR, "Login timed out");
+        ClientExpire(client);
+        return;
+    }
+    if(client->heartbeatSent && client->lastActive >= client->heartbeatSent) client->heartbeatSent = 0; // Answered
+    long long idle = (t->wheel->current - client->lastActive) * TIMER_TICK_MS;
+    if(idle < config.idleTimeout * 1000ll)
+        TimerArm(t, config.idleTimeout * 1000ll - idle);
+    else if(!client->heartbeatSent)
+    {
+        client->heartbeatSent = t->wheel->current;
+        SendText(client, REPLY_PING, "");
+        TimerArm(t, HEARTBEAT_TIMEOUT);
+    }
+    else
+    {
+        LogInfo("Client %lu didn't answer the heartbeat", client->id);
+        METRIC_ADD(idleTimeouts, 1);
+        ClientExpire(client);
     }
 }
 
@@ -1,5 +1,9 @@
 #ifndef SHARED_H
 #define SHARED_H
+// Needed for accept4, recvmmsg and other Linux specific extensions
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 // Headers
 #include <limits.h>
 #include <stdlib.h>
@@ -13,6 +17,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <time.h>
+#include <sys/resource.h>
 
 /*
  * Header file that is used both in server and client code.
@@ -21,17 +26,18 @@
 #define DEFAULT_BUFLEN 65536
 #define DEFAULT_PORT   27015
 
-#define MAX_CLIENT 5
+// Default connection limit of the server, can be changed with the -c option
+#define MAX_CLIENT 16384
 // A username can be at most 15 characters long
 #define USERNAME_MAX 16
+// A room name can be at most 31 characters long, and a client can be in at most 16 rooms at once
+#define ROOMNAME_MAX 32
+#define CLIENT_ROOMS_MAX 16
 // A command sent to the server can be at most 10 characters long
 #define CLIENT_CMD_MAX 11
 
 typedef enum { LOGGING_IN, LOGGING_OUT, IDLE, CONNECTING, PENDING_REQUEST, CHATTING } clientStates;
-typedef enum { LOGIN = 0, LOGOUT, USERS, TALKTO, DISCONNECT, DATA, UNKNOWN } clientCommands;
-
-// nanosleep boilerplate used to delay threads in order to prevent busy-waiting
-struct timespec timeout = { .tv_sec = 0, .tv_nsec = 500000 };
+typedef enum { LOGIN = 0, LOGOUT, USERS, TALKTO, DISCONNECT, DATA, JOIN, LEAVE, ROOMS, SAY, STATS, MSG, PRESENCE, PING, UNKNOWN } clientCommands;
 
 // Helper functions to reduce copy-pasted code
 int startsWith(char *message, char *str)
@@ -49,15 +55,27 @@ int AssertValidCommand(clientCommands c)
     return 1;
 }
 
+// Every connection holds a file descriptor, so the default soft limit (usually 1024) is raised to the hard limit
+void RaiseFileLimit()
+{
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &limit) < 0)
+            perror("WARN: Failed to raise the file descriptor limit");
+    }
+}
+
 // Used to convert a string command into its enum counterpart
-char *clientCommandsString[6] = {"Login", "Logout", "Users", "TalkTo", "Disconnect", "Data" };
+char *clientCommandsString[UNKNOWN] = {"Login", "Logout", "Users", "TalkTo", "Disconnect", "Data", "Join", "Leave", "Rooms", "Say", "Stats", "Msg", "Presence", "Ping" };
 clientCommands StringToCommandClient(char *message)
 {
     char command[CLIENT_CMD_MAX];
     sscanf(message, "%10s\n", command);
 
     int i;
-    for(i = 0; i < 6; i++)
+    for(i = 0; i < UNKNOWN; i++)
     {
         if(strcmp(command, clientCommandsString[i]) == 0)
         {
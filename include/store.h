@@ -0,0 +1,627 @@
+#ifndef STORE_H
+#define STORE_H
+#include "map.h"
+#include "config.h"
+#include "metrics.h"
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Offline message store. Direct messages for users that aren't logged in are appended to a log
+ * made out of fixed-size segment files, which are mapped into memory as a whole. Appending is
+ * a copy into the mapping of the newest segment, nothing is written with a system call.
+ *
+ * A sync thread commits the appended records in groups. Every few milliseconds (-Y) it syncs
+ * whatever was appended since the last commit with a single msync per segment, and only then
+ * tells the senders that their messages are stored. The amount of syncs per second is bounded no
+ * matter how many messages are sent, and a message is only acknowledged once it's on disk. A
+ * commit that fails leaves its records indexed for delivery, so its senders keep waiting for the
+ * commit retrying them rather than being told their messages were lost.
+ *
+ * Pending records are indexed by recipient in memory, and the index points straight into the
+ * mappings. On startup every segment is mapped again and only the record headers are walked to
+ * rebuild the index. Segments without pending records are removed unread, and checksums are
+ * only verified for records past the last commit. A record is marked delivered in place once
+ * it's queued for its recipient, and a segment is removed as soon as all of its records are.
+ *
+ * The index and the segments are guarded by storeLock. It's taken after conversationLock.
+ */
+#define STORE_MAGIC          "ORMS"
+#define STORE_VERSION        1
+#define STORE_SEGMENT_SIZE   (16 * 1024 * 1024)
+#define STORE_BUCKETS_INITIAL 64
+#define STORE_MAILBOX_MAX    1024 // Pending messages a single user can have
+#define STORE_SYNC_BATCH     16   // Segments synced at most in a single commit
+#define STORE_RETRY_MS       100  // Wait before a failed commit is retried
+// Stored messages are sent in a single frame along with their header, see SendDirectMessage
+#define STORE_MESSAGE_MAX    (FRAME_MAX_PAYLOAD - 64)
+
+typedef struct storeSegmentHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t synced;   // Records before this offset are known to be on disk
+    uint64_t pending;  // Records not delivered yet, segments without any are removed unread on startup
+    char reserved[40];
+} storeSegmentHeader;
+
+/*
+ * A record, padded to a multiple of 8 bytes. The size is written after everything else, a zero
+ * size marks the end of the records since segment files are created filled with zeros.
+ */
+typedef struct storeRecord {
+    uint32_t size;
+    uint32_t checksum;     // Of the data, only verified for records past the synced offset
+    int64_t time;          // Unix time the message was sent at
+    uint32_t textLength;
+    uint8_t recipientLength;
+    uint8_t senderLength;
+    uint8_t delivered;
+    uint8_t reserved;
+    char data[];           // Recipient, sender and text, none of them null-terminated
+} storeRecord;
+
+typedef struct storeSegment {
+    struct storeSegment *next;  // Segments in the order they were created in
+    unsigned int number;        // Segment files are named after it
+    storeSegmentHeader *header; // Start of the mapping of the whole file
+    size_t tail;                // Bytes used
+    size_t synced;
+    unsigned long pending;
+} storeSegment;
+
+typedef struct storeLocation {
+    storeSegment *segment;
+    uint32_t offset;
+} storeLocation;
+
+// Pending messages of a single recipient in the order they were sent in
+typedef struct storeMailbox {
+    struct storeMailbox *next; // Next mailbox in the same bucket
+    char username[USERNAME_MAX];
+    uint32_t hash;
+    storeLocation *records;
+    unsigned int len;
+    unsigned int capacity;
+} storeMailbox;
+
+// Sender waiting for the sync thread to commit its message
+typedef struct storeAck {
+    struct storeAck *next;
+    clientData *client;        // Referenced until the acknowledgement is sent
+    char recipient[USERNAME_MAX];
+} storeAck;
+
+// Defined by the server, tells a sender that its message made it to disk
+void StoreAcknowledge(clientData *client, char *recipient);
+
+storeSegment *storeSegments = NULL;
+storeSegment *storeActive = NULL;   // Newest segment, the only one appended to
+unsigned int storeNextNumber = 0;
+storeMailbox **storeBuckets;
+unsigned int storeBucketCount = 0;
+unsigned int storeMailboxCount = 0;
+storeAck *storeAcks = NULL;         // In reverse order of the appends
+pthread_mutex_t storeLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t storeAppended = PTHREAD_COND_INITIALIZER;
+int storeRunning = 0;
+int storeAcknowledgeClose = 0;      // Whether the last commit still acknowledges its senders
+pthread_t storeThread;
+
+uint32_t StoreChecksum(char *data, size_t length)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    size_t i;
+    for(i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+storeRecord* StoreRecordAt(storeLocation *location)
+{
+    return (storeRecord*)((char*)location->segment->header + location->offset);
+}
+
+// storeLock must be held from here on
+storeMailbox* StoreMailboxFind(char *username, uint32_t hash)
+{
+    storeMailbox *m = storeBuckets[hash & (storeBucketCount - 1)];
+    while(m && (m->hash != hash || strcmp(m->username, username) != 0)) m = m->next;
+    return m;
+}
+// Doubles the amount of buckets
+void StoreGrow()
+{
+    unsigned int count = storeBucketCount * 2;
+    storeMailbox **buckets = (storeMailbox**)calloc(count, sizeof(storeMailbox*));
+    if(!buckets) return; // Chains just get longer
+    unsigned int i;
+    for(i = 0; i < storeBucketCount; i++)
+    {
+        storeMailbox *m = storeBuckets[i];
+        while(m)
+        {
+            storeMailbox *next = m->next;
+            m->next = buckets[m->hash & (count - 1)];
+            buckets[m->hash & (count - 1)] = m;
+            m = next;
+        }
+    }
+    free(storeBuckets);
+    storeBuckets = buckets;
+    storeBucketCount = count;
+}
+storeMailbox* StoreMailboxCreate(char *username, uint32_t hash)
+{
+    storeMailbox *m = (storeMailbox*)calloc(1, sizeof(storeMailbox));
+    if(!m) return NULL;
+    strncpy(m->username, username, USERNAME_MAX - 1);
+    m->hash = hash;
+    if(storeMailboxCount + 1 > storeBucketCount) StoreGrow();
+    m->next = storeBuckets[hash & (storeBucketCount - 1)];
+    storeBuckets[hash & (storeBucketCount - 1)] = m;
+    storeMailboxCount++;
+    return m;
+}
+void StoreMailboxRemove(storeMailbox *m)
+{
+    storeMailbox **link = &storeBuckets[m->hash & (storeBucketCount - 1)];
+    while(*link != m) link = &(*link)->next;
+    *link = m->next;
+    storeMailboxCount--;
+    free(m->records);
+    free(m);
+}
+int StoreMailboxAdd(storeMailbox *m, storeSegment *segment, uint32_t offset)
+{
+    if(m->len == m->capacity)
+    {
+        unsigned int capacity = m->capacity ? m->capacity * 2 : 8;
+        storeLocation *records = (storeLocation*)realloc(m->records, capacity * sizeof(storeLocation));
+        if(!records) return 0;
+        m->records = records;
+        m->capacity = capacity;
+    }
+    m->records[m->len].segment = segment;
+    m->records[m->len].offset = offset;
+    m->len++;
+    return 1;
+}
+
+void StoreSegmentPath(char *path, size_t size, unsigned int number)
+{
+    snprintf(path, size, "%s/segment-%08u.log", config.storePath, number);
+}
+// Maps a segment file, a new one is created filled with zeros
+storeSegment* StoreSegmentMap(unsigned int number, int create)
+{
+    char path[PATH_MAX];
+    StoreSegmentPath(path, sizeof(path), number);
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if(fd < 0)
+    {
+        LogError("Failed to open message store segment %s: %m", path);
+        return NULL;
+    }
+    struct stat info;
+    if((create && ftruncate(fd, STORE_SEGMENT_SIZE) < 0) || fstat(fd, &info) < 0 || info.st_size != STORE_SEGMENT_SIZE)
+    {
+        LogError("Message store segment %s has the wrong size", path);
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, STORE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file open
+    storeSegment *segment = (storeSegment*)calloc(1, sizeof(storeSegment));
+    if(mapping == MAP_FAILED || !segment)
+    {
+        LogError("Failed to map message store segment %s: %m", path);
+        if(mapping != MAP_FAILED) munmap(mapping, STORE_SEGMENT_SIZE);
+        free(segment);
+        return NULL;
+    }
+    segment->number = number;
+    segment->header = (storeSegmentHeader*)mapping;
+    if(create)
+    {
+        memcpy(segment->header->magic, STORE_MAGIC, 4);
+        segment->header->version = STORE_VERSION;
+        segment->header->synced = sizeof(storeSegmentHeader);
+    }
+    segment->tail = sizeof(storeSegmentHeader);
+    segment->synced = sizeof(storeSegmentHeader);
+    return segment;
+}
+void StoreSegmentUnmap(storeSegment *segment, int remove)
+{
+    if(remove)
+    {
+        char path[PATH_MAX];
+        StoreSegmentPath(path, sizeof(path), segment->number);
+        if(unlink(path) < 0) LogWarn("Failed to remove message store segment %s: %m", path);
+    }
+    munmap(segment->header, STORE_SEGMENT_SIZE);
+    free(segment);
+}
+// Removes the segments every record of which has been delivered and synced, except the one appended to
+void StoreDropDelivered()
+{
+    storeSegment **link = &storeSegments;
+    while(*link)
+    {
+        storeSegment *segment = *link;
+        if(segment != storeActive && segment->pending == 0 && segment->synced == segment->tail)
+        {
+            *link = segment->next;
+            StoreSegmentUnmap(segment, 1);
+        }
+        else link = &segment->next;
+    }
+}
+
+/*
+ * Walks the records of a segment mapped on startup and indexes the pending ones. Records past the
+ * last commit may have been torn by a crash, the first one with a bad checksum ends the segment.
+ */
+void StoreSegmentScan(storeSegment *segment)
+{
+    char *base = (char*)segment->header;
+    size_t synced = segment->header->synced;
+    size_t offset = sizeof(storeSegmentHeader);
+    segment->pending = 0;
+    while(offset + sizeof(storeRecord) <= STORE_SEGMENT_SIZE)
+    {
+        storeRecord *record = (storeRecord*)(base + offset);
+        size_t dataLength = (size_t)record->recipientLength + record->senderLength + record->textLength;
+        if(record->size == 0 || record->size > STORE_SEGMENT_SIZE - offset || sizeof(storeRecord) + dataLength > record->size) break;
+        if(offset >= synced && StoreChecksum(record->data, dataLength) != record->checksum)
+        {
+            LogWarn("Message store segment %u ends with a torn record at %zu", segment->number, offset);
+            memset(record, 0, sizeof(storeRecord));
+            break;
+        }
+        if(!record->delivered)
+        {
+            char recipient[USERNAME_MAX];
+            size_t recipientLength = record->recipientLength < USERNAME_MAX ? record->recipientLength : USERNAME_MAX - 1;
+            memcpy(recipient, record->data, recipientLength);
+            recipient[recipientLength] = 0;
+            uint32_t hash = HashUsername(recipient);
+            storeMailbox *m = StoreMailboxFind(recipient, hash);
+            if(!m) m = StoreMailboxCreate(recipient, hash);
+            if(m && StoreMailboxAdd(m, segment, (uint32_t)offset)) segment->pending++;
+        }
+        offset += record->size;
+    }
+    segment->tail = offset;
+    segment->synced = offset < synced ? offset : synced;
+    segment->header->pending = segment->pending;
+    // Records that made it to the file but weren't committed before the last run ended are committed now
+    if(segment->synced < segment->tail && msync(segment->header, STORE_SEGMENT_SIZE, MS_SYNC) == 0)
+        segment->synced = segment->header->synced = segment->tail;
+}
+
+int StoreSegmentNumberCompare(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+    return x < y ? -1 : x > y;
+}
+// Maps the segments left by previous runs in the order they were written in
+int StoreLoad()
+{
+    DIR *directory = opendir(config.storePath);
+    if(!directory)
+    {
+        LogError("Failed to open message store %s: %m", config.storePath);
+        return 0;
+    }
+    unsigned int *numbers = NULL;
+    unsigned int count = 0, capacity = 0;
+    struct dirent *entry;
+    while((entry = readdir(directory)))
+    {
+        unsigned int number;
+        char extra;
+        if(sscanf(entry->d_name, "segment-%u.lo%c", &number, &extra) != 2 || extra != 'g') continue;
+        if(count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            unsigned int *grown = (unsigned int*)realloc(numbers, capacity * sizeof(unsigned int));
+            if(!grown) break;
+            numbers = grown;
+        }
+        numbers[count++] = number;
+    }
+    closedir(directory);
+    qsort(numbers, count, sizeof(unsigned int), StoreSegmentNumberCompare);
+
+    storeSegment **last = &storeSegments;
+    unsigned long pending = 0;
+    unsigned int i;
+    for(i = 0; i < count; i++)
+    {
+        storeNextNumber = numbers[i] + 1;
+        storeSegment *segment = StoreSegmentMap(numbers[i], 0);
+        if(!segment) continue;
+        if(memcmp(segment->header->magic, STORE_MAGIC, 4) != 0 || segment->header->version != STORE_VERSION)
+        {
+            LogWarn("Skipping message store segment %u, it has an unknown format", numbers[i]);
+            StoreSegmentUnmap(segment, 0);
+            continue;
+        }
+        if(segment->header->pending == 0 && i + 1 < count) // Fully delivered, there's nothing to read
+        {
+            StoreSegmentUnmap(segment, 1);
+            continue;
+        }
+        StoreSegmentScan(segment);
+        pending += segment->pending;
+        *last = segment;
+        last = &segment->next;
+        storeActive = segment;
+    }
+    free(numbers);
+    LogInfo("Message store holds %lu pending messages for %u users", pending, storeMailboxCount);
+    return 1;
+}
+
+// Starts a new segment once the newest one can't fit another record
+int StoreRoll(size_t size)
+{
+    if(storeActive && storeActive->tail + size <= STORE_SEGMENT_SIZE) return 1;
+    storeSegment *segment = StoreSegmentMap(storeNextNumber, 1);
+    if(!segment) return 0;
+    storeNextNumber++;
+    storeSegment **last = &storeSegments;
+    while(*last) last = &(*last)->next;
+    *last = segment;
+    storeActive = segment; // The previous one is removed once it's synced and delivered
+    return 1;
+}
+/*
+ * Appends a message for an offline user and queues the sender for the acknowledgement. Returns -1
+ * if the recipient's mailbox is full and 0 if the message couldn't be stored. Takes storeLock.
+ */
+int StoreAppend(clientData *sender, char *recipient, char *text, size_t length)
+{
+    size_t recipientLength = strnlen(recipient, USERNAME_MAX - 1);
+    size_t senderLength = strnlen(sender->username, USERNAME_MAX - 1);
+    if(length > STORE_MESSAGE_MAX) length = STORE_MESSAGE_MAX;
+    size_t dataLength = recipientLength + senderLength + length;
+    size_t size = (sizeof(storeRecord) + dataLength + 7) & ~(size_t)7;
+    uint32_t hash = HashUsername(recipient);
+    storeAck *ack = (storeAck*)malloc(sizeof(storeAck));
+    if(!ack) return 0;
+
+    pthread_mutex_lock(&storeLock);
+    storeMailbox *m = StoreMailboxFind(recipient, hash);
+    if(m && m->len >= STORE_MAILBOX_MAX)
+    {
+        pthread_mutex_unlock(&storeLock);
+        free(ack);
+        return -1;
+    }
+    if(!m) m = StoreMailboxCreate(recipient, hash);
+    if(!m || !StoreRoll(size) || !StoreMailboxAdd(m, storeActive, (uint32_t)storeActive->tail))
+    {
+        if(m && m->len == 0) StoreMailboxRemove(m);
+        pthread_mutex_unlock(&storeLock);
+        free(ack);
+        return 0;
+    }
+    storeRecord *record = (storeRecord*)((char*)storeActive->header + storeActive->tail);
+    record->time = (int64_t)time(NULL);
+    record->textLength = (uint32_t)length;
+    record->recipientLength = (uint8_t)recipientLength;
+    record->senderLength = (uint8_t)senderLength;
+    record->delivered = 0;
+    memcpy(record->data, recipient, recipientLength);
+    memcpy(record->data + recipientLength, sender->username, senderLength);
+    memcpy(record->data + recipientLength + senderLength, text, length);
+    record->checksum = StoreChecksum(record->data, dataLength);
+    __atomic_store_n(&record->size, (uint32_t)size, __ATOMIC_RELEASE); // Makes the record valid
+    storeActive->tail += size;
+    storeActive->pending++;
+    storeActive->header->pending = storeActive->pending;
+
+    ClientDataRef(sender);
+    ack->client = sender;
+    strncpy(ack->recipient, recipient, USERNAME_MAX - 1);
+    ack->recipient[USERNAME_MAX - 1] = 0;
+    ack->next = storeAcks;
+    storeAcks = ack;
+    pthread_cond_signal(&storeAppended);
+    pthread_mutex_unlock(&storeLock);
+    METRIC_ADD(stored, 1);
+    return 1;
+}
+// Marks the first count messages of the mailbox delivered, returns how many are left
+unsigned int StoreMarkDelivered(storeMailbox *m, unsigned int count)
+{
+    unsigned int i;
+    for(i = 0; i < count; i++)
+    {
+        storeSegment *segment = m->records[i].segment;
+        StoreRecordAt(&m->records[i])->delivered = 1;
+        segment->pending--;
+        segment->header->pending = segment->pending;
+    }
+    METRIC_ADD(storedDelivered, count);
+    unsigned int left = m->len - count;
+    if(left == 0) StoreMailboxRemove(m);
+    else if(count)
+    {
+        memmove(m->records, m->records + count, left * sizeof(storeLocation));
+        m->len = left;
+    }
+    if(count) StoreDropDelivered();
+    return left;
+}
+
+typedef struct storeSyncRange {
+    storeSegment *segment;
+    size_t from;
+    size_t to;
+} storeSyncRange;
+
+/*
+ * Group commit. Everything appended since the last commit is synced with one msync per segment,
+ * then every sender waiting for it is acknowledged at once. Returns 0 if the sync failed, the
+ * senders are queued again for the next commit then.
+ */
+int StoreCommit()
+{
+    storeSyncRange ranges[STORE_SYNC_BATCH];
+    int count = 0;
+    pthread_mutex_lock(&storeLock);
+    storeAck *acks = storeAcks;
+    storeAcks = NULL;
+    storeSegment *segment;
+    for(segment = storeSegments; segment && count < STORE_SYNC_BATCH; segment = segment->next)
+    {
+        if(segment->synced == segment->tail) continue;
+        ranges[count].segment = segment; // Not removed before it's synced, see StoreDropDelivered
+        ranges[count].from = segment->synced;
+        ranges[count].to = segment->tail;
+        count++;
+    }
+    pthread_mutex_unlock(&storeLock);
+    if(!count && !acks) return 1;
+
+    int failed = 0, i;
+    long page = sysconf(_SC_PAGESIZE);
+    for(i = 0; i < count; i++)
+    {
+        char *base = (char*)ranges[i].segment->header;
+        size_t from = ranges[i].from & ~(size_t)(page - 1);
+        // The header page goes along, it holds the pending count the next startup relies on
+        if((from > 0 && msync(base, page, MS_SYNC) < 0) || msync(base + from, ranges[i].to - from, MS_SYNC) < 0)
+        {
+            LogError("Failed to sync message store segment %u: %m", ranges[i].segment->number);
+            failed = 1;
+        }
+    }
+    METRIC_ADD(storeSyncs, 1);
+
+    pthread_mutex_lock(&storeLock);
+    if(failed)
+    {
+        // Behind the senders that appended since, which are newer
+        storeAck **tail = &storeAcks;
+        while(*tail) tail = &(*tail)->next;
+        *tail = acks;
+        pthread_mutex_unlock(&storeLock);
+        return 0;
+    }
+    for(i = 0; i < count; i++)
+    {
+        ranges[i].segment->synced = ranges[i].to;
+        ranges[i].segment->header->synced = ranges[i].to; // On disk with the next commit
+    }
+    StoreDropDelivered();
+    pthread_mutex_unlock(&storeLock);
+
+    // Acknowledged in the order the messages were sent in
+    storeAck *ordered = NULL;
+    while(acks)
+    {
+        storeAck *next = acks->next;
+        acks->next = ordered;
+        ordered = acks;
+        acks = next;
+    }
+    int running = __atomic_load_n(&storeRunning, __ATOMIC_ACQUIRE) || storeAcknowledgeClose;
+    while(ordered)
+    {
+        storeAck *next = ordered->next;
+        if(running) StoreAcknowledge(ordered->client, ordered->recipient);
+        ClientDataRelease(ordered->client);
+        free(ordered);
+        ordered = next;
+    }
+    return 1;
+}
+void* StoreThread(void *arg)
+{
+    MetricsAttach(metricsReactors); // First background block
+    struct timespec interval = { .tv_sec = config.storeSyncInterval / 1000, .tv_nsec = (config.storeSyncInterval % 1000) * 1000000L };
+    struct timespec retry = { .tv_sec = 0, .tv_nsec = STORE_RETRY_MS * 1000000L };
+    while(1)
+    {
+        pthread_mutex_lock(&storeLock);
+        while(storeRunning && !storeAcks) pthread_cond_wait(&storeAppended, &storeLock);
+        int running = storeRunning;
+        pthread_mutex_unlock(&storeLock);
+
+        // Gives other appends the chance to join this commit
+        if(running && config.storeSyncInterval) nanosleep(&interval, NULL);
+        int committed = StoreCommit();
+        if(!running) break;
+        if(!committed) nanosleep(&retry, NULL);
+    }
+    return NULL;
+}
+
+int StoreOpen()
+{
+    if(mkdir(config.storePath, 0755) < 0 && errno != EEXIST)
+    {
+        LogError("Failed to create message store %s: %m", config.storePath);
+        return 0;
+    }
+    storeBuckets = (storeMailbox**)calloc(STORE_BUCKETS_INITIAL, sizeof(storeMailbox*));
+    if(!storeBuckets) return 0;
+    storeBucketCount = STORE_BUCKETS_INITIAL;
+    if(!StoreLoad()) return 0;
+
+    storeRunning = 1;
+    if(pthread_create(&storeThread, NULL, StoreThread, NULL) != 0)
+    {
+        LogError("Failed to start message store thread");
+        storeRunning = 0;
+        return 0;
+    }
+    return 1;
+}
+/*
+ * Commits whatever is left and unmaps every segment, the reactors must be stopped by now.
+ * The senders of the last commit are only acknowledged if asked to, when the server is
+ * handed over they're still connected and the acknowledgements go along, see handoff.h.
+ */
+void StoreClose(int acknowledge)
+{
+    pthread_mutex_lock(&storeLock);
+    storeRunning = 0;
+    storeAcknowledgeClose = acknowledge;
+    pthread_cond_signal(&storeAppended);
+    pthread_mutex_unlock(&storeLock);
+    pthread_join(storeThread, NULL);
+
+    // Senders still waiting after a failed last commit are never told, their messages may or may not be on disk
+    while(storeAcks)
+    {
+        storeAck *next = storeAcks->next;
+        ClientDataRelease(storeAcks->client);
+        free(storeAcks);
+        storeAcks = next;
+    }
+    unsigned int i;
+    for(i = 0; i < storeBucketCount; i++)
+    {
+        while(storeBuckets[i]) StoreMailboxRemove(storeBuckets[i]);
+    }
+    free(storeBuckets);
+    while(storeSegments)
+    {
+        storeSegment *next = storeSegments->next;
+        StoreSegmentUnmap(storeSegments, 0);
+        storeSegments = next;
+    }
+    storeActive = NULL;
+    storeAcknowledgeClose = 0;
+}
+
+#endif // STORE_H
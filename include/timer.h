@@ -0,0 +1,190 @@
+#ifndef TIMER_H
+#define TIMER_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Hierarchical timing wheel, one per reactor, holding the timeouts of the reactor's clients.
+ *
+ * Time is counted in ticks of TIMER_TICK_MS. Every level has TIMER_SLOTS slots, a slot of the
+ * first level spans a single tick and a slot of every further level spans a whole rotation of
+ * the level below it. A timer is put into the lowest level its expiry fits into, and whenever a
+ * level wraps around, the next slot of the level above is cascaded, its timers moving down to
+ * where they now fit. Arming and cancelling a timer is a constant time list operation, timers
+ * only ever move between levels a few times before they expire, and most of them, e.g. a request
+ * answered in time, are cancelled without ever being looked at again.
+ *
+ * Each level keeps a bitmap of its occupied slots, so the reactor can sleep until the next slot
+ * that has to be looked at instead of waking up every tick.
+ *
+ * A wheel and its timers are only ever touched by the thread of the reactor owning them.
+ */
+#define TIMER_TICK_MS    10
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS      (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS     4 // Timeouts of up to 64^4 ticks, about 19 days
+#define TIMER_MAX_TICKS  ((1ll << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1)
+
+struct timerWheel;
+
+typedef struct timer {
+    struct timer *next;
+    struct timer **prev;        // Pointer to this timer in the list holding it, NULL while it isn't armed
+    long long expiry;           // Tick it fires at
+    unsigned char level;
+    unsigned char slot;
+    struct timerWheel *wheel;
+    void (*expire)(struct timer *t);
+    void *data;
+} timer;
+
+typedef struct timerWheel {
+    long long current;          // Last tick that was processed
+    unsigned int count;         // Armed timers
+    uint64_t occupied[TIMER_LEVELS];
+    timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+} timerWheel;
+
+long long TimerTicks(long long micros)
+{
+    return micros / (TIMER_TICK_MS * 1000);
+}
+
+void TimerWheelInit(timerWheel *w, long long nowMicros)
+{
+    memset(w, 0, sizeof(timerWheel));
+    w->current = TimerTicks(nowMicros);
+}
+
+void TimerInit(timer *t, timerWheel *w, void (*expire)(timer *t), void *data)
+{
+    t->next = NULL;
+    t->prev = NULL;
+    t->wheel = w;
+    t->expire = expire;
+    t->data = data;
+}
+
+int TimerArmed(timer *t)
+{
+    return t->prev != NULL;
+}
+
+// Links the timer into the slot its expiry falls into, relative to the current tick
+void TimerPlace(timerWheel *w, timer *t)
+{
+    long long delta = t->expiry - w->current;
+    if(delta < 0) delta = 0;
+    int level = 0;
+    while(level < TIMER_LEVELS - 1 && delta >= 1ll << (TIMER_LEVEL_BITS * (level + 1))) level++;
+    int slot = (int)((t->expiry >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1));
+
+    timer **head = &w->slots[level][slot];
+    t->level = (unsigned char)level;
+    t->slot = (unsigned char)slot;
+    t->next = *head;
+    if(*head) (*head)->prev = &t->next;
+    t->prev = head;
+    *head = t;
+    w->occupied[level] |= 1ull << slot;
+}
+
+void TimerCancel(timer *t)
+{
+    if(!t->prev) return;
+    timerWheel *w = t->wheel;
+    *t->prev = t->next;
+    if(t->next) t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+    if(!w->slots[t->level][t->slot]) w->occupied[t->level] &= ~(1ull << t->slot);
+    w->count--;
+}
+
+// Arms the timer to fire after the given amount of milliseconds, an armed timer is moved
+void TimerArm(timer *t, long long milliseconds)
+{
+    long long ticks = (milliseconds + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if(ticks < 1) ticks = 1;
+    if(ticks > TIMER_MAX_TICKS) ticks = TIMER_MAX_TICKS;
+    TimerCancel(t);
+    t->expiry = t->wheel->current + ticks;
+    TimerPlace(t->wheel, t);
+    t->wheel->count++;
+}
+
+// Moves the timers of a slot of a higher level down to the levels they fit into now
+void TimerCascade(timerWheel *w, int level, int slot)
+{
+    timer *t = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    w->occupied[level] &= ~(1ull << slot);
+    while(t)
+    {
+        timer *next = t->next;
+        TimerPlace(w, t);
+        t = next;
+    }
+}
+
+/*
+ * Fires every timer that expired up to the given time. Expired timers are disarmed before their
+ * callback runs, which may arm them again or cancel any other timer of the wheel.
+ */
+void TimerWheelAdvance(timerWheel *w, long long nowMicros)
+{
+    long long now = TimerTicks(nowMicros);
+    if(!w->count)
+    {
+        if(now > w->current) w->current = now;
+        return;
+    }
+    while(w->current < now && w->count)
+    {
+        w->current++;
+        int level;
+        for(level = 1; level < TIMER_LEVELS; level++)
+        {
+            // A level cascades whenever all the levels below it have wrapped around
+            if(w->current & ((1ll << (TIMER_LEVEL_BITS * level)) - 1)) break;
+            TimerCascade(w, level, (int)((w->current >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)));
+        }
+        int slot = (int)(w->current & (TIMER_SLOTS - 1));
+        timer *t;
+        while((t = w->slots[0][slot]))
+        {
+            TimerCancel(t);
+            t->expire(t);
+        }
+    }
+    if(now > w->current) w->current = now; // Nothing left to fire, skip the idle ticks
+}
+
+/*
+ * Returns the time in microseconds at which the wheel has to be advanced next, either to fire a
+ * timer or to cascade a slot holding some, or -1 if no timer is armed.
+ */
+long long TimerWheelNext(timerWheel *w)
+{
+    if(!w->count) return -1;
+    long long best = -1;
+    int level;
+    for(level = 0; level < TIMER_LEVELS; level++)
+    {
+        if(!w->occupied[level]) continue;
+        int shift = TIMER_LEVEL_BITS * level;
+        int position = (int)((w->current >> shift) & (TIMER_SLOTS - 1));
+        // Rotate the bitmap so the slot after the current one comes first
+        uint64_t rotated = w->occupied[level];
+        int by = (position + 1) & (TIMER_SLOTS - 1);
+        if(by) rotated = (rotated >> by) | (rotated << (TIMER_SLOTS - by));
+        long long distance = __builtin_ctzll(rotated) + 1;
+        // The slot is reached once the levels below it have wrapped around that many times
+        long long tick = ((w->current >> shift) + distance) << shift;
+        if(best < 0 || tick < best) best = tick;
+    }
+    return best * TIMER_TICK_MS * 1000;
+}
+
+#endif // TIMER_H
@@ -0,0 +1,218 @@
+#ifndef TLS_H
+#define TLS_H
+#include "map.h"
+#include "config.h"
+#include "metrics.h"
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/*
+ * Optional TLS layer of the server, turned on by giving it a certificate (-e). Every connection
+ * then starts with a non-blocking handshake, driven by the reactor owning it whenever the socket
+ * is ready, and the login deadline covers handshakes that never finish.
+ *
+ * Keeping the per-message cost close to plaintext:
+ *      - Sessions are resumed through stateless tickets. All reactors share one context and with
+ *        it the ticket key, so a client reconnecting to any reactor skips the full handshake
+ *        without the reactors sharing a session cache or a lock.
+ *      - A flush gathers the queued messages into records of up to TLS_RECORD_SIZE bytes, so a
+ *        burst of small chat messages costs a single encryption and write instead of one each.
+ *      - Where the kernel supports it, OpenSSL hands the record keys to the kernel (kTLS) once the
+ *        handshake is done. Flushes of such a connection take the plaintext path, writev with the
+ *        relayed payloads referenced in place, and the kernel encrypts them on the way out.
+ *        Otherwise the connection stays in userspace TLS without any difference to the client.
+ *
+ * A connection's TLS state is only touched by the thread of the reactor owning it.
+ */
+#define TLS_RECORD_SIZE     16384 // Largest plaintext a single record carries
+#define TLS_TICKET_LIFETIME 7200  // Seconds a session ticket can be resumed for
+#define TLS_TICKET_KEYS     80    // Size of the ticket key name, HMAC and AES keys OpenSSL hands out together
+// AES-GCM first, the ciphers the kernel can take over
+#define TLS_CIPHERSUITES    "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define TLS_CIPHERS         "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+
+SSL_CTX *tlsContext = NULL;          // NULL unless TLS is enabled
+__thread char tlsRecord[TLS_RECORD_SIZE]; // Plaintext of the record being written
+
+// Logs the reason of the last OpenSSL failure on the calling thread and clears the rest
+void TlsLogError(char *what)
+{
+    char reason[256];
+    unsigned long error = ERR_get_error();
+    if(error) ERR_error_string_n(error, reason, sizeof(reason));
+    LogWarn("%s: %s", what, error ? reason : strerror(errno));
+    ERR_clear_error();
+}
+
+// Sets up the context every connection's TLS state is created from, nothing to do without a certificate
+int TlsInit()
+{
+    if(!config.tlsCert) return 1;
+    tlsContext = SSL_CTX_new(TLS_server_method());
+    if(!tlsContext)
+    {
+        TlsLogError("Failed to create the TLS context");
+        return 0;
+    }
+    char *key = config.tlsKey ? config.tlsKey : config.tlsCert;
+    if(SSL_CTX_use_certificate_chain_file(tlsContext, config.tlsCert) != 1 ||
+       SSL_CTX_use_PrivateKey_file(tlsContext, key, SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(tlsContext) != 1)
+    {
+        TlsLogError("Failed to load the TLS certificate");
+        return 0;
+    }
+    SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+    SSL_CTX_set_ciphersuites(tlsContext, TLS_CIPHERSUITES);
+    SSL_CTX_set_cipher_list(tlsContext, TLS_CIPHERS);
+    // A client that just goes away is an ordinary disconnect, not a protocol error
+    SSL_CTX_set_options(tlsContext, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // Records are written from the queue as it is, and idle connections give their buffers back
+    SSL_CTX_set_mode(tlsContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    // Tickets carry the whole session, there's no server side cache to look sessions up in
+    SSL_CTX_set_session_cache_mode(tlsContext, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_timeout(tlsContext, TLS_TICKET_LIFETIME);
+    SSL_CTX_set_num_tickets(tlsContext, 1);
+    LogInfo("TLS enabled with certificate %s", config.tlsCert);
+    return 1;
+}
+// Reads or replaces the ticket key, a restarted server keeps it so the tickets it gave out still resume
+int TlsTicketKeys(unsigned char *keys, int replace)
+{
+    if(!tlsContext) return 0;
+    long done = replace ? SSL_CTX_set_tlsext_ticket_keys(tlsContext, keys, TLS_TICKET_KEYS)
+                        : SSL_CTX_get_tlsext_ticket_keys(tlsContext, keys, TLS_TICKET_KEYS);
+    return done == 1;
+}
+void TlsDestroy()
+{
+    if(tlsContext) SSL_CTX_free(tlsContext);
+    tlsContext = NULL;
+}
+
+// Attaches a new TLS session to an accepted connection, which handshakes before anything else
+int TlsAccept(clientData *client)
+{
+    SSL *tls = SSL_new(tlsContext);
+    if(!tls || SSL_set_fd(tls, client->clientSocket) != 1)
+    {
+        TlsLogError("Failed to create TLS session");
+        if(tls) SSL_free(tls);
+        return 0;
+    }
+    SSL_set_accept_state(tls);
+    client->tls = tls;
+    client->tlsHandshake = 1;
+    return 1;
+}
+// Sends the close notification as far as the socket takes it and frees the session
+void TlsClose(clientData *client)
+{
+    if(!client->tls) return;
+    if(!client->tlsHandshake) SSL_shutdown(client->tls);
+    ERR_clear_error();
+    SSL_free(client->tls);
+    client->tls = NULL;
+}
+
+/*
+ * Continues the handshake of a connection. Returns 1 once it's done, 0 while it waits for the
+ * socket and -1 if it failed.
+ */
+int TlsHandshake(clientData *client)
+{
+    ERR_clear_error();
+    int status = SSL_do_handshake(client->tls);
+    if(status == 1)
+    {
+        client->tlsHandshake = 0;
+        client->tlsKernel = BIO_get_ktls_send(SSL_get_wbio(client->tls)) ? 1 : 0;
+        METRIC_ADD(tlsHandshakes, 1);
+        if(SSL_session_reused(client->tls)) METRIC_ADD(tlsResumed, 1);
+        if(client->tlsKernel) METRIC_ADD(tlsKernel, 1);
+        LogDebug("Client %lu negotiated %s with %s%s%s", client->id, SSL_get_version(client->tls), SSL_get_cipher_name(client->tls),
+                 SSL_session_reused(client->tls) ? ", resumed" : "", client->tlsKernel ? ", kernel offloaded" : "");
+        return 1;
+    }
+    int error = SSL_get_error(client->tls, status);
+    if(error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) return 0;
+    METRIC_ADD(tlsFailures, 1);
+    if(error == SSL_ERROR_SSL) TlsLogError("TLS handshake failed");
+    else ERR_clear_error(); // The client just went away
+    return -1;
+}
+
+// Reads decrypted bytes the way recv does, with errno set to EAGAIN once nothing is left
+ssize_t TlsRecv(clientData *client, char *buffer, size_t length)
+{
+    ERR_clear_error();
+    int readSize = SSL_read(client->tls, buffer, (int)length);
+    if(readSize > 0) return readSize;
+    switch(SSL_get_error(client->tls, readSize))
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if(!errno) return 0;
+            return -1;
+        default:
+            TlsLogError("TLS read failed");
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+/*
+ * Writes the parts as records of up to TLS_RECORD_SIZE bytes each, with the same result as
+ * TryWrite. A record the socket didn't take has to be written again with the same length, the
+ * queue only ever grows behind it, so the next flush gathers the same bytes into it.
+ */
+ssize_t TlsWrite(clientData *client, struct iovec *parts, int count)
+{
+    ssize_t total = 0;
+    size_t offset = 0;
+    int part = 0;
+    while(part < count)
+    {
+        size_t limit = client->tlsRetry ? client->tlsRetry : TLS_RECORD_SIZE;
+        size_t length = 0;
+        while(part < count && length < limit)
+        {
+            size_t chunk = parts[part].iov_len - offset;
+            if(chunk > limit - length) chunk = limit - length;
+            memcpy(tlsRecord + length, (char*)parts[part].iov_base + offset, chunk);
+            length += chunk;
+            offset += chunk;
+            if(offset == parts[part].iov_len)
+            {
+                part++;
+                offset = 0;
+            }
+        }
+        ERR_clear_error();
+        int written = SSL_write(client->tls, tlsRecord, (int)length);
+        if(written <= 0)
+        {
+            int error = SSL_get_error(client->tls, written);
+            if(error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ)
+            {
+                client->tlsRetry = length;
+                return total;
+            }
+            if(error == SSL_ERROR_SSL) TlsLogError("TLS write failed");
+            else ERR_clear_error();
+            return -1;
+        }
+        client->tlsRetry = 0;
+        total += written;
+        if((size_t)written < length) break;
+    }
+    return total;
+}
+
+#endif // TLS_H
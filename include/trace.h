@@ -0,0 +1,130 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include "shared.h"
+#include <stdint.h>
+
+/*
+ * Traffic trace, written by the server's capture mode (see capture.h) and read by the replay tool.
+ * The file starts with the magic and a version byte, followed by one record per event:
+ *      - Type: A single byte, TRACE_OPEN, TRACE_FRAME or TRACE_CLOSE
+ *      - Time: Microseconds since the previous record as a zigzag varint. Records of different
+ *        reactors are interleaved, so the time can go backwards between connections, but never
+ *        within one
+ *      - Connection: Id of the client connection as a varint
+ *      - Frames only: Opcode and flags bytes, the state the client was in when it sent the frame
+ *        as a byte, the payload length as a varint and the payload
+ * Varints hold 7 bits per byte, least significant first, with the high bit set on all but the last.
+ * Every frame is kept as the binary protocol frame it would have been, whichever protocol the client spoke.
+ * The state lets the replay tell when a frame depends on what other connections did before it.
+ */
+#define TRACE_MAGIC       "ORMTRACE"
+#define TRACE_MAGIC_LEN   8
+#define TRACE_VERSION     2
+#define TRACE_HEADER_SIZE (TRACE_MAGIC_LEN + 1)
+#define TRACE_RECORD_MAX  32 // Longest record without its payload
+
+typedef enum { TRACE_OPEN = 1, TRACE_FRAME, TRACE_CLOSE } traceRecords;
+
+typedef struct traceRecord {
+    uint8_t type;
+    int64_t time;        // Microseconds since the capture started
+    uint64_t connection;
+    uint8_t opcode;
+    uint8_t flags;
+    uint8_t state;       // clientStates value of the client when it sent the frame
+    uint32_t length;
+    char *payload;       // Points into the buffer the record was read from
+} traceRecord;
+
+size_t TraceWriteHeader(char *buffer)
+{
+    memcpy(buffer, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    buffer[TRACE_MAGIC_LEN] = TRACE_VERSION;
+    return TRACE_HEADER_SIZE;
+}
+// Returns 0 unless the buffer starts with a trace header this build can read
+int TraceReadHeader(char *buffer, size_t length)
+{
+    return length >= TRACE_HEADER_SIZE && memcmp(buffer, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0 && buffer[TRACE_MAGIC_LEN] == TRACE_VERSION;
+}
+
+size_t TraceWriteVarint(char *buffer, uint64_t value)
+{
+    size_t used = 0;
+    while(value >= 0x80)
+    {
+        buffer[used++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[used++] = (char)value;
+    return used;
+}
+// Returns the bytes the varint took, 0 if it's cut off or too long
+size_t TraceReadVarint(char *buffer, size_t length, uint64_t *value)
+{
+    uint64_t result = 0;
+    size_t used;
+    for(used = 0; used < length && used < 10; used++)
+    {
+        uint8_t byte = (uint8_t)buffer[used];
+        result |= (uint64_t)(byte & 0x7F) << (7 * used);
+        if(!(byte & 0x80))
+        {
+            *value = result;
+            return used + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes everything of a record but its payload, which the caller appends, and returns its size.
+ * lastTime holds the time of the record written before, the times are stored relative to it.
+ */
+size_t TraceWriteRecord(char *buffer, traceRecord *record, int64_t *lastTime)
+{
+    int64_t delta = record->time - *lastTime;
+    *lastTime = record->time;
+    size_t used = 0;
+    buffer[used++] = (char)record->type;
+    used += TraceWriteVarint(buffer + used, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    used += TraceWriteVarint(buffer + used, record->connection);
+    if(record->type != TRACE_FRAME) return used;
+    buffer[used++] = (char)record->opcode;
+    buffer[used++] = (char)record->flags;
+    buffer[used++] = (char)record->state;
+    used += TraceWriteVarint(buffer + used, record->length);
+    return used;
+}
+// Reads the record at the start of the buffer, returns its size with the payload or -1 if it's cut off or malformed
+long TraceReadRecord(char *buffer, size_t length, traceRecord *record, int64_t *lastTime)
+{
+    if(length < 1) return -1;
+    size_t used = 1, size;
+    uint64_t delta, value;
+    record->type = (uint8_t)buffer[0];
+    if(record->type < TRACE_OPEN || record->type > TRACE_CLOSE) return -1;
+    if(!(size = TraceReadVarint(buffer + used, length - used, &delta))) return -1;
+    used += size;
+    if(!(size = TraceReadVarint(buffer + used, length - used, &record->connection))) return -1;
+    used += size;
+    *lastTime += (int64_t)(delta >> 1) ^ -(int64_t)(delta & 1);
+    record->time = *lastTime;
+    record->opcode = 0;
+    record->flags = 0;
+    record->state = 0;
+    record->length = 0;
+    record->payload = buffer + used;
+    if(record->type != TRACE_FRAME) return used;
+    if(used + 3 > length) return -1;
+    record->opcode = (uint8_t)buffer[used++];
+    record->flags = (uint8_t)buffer[used++];
+    record->state = (uint8_t)buffer[used++];
+    if(!(size = TraceReadVarint(buffer + used, length - used, &value)) || value > length - used - size) return -1;
+    used += size;
+    record->length = (uint32_t)value;
+    record->payload = buffer + used;
+    return used + record->length;
+}
+
+#endif // TRACE_H
@@ -0,0 +1,235 @@
+#ifndef URING_H
+#define URING_H
+#include "pool.h"
+#include "log.h"
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+/*
+ * Minimal io_uring interface for the reactors, straight on top of the system calls so the server
+ * doesn't depend on liburing.
+ *
+ * A ring is a submission queue the reactor fills with requests and a completion queue the kernel
+ * fills with their results, both shared memory. Requests are only handed to the kernel by
+ * UringEnter, which also waits for completions, so a whole event loop iteration worth of requests
+ * costs a single system call.
+ *
+ * Every ring comes with a ring of provided buffers: URING_BUFFERS pooled large buffers the kernel
+ * picks from whenever data arrives on one of the reactor's connections, instead of every
+ * connection holding a buffer of its own while it waits. A buffer is handed back with
+ * UringBufferRecycle once its data was handled, and only swapped for a new one if a handler still
+ * references it.
+ *
+ * Rings are created disabled and only enabled by the reactor thread that uses them, which is the
+ * only thread ever submitting to it. This lets the kernel run completions on that thread alone,
+ * when it asks for them (DEFER_TASKRUN), rather than interrupting it whenever one is ready.
+ */
+#define URING_ENTRIES       1024
+#define URING_CQ_ENTRIES    (4 * URING_ENTRIES)
+#define URING_BUFFERS       64 // Provided buffers of a ring, a power of two
+#define URING_BUFFER_GROUP  0
+
+typedef struct uring {
+    int fd;
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    unsigned int sqLocalTail;      // Requests prepared so far, handed to the kernel by the next UringEnter
+    unsigned int sqSubmitted;
+    struct io_uring_sqe *sqes;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t ringsSize;
+    size_t sqesSize;
+    struct io_uring_buf_ring *bufferRing;
+    unsigned short bufferTail;
+    char *buffers[URING_BUFFERS];  // Pooled buffer behind every buffer id
+} uring;
+
+int UringSetup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+int UringRegister(uring *u, unsigned int opcode, void *arg, unsigned int count)
+{
+    return (int)syscall(__NR_io_uring_register, u->fd, opcode, arg, count);
+}
+
+// Hands a buffer to the kernel to receive into, it gets at most one byte less than the buffer holds
+void UringBufferRecycle(uring *u, unsigned short id)
+{
+    struct io_uring_buf *entry = &u->bufferRing->bufs[u->bufferTail & (URING_BUFFERS - 1)];
+    entry->addr = (uint64_t)(uintptr_t)u->buffers[id];
+    entry->len = BUFFER_LARGE_SIZE - 1;
+    entry->bid = id;
+    u->bufferTail++;
+    __atomic_store_n(&u->bufferRing->tail, u->bufferTail, __ATOMIC_RELEASE);
+}
+
+void UringDestroy(uring *u)
+{
+    int i;
+    if(u->bufferRing)
+    {
+        struct io_uring_buf_reg reg = { .bgid = URING_BUFFER_GROUP };
+        UringRegister(u, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(u->bufferRing, URING_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    for(i = 0; i < URING_BUFFERS; i++) BufferRelease(u->buffers[i]);
+    if(u->sqes) munmap(u->sqes, u->sqesSize);
+    if(u->rings) munmap(u->rings, u->ringsSize);
+    if(u->fd >= 0) close(u->fd);
+    free(u);
+}
+
+/*
+ * Creates a disabled ring along with its provided buffers. Returns NULL with errno set if the
+ * kernel doesn't support everything the reactors need, which is the case before Linux 6.1.
+ */
+uring* UringCreate()
+{
+    uring *u = (uring*)calloc(1, sizeof(uring));
+    if(!u) return NULL;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE |
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_CQ_ENTRIES;
+    u->fd = UringSetup(URING_ENTRIES, &params);
+    if(u->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) ||
+       !(params.features & IORING_FEAT_EXT_ARG))
+    {
+        if(u->fd >= 0) errno = ENOSYS;
+        UringDestroy(u);
+        return NULL;
+    }
+
+    // Both queues share a single mapping, the requests themselves are mapped separately
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+    u->rings = mmap(NULL, u->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(u->rings == MAP_FAILED || u->sqes == MAP_FAILED)
+    {
+        if(u->rings == MAP_FAILED) u->rings = NULL;
+        if(u->sqes == MAP_FAILED) u->sqes = NULL;
+        UringDestroy(u);
+        return NULL;
+    }
+    char *rings = (char*)u->rings;
+    u->sqHead = (unsigned int*)(rings + params.sq_off.head);
+    u->sqTail = (unsigned int*)(rings + params.sq_off.tail);
+    u->sqMask = *(unsigned int*)(rings + params.sq_off.ring_mask);
+    u->sqEntries = params.sq_entries;
+    u->cqHead = (unsigned int*)(rings + params.cq_off.head);
+    u->cqTail = (unsigned int*)(rings + params.cq_off.tail);
+    u->cqMask = *(unsigned int*)(rings + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    // Requests are always taken in the order they were prepared in
+    unsigned int *array = (unsigned int*)(rings + params.sq_off.array);
+    unsigned int i;
+    for(i = 0; i < u->sqEntries; i++) array[i] = i;
+    u->sqLocalTail = u->sqSubmitted = *u->sqTail;
+
+    u->bufferRing = (struct io_uring_buf_ring*)mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                                                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(u->bufferRing == MAP_FAILED)
+    {
+        u->bufferRing = NULL;
+        UringDestroy(u);
+        return NULL;
+    }
+    struct io_uring_buf_reg reg = { .ring_addr = (uint64_t)(uintptr_t)u->bufferRing, .ring_entries = URING_BUFFERS, .bgid = URING_BUFFER_GROUP };
+    if(UringRegister(u, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        munmap(u->bufferRing, URING_BUFFERS * sizeof(struct io_uring_buf));
+        u->bufferRing = NULL;
+        UringDestroy(u);
+        return NULL;
+    }
+    for(i = 0; i < URING_BUFFERS; i++)
+    {
+        u->buffers[i] = BufferAlloc(BUFFER_LARGE_SIZE);
+        if(!u->buffers[i])
+        {
+            UringDestroy(u);
+            return NULL;
+        }
+        UringBufferRecycle(u, (unsigned short)i);
+    }
+    return u;
+}
+
+// Makes the calling thread the only one submitting to the ring
+int UringEnable(uring *u)
+{
+    return UringRegister(u, IORING_REGISTER_ENABLE_RINGS, NULL, 0);
+}
+
+/*
+ * Hands the prepared requests to the kernel and waits until at least wait completions are there,
+ * or until the timeout in microseconds passed if it isn't negative. Returns -1 if the call failed.
+ */
+int UringEnter(uring *u, unsigned int wait, long long timeout)
+{
+    unsigned int pending = u->sqLocalTail - u->sqSubmitted;
+    if(!pending && !wait) return 0;
+    __atomic_store_n(u->sqTail, u->sqLocalTail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = { .sigmask = 0, .sigmask_sz = _NSIG / 8, .ts = 0 };
+    unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    if(wait && timeout >= 0)
+    {
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = (timeout % 1000000) * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    while(1)
+    {
+        int submitted = (int)syscall(__NR_io_uring_enter, u->fd, pending, wait, flags,
+                                     (flags & IORING_ENTER_EXT_ARG) ? (void*)&arg : NULL, sizeof(arg));
+        if(submitted >= 0)
+        {
+            u->sqSubmitted += submitted;
+            return 0;
+        }
+        if(errno == ETIME) return 0; // Nothing completed before the timeout
+        if(errno == EINTR) continue;
+        return -1;
+    }
+}
+
+// Returns a cleared request to fill in, handing the prepared ones to the kernel first if the queue is full
+struct io_uring_sqe* UringRequest(uring *u)
+{
+    if(u->sqLocalTail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->sqEntries && UringEnter(u, 0, -1) < 0)
+        LogError("Failed to submit to io_uring: %m");
+    struct io_uring_sqe *sqe = &u->sqes[u->sqLocalTail & u->sqMask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sqLocalTail++;
+    return sqe;
+}
+
+// Returns the next completion, or NULL if there's none. It has to be marked as seen once it was handled
+struct io_uring_cqe* UringCompletion(uring *u)
+{
+    unsigned int head = *u->cqHead;
+    if(head == __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) return NULL;
+    return &u->cqes[head & u->cqMask];
+}
+void UringSeen(uring *u)
+{
+    __atomic_store_n(u->cqHead, *u->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+#endif // URING_H
@@ -0,0 +1,172 @@
+#ifndef USERS_H
+#define USERS_H
+#include "shared.h"
+#include "log.h"
+#include <stdint.h>
+
+/*
+ * Sorted index of the logged in users, which the Users command pages through.
+ *
+ * The index is kept up to date as users log in, log out and start or end conversations, with a
+ * binary search and a single memmove per change, so a request never has to walk the client table
+ * or sort anything. Requests read it under a shared lock, which makes every page a consistent
+ * snapshot. Prefix searches, offsets and counts are binary searches, a page costs as much as the
+ * entries on it. The version is bumped by every change, so clients paging through the list can
+ * tell whether it changed in between.
+ *
+ * Changes are made under conversationLock, which is taken before userIndexLock.
+ */
+#define USER_INDEX_INITIAL 256
+
+typedef struct userEntry {
+    char username[USERNAME_MAX];
+    int busy;                     // In a conversation
+    int node;                     // Cluster node the user is logged in on, see cluster.h
+} userEntry;
+
+userEntry *userIndex;
+unsigned int userIndexLen = 0;
+unsigned int userIndexCapacity = 0;
+uint64_t userIndexVersion = 0;
+pthread_rwlock_t userIndexLock;
+
+int UserIndexInit()
+{
+    pthread_rwlock_init(&userIndexLock, NULL);
+    userIndex = (userEntry*)malloc(USER_INDEX_INITIAL * sizeof(userEntry));
+    if(!userIndex) return -1;
+    userIndexCapacity = USER_INDEX_INITIAL;
+    return 0;
+}
+void UserIndexDestroy()
+{
+    free(userIndex);
+    pthread_rwlock_destroy(&userIndexLock);
+}
+
+// Position of the first entry that doesn't sort before the first length bytes of name, userIndexLock must be held
+unsigned int UserIndexLowerBound(char *name, size_t length)
+{
+    unsigned int low = 0, high = userIndexLen;
+    while(low < high)
+    {
+        unsigned int middle = low + (high - low) / 2;
+        if(strncmp(userIndex[middle].username, name, length) < 0) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+// Position of the first entry after the ones starting with the prefix, userIndexLock must be held
+unsigned int UserIndexPrefixEnd(char *prefix, size_t length, unsigned int start)
+{
+    unsigned int low = start, high = userIndexLen;
+    while(low < high)
+    {
+        unsigned int middle = low + (high - low) / 2;
+        if(strncmp(userIndex[middle].username, prefix, length) <= 0) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+// Returns the position of the user, or -1 if it isn't in the index. userIndexLock must be held
+int UserIndexFind(char *username)
+{
+    unsigned int i = UserIndexLowerBound(username, USERNAME_MAX);
+    return i < userIndexLen && strcmp(userIndex[i].username, username) == 0 ? (int)i : -1;
+}
+
+// Adds a user, a user that's already in the index is only moved to the node
+int UserIndexInsert(char *username, int node)
+{
+    pthread_rwlock_wrlock(&userIndexLock);
+    int existing = UserIndexFind(username);
+    if(existing >= 0)
+    {
+        userIndex[existing].node = node;
+        pthread_rwlock_unlock(&userIndexLock);
+        return 1;
+    }
+    if(userIndexLen == userIndexCapacity)
+    {
+        userEntry *grown = (userEntry*)realloc(userIndex, userIndexCapacity * 2 * sizeof(userEntry));
+        if(!grown)
+        {
+            pthread_rwlock_unlock(&userIndexLock);
+            LogError("Failed to grow the user index");
+            return 0;
+        }
+        userIndex = grown;
+        userIndexCapacity *= 2;
+    }
+    unsigned int i = UserIndexLowerBound(username, USERNAME_MAX);
+    memmove(userIndex + i + 1, userIndex + i, (userIndexLen - i) * sizeof(userEntry));
+    memset(userIndex[i].username, 0, USERNAME_MAX);
+    strncpy(userIndex[i].username, username, USERNAME_MAX - 1);
+    userIndex[i].busy = 0;
+    userIndex[i].node = node;
+    userIndexLen++;
+    userIndexVersion++;
+    pthread_rwlock_unlock(&userIndexLock);
+    return 1;
+}
+void UserIndexRemove(char *username)
+{
+    pthread_rwlock_wrlock(&userIndexLock);
+    int i = UserIndexFind(username);
+    if(i >= 0)
+    {
+        memmove(userIndex + i, userIndex + i + 1, (userIndexLen - i - 1) * sizeof(userEntry));
+        userIndexLen--;
+        userIndexVersion++;
+    }
+    pthread_rwlock_unlock(&userIndexLock);
+}
+void UserIndexSetBusy(char *username, int busy)
+{
+    pthread_rwlock_wrlock(&userIndexLock);
+    int i = UserIndexFind(username);
+    if(i >= 0 && userIndex[i].busy != busy)
+    {
+        userIndex[i].busy = busy;
+        userIndexVersion++;
+    }
+    pthread_rwlock_unlock(&userIndexLock);
+}
+// Returns the node the user is logged in on and whether it's busy, or -1 if it isn't in the index
+int UserIndexGet(char *username, int *busy)
+{
+    pthread_rwlock_rdlock(&userIndexLock);
+    int i = UserIndexFind(username);
+    int node = i >= 0 ? userIndex[i].node : -1;
+    if(i >= 0) *busy = userIndex[i].busy;
+    pthread_rwlock_unlock(&userIndexLock);
+    return node;
+}
+/*
+ * Removes every user logged in on the node with a single pass over the index. Returns the removed
+ * entries, to be freed by the caller, and sets their amount.
+ */
+userEntry* UserIndexDropNode(int node, unsigned int *count)
+{
+    *count = 0;
+    pthread_rwlock_wrlock(&userIndexLock);
+    userEntry *dropped = (userEntry*)malloc((userIndexLen ? userIndexLen : 1) * sizeof(userEntry));
+    if(!dropped)
+    {
+        pthread_rwlock_unlock(&userIndexLock);
+        LogError("Failed to drop the users of node %d", node);
+        return NULL;
+    }
+    unsigned int i, kept = 0;
+    for(i = 0; i < userIndexLen; i++)
+    {
+        if(userIndex[i].node == node) dropped[(*count)++] = userIndex[i];
+        else userIndex[kept++] = userIndex[i];
+    }
+    if(*count) userIndexVersion++;
+    userIndexLen = kept;
+    pthread_rwlock_unlock(&userIndexLock);
+    return dropped;
+}
+
+#endif // USERS_H
@@ -0,0 +1,377 @@
+#include "bench.h"
+
+benchWorker *workers;
+
+void BenchClose(benchWorker *w, benchConnection *c)
+{
+    if(c->state == BENCH_CLOSED) return;
+    if(Phase() < PHASE_DRAIN) w->errors++;
+    if(c->tls) SSL_free(c->tls);
+    c->tls = NULL;
+    close(c->socket); // Closing the descriptor also removes it from the epoll instance
+    c->socket = -1;
+    c->state = BENCH_CLOSED;
+}
+
+// Starts connecting the next batch of the worker's connections, the socket reports completion as writable
+void BenchOpen(benchWorker *w)
+{
+    struct sockaddr_in server = { .sin_family = AF_INET };
+    server.sin_addr.s_addr = inet_addr(bench.ip);
+    int batch;
+    for(batch = 0; batch < BENCH_CONNECT_BATCH && w->opened < w->count; batch++)
+    {
+        benchConnection *c = &w->connections[w->opened++];
+        server.sin_port = htons(bench.ports[c->index % bench.portCount]);
+        c->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(c->socket < 0)
+        {
+            perror("Could not create socket");
+            c->state = BENCH_CLOSED;
+            w->errors++;
+            continue;
+        }
+        int flag = 1;
+        setsockopt(c->socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        if(connect(c->socket, (struct sockaddr*)&server, sizeof(server)) < 0 && errno != EINPROGRESS)
+        {
+            perror("Connect failed");
+            BenchClose(w, c);
+            continue;
+        }
+        c->state = BENCH_CONNECTING;
+        struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+        epoll_ctl(w->epollFd, EPOLL_CTL_ADD, c->socket, &event);
+    }
+}
+
+void BenchConnected(benchWorker *w, benchConnection *c)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(getsockopt(c->socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error)
+    {
+        printf("Connection %u failed: %s\n", c->index, strerror(error));
+        BenchClose(w, c);
+        return;
+    }
+    if(benchTls)
+    {
+        c->tls = SSL_new(benchTls);
+        if(!c->tls || SSL_set_fd(c->tls, c->socket) != 1)
+        {
+            printf("Connection %u failed to create its TLS session\n", c->index);
+            BenchClose(w, c);
+            return;
+        }
+        SSL_set_connect_state(c->tls);
+    }
+    // The server handles the HELLO and the login in a single read, no need to wait in between
+    c->outLength = BuildHello(c->out, PROTOCOL_VERSION, bench.compress ? PROTOCOL_FEATURE_DEFLATE : 0);
+    BenchQueue(c, LOGIN, c->username, strlen(c->username));
+    c->state = BENCH_LOGGING_IN;
+}
+
+void BenchReady(benchConnection *c)
+{
+    c->state = BENCH_READY;
+    __atomic_add_fetch(&readyConnections, 1, __ATOMIC_RELEASE);
+}
+
+// Records the latency of a chat message, or notes that the connection's own message came back
+void BenchReceive(benchWorker *w, benchConnection *c, char *text, size_t length)
+{
+    if(length < BENCH_HEADER_SIZE) return;
+    uint64_t stamp;
+    uint32_t sender;
+    memcpy(&stamp, text, sizeof(stamp));
+    memcpy(&sender, text + sizeof(stamp), sizeof(sender));
+    if(sender == c->index)
+    {
+        c->inFlight = 0;
+        return;
+    }
+    if(Phase() >= PHASE_MEASURE && stamp >= measureStart)
+    {
+        uint64_t now = NowNanos();
+        HistogramRecord(&w->latency, now > stamp ? now - stamp : 0);
+        w->received++;
+        w->bytesReceived += length;
+    }
+}
+
+void BenchHandleFrame(benchWorker *w, benchConnection *c, frame *f)
+{
+    switch(f->opcode)
+    {
+        case REPLY_LOGIN:
+            c->state = BENCH_JOINING;
+            if(bench.mode == BENCH_ROOMS)
+            {
+                char room[ROOMNAME_MAX];
+                BenchQueue(c, JOIN, room, sprintf(room, "room%u", c->index % bench.rooms));
+            }
+            else if(c->partner && c->partner->state == BENCH_JOINING) // Both are logged in, the even one of the pair asks the other
+            {
+                benchConnection *initiator = c->index % 2 == 0 ? c : c->partner;
+                BenchQueue(initiator, TALKTO, initiator->partner->username, strlen(initiator->partner->username));
+                if(BenchFlush(initiator) < 0) BenchClose(w, initiator);
+            }
+            break;
+        case REPLY_LOG:
+            if(bench.mode == BENCH_ROOMS && c->state == BENCH_JOINING) BenchReady(c);
+            break;
+        case REPLY_TALKTO:
+            if(f->length && f->payload[0] == PENDING_REQUEST) BenchQueue(c, TALKTO, "Accept", 6);
+            else if(f->length && f->payload[0] == CHATTING) BenchReady(c);
+            break;
+        case REPLY_MESSAGE:
+        {
+            size_t usernameLength = f->length ? (unsigned char)f->payload[0] : 0;
+            if(usernameLength + 1 > f->length) break;
+            char *text = f->payload + 1 + usernameLength;
+            long length = f->length - 1 - usernameLength;
+            if(f->flags & FRAME_FLAG_COMPRESSED)
+            {
+                length = DecompressText(&benchCompressor, text, length, benchText, sizeof(benchText));
+                text = benchText;
+            }
+            if(length >= 0) BenchReceive(w, c, text, length);
+            else w->errors++;
+            break;
+        }
+        case REPLY_ROOM_MESSAGE:
+        {
+            size_t offset = f->length ? (unsigned char)f->payload[0] + 1 : 0;
+            if(offset < f->length) offset += (unsigned char)f->payload[offset] + 1;
+            if(offset <= f->length) BenchReceive(w, c, f->payload + offset, f->length - offset);
+            break;
+        }
+        case REPLY_ERROR:
+        case REPLY_TALKTO_ERROR:
+            printf("Connection %u got an error: %.*s\n", c->index, (int)f->length, f->payload);
+            w->errors++;
+            break;
+        default:
+            break;
+    }
+}
+
+void BenchRead(benchWorker *w, benchConnection *c)
+{
+    while(c->state != BENCH_CLOSED)
+    {
+        ssize_t readSize = BenchRecv(c, c->in + c->inLength, inCapacity - c->inLength);
+        if(readSize <= 0)
+        {
+            if(readSize < 0 && errno == EINTR) continue;
+            if(readSize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            BenchClose(w, c);
+            return;
+        }
+        c->inLength += readSize;
+
+        size_t consumed = 0;
+        frame f;
+        int size;
+        while((size = ParseFrame(c->in + consumed, c->inLength - consumed, &f)) > 0)
+        {
+            BenchHandleFrame(w, c, &f);
+            consumed += size;
+        }
+        if(size < 0)
+        {
+            printf("Connection %u received a malformed frame\n", c->index);
+            BenchClose(w, c);
+            return;
+        }
+        memmove(c->in, c->in + consumed, c->inLength - consumed);
+        c->inLength -= consumed;
+    }
+}
+
+// Sends every message that is due on the worker's ready connections
+void BenchTick(benchWorker *w)
+{
+    int phase = Phase();
+    if(phase != PHASE_WARMUP && phase != PHASE_MEASURE) return;
+    uint64_t now = NowNanos();
+    uint64_t interval = bench.rate > 0 ? (uint64_t)(1e9 / bench.rate) : 0;
+    int i;
+    for(i = 0; i < w->opened; i++)
+    {
+        benchConnection *c = &w->connections[i];
+        if(c->state != BENCH_READY) continue;
+        if(interval)
+        {
+            // Spread the first messages over the interval so the connections don't all send at once
+            if(!c->nextSend) c->nextSend = now + interval * i / w->count;
+            int k;
+            for(k = 0; k < BENCH_CATCH_UP && c->nextSend <= now; k++, c->nextSend += interval)
+            {
+                if(!BenchSendChat(c, c->nextSend)) w->backpressured++;
+                else if(phase == PHASE_MEASURE) w->sent++;
+            }
+        }
+        else if(!c->inFlight && BenchSendChat(c, now))
+        {
+            c->inFlight = 1;
+            if(phase == PHASE_MEASURE) w->sent++;
+        }
+        if(BenchFlush(c) < 0) BenchClose(w, c);
+    }
+}
+
+void* BenchWorker(void *arg)
+{
+    benchWorker *w = (benchWorker*)arg;
+    struct epoll_event events[256];
+    while(Phase() != PHASE_DONE)
+    {
+        BenchOpen(w);
+        int count = epoll_wait(w->epollFd, events, 256, BENCH_TICK_MS);
+        int i;
+        for(i = 0; i < count; i++)
+        {
+            benchConnection *c = (benchConnection*)events[i].data.ptr;
+            if(c->state == BENCH_CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                BenchConnected(w, c);
+            if(c->state != BENCH_CLOSED && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                BenchRead(w, c);
+            if(c->state != BENCH_CLOSED && BenchFlush(c) < 0)
+                BenchClose(w, c);
+        }
+        BenchTick(w);
+    }
+    int i;
+    for(i = 0; i < w->opened; i++)
+    {
+        if(w->connections[i].tls) SSL_free(w->connections[i].tls);
+        if(w->connections[i].socket >= 0) close(w->connections[i].socket);
+    }
+    CompressorDestroy(&benchCompressor);
+    return NULL;
+}
+
+// Hands every worker its share of the connections, pairs are never split between workers
+int BenchSetup()
+{
+    workers = (benchWorker*)calloc(bench.threads, sizeof(benchWorker));
+    if(!workers) return 0;
+    unsigned int index = 0;
+    int t;
+    for(t = 0; t < bench.threads; t++)
+    {
+        benchWorker *w = &workers[t];
+        w->id = t;
+        w->count = bench.connections / bench.threads + (t < bench.connections % bench.threads);
+        if(bench.mode == BENCH_PAIRS && w->count % 2 && t + 1 < bench.threads) w->count++;
+        if(index + w->count > (unsigned int)bench.connections) w->count = bench.connections - index;
+        HistogramReset(&w->latency);
+        w->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        w->connections = (benchConnection*)calloc(w->count ? w->count : 1, sizeof(benchConnection));
+        if(w->epollFd < 0 || !w->connections) return 0;
+
+        int i;
+        for(i = 0; i < w->count; i++)
+        {
+            benchConnection *c = &w->connections[i];
+            c->socket = -1;
+            c->index = index++;
+            c->partner = (i ^ 1) < w->count ? &w->connections[i ^ 1] : NULL;
+            snprintf(c->username, USERNAME_MAX, "%s%u", bench.prefix, c->index);
+            c->in = (char*)malloc(inCapacity);
+            c->out = (char*)malloc(outCapacity);
+            if(!c->in || !c->out) return 0;
+        }
+    }
+    return 1;
+}
+
+void BenchReport(double seconds)
+{
+    histogram latency;
+    HistogramReset(&latency);
+    uint64_t sent = 0, received = 0, bytes = 0, backpressured = 0, errors = 0;
+    int t;
+    for(t = 0; t < bench.threads; t++)
+    {
+        HistogramMerge(&latency, &workers[t].latency);
+        sent += workers[t].sent;
+        received += workers[t].received;
+        bytes += workers[t].bytesReceived;
+        backpressured += workers[t].backpressured;
+        errors += workers[t].errors;
+    }
+    printf("Connections: %d ready of %d, %s mode, %d thread(s)\n", readyConnections, bench.connections,
+           bench.mode == BENCH_PAIRS ? "pairs" : "rooms", bench.threads);
+    printf("Messages:    %lu sent, %lu received in %.2f s\n", (unsigned long)sent, (unsigned long)received, seconds);
+    printf("Throughput:  %.0f msg/s sent, %.0f msg/s received, %.2f MiB/s received\n",
+           sent / seconds, received / seconds, bytes / seconds / (1024 * 1024));
+    if(latency.total)
+        printf("Latency (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f  mean %.1f\n",
+               latency.min / 1000.0, HistogramPercentile(&latency, 50) / 1000.0, HistogramPercentile(&latency, 90) / 1000.0,
+               HistogramPercentile(&latency, 99) / 1000.0, HistogramPercentile(&latency, 99.9) / 1000.0,
+               latency.max / 1000.0, (double)latency.sum / latency.total / 1000.0);
+    printf("Backpressured sends: %lu, errors: %lu\n", (unsigned long)backpressured, (unsigned long)errors);
+}
+
+void SetPhase(benchPhases phase)
+{
+    __atomic_store_n(&benchPhase, phase, __ATOMIC_RELEASE);
+}
+
+int main(int argc, char *argv[])
+{
+    ParseArguments(argc, argv);
+    BenchFillText();
+    signal(SIGPIPE, SIG_IGN);
+    RaiseFileLimit();
+
+    inCapacity = 2 * (FRAME_HEADER_SIZE + bench.size + ROOMNAME_MAX + USERNAME_MAX + 8);
+    if(inCapacity < 4096) inCapacity = 4096;
+    outCapacity = (BENCH_CATCH_UP + 4) * (FRAME_HEADER_SIZE + bench.size + ROOMNAME_MAX + 1);
+    if(outCapacity < 16384) outCapacity = 16384;
+    if(bench.tls)
+    {
+        benchTls = SSL_CTX_new(TLS_client_method());
+        if(!benchTls)
+        {
+            printf("Failed to create the TLS context\n");
+            return 1;
+        }
+        // The send buffer moves as it's written, and a record it didn't take is retried with more behind it
+        SSL_CTX_set_mode(benchTls, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+
+    if(!BenchSetup())
+    {
+        perror("Failed to set up the benchmark");
+        return 1;
+    }
+    int t;
+    for(t = 0; t < bench.threads; t++) pthread_create(&workers[t].thread, NULL, BenchWorker, &workers[t]);
+
+    // Wait for every connection to log in and pair up or join its room
+    int waited;
+    for(waited = 0; waited < 300 && __atomic_load_n(&readyConnections, __ATOMIC_ACQUIRE) < bench.connections; waited++)
+        usleep(100000);
+    if(readyConnections < bench.connections)
+        printf("WARN: Only %d of %d connections are ready, running with those\n", readyConnections, bench.connections);
+    else
+        printf("All %d connections are ready after %.1f s\n", bench.connections, waited / 10.0);
+
+    SetPhase(PHASE_WARMUP);
+    sleep(bench.warmup);
+    measureStart = NowNanos();
+    SetPhase(PHASE_MEASURE);
+    sleep(bench.duration);
+    double seconds = (NowNanos() - measureStart) / 1e9;
+    SetPhase(PHASE_DRAIN);
+    sleep(1); // Messages still on their way are counted
+    SetPhase(PHASE_DONE);
+
+    for(t = 0; t < bench.threads; t++) pthread_join(workers[t].thread, NULL);
+    BenchReport(seconds);
+    return 0;
+}
@@ -0,0 +1,4 @@
+#!/bin/bash
+mkdir -p obj
+make bench_clean
+make bench
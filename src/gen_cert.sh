@@ -0,0 +1,8 @@
+#!/bin/bash
+# Generates a self-signed certificate for local testing: server.pem holds the certificate and its key,
+# server.crt just the certificate. Run the server with "./server -e server.pem" and the client with "./client -e server.crt".
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 365 \
+    -subj "/CN=localhost" -addext "subjectAltName=DNS:localhost,IP:127.0.0.1" \
+    -keyout server.key -out server.crt
+cat server.crt server.key > server.pem
+rm -f server.key
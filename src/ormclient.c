@@ -0,0 +1,2 @@
+// libormclient, the implementation lives in client.h and the interface in ormclient.h
+#include "client.h"
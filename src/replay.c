@@ -0,0 +1,446 @@
+#include "replay.h"
+
+replayTrace trace;
+replayStats stats;
+int epollFd;
+uint32_t *dirtyConnections; // Connections queued to since the last flush
+uint32_t dirtyCount = 0;
+uint32_t *closingConnections; // Connections the trace closed that haven't shut down their sending side yet
+uint32_t closingCount = 0;
+uint32_t loginsPending = 0;  // Logins sent and not answered yet, frames other than logins wait for them
+uint64_t lastActivity = 0;   // When the last event was dispatched or the last frame received
+int pwait2 = 1;              // Whether the kernel has epoll_pwait2
+
+// Closes the connection and frees its buffers, a trace can have far more connections than fit into memory at once
+void ReplayClose(replayConnection *c)
+{
+    if(c->socket >= 0) close(c->socket); // Closing the descriptor also removes it from the epoll instance
+    c->socket = -1;
+    c->state = REPLAY_CLOSED;
+    c->closing = 0;
+    free(c->in);
+    c->in = NULL;
+    c->inLength = 0;
+    free(c->out);
+    c->out = NULL;
+    c->outLength = 0;
+    c->outCapacity = 0;
+    if(c->probeStart) stats.unanswered++;
+    c->probeStart = 0;
+    if(c->loginPending) loginsPending--;
+    c->loginPending = 0;
+}
+
+void ReplayMarkDirty(uint32_t index)
+{
+    replayConnection *c = &trace.connections[index];
+    if(c->dirty) return;
+    c->dirty = 1;
+    dirtyConnections[dirtyCount++] = index;
+}
+
+// Starts connecting, the socket reports completion as writable. The HELLO waits in the send buffer until then
+void ReplayOpen(replayConnection *c, uint32_t index)
+{
+    struct sockaddr_in server = { .sin_family = AF_INET, .sin_port = htons(replay.port) };
+    server.sin_addr.s_addr = inet_addr(replay.ip);
+    c->in = (char*)malloc(REPLAY_IN_SIZE);
+    c->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(!c->in || c->socket < 0)
+    {
+        perror("Could not create socket");
+        stats.failed++;
+        ReplayClose(c);
+        return;
+    }
+    int flag = 1;
+    setsockopt(c->socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if(connect(c->socket, (struct sockaddr*)&server, sizeof(server)) < 0 && errno != EINPROGRESS)
+    {
+        perror("Connect failed");
+        stats.failed++;
+        ReplayClose(c);
+        return;
+    }
+    c->state = REPLAY_CONNECTING;
+    c->session = LOGGING_IN;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.u32 = index };
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, c->socket, &event);
+    // Compression is always offered, so compressed frames of the trace are accepted whatever their client negotiated
+    char hello[FRAME_HEADER_SIZE + PROTOCOL_MAGIC_LEN + 2];
+    size_t length = BuildHello(hello, PROTOCOL_VERSION, PROTOCOL_FEATURE_DEFLATE);
+    ReplayQueue(c, OPCODE_HELLO, 0, hello + FRAME_HEADER_SIZE, length - FRAME_HEADER_SIZE);
+}
+
+void ReplayConnected(replayConnection *c)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(getsockopt(c->socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error)
+    {
+        printf("Connection %lu failed: %s\n", (unsigned long)c->id, strerror(error));
+        stats.failed++;
+        ReplayClose(c);
+        return;
+    }
+    c->state = REPLAY_OPEN;
+}
+
+void ReplayDispatch(replayEvent *e, uint64_t now)
+{
+    replayConnection *c = &trace.connections[e->connection];
+    switch(e->type)
+    {
+        case TRACE_OPEN:
+            if(c->state == REPLAY_IDLE) ReplayOpen(c, e->connection);
+            break;
+        case TRACE_FRAME:
+            if((c->state != REPLAY_CONNECTING && c->state != REPLAY_OPEN) || c->closing)
+            {
+                stats.skipped++;
+                break;
+            }
+            if(c->probeStart && now - c->probeStart > REPLAY_PROBE_TIMEOUT)
+            {
+                stats.unanswered++;
+                c->probeStart = 0;
+            }
+            if(!ReplayQueue(c, e->opcode, e->flags, e->payload, e->length))
+            {
+                stats.skipped++;
+                break;
+            }
+            if(!c->probeStart && ReplayProbed(e))
+            {
+                c->probeStart = now;
+                c->probeOpcode = e->opcode;
+            }
+            if(e->opcode == LOGIN && !c->loginPending)
+            {
+                c->loginPending = 1;
+                loginsPending++;
+            }
+            stats.sent++;
+            stats.bytesSent += e->length;
+            ReplayMarkDirty(e->connection);
+            break;
+        case TRACE_CLOSE:
+            if((c->state == REPLAY_CONNECTING || c->state == REPLAY_OPEN) && !c->closing)
+            {
+                c->closing = 1;
+                closingConnections[closingCount++] = e->connection;
+                ReplayMarkDirty(e->connection);
+            }
+            break;
+    }
+}
+
+/*
+ * Writes what was queued, shutting down the sending side of connections the trace closed once
+ * they're done. The server drops the answers it hasn't sent yet once it reads the end of the
+ * connection, so that waits for the answer to the last frame as well.
+ */
+void ReplayWrite(replayConnection *c)
+{
+    if(c->state != REPLAY_OPEN) return;
+    if(ReplayFlush(c) < 0)
+    {
+        if(!c->closing) stats.closed++;
+        ReplayClose(c);
+    }
+    else if(c->closing == 1 && !c->outLength && !c->probeStart)
+    {
+        shutdown(c->socket, SHUT_WR);
+        c->closing = 2;
+    }
+}
+
+// Follows the state of the client from the server's state replies, ends the probe if the frame answers it
+void ReplayHandleFrame(replayConnection *c, frame *f)
+{
+    if(f->opcode == OPCODE_HELLO) return;
+    stats.received++;
+    stats.bytesReceived += f->length;
+    lastActivity = NowNanos();
+    if((f->opcode == REPLY_LOGIN || f->opcode == REPLY_TALKTO || f->opcode == REPLY_DISCONNECT) && f->length)
+        c->session = (clientStates)(uint8_t)f->payload[0];
+    if(f->opcode == REPLY_LOGIN && f->length)
+    {
+        size_t length = f->length - 1 < USERNAME_MAX - 1 ? f->length - 1 : USERNAME_MAX - 1;
+        memcpy(c->username, f->payload + 1, length);
+        c->username[length] = 0;
+    }
+    // An error only answers the Login while the Login is probed, others can come from rate limits and the like
+    if(c->loginPending && (f->opcode == REPLY_LOGIN || (f->opcode == REPLY_ERROR && c->probeStart && c->probeOpcode == LOGIN)))
+    {
+        c->loginPending = 0;
+        loginsPending--;
+    }
+    if(!c->probeStart) return;
+    int answer = ReplayAnswer(c, f);
+    if(!answer) return;
+    if(answer > 0) HistogramRecord(&stats.response, lastActivity - c->probeStart);
+    else stats.errors++;
+    c->probeStart = 0;
+    if(c->closing == 1) ReplayWrite(c);
+}
+
+void ReplayRead(replayConnection *c)
+{
+    while(c->state != REPLAY_CLOSED)
+    {
+        ssize_t readSize = recv(c->socket, c->in + c->inLength, REPLAY_IN_SIZE - c->inLength, MSG_DONTWAIT);
+        if(readSize <= 0)
+        {
+            if(readSize < 0 && errno == EINTR) continue;
+            if(readSize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if(!c->closing) stats.closed++;
+            ReplayClose(c);
+            return;
+        }
+        c->inLength += readSize;
+
+        size_t consumed = 0;
+        frame f;
+        int size;
+        while((size = ParseFrame(c->in + consumed, c->inLength - consumed, &f)) > 0)
+        {
+            ReplayHandleFrame(c, &f);
+            if(c->state == REPLAY_CLOSED) return; // Writing what the frame let go failed, the buffer is gone
+            consumed += size;
+        }
+        if(size < 0)
+        {
+            printf("Connection %lu received a malformed frame\n", (unsigned long)c->id);
+            stats.closed++;
+            ReplayClose(c);
+            return;
+        }
+        memmove(c->in, c->in + consumed, c->inLength - consumed);
+        c->inLength -= consumed;
+    }
+}
+
+/*
+ * Whether an event finds the replay where the capture was: a frame's connection in the state the
+ * frame was captured in, and every login before it answered. Frames of connections that can't
+ * send anymore are skipped anyway.
+ */
+int ReplayInSync(replayEvent *e)
+{
+    if(e->type != TRACE_FRAME) return 1;
+    replayConnection *c = &trace.connections[e->connection];
+    if((c->state != REPLAY_CONNECTING && c->state != REPLAY_OPEN) || c->closing) return 1;
+    return c->session == e->state && (e->opcode == LOGIN || !loginsPending);
+}
+
+// Stops an event from waiting any longer, for its connection's state from then on or for the logins pending
+void ReplayGiveUp(replayEvent *e)
+{
+    replayConnection *c = &trace.connections[e->connection];
+    if(c->session != e->state)
+    {
+        c->unsynced = 1;
+        stats.unsynced++;
+        return;
+    }
+    uint32_t i;
+    for(i = 0; i < trace.connectionCount; i++) trace.connections[i].loginPending = 0;
+    loginsPending = 0;
+}
+
+// Expires the probes connections the trace closed are waiting on, so they don't keep their sending side open for good
+void ReplaySweepClosing(uint64_t now)
+{
+    uint32_t i, kept = 0;
+    for(i = 0; i < closingCount; i++)
+    {
+        replayConnection *c = &trace.connections[closingConnections[i]];
+        if(c->probeStart && now - c->probeStart > REPLAY_PROBE_TIMEOUT)
+        {
+            stats.unanswered++;
+            c->probeStart = 0;
+            ReplayWrite(c);
+        }
+        if(c->closing == 1 && c->state != REPLAY_CLOSED) closingConnections[kept++] = closingConnections[i];
+    }
+    closingCount = kept;
+}
+
+// Waits for the sockets, with a timeout in nanoseconds where the kernel supports it and in milliseconds otherwise
+int ReplayWait(struct epoll_event *events, int maxEvents, uint64_t timeout)
+{
+    if(pwait2)
+    {
+        struct timespec wait = { .tv_sec = timeout / 1000000000ull, .tv_nsec = timeout % 1000000000ull };
+        int count = epoll_pwait2(epollFd, events, maxEvents, &wait, NULL);
+        if(count >= 0 || errno != ENOSYS) return count;
+        pwait2 = 0;
+    }
+    return epoll_wait(epollFd, events, maxEvents, (int)((timeout + 999999) / 1000000));
+}
+
+/*
+ * Dispatches every event that is due, unless it has to wait for other connections, then waits for
+ * the sockets until the next one is. Returns the seconds from the first event to the last event or
+ * answer, whichever came later.
+ */
+double ReplayRun()
+{
+    struct epoll_event events[256];
+    uint64_t start = NowNanos(), drainUntil = 0, heldSince = 0;
+    uint32_t next = 0;
+    while(1)
+    {
+        uint64_t now = NowNanos();
+        while(next < trace.eventCount)
+        {
+            replayEvent *e = &trace.events[next];
+            uint64_t due = replay.speed > 0 ? start + (uint64_t)(e->time * 1000 / replay.speed) : now;
+            if(due > now || trace.connections[e->connection].outLength >= REPLAY_WINDOW) break;
+            int inSync = ReplayInSync(e);
+            if(!inSync && !trace.connections[e->connection].unsynced)
+            {
+                if(!heldSince) heldSince = now;
+                if(now - heldSince < REPLAY_HOLD_TIMEOUT) break;
+                ReplayGiveUp(e);
+            }
+            heldSince = 0;
+            if(!inSync) stats.diverged++;
+            HistogramRecord(&stats.behind, now - due);
+            ReplayDispatch(e, now);
+            lastActivity = now;
+            next++;
+        }
+        uint32_t i;
+        for(i = 0; i < dirtyCount; i++)
+        {
+            replayConnection *c = &trace.connections[dirtyConnections[i]];
+            c->dirty = 0;
+            ReplayWrite(c);
+        }
+        dirtyCount = 0;
+        ReplaySweepClosing(now);
+
+        if(next == trace.eventCount && !drainUntil) drainUntil = now + REPLAY_DRAIN_MS * 1000000ull;
+        if(drainUntil && now >= drainUntil) break;
+        uint64_t timeout = 1000000; // Held up by a full send buffer, the socket taking more is reported as writable
+        if(drainUntil) timeout = drainUntil - now;
+        else if(heldSince) timeout = heldSince + REPLAY_HOLD_TIMEOUT - now; // The answers it waits for wake it up before
+        else if(trace.connections[trace.events[next].connection].outLength < REPLAY_WINDOW)
+        {
+            uint64_t due = replay.speed > 0 ? start + (uint64_t)(trace.events[next].time * 1000 / replay.speed) : now;
+            timeout = due > now ? due - now : 0;
+        }
+        if(closingCount && timeout > REPLAY_SWEEP_NS) timeout = REPLAY_SWEEP_NS;
+
+        int count = ReplayWait(events, 256, timeout);
+        for(i = 0; i < (uint32_t)(count > 0 ? count : 0); i++)
+        {
+            replayConnection *c = &trace.connections[events[i].data.u32];
+            if(c->state == REPLAY_CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                ReplayConnected(c);
+            if(c->state != REPLAY_CLOSED && c->state != REPLAY_CONNECTING && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                ReplayRead(c);
+            if(events[i].events & EPOLLOUT) ReplayWrite(c);
+        }
+    }
+    for(next = 0; next < trace.connectionCount; next++)
+        if(trace.connections[next].state != REPLAY_IDLE) ReplayClose(&trace.connections[next]);
+    return lastActivity > start ? (lastActivity - start) / 1e9 : 0;
+}
+
+void ReplayReport(double seconds, double *results)
+{
+    histogram *h = &stats.response;
+    if(seconds <= 0) seconds = 1e-9;
+    results[RESULT_SENT_RATE] = stats.sent / seconds;
+    results[RESULT_RECEIVED_RATE] = stats.received / seconds;
+    results[RESULT_P50] = HistogramPercentile(h, 50) / 1000.0;
+    results[RESULT_P99] = HistogramPercentile(h, 99) / 1000.0;
+    results[RESULT_P999] = HistogramPercentile(h, 99.9) / 1000.0;
+    results[RESULT_MAX] = h->total ? h->max / 1000.0 : 0;
+    results[RESULT_MEAN] = h->total ? (double)h->sum / h->total / 1000.0 : 0;
+    results[RESULT_BEHIND] = stats.behind.total ? stats.behind.max / 1e6 : 0;
+    results[RESULT_ERRORS] = stats.errors;
+    results[RESULT_DIVERGED] = stats.diverged;
+
+    char speed[32] = "full speed";
+    if(replay.speed > 0) snprintf(speed, sizeof(speed), "%gx", replay.speed);
+    printf("Trace:         %u connections, %lu frames over %.2f s, replayed at %s\n", trace.connectionCount, (unsigned long)trace.frames,
+           trace.eventCount ? trace.events[trace.eventCount - 1].time / 1e6 : 0.0, speed);
+    printf("Frames:        %lu sent, %lu received in %.2f s\n", (unsigned long)stats.sent, (unsigned long)stats.received, seconds);
+    printf("Throughput:    %.0f frames/s sent, %.0f frames/s received, %.2f MiB/s sent, %.2f MiB/s received\n",
+           results[RESULT_SENT_RATE], results[RESULT_RECEIVED_RATE],
+           stats.bytesSent / seconds / (1024 * 1024), stats.bytesReceived / seconds / (1024 * 1024));
+    printf("Response (us): p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f  mean %.1f, %lu answered, %lu errors, %lu unanswered\n",
+           results[RESULT_P50], HistogramPercentile(h, 90) / 1000.0, results[RESULT_P99], results[RESULT_P999],
+           results[RESULT_MAX], results[RESULT_MEAN], (unsigned long)h->total, (unsigned long)stats.errors, (unsigned long)stats.unanswered);
+    printf("Schedule (ms): p99 %.2f  max %.2f behind\n", HistogramPercentile(&stats.behind, 99) / 1e6, results[RESULT_BEHIND]);
+    printf("Errors:        %lu error replies, %lu connections failed, %lu closed by the server, %lu frames skipped\n",
+           (unsigned long)stats.errors, (unsigned long)stats.failed, (unsigned long)stats.closed, (unsigned long)stats.skipped);
+    if(stats.diverged)
+        printf("WARN: %lu frames were sent before the replay got where the capture was, %lu connections gave up waiting for it. "
+               "The server didn't see the captured traffic, so the results don't describe it\n",
+               (unsigned long)stats.diverged, (unsigned long)stats.unsynced);
+}
+
+// Prints every result next to the baseline's, with the change in percent
+void ReplayCompare(double *results, double *baseline)
+{
+    printf("Compared to %s:\n", replay.compare);
+    int i;
+    for(i = 0; i < RESULTS; i++)
+    {
+        double difference = results[i] - baseline[i];
+        int better = replayResultHigherBetter[i] ? difference > 0 : difference < 0;
+        char change[16] = "    new"; // Counts that used to be zero, like the error replies, have no percentage
+        if(baseline[i] != 0) snprintf(change, sizeof(change), "%+7.1f%%", difference / baseline[i] * 100);
+        printf("  %-24s %12.1f -> %12.1f  %s%s\n", replayResultNames[i], baseline[i], results[i], difference == 0 ? "      -" : change,
+               difference == 0 ? "" : better ? " better" : " worse");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    ParseArguments(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+    RaiseFileLimit();
+
+    double baseline[RESULTS];
+    if(replay.compare && !ReplayLoadResults(replay.compare, baseline))
+    {
+        printf("Failed to read the results to compare to from %s\n", replay.compare);
+        return 1;
+    }
+    if(!ReplayLoad(replay.trace, &trace))
+    {
+        ReplayFree(&trace);
+        return 1;
+    }
+    HistogramReset(&stats.response);
+    HistogramReset(&stats.behind);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    dirtyConnections = (uint32_t*)malloc((trace.connectionCount ? trace.connectionCount : 1) * sizeof(uint32_t));
+    closingConnections = (uint32_t*)malloc((trace.connectionCount ? trace.connectionCount : 1) * sizeof(uint32_t));
+    if(epollFd < 0 || !dirtyConnections || !closingConnections)
+    {
+        perror("Failed to set up the replay");
+        return 1;
+    }
+    printf("Replaying %u events of %u connections...\n", trace.eventCount, trace.connectionCount);
+
+    double results[RESULTS];
+    ReplayReport(ReplayRun(), results);
+    close(epollFd);
+    free(dirtyConnections);
+    free(closingConnections);
+    ReplayFree(&trace);
+    if(replay.compare) ReplayCompare(results, baseline);
+    if(replay.save && !ReplaySaveResults(replay.save, results))
+    {
+        perror("Failed to save the results");
+        return 1;
+    }
+    return 0;
+}
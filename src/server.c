@@ -1,132 +1,44 @@
-#include "server.h"
-
-// Parses and deals with client commands
-void* Connection(void *c)
-{
-    clientData* client = (clientData*)c;
-    unsigned long id = client->id;
-    int clientSocket = client->clientSocket;
-
-    char clientMessage[DEFAULT_BUFLEN];
-    char returnMessage[DEFAULT_BUFLEN];
-    int readSize;
-
-    printf("INFO: Client %s has connected with ID %lu\n", client->username, id);
-    // Main server loop that keeps waiting for the client to send a message
-    while(1)
-    {
-        memset(clientMessage, 0, DEFAULT_BUFLEN);
-        memset(returnMessage, 0, DEFAULT_BUFLEN);
-        if((readSize = recv(clientSocket, clientMessage, DEFAULT_BUFLEN, 0)) <= 0) break; // Receive message from client
-        printf("DEBUG: Client %lu has sent a %d byte long message: %s\n", id, readSize, clientMessage);
-
-        clientCommands cmd = StringToCommandClient(clientMessage);
-        switch(cmd)
-        {
-            case LOGIN:
-                HandleLogin(client, clientMessage, returnMessage);
-                break;
-            case USERS:
-                GetUserData(client, returnMessage);
-                break;
-            case TALKTO:
-                HandleChatRequests(client, clientMessage, returnMessage);
-                break;
-            case DATA:
-                SendTo(client, clientMessage, returnMessage);
-                break;
-            case DISCONNECT:
-                DisconnectChat(client, returnMessage);
-                break;
-            default:
-                SendMessage(client, "ERROR: Unknown command");
-        }
-    }
-
-    if(readSize == 0)
-    {
-        printf("INFO: Client %lu has disconnected\n", id);
-        fflush(stdout);
-
-        // Handle client that has been forcibly disconnected (e.g Ctrl-C)
-        if(client->state == CONNECTING)
-        {
-            client->state = LOGGING_OUT;
-            RejectChat(client, returnMessage);
-        }
-        else if(client->state == CHATTING)
-        {
-            client->state = LOGGING_OUT;
-            DisconnectChat(client, returnMessage);
-        }
-        ClientDataRemove(client);
-    }
-    else if(readSize == -1)
-    {
-        close(clientSocket);
-        perror("ERROR: recv failed");
-        ClientDataRemove(client);
-    }
-    return 0;
-}
-
-int main(int argc , char *argv[])
-{
-    /*
-     * Socket boilerplate variables:
-     * socketDesc   - The file descriptor for the socket which is used by the server to
-     *                listen to incoming connections.
-     * clientSocket - Temporary variable used to catch the incoming client's socket
-     *                descriptor.
-     * c            - Helper variable to determine the size of sockaddr_in.
-     * server       - Holds information about the server.
-     * client       - Holds information about the client.
-     */
-    int socketDesc, clientSocket, c;
-    struct sockaddr_in server, client;
-    c = sizeof(struct sockaddr_in);
-    InitServer(&socketDesc, &server);
-
-    ClientDataInit();
-
-    // Main event loop, where we now poll for new clients instead of blocking execution while waiting for clients to connect
-    while(1)
-    {
-        clientSocket = accept(socketDesc, (struct sockaddr*)&client, (socklen_t*)&c);
-        if(clientSocket < 0) 
-        {
-            if(errno == EWOULDBLOCK) 
-            {
-                // No client has connected, continue polling after a slight timeout to prevent busy waiting and high CPU usage
-                nanosleep(&timeout, NULL);
-                continue;
-            } else 
-            {
-                perror("ERROR: Error when accepting connection");
-                return 1;
-            }
-        }
-        if(clientsLen == MAX_CLIENT)
-        {
-            printf("WARN: Server cannot connect to any more clients!\n");
-            close(clientSocket);
-            continue;
-        }
-
-        printf("INFO: Connection accepted, socket = %d\n", clientSocket);
-
-        clientData* newClient = ClientDataAdd(clientSocket);
-        if(!newClient)
-        {
-            printf("ERROR: Failed to create client object\n");
-            break;
-        }
-        pthread_create(&(newClient->clientThread), NULL, Connection, (void*)(newClient));
-        pthread_detach((newClient->clientThread)); // Detach the thread to prevent blocking the main thread
-    }
-
-    ClientDataDestroy();
-    printf("INFO: Closing server\n");
-    return 0;
-}
-
+#include "handoff.h"
+
+int main(int argc , char *argv[])
+{
+    ParseArguments(argc, argv);
+    if(!LogInit(config.logPath)) return 1;
+
+    signal(SIGPIPE, SIG_IGN); // Writing to a closed client socket must not terminate the server
+    RaiseFileLimit();
+    ClientDataInit();
+    RoomsInit();
+    UserIndexInit();
+    MetricsInit(config.reactors);
+    if(!TlsInit()) return 1;
+    // A server already running on the hand over socket passes its listeners and clients on
+    if(config.handoffPath && !HandoffTake(config.handoffPath)) return 1;
+    if(!StoreOpen() || !PresenceInit()) return 1;
+    if(config.adminPath && !StartAdminSocket(config.adminPath)) return 1;
+    if(config.capturePath && !CaptureStart(config.capturePath)) return 1;
+    if(!ClusterInit()) return 1;
+
+    // Every reactor listens on the same port through its own socket and runs on its own thread
+    if(!CreateReactors(config.reactors, handoffListeners, handoffListenerCount) || !HandoffRestore() || !ClusterRun() || !RunReactors())
+    {
+        LogError("Failed to start the event loops");
+        return 1;
+    }
+    if(config.handoffPath && !HandoffListen(config.handoffPath)) return 1;
+    LogInfo("Waiting for incoming connections on %d reactor(s)...", config.reactors);
+    StopReactors();
+    CaptureStop();
+    ClusterStop();
+    StoreClose(0);
+    PresenceDestroy();
+    TlsDestroy();
+
+    RoomsDestroy();
+    UserIndexDestroy();
+    MetricsDestroy();
+    ClientDataDestroy();
+    LogInfo("Closing server");
+    LogShutdown();
+    return 0;
+}